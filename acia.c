@@ -0,0 +1,417 @@
+#define _GNU_SOURCE // posix_openpt and cfmakeraw
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "acia.h"
+
+#define ACIA_LINGER_MS 1 // How long the host thread waits for more output before it sleeps until woken up
+#define ACIA_FULL_RETRY_MS 10 // How often the host thread looks at a full receive ring again
+
+static void ring_init(acia_ring_t *ring) {
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->producer_head = 0;
+    ring->consumer_tail = 0;
+}
+
+/**
+ * Consumer side, returns the number of bytes waiting in the ring.
+ * The shared tail is read only if the cached one says there is nothing
+ */
+static unsigned ring_used(acia_ring_t *ring) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (ring->consumer_tail == head) {
+        ring->consumer_tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    }
+    return ring->consumer_tail - head;
+}
+
+/**
+ * Producer side, returns the number of bytes that can be put into the ring.
+ * The shared head is read only if the cached one says the ring is full
+ */
+static unsigned ring_free(acia_ring_t *ring) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - ring->producer_head == ACIA_RING_SIZE) {
+        ring->producer_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    }
+    return ACIA_RING_SIZE - (tail - ring->producer_head);
+}
+
+/**
+ * Posts the receive interrupt unless it's disabled or already posted and not yet followed by a read of the data
+ */
+static void post_receive_interrupt(acia_t *acia) {
+    if (atomic_load(&acia->receive_interrupts) && acia->cpu != NULL && !atomic_exchange(&acia->interrupt_posted, true)) {
+        cpu_request_interrupt(acia->cpu, acia->interrupt_opcode);
+    }
+}
+
+/**
+ * Writes out the bytes waiting in the transmit ring, blocking if the descriptor doesn't take them
+ * (a pseudo-terminal doesn't block, the bytes it doesn't take stay in the ring)
+ * Returns false if the descriptor can't be written anymore
+ */
+static bool host_transmit(acia_t *acia) {
+    acia_ring_t *ring = &acia->transmit;
+    unsigned used;
+    while ((used = ring_used(ring)) > 0) {
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        unsigned start = head % ACIA_RING_SIZE;
+        unsigned length = (used < ACIA_RING_SIZE - start) ? used : ACIA_RING_SIZE - start;
+        ssize_t written = write(acia->out_fd, &ring->buffer[start], length);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written < 0 && errno == EAGAIN) {
+            return true; // Nobody reads the pseudo-terminal, the rest waits until it takes more
+        }
+        if (written <= 0) {
+            return false;
+        }
+        atomic_store_explicit(&ring->head, head + written, memory_order_release);
+    }
+    return true;
+}
+
+/**
+ * Reads what the descriptor has into the free space of the receive ring
+ * Returns false at the end of the input
+ */
+static bool host_receive(acia_t *acia) {
+    acia_ring_t *ring = &acia->receive;
+    unsigned free_bytes = ring_free(ring);
+    if (free_bytes == 0) {
+        return true;
+    }
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    unsigned start = tail % ACIA_RING_SIZE;
+    unsigned length = (free_bytes < ACIA_RING_SIZE - start) ? free_bytes : ACIA_RING_SIZE - start;
+    ssize_t received = read(acia->in_fd, &ring->buffer[start], length);
+    if (received < 0) {
+        return errno == EINTR || errno == EAGAIN;
+    }
+    if (received == 0) {
+        atomic_store(&acia->input_ended, true);
+        return false;
+    }
+    atomic_store_explicit(&ring->tail, tail + received, memory_order_seq_cst);
+    post_receive_interrupt(acia);
+    return true;
+}
+
+/**
+ * Host thread, the only one making system calls on the descriptors.
+ * It sleeps in poll until there is input, the CPU thread wakes it up through the pipe,
+ * the output descriptor takes more bytes or it's time to look at a full receive ring again
+ */
+static void *host_thread(void *context) {
+    acia_t *acia = context;
+    bool input_open = true;
+    bool output_open = true;
+    bool lingering = false;
+    while (!atomic_load(&acia->stopping)) {
+        bool output_pending = false;
+        if (output_open && ring_used(&acia->transmit) > 0) {
+            output_open = host_transmit(acia);
+            output_pending = output_open && ring_used(&acia->transmit) > 0;
+            if (!output_pending) {
+                lingering = true;
+                continue;
+            }
+        }
+        int timeout = -1;
+        if (lingering && !output_pending) {
+            // More output usually follows soon, waiting for it a little saves the CPU thread waking this one up
+            timeout = ACIA_LINGER_MS;
+        } else if (!output_pending) {
+            atomic_store(&acia->host_sleeping, true);
+            if (ring_used(&acia->transmit) > 0 || atomic_load(&acia->stopping)) {
+                atomic_store(&acia->host_sleeping, false);
+                continue;
+            }
+        }
+        bool receive_full = ring_free(&acia->receive) == 0;
+        if (input_open && receive_full && (timeout < 0 || timeout > ACIA_FULL_RETRY_MS)) {
+            timeout = ACIA_FULL_RETRY_MS;
+        }
+        struct pollfd fds[3] = {
+            {acia->wake_pipe[0], POLLIN, 0},
+            {(input_open && !receive_full) ? acia->in_fd : -1, POLLIN, 0},
+            {output_pending ? acia->out_fd : -1, POLLOUT, 0}
+        };
+        int ready = poll(fds, 3, timeout);
+        atomic_store(&acia->host_sleeping, false);
+        if (ready == 0) {
+            lingering = false;
+        }
+        if (ready <= 0) {
+            continue;
+        }
+        if (fds[0].revents & POLLIN) {
+            char drained[64];
+            while (read(acia->wake_pipe[0], drained, sizeof(drained)) > 0) {
+            }
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+            input_open = host_receive(acia);
+        }
+    }
+    if (output_open) {
+        host_transmit(acia);
+    }
+    return NULL;
+}
+
+/**
+ * Returns true if a received byte is in the data register, with a baud rate set that is one character time
+ * after the program read the previous one. Without the pacing a program echoing its input while checking
+ * for a break key (e.g. VTL-2) takes the characters of the next line piped in as the break
+ */
+static bool receive_ready(acia_t *acia) {
+    if (ring_used(&acia->receive) == 0) {
+        return false;
+    }
+    return acia->clock == NULL || cpu_get_cycles(acia->clock) >= acia->next_receive_cycle;
+}
+
+static uint8_t read_status(void *context, uint8_t port) {
+    (void)port;
+    acia_t *acia = context;
+    uint8_t status = receive_ready(acia) ? ACIA_STATUS_RDRF : 0;
+    if (ring_free(&acia->transmit) > 0) {
+        status |= ACIA_STATUS_TDRE;
+    }
+    if ((status & ACIA_STATUS_RDRF) && (acia->control & ACIA_CONTROL_RECEIVE_INTERRUPT)) {
+        status |= ACIA_STATUS_IRQ;
+    }
+    return status;
+}
+
+/**
+ * Status register as the 88-SIO has it, the board has no control register so writes to the port are ignored
+ */
+static uint8_t read_sio_status(void *context, uint8_t port) {
+    uint8_t status = read_status(context, port);
+    return ((status & ACIA_STATUS_RDRF) ? 0 : ACIA_SIO_STATUS_INPUT_BUSY) | ((status & ACIA_STATUS_TDRE) ? 0 : ACIA_SIO_STATUS_OUTPUT_BUSY);
+}
+
+static void write_control(void *context, uint8_t port, uint8_t data) {
+    (void)port;
+    acia_t *acia = context;
+    acia->control = ((data & ACIA_CONTROL_MASTER_RESET) == ACIA_CONTROL_MASTER_RESET) ? 0 : data;
+    atomic_store(&acia->receive_interrupts, (acia->control & ACIA_CONTROL_RECEIVE_INTERRUPT) != 0);
+    if (ring_used(&acia->receive) > 0) {
+        post_receive_interrupt(acia);
+    }
+}
+
+static uint8_t read_data(void *context, uint8_t port) {
+    (void)port;
+    acia_t *acia = context;
+    acia_ring_t *ring = &acia->receive;
+    // The interrupt handler reads the byte it was called for without looking at the status, so it isn't paced
+    bool interrupt_driven = atomic_load(&acia->receive_interrupts) && acia->cpu != NULL;
+    if (interrupt_driven ? ring_used(ring) > 0 : receive_ready(acia)) {
+        unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        acia->last_received = ring->buffer[head % ACIA_RING_SIZE];
+        atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        if (acia->clock != NULL) {
+            acia->next_receive_cycle = cpu_get_cycles(acia->clock) + acia->character_cycles;
+        }
+    }
+    // The byte read clears the request, the next one is posted right away if more bytes are waiting
+    atomic_store(&acia->interrupt_posted, false);
+    if (atomic_load_explicit(&ring->tail, memory_order_seq_cst) != atomic_load_explicit(&ring->head, memory_order_relaxed)) {
+        post_receive_interrupt(acia);
+    }
+    return acia->last_received;
+}
+
+static void write_data(void *context, uint8_t port, uint8_t data) {
+    (void)port;
+    acia_t *acia = context;
+    acia_ring_t *ring = &acia->transmit;
+    if (ring_free(ring) == 0) {
+        return; // The program didn't wait for TDRE, the byte is lost like on the real chip
+    }
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    ring->buffer[tail % ACIA_RING_SIZE] = data;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_seq_cst);
+    if (atomic_load(&acia->host_sleeping) && atomic_exchange(&acia->host_sleeping, false)) {
+        ssize_t written = write(acia->wake_pipe[1], "", 1); // Never blocks, a full pipe wakes the thread up anyway
+        (void)written;
+    }
+}
+
+/**
+ * Switches a terminal to raw input (no line editing, echo or CR to LF translation),
+ * the signal keys keep working
+ */
+static void make_raw(acia_t *acia) {
+    acia->restore_termios = isatty(acia->in_fd) && tcgetattr(acia->in_fd, &acia->saved_termios) == 0;
+    if (acia->restore_termios) {
+        struct termios raw = acia->saved_termios;
+        raw.c_lflag &= ~(ICANON | ECHO);
+        raw.c_iflag &= ~(ICRNL | IXON);
+        raw.c_cc[VMIN] = 1;
+        raw.c_cc[VTIME] = 0;
+        tcsetattr(acia->in_fd, TCSANOW, &raw);
+    }
+}
+
+/**
+ * Resets the ACIA and starts the host thread
+ */
+static bool start(acia_t *acia, int in_fd, int out_fd, bool owns_fds, int held_fd) {
+    ring_init(&acia->receive);
+    ring_init(&acia->transmit);
+    acia->in_fd = in_fd;
+    acia->out_fd = out_fd;
+    acia->owns_fds = owns_fds;
+    acia->held_fd = held_fd;
+    acia->restore_termios = false;
+    acia->control = 0;
+    acia->last_received = 0;
+    atomic_init(&acia->receive_interrupts, false);
+    atomic_init(&acia->interrupt_posted, false);
+    atomic_init(&acia->host_sleeping, false);
+    atomic_init(&acia->stopping, false);
+    atomic_init(&acia->input_ended, false);
+    acia->cpu = NULL;
+    acia->interrupt_opcode = 0xFF;
+    acia->clock = NULL;
+    acia->character_cycles = 0;
+    acia->next_receive_cycle = 0;
+    acia->running = false;
+    if (pipe(acia->wake_pipe) != 0) {
+        acia->wake_pipe[0] = acia->wake_pipe[1] = -1;
+        acia_close(acia);
+        return false;
+    }
+    fcntl(acia->wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(acia->wake_pipe[1], F_SETFL, O_NONBLOCK);
+    if (!owns_fds) {
+        make_raw(acia);
+    }
+    if (pthread_create(&acia->thread, NULL, host_thread, acia) != 0) {
+        acia_close(acia);
+        return false;
+    }
+    acia->running = true;
+    return true;
+}
+
+/**
+ * Opens an ACIA receiving from one descriptor and transmitting to another one (e.g. stdin and stdout),
+ * a terminal is switched to raw input until acia_close. The descriptors stay open after acia_close
+ * Returns false if the host thread can't be started
+ */
+bool acia_open_fds(acia_t *acia, int in_fd, int out_fd) {
+    acia->pty_name[0] = '\0';
+    return start(acia, in_fd, out_fd, false, -1);
+}
+
+/**
+ * Opens an ACIA connected to a new raw pseudo-terminal, its name (e.g. /dev/pts/3) is in acia->pty_name
+ * for a terminal program to connect to. The emulator keeps the terminal side open too,
+ * so input isn't lost between terminal programs connecting and disconnecting
+ * Returns false if the pseudo-terminal or the host thread can't be created
+ */
+bool acia_open_pty(acia_t *acia) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        return false;
+    }
+    const char *name = (grantpt(fd) == 0 && unlockpt(fd) == 0) ? ptsname(fd) : NULL;
+    int terminal_fd = (name != NULL && strlen(name) < sizeof(acia->pty_name)) ? open(name, O_RDWR | O_NOCTTY) : -1;
+    if (terminal_fd < 0) {
+        close(fd);
+        return false;
+    }
+    strcpy(acia->pty_name, name);
+    struct termios raw;
+    if (tcgetattr(terminal_fd, &raw) == 0) {
+        cfmakeraw(&raw);
+        tcsetattr(terminal_fd, TCSANOW, &raw);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    return start(acia, fd, fd, true, terminal_fd);
+}
+
+/**
+ * Stops the host thread after it writes out the remaining output and restores the terminal
+ */
+void acia_close(acia_t *acia) {
+    if (acia->running) {
+        atomic_store(&acia->stopping, true);
+        ssize_t written = write(acia->wake_pipe[1], "", 1);
+        (void)written;
+        pthread_join(acia->thread, NULL);
+        acia->running = false;
+    }
+    if (acia->restore_termios) {
+        tcsetattr(acia->in_fd, TCSANOW, &acia->saved_termios);
+        acia->restore_termios = false;
+    }
+    if (acia->wake_pipe[0] >= 0) {
+        close(acia->wake_pipe[0]);
+        close(acia->wake_pipe[1]);
+        acia->wake_pipe[0] = acia->wake_pipe[1] = -1;
+    }
+    if (acia->owns_fds) {
+        close(acia->in_fd);
+        acia->owns_fds = false;
+    }
+    if (acia->held_fd >= 0) {
+        close(acia->held_fd);
+        acia->held_fd = -1;
+    }
+}
+
+/**
+ * Sets the operation (an RST) the board's interrupt jumper sends to the CPU when a byte is received
+ * and the program enables receive interrupts in the control register, called before running the CPU
+ */
+void acia_set_interrupt(acia_t *acia, cpu_t *cpu, uint8_t opcode) {
+    acia->interrupt_opcode = opcode;
+    acia->cpu = cpu;
+}
+
+/**
+ * Paces the received bytes at a baud rate of the serial line, measured in cycles of the given CPU:
+ * the byte after the one the program read becomes ready one character time later, however fast
+ * the host delivers the input. Called before running the CPU, a baud rate of 0 turns the pacing off
+ */
+void acia_set_baud_rate(acia_t *acia, cpu_t *clock, unsigned baud_rate) {
+    acia->clock = (baud_rate > 0) ? clock : NULL;
+    acia->character_cycles = (baud_rate > 0) ? (uint64_t)CPU_FREQ * ACIA_BITS_PER_CHARACTER / baud_rate : 0;
+    acia->next_receive_cycle = (baud_rate > 0) ? cpu_get_cycles(clock) + acia->character_cycles : 0;
+}
+
+/**
+ * Connects the ACIA to the status/control port and the data port right after it
+ */
+void acia_attach(acia_t *acia, io_bus_t *bus, uint8_t status_port) {
+    io_bus_register(bus, status_port, read_status, write_control, acia);
+    io_bus_register(bus, status_port + 1, read_data, write_data, acia);
+}
+
+/**
+ * Connects the ACIA in place of an older 88-SIO board, to its active low status port and the data port right after it
+ */
+void acia_attach_sio(acia_t *acia, io_bus_t *bus, uint8_t status_port) {
+    io_bus_register(bus, status_port, read_sio_status, NULL, acia);
+    io_bus_register(bus, status_port + 1, read_data, write_data, acia);
+}
+
+/**
+ * Returns true once the input descriptor ended and the program read everything received before
+ */
+bool acia_input_ended(acia_t *acia) {
+    return atomic_load(&acia->input_ended) && ring_used(&acia->receive) == 0;
+}
@@ -0,0 +1,91 @@
+#ifndef __ACIA_H__
+#define __ACIA_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <termios.h>
+#include "cpu.h"
+#include "io.h"
+
+#define ACIA_2SIO_PORT_A 0x10 // Status/control port of the first channel of an Altair 88-2SIO, data port is the next one
+#define ACIA_2SIO_PORT_B 0x12
+#define ACIA_SIO_PORT 0x00 // Status port of an Altair 88-SIO, data port is the next one
+#define ACIA_RING_SIZE 1024 // Must be a power of 2
+#define ACIA_BITS_PER_CHARACTER 10 // Start bit, 8 data bits and a stop bit
+
+// Status register
+#define ACIA_STATUS_RDRF 0x01 // Receive data register full
+#define ACIA_STATUS_TDRE 0x02 // Transmit data register empty
+#define ACIA_STATUS_IRQ 0x80 // Interrupt request
+// Control register
+#define ACIA_CONTROL_MASTER_RESET 0x03 // Both counter divide select bits set
+#define ACIA_CONTROL_RECEIVE_INTERRUPT 0x80
+// Status register of the 88-SIO, the bits are active low
+#define ACIA_SIO_STATUS_INPUT_BUSY 0x01 // Nothing received
+#define ACIA_SIO_STATUS_OUTPUT_BUSY 0x80 // A byte is being transmitted
+
+/*
+ * Single-producer single-consumer ring of bytes, the indexes only grow and wrap around modulo the size.
+ * Each side owns one index and keeps a cached copy of the other one, so it reads the shared index
+ * only when the cached one says the ring is empty (or full)
+ */
+typedef struct ACIA_RING {
+    _Alignas(64) atomic_uint head; // Bytes taken by the consumer
+    _Alignas(64) atomic_uint tail; // Bytes put by the producer
+    _Alignas(64) unsigned producer_head; // Producer's copy of 'head'
+    _Alignas(64) unsigned consumer_tail; // Consumer's copy of 'tail'
+    uint8_t buffer[ACIA_RING_SIZE];
+} acia_ring_t;
+
+/*
+ * Motorola 6850 ACIA, one channel of an Altair 88-2SIO, connected to host file descriptors
+ * (a pseudo-terminal or stdin and stdout). The host side runs in its own thread which moves bytes
+ * between the descriptors and the rings, so the CPU thread never waits in a system call
+ * (it only wakes the thread up through a pipe when the thread sleeps and there is something to send)
+ */
+typedef struct ACIA {
+    acia_ring_t receive; // Filled by the host thread
+    acia_ring_t transmit; // Emptied by the host thread
+    int in_fd;
+    int out_fd;
+    bool owns_fds; // True if the descriptors are closed together with the ACIA (the pty)
+    int held_fd; // Terminal side of the pty kept open by the emulator, -1 otherwise
+    bool restore_termios; // True if 'in_fd' is a terminal switched to raw mode
+    struct termios saved_termios;
+    int wake_pipe[2]; // Written by the CPU thread to wake up the host thread
+    atomic_bool host_sleeping;
+    atomic_bool stopping;
+    atomic_bool input_ended; // Set by the host thread at the end of the input
+    pthread_t thread;
+    bool running;
+    uint8_t control;
+    uint8_t last_received; // Read again from the data register while nothing new is received
+    atomic_bool receive_interrupts; // Receive interrupt enable bit of the control register
+    atomic_bool interrupt_posted; // Cleared when the CPU reads the data register
+    cpu_t *cpu; // Receives the interrupt requests, NULL if the board has no interrupt jumper set
+    uint8_t interrupt_opcode;
+    cpu_t *clock; // Counts the cycles of the character time, NULL if the received bytes aren't paced
+    uint64_t character_cycles;
+    uint64_t next_receive_cycle; // Cycle of the clock at which the byte after the last one read is received
+    char pty_name[64];
+} acia_t;
+
+bool acia_open_fds(acia_t *acia, int in_fd, int out_fd);
+
+bool acia_open_pty(acia_t *acia);
+
+void acia_close(acia_t *acia);
+
+void acia_set_interrupt(acia_t *acia, cpu_t *cpu, uint8_t opcode);
+
+void acia_set_baud_rate(acia_t *acia, cpu_t *clock, unsigned baud_rate);
+
+void acia_attach(acia_t *acia, io_bus_t *bus, uint8_t status_port);
+
+void acia_attach_sio(acia_t *acia, io_bus_t *bus, uint8_t status_port);
+
+bool acia_input_ended(acia_t *acia);
+
+#endif // __ACIA_H__
@@ -0,0 +1,102 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "memory.h"
+#include "io.h"
+#include "loader.h"
+#include "acia.h"
+#include "hle.h"
+#include "pacer.h"
+#include "altair.h"
+
+#define RUN_BUDGET_CYCLES (CPU_FREQ / 100) // Short batches, the program polls the serial board
+#define END_CYCLES CPU_FREQ // The program runs for 1 s of emulated time after its input ends to answer the last line
+#define SENSE_SWITCHES_PORT 0xFF
+#define CONSOLE_BAUD_RATE 110 // Teletype of the Altair, input piped in is received no faster than it would send it
+
+// ROM image in programs/ and the Altair 8800 it expects
+typedef struct ALTAIR_ROM {
+    const char *name;
+    const char *path;
+    uint16_t address; // Where the image is mapped and started from, the console is the first channel of an 88-2SIO
+    uint8_t sense_switches; // Read from port 0xFF
+} altair_rom_t;
+
+static const altair_rom_t roms[] = {
+    {"vtl2", "../programs/VTL-2.BIN", 0xF800, 0x08}
+};
+
+static memory_t memory;
+static cpu_t cpu;
+static cpu_traps_t traps;
+static io_bus_t bus;
+static acia_t acia;
+static hle_t hle;
+
+static uint8_t read_sense_switches(void *context, uint8_t port) {
+    (void)port;
+    return *(const uint8_t *)context;
+}
+
+/**
+ * Boots a ROM image (by its name in the roms table) with the serial console on stdin and stdout,
+ * as fast as possible or paced at a multiple of CPU_FREQ, until the input ends.
+ * Known routines of the image run natively through HLE hooks
+ * Returns false if the image is unknown or can't be loaded
+ */
+bool run_altair(const char *rom_name, double speed) {
+    const altair_rom_t *rom = NULL;
+    for (unsigned i = 0; i < sizeof(roms) / sizeof(roms[0]); i++) {
+        if (strcmp(roms[i].name, rom_name) == 0) {
+            rom = &roms[i];
+        }
+    }
+    if (rom == NULL) {
+        fprintf(stderr, "Unknown ROM %s\n", rom_name);
+        return false;
+    }
+    memory_init(&memory);
+    loader_t loader;
+    loader_init(&loader, &memory);
+    loader_segment_t image = {rom->path, LOADER_ROM, rom->address};
+    if (!loader_load(&loader, &image, 1)) {
+        fprintf(stderr, "ROM load error: %s\n", loader.error);
+        return false;
+    }
+    cpu_init(&cpu, &memory);
+    cpu_set_PC_reg(&cpu, rom->address);
+    cpu_traps_init(&traps);
+    hle_init(&hle, &cpu);
+    hle_install(&hle, &traps, loader.mappings[0].address, loader.ranges[0].length);
+    cpu_set_traps(&cpu, &traps);
+    io_bus_init(&bus);
+    io_bus_register(&bus, SENSE_SWITCHES_PORT, read_sense_switches, NULL, (void *)&rom->sense_switches);
+    if (!acia_open_fds(&acia, STDIN_FILENO, STDOUT_FILENO)) {
+        fprintf(stderr, "Can't start the serial board\n");
+        cpu_destroy(&cpu);
+        loader_unload(&loader);
+        return false;
+    }
+    acia_attach(&acia, &bus, ACIA_2SIO_PORT_A);
+    acia_set_baud_rate(&acia, &cpu, CONSOLE_BAUD_RATE);
+    cpu_set_io_hooks(&cpu, io_read, io_write, &bus);
+    pacer_t pacer;
+    pacer_init(&pacer, CPU_FREQ, speed);
+    long long end_cycles = -1;
+    for (;;) {
+        cpu_run_result_t result = (speed > PACER_UNLIMITED) ? pacer_run_slice(&pacer, &cpu) : cpu_run(&cpu, RUN_BUDGET_CYCLES);
+        if (result.reason == CPU_EXIT_TRAP || (end_cycles >= 0 && (long long)cpu_get_cycles(&cpu) >= end_cycles)) {
+            break;
+        }
+        if (end_cycles < 0 && acia_input_ended(&acia)) {
+            end_cycles = cpu_get_cycles(&cpu) + END_CYCLES;
+        }
+    }
+    acia_close(&acia);
+    cpu_destroy(&cpu);
+    loader_unload(&loader);
+    return true;
+}
@@ -0,0 +1,8 @@
+#ifndef __ALTAIR_H__
+#define __ALTAIR_H__
+
+#include <stdbool.h>
+
+bool run_altair(const char *rom_name, double speed);
+
+#endif // __ALTAIR_H__
@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "aot.h"
+
+static const aot_program_t *programs[AOT_MAX_PROGRAMS];
+static int programs_count = 0;
+
+/**
+ * Adds a recompiled program to the list searched by aot_find,
+ * called by the generated sources before main
+ */
+void aot_register(const aot_program_t *program) {
+    if (programs_count >= AOT_MAX_PROGRAMS) {
+        fprintf(stderr, "Too many recompiled programs, %s is ignored\n", program->name);
+        return;
+    }
+    programs[programs_count++] = program;
+}
+
+/**
+ * Returns the recompiled program whose image is loaded in the memory or NULL if there is none
+ */
+const aot_program_t *aot_find(const memory_t *memory) {
+    for (int i = 0; i < programs_count; i++) {
+        const aot_program_t *program = programs[i];
+        if (program->load_address + program->image_size <= MEMORY_SIZE
+            && memory_equals(memory, program->load_address, program->image, program->image_size)) {
+            return program;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Prepares a program to run on a given memory: marks the code of its blocks
+ * so writes to it are noticed and remembers the current generations of the pages
+ * Returns NULL if there is not enough memory
+ */
+aot_t *aot_attach(const aot_program_t *program, memory_t *memory) {
+    aot_t *aot = calloc(1, sizeof(aot_t));
+    if (aot == NULL) {
+        return NULL;
+    }
+    aot->program = program;
+    for (int i = 0; i < program->blocks_count; i++) {
+        const aot_block_t *block = &program->blocks[i];
+        aot->entry_map[block->start >> 3] |= (1 << (block->start & 0x07));
+        memory_mark_code(memory, block->start, block->last);
+    }
+    memcpy(aot->page_generation, memory->page_generation, sizeof(aot->page_generation));
+    return aot;
+}
+
+/**
+ * Frees the attached program, its code stays marked in the memory
+ * since the block cache may share the marks
+ */
+void aot_detach(aot_t *aot) {
+    free(aot);
+}
@@ -0,0 +1,235 @@
+#ifndef __AOT_H__
+#define __AOT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include "memory.h"
+#include "cpu.h"
+
+#define AOT_MAX_PROGRAMS 16
+
+#define AOT_FLAGS_ALL (FLAG_S | FLAG_Z | FLAG_AC | FLAG_P | FLAG_C)
+
+/*
+ * The 8080 state the recompiled code works on,
+ * cpu_run copies the registers in and out around every call
+ */
+typedef struct AOT_REGS {
+    reg_16bit_t bc, de, hl;
+    uint16_t sp, pc;
+    uint8_t a;
+    uint8_t f;
+    bool halted;
+    bool interrupts_enabled;
+    bool stale; // Set when the execution stopped at a block whose code was overwritten
+    long long remaining_cycles;
+    unsigned long long blocks_executed;
+    memory_t *memory;
+    const uint32_t *page_generation; // Generations of the memory pages when the program was attached
+    const uint8_t *trap_map;
+    const atomic_bool *interrupt_pending;
+    cpu_io_read_hook_t io_read;
+    cpu_io_write_hook_t io_write;
+    void *io_context;
+} aot_regs_t;
+
+// Bytes of a basic block, the last one is the last byte of its last operation
+typedef struct AOT_BLOCK {
+    uint16_t start;
+    uint16_t last;
+} aot_block_t;
+
+/*
+ * A program recompiled by Intel8080Recompiler,
+ * generated sources register their program before main
+ */
+typedef struct AOT_PROGRAM {
+    const char *name;
+    uint16_t load_address;
+    uint32_t image_size;
+    const uint8_t *image;
+    const aot_block_t *blocks;
+    int blocks_count;
+    void (*run)(aot_regs_t *regs); // Executes blocks starting at regs->pc until it reaches code it doesn't have
+} aot_program_t;
+
+typedef struct AOT_STATS {
+    unsigned long long entries; // Calls of the program's run function
+    unsigned long long blocks_executed;
+    unsigned long long stale_exits; // Returns to the interpreter because the block's code was overwritten
+} aot_stats_t;
+
+// A program attached to a CPU
+typedef struct AOT {
+    const aot_program_t *program;
+    uint8_t entry_map[MEMORY_SIZE / 8]; // One bit per block start
+    uint32_t page_generation[MEMORY_PAGES];
+    aot_stats_t stats;
+} aot_t;
+
+void aot_register(const aot_program_t *program);
+
+const aot_program_t *aot_find(const memory_t *memory);
+
+aot_t *aot_attach(const aot_program_t *program, memory_t *memory);
+
+void aot_detach(aot_t *aot);
+
+inline static bool aot_is_entry(const aot_t *aot, uint16_t address) {
+    return aot->entry_map[address >> 3] & (1 << (address & 0x07));
+}
+
+/*
+ * Helpers used by the generated code, every one of them behaves exactly like its counterpart in cpu.c
+ */
+
+/**
+ * Checks if the code of a block is still the same as the recompiled one
+ */
+inline static bool aot_block_is_current(aot_regs_t *r, const uint8_t *image, uint16_t load_address, uint16_t start, uint16_t last) {
+    if (r->memory->page_generation[start / MEMORY_PAGE_SIZE] == r->page_generation[start / MEMORY_PAGE_SIZE]
+        && r->memory->page_generation[last / MEMORY_PAGE_SIZE] == r->page_generation[last / MEMORY_PAGE_SIZE]) {
+        return true;
+    }
+    // Something else on the page was written or the page was remapped
+    return memory_equals(r->memory, start, &image[start - load_address], last - start + 1);
+}
+
+/**
+ * Checks if the recompiled code can go on to the next block
+ */
+inline static bool aot_can_continue(const aot_regs_t *r) {
+    return r->remaining_cycles > 0 && !r->halted && !atomic_load_explicit(r->interrupt_pending, memory_order_relaxed)
+        && !(r->trap_map[r->pc >> 3] & (1 << (r->pc & 0x07)));
+}
+
+/*
+ * Every block works on local copies of the registers, so the compiler can keep them in host registers
+ */
+#define AOT_LOAD_REGS(r) \
+    memory_t *const memory = (r)->memory; \
+    uint8_t A = (r)->a, F = (r)->f; \
+    reg_16bit_t BC = (r)->bc, DE = (r)->de, HL = (r)->hl; \
+    uint16_t SP = (r)->sp; \
+    (void)memory
+
+#define AOT_STORE_REGS(r) \
+    ((r)->a = A, (r)->f = F, (r)->bc = BC, (r)->de = DE, (r)->hl = HL, (r)->sp = SP)
+
+/**
+ * Same as memory_get
+ */
+inline static uint8_t aot_read(memory_t *memory, uint16_t address) {
+    return memory_get(memory, address);
+}
+
+/**
+ * Same as memory_store
+ */
+inline static void aot_write(memory_t *memory, uint16_t address, uint8_t value) {
+    memory_store(memory, address, value);
+}
+
+/**
+ * Z, S and P flags (and the always set bit 1) of an 8bit result
+ */
+inline static uint8_t aot_zsp_flags(uint8_t value) {
+    return STATUS_REG_FIXED_BITS | (value == 0 ? FLAG_Z : 0) | (value & FLAG_S) | (__builtin_parity(value) ? 0 : FLAG_P);
+}
+
+/**
+ * Same as set_flags in cpu.c: the 9th bit of 'result' is the carry, bit 4 of (aux ^ result) is AC
+ */
+inline static uint8_t aot_flags(uint16_t result, uint8_t aux) {
+    return aot_zsp_flags(result & 0xFF) | ((result >> 8) & FLAG_C) | ((aux ^ result) & FLAG_AC);
+}
+
+inline static uint8_t aot_add(uint8_t *f, uint8_t val1, uint8_t val2, uint8_t carry) {
+    int result = val1 + val2 + carry;
+    *f = aot_flags(result, val1 ^ val2);
+    return result & 0xFF;
+}
+
+inline static uint8_t aot_sub(uint8_t *f, uint8_t val1, uint8_t val2, uint8_t borrow) {
+    int result = (val1 - val2 - borrow) & 0x1FF;
+    *f = aot_flags(result, ~(val1 ^ val2));
+    return result & 0xFF;
+}
+
+inline static uint8_t aot_inc(uint8_t *f, uint8_t val) {
+    uint8_t result = val + 1;
+    *f = aot_flags(((*f & FLAG_C) << 8) | result, val);
+    return result;
+}
+
+inline static uint8_t aot_dec(uint8_t *f, uint8_t val) {
+    uint8_t result = val - 1;
+    *f = aot_flags(((*f & FLAG_C) << 8) | result, ~val);
+    return result;
+}
+
+inline static uint8_t aot_and(uint8_t *f, uint8_t val1, uint8_t val2) {
+    uint8_t result = val1 & val2;
+    *f = aot_flags(result, result ^ (((val1 | val2) & 0x08) << 1));
+    return result;
+}
+
+inline static uint8_t aot_or(uint8_t *f, uint8_t val1, uint8_t val2) {
+    uint8_t result = val1 | val2;
+    *f = aot_flags(result, result);
+    return result;
+}
+
+inline static uint8_t aot_xor(uint8_t *f, uint8_t val1, uint8_t val2) {
+    uint8_t result = val1 ^ val2;
+    *f = aot_flags(result, result);
+    return result;
+}
+
+inline static uint16_t aot_dad(uint8_t *f, uint16_t val1, uint16_t val2) {
+    int result = val1 + val2;
+    *f = (*f & ~FLAG_C) | (result >= 0x10000);
+    return result & 0xFFFF;
+}
+
+inline static uint8_t aot_rlc(uint8_t *f, uint8_t a) {
+    *f = (*f & ~FLAG_C) | (a >> 7);
+    return (a << 1) | (a >> 7);
+}
+
+inline static uint8_t aot_rrc(uint8_t *f, uint8_t a) {
+    *f = (*f & ~FLAG_C) | (a & 0x01);
+    return (a >> 1) | (a << 7);
+}
+
+inline static uint8_t aot_ral(uint8_t *f, uint8_t a) {
+    uint8_t old_carry = *f & FLAG_C;
+    *f = (*f & ~FLAG_C) | (a >> 7);
+    return (a << 1) | old_carry;
+}
+
+inline static uint8_t aot_rar(uint8_t *f, uint8_t a) {
+    uint8_t old_carry = *f & FLAG_C;
+    *f = (*f & ~FLAG_C) | (a & 0x01);
+    return (a >> 1) | (old_carry << 7);
+}
+
+inline static uint8_t aot_daa(uint8_t *f, uint8_t a) {
+    uint8_t flags = *f;
+    if ((a & 0x0F) > 9 || (flags & FLAG_AC)) {
+        flags |= (a > 0xA0) ? FLAG_C : 0;
+        flags = ((a & 0x0F) > 0x09) ? (flags | FLAG_AC) : (flags & ~FLAG_AC);
+        a += 0x06;
+    } else {
+        flags &= ~FLAG_AC;
+    }
+    if ((a >> 4) > 9 || (flags & FLAG_C)) {
+        flags |= FLAG_C;
+        a += 0x60;
+    }
+    *f = (flags & (FLAG_C | FLAG_AC)) | aot_zsp_flags(a);
+    return a;
+}
+
+#endif // __AOT_H__
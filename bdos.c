@@ -0,0 +1,769 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <limits.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bdos.h"
+
+#define FCB_SIZE 36
+#define FCB_DRIVE 0
+#define FCB_NAME 1 // 8 characters of the name and 3 of the extension, padded with spaces
+#define FCB_EX 12 // Extent (16 KiB) of the sequential position
+#define FCB_S2 14 // Module (512 KiB) of the sequential position
+#define FCB_RC 15 // Records in the current extent
+#define FCB_CR 32 // Record in the current extent
+#define FCB_R0 33 // Random record number, 3 bytes
+#define FCB_RENAME 16 // New name of function 23 (drive byte and name)
+#define NAME_LENGTH 11
+#define RECORDS_PER_EXTENT 128
+#define RECORDS_PER_MODULE 4096
+#define DIRECTORY_ENTRY_SIZE 32
+#define EMPTY_DIRECTORY_ENTRY 0xE5
+
+// Results of the file functions
+#define OK 0x00
+#define END_OF_FILE 0x01 // Also "reading unwritten data" of the random read
+#define DISK_FULL 0x02
+#define RANDOM_RECORD_OUT_OF_RANGE 0x06
+#define FAILED 0xFF
+
+/**
+ * Writes bytes to the emulated memory, wrapping around its end
+ */
+static void write_bytes(bdos_t *bdos, uint16_t address, const uint8_t *bytes, uint32_t length) {
+    uint32_t first_length = (address + length <= MEMORY_SIZE) ? length : (uint32_t)(MEMORY_SIZE - address);
+    memory_write_bytes(bdos->cpu->memory, address, bytes, first_length);
+    if (first_length < length) {
+        memory_write_bytes(bdos->cpu->memory, 0, bytes + first_length, length - first_length);
+    }
+}
+
+static void read_bytes(bdos_t *bdos, uint16_t address, uint8_t *bytes, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) {
+        bytes[i] = memory_get(bdos->cpu->memory, address + i);
+    }
+}
+
+/**
+ * Converts a host file name to the space padded upper case form of FCBs
+ * Returns false if the name doesn't fit in 8.3 characters or has characters CP/M can't use
+ */
+static bool host_name_to_fcb(const char *host_name, uint8_t *fcb_name) {
+    memset(fcb_name, ' ', NAME_LENGTH);
+    int position = 0;
+    int limit = 8;
+    for (const char *c = host_name; *c != '\0'; c++) {
+        if (*c == '.' && limit == 8 && c != host_name) {
+            position = 8;
+            limit = NAME_LENGTH;
+            continue;
+        }
+        if (position >= limit || *c <= ' ' || (unsigned char)*c >= 0x7F || strchr(".,;:=?*<>|[]", *c) != NULL) {
+            return false;
+        }
+        fcb_name[position++] = toupper((unsigned char)*c);
+    }
+    return position > 0;
+}
+
+/**
+ * Converts the name of an FCB (ignoring the attribute bits) to a host name, e.g. "TEST.COM"
+ * Returns false if the name is empty or has wildcards
+ */
+static bool fcb_to_host_name(const uint8_t *fcb_name, char *host_name) {
+    int length = 0;
+    for (int i = 0; i < NAME_LENGTH; i++) {
+        char c = toupper(fcb_name[i] & 0x7F);
+        if (c == '?') {
+            return false;
+        }
+        if (i == 8 && c != ' ') {
+            host_name[length++] = '.';
+        }
+        if (c != ' ') {
+            host_name[length++] = c;
+        }
+    }
+    host_name[length] = '\0';
+    return length > 0 && host_name[0] != '.';
+}
+
+static bool name_matches(const uint8_t *pattern, const uint8_t *fcb_name) {
+    for (int i = 0; i < NAME_LENGTH; i++) {
+        uint8_t expected = toupper(pattern[i] & 0x7F);
+        if (expected != '?' && expected != fcb_name[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Returns the drive an FCB refers to or -1 if it doesn't exist
+ */
+static int fcb_drive(bdos_t *bdos, const uint8_t *fcb) {
+    int drive = (fcb[FCB_DRIVE] == 0 || fcb[FCB_DRIVE] == '?') ? bdos->current_drive : (fcb[FCB_DRIVE] & 0x1F) - 1;
+    return (drive >= 0 && drive < BDOS_DRIVES && bdos->drives[drive] != NULL) ? drive : -1;
+}
+
+/**
+ * Finds the host file with the name of an FCB (host names are matched regardless of the case)
+ * Returns false if there is no such file
+ */
+static bool find_host_path(bdos_t *bdos, int drive, const uint8_t *fcb_name, char *path, size_t path_size) {
+    DIR *directory = opendir(bdos->drives[drive]);
+    if (directory == NULL) {
+        return false;
+    }
+    bool found = false;
+    struct dirent *entry;
+    uint8_t entry_name[NAME_LENGTH];
+    while (!found && (entry = readdir(directory)) != NULL) {
+        if (host_name_to_fcb(entry->d_name, entry_name) && name_matches(fcb_name, entry_name)) {
+            found = (size_t)snprintf(path, path_size, "%s/%s", bdos->drives[drive], entry->d_name) < path_size;
+        }
+    }
+    closedir(directory);
+    return found;
+}
+
+static void close_file(bdos_file_t *file) {
+    if (file->map != NULL) {
+        munmap((void *)file->map, file->map_size);
+    }
+    close(file->fd);
+    file->used = false;
+}
+
+/**
+ * Maps the whole file (as it's now) to serve records from the host page cache,
+ * writes made later through the descriptor are seen in the mapping
+ */
+static void map_file(bdos_file_t *file) {
+    if (file->map != NULL) {
+        munmap((void *)file->map, file->map_size);
+        file->map = NULL;
+    }
+    struct stat status;
+    file->map_size = (fstat(file->fd, &status) == 0) ? status.st_size : 0;
+    if (file->map_size > 0) {
+        void *map = mmap(NULL, file->map_size, PROT_READ, MAP_SHARED, file->fd, 0);
+        file->map = (map != MAP_FAILED) ? map : NULL;
+    }
+    if (file->map == NULL) {
+        file->map_size = 0;
+    }
+}
+
+static bdos_file_t *lookup_file(bdos_t *bdos, int drive, const char *name) {
+    for (int i = 0; i < BDOS_MAX_FILES; i++) {
+        bdos_file_t *file = &bdos->files[i];
+        if (file->used && file->drive == drive && strcmp(file->name, name) == 0) {
+            file->last_used = ++bdos->clock;
+            return file;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Returns the host file of an FCB, opening (or creating) it if it isn't open yet
+ * or NULL if it doesn't exist or can't be opened
+ */
+static bdos_file_t *open_file(bdos_t *bdos, int drive, const uint8_t *fcb, bool create) {
+    char name[13];
+    if (!fcb_to_host_name(&fcb[FCB_NAME], name)) {
+        return NULL;
+    }
+    bdos_file_t *file = lookup_file(bdos, drive, name);
+    if (file != NULL && !create) {
+        return file;
+    }
+    char path[PATH_MAX];
+    int fd;
+    if (create) {
+        if (file != NULL) {
+            close_file(file);
+        }
+        if (!find_host_path(bdos, drive, &fcb[FCB_NAME], path, sizeof(path))
+            && (size_t)snprintf(path, sizeof(path), "%s/%s", bdos->drives[drive], name) >= sizeof(path)) {
+            return NULL;
+        }
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    } else {
+        if (!find_host_path(bdos, drive, &fcb[FCB_NAME], path, sizeof(path))) {
+            return NULL;
+        }
+        fd = open(path, O_RDWR);
+        if (fd < 0) {
+            fd = open(path, O_RDONLY);
+        }
+    }
+    if (fd < 0) {
+        return NULL;
+    }
+    file = &bdos->files[0];
+    for (int i = 0; i < BDOS_MAX_FILES && file->used; i++) {
+        if (!bdos->files[i].used || bdos->files[i].last_used < file->last_used) {
+            file = &bdos->files[i];
+        }
+    }
+    if (file->used) {
+        close_file(file); // CP/M programs don't have to close files they only read
+    }
+    file->used = true;
+    file->drive = drive;
+    strcpy(file->name, name);
+    file->fd = fd;
+    file->map = NULL;
+    file->last_used = ++bdos->clock;
+    map_file(file);
+    return file;
+}
+
+/**
+ * Closes the host files of all names matching a pattern, before they're deleted or renamed
+ */
+static void forget_files(bdos_t *bdos, int drive, const uint8_t *pattern) {
+    uint8_t fcb_name[NAME_LENGTH];
+    for (int i = 0; i < BDOS_MAX_FILES; i++) {
+        bdos_file_t *file = &bdos->files[i];
+        if (file->used && file->drive == drive && host_name_to_fcb(file->name, fcb_name) && name_matches(pattern, fcb_name)) {
+            close_file(file);
+        }
+    }
+}
+
+static off_t file_size(bdos_file_t *file) {
+    struct stat status;
+    return (fstat(file->fd, &status) == 0) ? status.st_size : 0;
+}
+
+static uint32_t sequential_record(const uint8_t *fcb) {
+    return ((fcb[FCB_S2] & 0x3F) * RECORDS_PER_MODULE) + ((fcb[FCB_EX] & 0x1F) * RECORDS_PER_EXTENT) + fcb[FCB_CR];
+}
+
+/**
+ * Sets the sequential position of an FCB and the number of records of its extent
+ */
+static void set_sequential_record(uint8_t *fcb, uint32_t record, off_t size) {
+    fcb[FCB_CR] = record % RECORDS_PER_EXTENT;
+    fcb[FCB_EX] = (record / RECORDS_PER_EXTENT) % (RECORDS_PER_MODULE / RECORDS_PER_EXTENT);
+    fcb[FCB_S2] = record / RECORDS_PER_MODULE;
+    long long records_left = (size + BDOS_RECORD_SIZE - 1) / BDOS_RECORD_SIZE - (record - fcb[FCB_CR]);
+    fcb[FCB_RC] = (records_left < 0) ? 0 : (records_left > RECORDS_PER_EXTENT) ? RECORDS_PER_EXTENT : records_left;
+}
+
+/**
+ * Copies a record from the mapped file to the DMA address, the last one is padded with end of file characters
+ * Returns END_OF_FILE if the record is beyond the end of the file
+ */
+static uint8_t read_record(bdos_t *bdos, bdos_file_t *file, uint32_t record) {
+    size_t offset = (size_t)record * BDOS_RECORD_SIZE;
+    if (offset >= file->map_size) {
+        if ((size_t)file_size(file) <= file->map_size) {
+            return END_OF_FILE;
+        }
+        map_file(file); // The file grew since it was mapped
+        bdos->stats.remaps++;
+        if (offset >= file->map_size) {
+            return END_OF_FILE;
+        }
+    }
+    size_t length = file->map_size - offset;
+    if (length >= BDOS_RECORD_SIZE) {
+        write_bytes(bdos, bdos->dma, &file->map[offset], BDOS_RECORD_SIZE);
+    } else {
+        uint8_t padded[BDOS_RECORD_SIZE];
+        memcpy(padded, &file->map[offset], length);
+        memset(&padded[length], BDOS_EOF, BDOS_RECORD_SIZE - length);
+        write_bytes(bdos, bdos->dma, padded, BDOS_RECORD_SIZE);
+    }
+    bdos->stats.records_read++;
+    return OK;
+}
+
+/**
+ * Writes the record at the DMA address to the file, straight from the emulated RAM if it's there
+ * Returns DISK_FULL if the host file can't be written
+ */
+static uint8_t write_record(bdos_t *bdos, bdos_file_t *file, uint32_t record) {
+    memory_t *memory = bdos->cpu->memory;
+    uint8_t copy[BDOS_RECORD_SIZE];
+    const uint8_t *bytes = copy;
+    if (bdos->dma + BDOS_RECORD_SIZE <= MEMORY_SIZE && memory_is_ram(memory, bdos->dma, BDOS_RECORD_SIZE)) {
+        bytes = &memory->data[bdos->dma];
+    } else {
+        read_bytes(bdos, bdos->dma, copy, BDOS_RECORD_SIZE);
+    }
+    ssize_t written;
+    do {
+        written = pwrite(file->fd, bytes, BDOS_RECORD_SIZE, (off_t)record * BDOS_RECORD_SIZE);
+    } while (written < 0 && errno == EINTR);
+    if (written != BDOS_RECORD_SIZE) {
+        return DISK_FULL;
+    }
+    bdos->stats.records_written++;
+    return OK;
+}
+
+/**
+ * Reads or writes the record at the sequential position of an FCB and moves the position to the next record
+ */
+static uint8_t sequential_io(bdos_t *bdos, uint16_t fcb_address, bool write) {
+    uint8_t fcb[FCB_SIZE];
+    read_bytes(bdos, fcb_address, fcb, FCB_SIZE);
+    int drive = fcb_drive(bdos, fcb);
+    bdos_file_t *file = (drive >= 0) ? open_file(bdos, drive, fcb, false) : NULL;
+    if (file == NULL) {
+        return write ? DISK_FULL : END_OF_FILE;
+    }
+    uint32_t record = sequential_record(fcb);
+    uint8_t result = write ? write_record(bdos, file, record) : read_record(bdos, file, record);
+    if (result == OK) {
+        set_sequential_record(fcb, record + 1, file_size(file));
+        write_bytes(bdos, fcb_address + FCB_EX, &fcb[FCB_EX], FCB_R0 - FCB_EX);
+    }
+    return result;
+}
+
+/**
+ * Reads or writes the record at the random record number of an FCB,
+ * the sequential position is set to the same record
+ */
+static uint8_t random_io(bdos_t *bdos, uint16_t fcb_address, bool write) {
+    uint8_t fcb[FCB_SIZE];
+    read_bytes(bdos, fcb_address, fcb, FCB_SIZE);
+    if (fcb[FCB_R0 + 2] != 0) {
+        return RANDOM_RECORD_OUT_OF_RANGE;
+    }
+    int drive = fcb_drive(bdos, fcb);
+    bdos_file_t *file = (drive >= 0) ? open_file(bdos, drive, fcb, false) : NULL;
+    if (file == NULL) {
+        return write ? DISK_FULL : END_OF_FILE;
+    }
+    uint32_t record = fcb[FCB_R0] | (fcb[FCB_R0 + 1] << 8);
+    uint8_t result = write ? write_record(bdos, file, record) : read_record(bdos, file, record);
+    set_sequential_record(fcb, record, file_size(file));
+    write_bytes(bdos, fcb_address + FCB_EX, &fcb[FCB_EX], FCB_R0 - FCB_EX);
+    return result;
+}
+
+static uint8_t open_fcb(bdos_t *bdos, uint16_t fcb_address, bool create) {
+    uint8_t fcb[FCB_SIZE];
+    read_bytes(bdos, fcb_address, fcb, FCB_SIZE);
+    int drive = fcb_drive(bdos, fcb);
+    bdos_file_t *file = (drive >= 0) ? open_file(bdos, drive, fcb, create) : NULL;
+    if (file == NULL) {
+        return FAILED;
+    }
+    if (create) {
+        memset(&fcb[FCB_EX], 0, FCB_CR - FCB_EX);
+    }
+    uint8_t current_record = fcb[FCB_CR];
+    fcb[FCB_S2] = 0;
+    set_sequential_record(fcb, ((fcb[FCB_EX] & 0x1F) * RECORDS_PER_EXTENT), file_size(file));
+    fcb[FCB_CR] = current_record; // Opening doesn't move the position in the extent, programs set it themselves
+    write_bytes(bdos, fcb_address + FCB_EX, &fcb[FCB_EX], FCB_CR - FCB_EX);
+    return OK;
+}
+
+static uint8_t close_fcb(bdos_t *bdos, uint16_t fcb_address) {
+    uint8_t fcb[FCB_SIZE];
+    read_bytes(bdos, fcb_address, fcb, FCB_SIZE);
+    int drive = fcb_drive(bdos, fcb);
+    char path[PATH_MAX];
+    if (drive < 0 || !find_host_path(bdos, drive, &fcb[FCB_NAME], path, sizeof(path))) {
+        return FAILED;
+    }
+    forget_files(bdos, drive, &fcb[FCB_NAME]);
+    return OK;
+}
+
+/**
+ * Writes a directory record to the DMA address with the entry of the next file matching the search
+ * as its first entry. The entry describes the last extent of the file, its allocation map is empty
+ */
+static uint8_t search_next(bdos_t *bdos) {
+    struct dirent *entry;
+    uint8_t record[BDOS_RECORD_SIZE];
+    while (bdos->search != NULL && (entry = readdir(bdos->search)) != NULL) {
+        memset(record, EMPTY_DIRECTORY_ENTRY, sizeof(record));
+        memset(record, 0, DIRECTORY_ENTRY_SIZE);
+        char path[PATH_MAX];
+        struct stat status;
+        if (!host_name_to_fcb(entry->d_name, &record[FCB_NAME]) || !name_matches(bdos->search_pattern, &record[FCB_NAME])
+            || (size_t)snprintf(path, sizeof(path), "%s/%s", bdos->drives[bdos->search_drive], entry->d_name) >= sizeof(path)
+            || stat(path, &status) != 0 || !S_ISREG(status.st_mode)) {
+            continue;
+        }
+        record[0] = bdos->user;
+        uint32_t records = (status.st_size + BDOS_RECORD_SIZE - 1) / BDOS_RECORD_SIZE;
+        uint32_t last_extent_record = (records > 0) ? (records - 1) / RECORDS_PER_EXTENT * RECORDS_PER_EXTENT : 0;
+        set_sequential_record(record, last_extent_record, status.st_size);
+        record[FCB_CR] = EMPTY_DIRECTORY_ENTRY; // Only the first 32 bytes are the entry
+        write_bytes(bdos, bdos->dma, record, BDOS_RECORD_SIZE);
+        return 0;
+    }
+    if (bdos->search != NULL) {
+        closedir(bdos->search);
+        bdos->search = NULL;
+    }
+    return FAILED;
+}
+
+static uint8_t search_first(bdos_t *bdos, uint16_t fcb_address) {
+    uint8_t fcb[FCB_SIZE];
+    read_bytes(bdos, fcb_address, fcb, FCB_SIZE);
+    if (bdos->search != NULL) {
+        closedir(bdos->search);
+        bdos->search = NULL;
+    }
+    int drive = fcb_drive(bdos, fcb);
+    if (drive < 0) {
+        return FAILED;
+    }
+    if (fcb[FCB_DRIVE] == '?') {
+        memset(bdos->search_pattern, '?', NAME_LENGTH);
+    } else {
+        memcpy(bdos->search_pattern, &fcb[FCB_NAME], NAME_LENGTH);
+    }
+    bdos->search_drive = drive;
+    bdos->search = opendir(bdos->drives[drive]);
+    return search_next(bdos);
+}
+
+/**
+ * Deletes all files matching the name of an FCB
+ */
+static uint8_t delete_files(bdos_t *bdos, uint16_t fcb_address) {
+    uint8_t fcb[FCB_SIZE];
+    read_bytes(bdos, fcb_address, fcb, FCB_SIZE);
+    int drive = fcb_drive(bdos, fcb);
+    DIR *directory = (drive >= 0) ? opendir(bdos->drives[drive]) : NULL;
+    if (directory == NULL) {
+        return FAILED;
+    }
+    forget_files(bdos, drive, &fcb[FCB_NAME]);
+    uint8_t result = FAILED;
+    struct dirent *entry;
+    uint8_t entry_name[NAME_LENGTH];
+    char path[PATH_MAX];
+    while ((entry = readdir(directory)) != NULL) {
+        if (host_name_to_fcb(entry->d_name, entry_name) && name_matches(&fcb[FCB_NAME], entry_name)
+            && (size_t)snprintf(path, sizeof(path), "%s/%s", bdos->drives[drive], entry->d_name) < sizeof(path)
+            && unlink(path) == 0) {
+            result = OK;
+        }
+    }
+    closedir(directory);
+    return result;
+}
+
+static uint8_t rename_file(bdos_t *bdos, uint16_t fcb_address) {
+    uint8_t fcb[FCB_SIZE];
+    read_bytes(bdos, fcb_address, fcb, FCB_SIZE);
+    int drive = fcb_drive(bdos, fcb);
+    char old_path[PATH_MAX];
+    char new_path[PATH_MAX];
+    char new_name[13];
+    if (drive < 0 || !fcb_to_host_name(&fcb[FCB_RENAME + FCB_NAME], new_name)
+        || !find_host_path(bdos, drive, &fcb[FCB_NAME], old_path, sizeof(old_path))
+        || (size_t)snprintf(new_path, sizeof(new_path), "%s/%s", bdos->drives[drive], new_name) >= sizeof(new_path)) {
+        return FAILED;
+    }
+    forget_files(bdos, drive, &fcb[FCB_NAME]);
+    return (rename(old_path, new_path) == 0) ? OK : FAILED;
+}
+
+static uint8_t compute_file_size(bdos_t *bdos, uint16_t fcb_address) {
+    uint8_t fcb[FCB_SIZE];
+    read_bytes(bdos, fcb_address, fcb, FCB_SIZE);
+    int drive = fcb_drive(bdos, fcb);
+    bdos_file_t *file = (drive >= 0) ? open_file(bdos, drive, fcb, false) : NULL;
+    uint32_t records = (file != NULL) ? (file_size(file) + BDOS_RECORD_SIZE - 1) / BDOS_RECORD_SIZE : 0;
+    uint8_t random_record[3] = {records & 0xFF, (records >> 8) & 0xFF, records >> 16};
+    write_bytes(bdos, fcb_address + FCB_R0, random_record, sizeof(random_record));
+    return (file != NULL) ? OK : FAILED;
+}
+
+static void set_random_record(bdos_t *bdos, uint16_t fcb_address) {
+    uint8_t fcb[FCB_SIZE];
+    read_bytes(bdos, fcb_address, fcb, FCB_SIZE);
+    uint32_t record = sequential_record(fcb);
+    uint8_t random_record[3] = {record & 0xFF, (record >> 8) & 0xFF, record >> 16};
+    write_bytes(bdos, fcb_address + FCB_R0, random_record, sizeof(random_record));
+}
+
+static bool console_ready(bdos_t *bdos) {
+    if (bdos->lookahead >= 0) {
+        return true;
+    }
+    console_flush(bdos->output);
+    struct pollfd input = {bdos->input_fd, POLLIN, 0};
+    if (poll(&input, 1, 0) <= 0) {
+        return false;
+    }
+    uint8_t byte;
+    ssize_t received = read(bdos->input_fd, &byte, 1);
+    bdos->lookahead = (received == 1) ? byte : (received == 0) ? BDOS_EOF : -1;
+    return bdos->lookahead >= 0;
+}
+
+/**
+ * Waits for a byte from the console, a line feed of the host is returned as a carriage return
+ * and the end of the input as the end of file character
+ */
+static uint8_t console_input(bdos_t *bdos) {
+    int byte = bdos->lookahead;
+    bdos->lookahead = -1;
+    if (byte < 0) {
+        console_flush(bdos->output);
+        uint8_t received;
+        ssize_t result;
+        do {
+            result = read(bdos->input_fd, &received, 1);
+        } while (result < 0 && errno == EINTR);
+        byte = (result == 1) ? received : BDOS_EOF;
+    }
+    return (byte == '\n') ? '\r' : byte;
+}
+
+static void console_output(bdos_t *bdos, uint8_t byte) {
+    console_put(bdos->output, byte);
+}
+
+/**
+ * Function 10, reads a line into the buffer at DE (its size in the first byte, the length is stored in the second one)
+ */
+static void read_console_buffer(bdos_t *bdos, uint16_t buffer) {
+    uint8_t size = memory_get(bdos->cpu->memory, buffer);
+    uint8_t length = 0;
+    while (length < size) {
+        uint8_t byte = console_input(bdos);
+        if (byte == '\r' || (byte == BDOS_EOF && length == 0)) {
+            break;
+        }
+        if (byte == 0x08 || byte == 0x7F) {
+            if (length > 0) {
+                length--;
+                if (bdos->echo) {
+                    console_output(bdos, '\b');
+                    console_output(bdos, ' ');
+                    console_output(bdos, '\b');
+                }
+            }
+            continue;
+        }
+        memory_store(bdos->cpu->memory, buffer + 2 + length++, byte);
+        if (bdos->echo) {
+            console_output(bdos, byte);
+        }
+    }
+    memory_store(bdos->cpu->memory, buffer + 1, length);
+    if (bdos->echo) {
+        console_output(bdos, '\r');
+    }
+}
+
+/**
+ * Executes the BDOS function in register C, the result is returned in HL with A = L and B = H
+ * Returns false (with the PC at the warm boot address) if the program ended with function 0
+ */
+static bool bdos_call(cpu_t *cpu, void *context) {
+    bdos_t *bdos = context;
+    cpu_registers_t registers;
+    cpu_get_registers(cpu, &registers);
+    uint8_t function = registers.bc & 0xFF;
+    uint16_t de = registers.de;
+    uint8_t e = de & 0xFF;
+    uint16_t result = 0;
+    bdos->stats.calls++;
+    switch (function) {
+        case 0: // System reset
+            console_flush(bdos->output);
+            cpu_set_PC_reg(cpu, 0x0000);
+            return false;
+        case 1: // Console input
+            result = console_input(bdos);
+            if (bdos->echo) {
+                console_output(bdos, result);
+            }
+            break;
+        case 2: // Console output
+            console_output(bdos, e);
+            break;
+        case 3: // Reader input, there is no reader
+            result = BDOS_EOF;
+            break;
+        case 4: // Punch output and list output, there are no such devices
+        case 5:
+            break;
+        case 6: // Direct console I/O
+            if (e == 0xFF) {
+                result = console_ready(bdos) ? console_input(bdos) : 0;
+            } else if (e == 0xFE) {
+                result = console_ready(bdos) ? 0xFF : 0;
+            } else {
+                console_output(bdos, e);
+            }
+            break;
+        case 7: // Get IOBYTE
+            result = bdos->iobyte;
+            break;
+        case 8: // Set IOBYTE
+            bdos->iobyte = e;
+            break;
+        case 9: // Print string ended with '$'
+            for (uint16_t address = de; memory_get(cpu->memory, address) != '$'; address++) {
+                console_output(bdos, memory_get(cpu->memory, address));
+            }
+            break;
+        case 10: // Read console buffer
+            read_console_buffer(bdos, de);
+            break;
+        case 11: // Get console status
+            result = console_ready(bdos) ? 0xFF : 0;
+            break;
+        case 12: // Return version number, CP/M 2.2
+            result = 0x0022;
+            break;
+        case 13: // Reset disk system
+            bdos->current_drive = 0;
+            bdos->dma = BDOS_DEFAULT_DMA;
+            break;
+        case 14: // Select disk
+            if (e < BDOS_DRIVES && bdos->drives[e] != NULL) {
+                bdos->current_drive = e;
+            } else {
+                result = FAILED;
+            }
+            break;
+        case 15: // Open file
+            result = open_fcb(bdos, de, false);
+            break;
+        case 16: // Close file
+            result = close_fcb(bdos, de);
+            break;
+        case 17: // Search for first
+            result = search_first(bdos, de);
+            break;
+        case 18: // Search for next
+            result = search_next(bdos);
+            break;
+        case 19: // Delete file
+            result = delete_files(bdos, de);
+            break;
+        case 20: // Read sequential
+            result = sequential_io(bdos, de, false);
+            break;
+        case 21: // Write sequential
+            result = sequential_io(bdos, de, true);
+            break;
+        case 22: // Make file
+            result = open_fcb(bdos, de, true);
+            break;
+        case 23: // Rename file
+            result = rename_file(bdos, de);
+            break;
+        case 24: // Return login vector
+            for (int drive = 0; drive < BDOS_DRIVES; drive++) {
+                result |= (bdos->drives[drive] != NULL) << drive;
+            }
+            break;
+        case 25: // Return current disk
+            result = bdos->current_drive;
+            break;
+        case 26: // Set DMA address
+            bdos->dma = de;
+            break;
+        case 32: // Get or set user code
+            if (e == 0xFF) {
+                result = bdos->user;
+            } else {
+                bdos->user = e & 0x0F;
+            }
+            break;
+        case 33: // Read random
+            result = random_io(bdos, de, false);
+            break;
+        case 34: // Write random and write random with zero fill (the host fills the gaps with zeros)
+        case 40:
+            result = random_io(bdos, de, true);
+            break;
+        case 35: // Compute file size
+            result = compute_file_size(bdos, de);
+            break;
+        case 36: // Set random record
+            set_random_record(bdos, de);
+            break;
+        default:
+            // 27 and 31 (no allocation vectors nor disk parameter blocks), 28 and 37 (nothing to do),
+            // 29 (no drive is read-only), 30 (attributes aren't kept) and the functions CP/M 2.2 doesn't have
+            break;
+    }
+    registers.a = result & 0xFF;
+    registers.hl = result;
+    registers.bc = (registers.bc & 0x00FF) | (result & 0xFF00);
+    cpu_set_registers(cpu, &registers);
+    return true; // Continue with the return operation at the call address
+}
+
+/**
+ * Prepares a BDOS with no drives, reading the console from a descriptor and writing it to an output console
+ */
+void bdos_init(bdos_t *bdos, cpu_t *cpu, int input_fd, console_t *output) {
+    memset(bdos, 0, sizeof(*bdos));
+    bdos->cpu = cpu;
+    bdos->dma = BDOS_DEFAULT_DMA;
+    bdos->input_fd = input_fd;
+    bdos->output = output;
+    bdos->echo = !isatty(input_fd);
+    bdos->lookahead = -1;
+}
+
+/**
+ * Maps a drive (0 for A:) to a host directory, which has to outlive the BDOS
+ */
+void bdos_set_drive(bdos_t *bdos, uint8_t drive, const char *directory) {
+    if (drive < BDOS_DRIVES) {
+        bdos->drives[drive] = directory;
+    }
+}
+
+/**
+ * Puts return operations at the BDOS call address (followed by the end of the available memory)
+ * and at the BDOS entry and adds traps executing the functions at both addresses
+ * Returns false if there is no more space for trap handlers
+ */
+bool bdos_install(bdos_t *bdos, cpu_traps_t *traps) {
+    memory_t *memory = bdos->cpu->memory;
+    memory_store(memory, BDOS_CALL_ADDRESS, 0xC9);
+    memory_store(memory, BDOS_CALL_ADDRESS + 1, BDOS_ENTRY_ADDRESS & 0xFF);
+    memory_store(memory, BDOS_CALL_ADDRESS + 2, BDOS_ENTRY_ADDRESS >> 8);
+    memory_store(memory, BDOS_ENTRY_ADDRESS, 0xC9);
+    return cpu_traps_add(traps, BDOS_CALL_ADDRESS, bdos_call, bdos) && cpu_traps_add(traps, BDOS_ENTRY_ADDRESS, bdos_call, bdos);
+}
+
+/**
+ * Closes the host files and ends the directory search, the data is already written to the files
+ */
+void bdos_close_files(bdos_t *bdos) {
+    for (int i = 0; i < BDOS_MAX_FILES; i++) {
+        if (bdos->files[i].used) {
+            close_file(&bdos->files[i]);
+        }
+    }
+    if (bdos->search != NULL) {
+        closedir(bdos->search);
+        bdos->search = NULL;
+    }
+    console_flush(bdos->output);
+}
@@ -0,0 +1,71 @@
+#ifndef __BDOS_H__
+#define __BDOS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+#include "console.h"
+
+#define BDOS_CALL_ADDRESS 0x0005 // Programs call BDOS functions here with the function number in C
+#define BDOS_ENTRY_ADDRESS 0xFE06 // Stored at 0x0006, programs take it as the end of the memory they can use
+#define BDOS_DEFAULT_DMA 0x0080
+#define BDOS_RECORD_SIZE 128
+#define BDOS_DRIVES 16
+#define BDOS_MAX_FILES 16 // Host files kept open at once, the least recently used one is closed when more are needed
+#define BDOS_EOF 0x1A
+
+/*
+ * Host file behind the FCBs with a given name. Its bytes are mapped (the host page cache itself),
+ * so records are copied from there straight into the emulated memory
+ */
+typedef struct BDOS_FILE {
+    bool used;
+    uint8_t drive;
+    char name[13]; // CP/M name, e.g. "TEST.COM"
+    int fd;
+    const uint8_t *map; // NULL if the file was empty when it was mapped
+    size_t map_size;
+    unsigned long long last_used;
+} bdos_file_t;
+
+typedef struct BDOS_STATS {
+    unsigned long long calls;
+    unsigned long long records_read;
+    unsigned long long records_written;
+    unsigned long long remaps; // Files mapped again after they grew
+} bdos_stats_t;
+
+/*
+ * High-level emulation of the CP/M 2.2 BDOS. Console functions use a host input descriptor
+ * and an output console (flushed whenever the program waits for input), file functions work on host directories (one per drive) with the file position
+ * kept in the FCBs the same way as CP/M does, so programs may copy and reuse them freely.
+ * A program ending with function 0 stops cpu_run at address 0x0000 (the warm boot)
+ */
+typedef struct BDOS {
+    cpu_t *cpu;
+    const char *drives[BDOS_DRIVES]; // Host directory of every drive, NULL if the drive doesn't exist
+    uint8_t current_drive;
+    uint8_t user;
+    uint8_t iobyte;
+    uint16_t dma;
+    int input_fd;
+    console_t *output;
+    bool echo; // True if input is echoed by the BDOS (it isn't a terminal, which echoes it itself)
+    int lookahead; // Byte read by a console status check, -1 if there is none
+    bdos_file_t files[BDOS_MAX_FILES];
+    unsigned long long clock; // Counts file uses for the least recently used eviction
+    void *search; // Directory listed by functions 17 and 18 (DIR *), NULL if there is no search
+    uint8_t search_pattern[12]; // Drive-less FCB name of the search, '?' matches any character
+    uint8_t search_drive;
+    bdos_stats_t stats;
+} bdos_t;
+
+void bdos_init(bdos_t *bdos, cpu_t *cpu, int input_fd, console_t *output);
+
+void bdos_set_drive(bdos_t *bdos, uint8_t drive, const char *directory);
+
+bool bdos_install(bdos_t *bdos, cpu_traps_t *traps);
+
+void bdos_close_files(bdos_t *bdos);
+
+#endif // __BDOS_H__
@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include "block_cache.h"
+
+/**
+ * Length in bytes of every operation
+ */
+static const uint8_t op_lengths[256] = {
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0x00
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0x10
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, // 0x20
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, // 0x30
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x40
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x50
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x60
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x70
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x80
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x90
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xA0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xB0
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1, // 0xC0
+    1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, // 0xD0
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1, // 0xE0
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1  // 0xF0
+};
+
+#define L BLOCK_OP_LAST
+#define S BLOCK_OP_MAY_STORE
+#define F BLOCK_OP_FUSABLE
+
+/**
+ * Block cache flags of every operation, IN and OUT may store as the device may write to the memory (DMA)
+ */
+static const uint8_t op_flags[256] = {
+    0, F, S, 0, 0, F, 0, 0, 0, 0, 0, 0, 0, F, 0, 0, // 0x00
+    0, F, S, 0, 0, F, 0, 0, 0, 0, 0, 0, 0, F, 0, 0, // 0x10
+    0, F, S, F, 0, F, 0, 0, 0, 0, 0, 0, 0, F, 0, 0, // 0x20
+    0, 0, S, 0, S, S, S, 0, 0, 0, 0, 0, 0, F, 0, 0, // 0x30
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x40
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x50
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x60
+    S, S, S, S, S, S, L, S, 0, 0, 0, 0, 0, 0, 0, 0, // 0x70
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x80
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x90
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0xA0
+    0, 0, 0, 0, 0, 0, 0, 0, F, F, F, F, F, F, F, 0, // 0xB0
+    L, F, L, L, L, S | F, 0, L, L, L, L, L, L, L, 0, L, // 0xC0
+    L, F, L, S, L, S | F, 0, L, L, L, L, S, L, L, 0, L, // 0xD0
+    L, F, L, S, L, S | F, 0, L, L, L, L, 0, L, L, 0, L, // 0xE0
+    L, F, L, 0, L, S | F, 0, L, L, 0, L, 0, L, L, F, L  // 0xF0
+};
+
+#undef L
+#undef S
+#undef F
+
+#ifdef CPU_FUSED_OPS
+/**
+ * Returns the fused operation executing a given pair of operations
+ * or 0 if the pair isn't fused
+ */
+static uint16_t fused_op(uint8_t first, uint8_t second) {
+    bool conditional_jump = (second & 0xC7) == 0xC2; // JNZ, JZ, JNC, JC, JPO, JPE, JP, JM
+    if ((first & 0xC7) == 0x05 && first != 0x35 && second == 0xC2) { // DCR r (but not DCR M, it stores)
+        static const uint16_t dcr_jnz[8] = {
+            BLOCK_FUSED_DCR_B_JNZ, BLOCK_FUSED_DCR_C_JNZ, BLOCK_FUSED_DCR_D_JNZ, BLOCK_FUSED_DCR_E_JNZ,
+            BLOCK_FUSED_DCR_H_JNZ, BLOCK_FUSED_DCR_L_JNZ, 0, BLOCK_FUSED_DCR_A_JNZ
+        };
+        return dcr_jnz[(first >> 3) & 0x07];
+    }
+    if (first == 0x23 && second == 0x7E) {
+        return BLOCK_FUSED_INX_H_MOV_A_M;
+    }
+    if (first >= 0xB8 && first <= 0xBE && conditional_jump) { // CMP r except CMP A
+        return BLOCK_FUSED_CMP_B_JCC + (first - 0xB8);
+    }
+    if (first == 0xFE && conditional_jump) {
+        return BLOCK_FUSED_CPI_JCC;
+    }
+    if ((first == 0x01 || first == 0x11 || first == 0x21) && second == 0xCD) {
+        return BLOCK_FUSED_LXI_B_CALL + (first >> 4);
+    }
+    if ((first & 0xCF) == 0xC5 && (second & 0xCF) == 0xC5) {
+        return BLOCK_FUSED_PUSH_PUSH;
+    }
+    if ((first & 0xCF) == 0xC1 && (second & 0xCF) == 0xC1) {
+        return BLOCK_FUSED_POP_POP;
+    }
+    return 0;
+}
+
+/**
+ * Replaces the first operation of every fusable pair in a block with its fused operation,
+ * the second one stays in the block right after it
+ */
+static void fuse_ops(block_t *block, int ops_count) {
+    for (int i = 0; i + 1 < ops_count; i++) {
+        if (!(block->ops[i].flags & BLOCK_OP_FUSABLE)) {
+            continue;
+        }
+        uint16_t handler = fused_op(block->ops[i].opcode, block->ops[i + 1].opcode);
+        if (handler != 0) {
+            block->ops[i].handler = handler;
+            i++;
+        }
+    }
+}
+#endif
+
+/**
+ * Allocates an empty block cache for a given memory
+ * Returns NULL if there is not enough memory
+ */
+block_cache_t *block_cache_create(memory_t *memory) {
+    block_cache_t *cache = calloc(1, sizeof(block_cache_t));
+    if (cache != NULL) {
+        cache->memory = memory;
+    }
+    return cache;
+}
+
+void block_cache_destroy(block_cache_t *cache) {
+    free(cache);
+}
+
+/**
+ * Decodes the block starting at a given address into a given cache entry.
+ * The block ends after an operation that transfers control, after BLOCK_MAX_OPS operations
+ * or before the first operation starting on the next page.
+ * Code on the pages of memory-mapped devices is never read ahead (reads may have side effects
+ * and the bytes may change without a write), such an operation gets a block of its own which is decoded
+ * again every time it's executed, so its bytes are read once per execution like by the interpreter
+ * Returns the decoded block
+ */
+const block_t *block_cache_decode(block_cache_t *cache, block_t *block, uint16_t pc) {
+    memory_t *memory = cache->memory;
+    uint16_t address = pc;
+    uint16_t last_byte_address = pc;
+    int ops_count = 0;
+    block->start_pc = pc;
+    block->valid = true;
+    while (true) {
+        if (ops_count > 0 && memory->read_map[address / MEMORY_PAGE_SIZE] == NULL) {
+            block->ops[ops_count - 1].flags |= BLOCK_OP_LAST;
+            break;
+        }
+        uint8_t opcode = memory_get(memory, address);
+        uint16_t op_last_address = address + op_lengths[opcode] - 1;
+        bool device_code = memory->read_map[address / MEMORY_PAGE_SIZE] == NULL
+            || memory->read_map[op_last_address / MEMORY_PAGE_SIZE] == NULL
+            || op_last_address < address; // Wraps around the address space
+        if (ops_count > 0 && device_code) {
+            block->ops[ops_count - 1].flags |= BLOCK_OP_LAST;
+            break;
+        }
+        block_op_t *op = &block->ops[ops_count++];
+        op->opcode = opcode;
+        op->handler = op->opcode;
+        op->flags = op_flags[op->opcode];
+        switch (op_lengths[op->opcode]) {
+            case 1:
+                op->operand = 0;
+                break;
+            case 2:
+                op->operand = memory_get(memory, address + 1);
+                break;
+            case 3:
+                op->operand = (memory_get(memory, address + 2) << 8) | memory_get(memory, address + 1);
+                break;
+        }
+        last_byte_address = op_last_address;
+        address += op_lengths[op->opcode];
+        if (device_code) {
+            op->flags |= BLOCK_OP_LAST;
+            block->valid = false;
+            block->lines_count = 0;
+            return block;
+        }
+        if ((op->flags & BLOCK_OP_LAST) || ops_count == BLOCK_MAX_OPS || (address / MEMORY_PAGE_SIZE) != (pc / MEMORY_PAGE_SIZE)) {
+            op->flags |= BLOCK_OP_LAST;
+            break;
+        }
+    }
+#ifdef CPU_FUSED_OPS
+    fuse_ops(block, ops_count);
+#endif
+    memory_mark_code(memory, pc, last_byte_address);
+    block->first_line = pc / MEMORY_CODE_LINE_SIZE;
+    block->lines_count = last_byte_address / MEMORY_CODE_LINE_SIZE - block->first_line + 1;
+    for (int i = 0; i < block->lines_count; i++) {
+        block->line_generations[i] = memory->line_generation[block->first_line + i];
+    }
+    return block;
+}
@@ -0,0 +1,135 @@
+#ifndef __BLOCK_CACHE_H__
+#define __BLOCK_CACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory.h"
+
+#define BLOCK_CACHE_SIZE 2048 // Number of cached blocks, must be a power of 2
+#define BLOCK_MAX_OPS 16
+#define BLOCK_MAX_LINES 3 // Code lines (MEMORY_CODE_LINE_SIZE) spanned by BLOCK_MAX_OPS operations of up to 3 bytes
+
+// Flags of a decoded operation
+#define BLOCK_OP_LAST 0x01 // The operation ends the block (it transfers control or halts the CPU)
+#define BLOCK_OP_MAY_STORE 0x02 // The operation may write to the memory (directly or through an IO device)
+#define BLOCK_OP_FUSABLE 0x04 // The operation may be the first one of a fused pair
+
+/*
+ * Fused operations, used only with CPU_FUSED_OPS.
+ * Each one executes a common pair of operations with a single dispatch,
+ * it takes the place of the first operation of the pair in the block
+ */
+typedef enum BLOCK_FUSED_OP {
+    BLOCK_FUSED_DCR_B_JNZ = 0x100, // DCR r + JNZ adr
+    BLOCK_FUSED_DCR_C_JNZ,
+    BLOCK_FUSED_DCR_D_JNZ,
+    BLOCK_FUSED_DCR_E_JNZ,
+    BLOCK_FUSED_DCR_H_JNZ,
+    BLOCK_FUSED_DCR_L_JNZ,
+    BLOCK_FUSED_DCR_A_JNZ,
+    BLOCK_FUSED_INX_H_MOV_A_M, // INX H + MOV A,M
+    BLOCK_FUSED_CMP_B_JCC, // CMP r + any conditional jump
+    BLOCK_FUSED_CMP_C_JCC,
+    BLOCK_FUSED_CMP_D_JCC,
+    BLOCK_FUSED_CMP_E_JCC,
+    BLOCK_FUSED_CMP_H_JCC,
+    BLOCK_FUSED_CMP_L_JCC,
+    BLOCK_FUSED_CMP_M_JCC,
+    BLOCK_FUSED_CPI_JCC, // CPI D8 + any conditional jump
+    BLOCK_FUSED_LXI_B_CALL, // LXI rp,D16 + CALL adr
+    BLOCK_FUSED_LXI_D_CALL,
+    BLOCK_FUSED_LXI_H_CALL,
+    BLOCK_FUSED_PUSH_PUSH, // Any two PUSH operations
+    BLOCK_FUSED_POP_POP, // Any two POP operations
+    BLOCK_FUSED_END
+} block_fused_op_t;
+
+typedef struct BLOCK_OP {
+    uint16_t handler; // The opcode or the fused operation executed in its place
+    uint8_t opcode;
+    uint8_t flags;
+    uint16_t operand; // Immediate data or address, already joined if it takes two bytes
+} block_op_t;
+
+/*
+ * A run of operations decoded once and executed many times.
+ * It starts on the first page and ends on the same or the next one,
+ * it is valid as long as the generations of the code lines it spans don't change
+ * (they change when any byte decoded as code in the line is written, so self-modifying code
+ * goes stale only the blocks near the written bytes and not all blocks of the page)
+ */
+typedef struct BLOCK {
+    uint16_t start_pc;
+    bool valid; // False for blocks which have to be decoded every time (code read from memory-mapped devices)
+    uint8_t lines_count;
+    uint16_t first_line;
+    uint32_t line_generations[BLOCK_MAX_LINES];
+    block_op_t ops[BLOCK_MAX_OPS];
+} block_t;
+
+typedef struct BLOCK_CACHE_STATS {
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long invalidations; // Blocks found out of date because their code pages were written
+} block_cache_stats_t;
+
+typedef struct BLOCK_CACHE {
+    memory_t *memory;
+    block_cache_stats_t stats;
+    block_t blocks[BLOCK_CACHE_SIZE]; // Direct-mapped, indexed by the lower bits of the start PC
+} block_cache_t;
+
+block_cache_t *block_cache_create(memory_t *memory);
+
+void block_cache_destroy(block_cache_t *cache);
+
+const block_t *block_cache_decode(block_cache_t *cache, block_t *block, uint16_t pc);
+
+/**
+ * Checks if any of the code lines the block was decoded from was written since then
+ */
+inline static bool block_cache_is_stale(block_cache_t *cache, const block_t *block) {
+    const uint32_t *generations = &cache->memory->line_generation[block->first_line];
+    for (int i = 0; i < block->lines_count; i++) {
+        if (generations[i] != block->line_generations[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Returns the up to date block starting at a given address, decoding it if needed
+ */
+inline static const block_t *block_cache_get(block_cache_t *cache, uint16_t pc) {
+    block_t *block = &cache->blocks[pc & (BLOCK_CACHE_SIZE - 1)];
+    if (block->valid && block->start_pc == pc) {
+        if (!block_cache_is_stale(cache, block)) {
+            cache->stats.hits++;
+            return block;
+        }
+        cache->stats.invalidations++;
+    } else {
+        cache->stats.misses++;
+    }
+    return block_cache_decode(cache, block, pc);
+}
+
+/**
+ * Returns the operation to execute after a given one, switching to the block at pc
+ * if the given operation ends its block or has just overwritten the block's code
+ */
+inline static const block_op_t *block_cache_next_op(block_cache_t *cache, const block_t **block, const block_op_t *op, uint16_t pc) {
+    if (op->flags & BLOCK_OP_LAST) {
+        *block = block_cache_get(cache, pc);
+        return (*block)->ops;
+    }
+    if ((op->flags & BLOCK_OP_MAY_STORE) && block_cache_is_stale(cache, *block)) {
+        cache->stats.invalidations++;
+        *block = block_cache_decode(cache, &cache->blocks[pc & (BLOCK_CACHE_SIZE - 1)], pc);
+        return (*block)->ops;
+    }
+    return op + 1;
+}
+
+#endif // __BLOCK_CACHE_H__
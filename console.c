@@ -0,0 +1,104 @@
+#include <stddef.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "console.h"
+
+static uint8_t read_status(void *context, uint8_t port) {
+    (void)port;
+    console_flush(context);
+    return CONSOLE_STATUS_OUTPUT_READY;
+}
+
+static uint8_t read_data(void *context, uint8_t port) {
+    (void)port;
+    console_flush(context);
+    return 0; // No input
+}
+
+static void write_data(void *context, uint8_t port, uint8_t data) {
+    (void)port;
+    console_put(context, data);
+}
+
+static void flush_event(scheduler_t *scheduler, void *context) {
+    console_t *console = context;
+    if (!console_flush(console) || console->tail != console->head) {
+        scheduler_schedule_in(scheduler, &console->flush_event, CONSOLE_FLUSH_CYCLES); // The descriptor is full, try again later
+    }
+}
+
+/**
+ * Prepares an empty console writing to a given file descriptor, line buffered if it's a terminal
+ */
+void console_init(console_t *console, int fd) {
+    console->fd = fd;
+    console->line_buffered = isatty(fd);
+    console->head = 0;
+    console->tail = 0;
+    console->flushes = 0;
+    console->scheduler = NULL;
+    scheduler_event_init(&console->flush_event, flush_event, console);
+}
+
+/**
+ * Connects the console to the status and data ports of a bus
+ */
+void console_attach(console_t *console, io_bus_t *bus, uint8_t status_port, uint8_t data_port) {
+    io_bus_register(bus, status_port, read_status, NULL, console);
+    io_bus_register(bus, data_port, read_data, write_data, console);
+}
+
+/**
+ * Makes the console write out its output on time, the scheduler has to be run with scheduler_run
+ */
+void console_set_scheduler(console_t *console, scheduler_t *scheduler) {
+    console->scheduler = scheduler;
+}
+
+/**
+ * Adds a byte to the buffer, flushing it when it gets full or at the end of a line if the console is line buffered
+ */
+void console_put(console_t *console, uint8_t byte) {
+    if (console->tail - console->head == CONSOLE_BUFFER_SIZE && !console_flush(console)) {
+        console->head++; // The descriptor doesn't take anything, the oldest byte is lost
+    }
+    console->buffer[console->tail++ % CONSOLE_BUFFER_SIZE] = byte;
+    if (console->scheduler != NULL && console->flush_event.link == NULL) {
+        scheduler_schedule_in(console->scheduler, &console->flush_event, CONSOLE_FLUSH_CYCLES);
+    }
+    if ((byte == '\n' && console->line_buffered) || console->tail - console->head == CONSOLE_BUFFER_SIZE) {
+        console_flush(console);
+    }
+}
+
+/**
+ * Writes out the buffered bytes with a single system call, the bytes the descriptor
+ * doesn't take (e.g. a full pipe) stay in the buffer
+ * Returns false if nothing could be written
+ */
+bool console_flush(console_t *console) {
+    unsigned length = console->tail - console->head;
+    if (length == 0) {
+        return true;
+    }
+    unsigned start = console->head % CONSOLE_BUFFER_SIZE;
+    unsigned first_length = (length < CONSOLE_BUFFER_SIZE - start) ? length : CONSOLE_BUFFER_SIZE - start;
+    struct iovec parts[2] = {
+        {&console->buffer[start], first_length},
+        {console->buffer, length - first_length}
+    };
+    ssize_t written;
+    do {
+        written = writev(console->fd, parts, (first_length < length) ? 2 : 1);
+    } while (written < 0 && errno == EINTR);
+    console->flushes++;
+    if (written <= 0) {
+        return false;
+    }
+    console->head += written;
+    if (console->tail == console->head && console->scheduler != NULL) {
+        scheduler_cancel(console->scheduler, &console->flush_event);
+    }
+    return true;
+}
@@ -0,0 +1,42 @@
+#ifndef __CONSOLE_H__
+#define __CONSOLE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "io.h"
+#include "scheduler.h"
+
+#define CONSOLE_BUFFER_SIZE 4096 // Must be a power of 2
+#define CONSOLE_STATUS_OUTPUT_READY 0x02 // Set in the status port when a byte can be written to the data port
+#define CONSOLE_FLUSH_CYCLES (CPU_FREQ / 100) // Output is written out at the latest 10 ms of emulated time after it's put
+
+/*
+ * Output-only console. Bytes written to its data port are collected in a ring buffer and written
+ * to the file descriptor at once when a line ends (only on a terminal), when the buffer fills up,
+ * when the program polls the console (it's waiting, so it won't write anything else for a while)
+ * or on console_flush. A console given a scheduler also writes out its output CONSOLE_FLUSH_CYCLES
+ * after the first byte put into the empty buffer, a machine without one calls console_flush after
+ * every batch, so a program which stops (e.g. halts) without polling doesn't keep its output in the buffer
+ */
+typedef struct CONSOLE {
+    int fd;
+    bool line_buffered; // True if every line is written out as soon as it ends
+    uint8_t buffer[CONSOLE_BUFFER_SIZE];
+    unsigned head; // Number of bytes written out, indexes the buffer modulo its size
+    unsigned tail; // Number of bytes put into the buffer
+    unsigned long long flushes; // Calls to writev
+    scheduler_t *scheduler; // NULL if the output isn't flushed on time
+    scheduler_event_t flush_event;
+} console_t;
+
+void console_init(console_t *console, int fd);
+
+void console_attach(console_t *console, io_bus_t *bus, uint8_t status_port, uint8_t data_port);
+
+void console_set_scheduler(console_t *console, scheduler_t *scheduler);
+
+void console_put(console_t *console, uint8_t byte);
+
+bool console_flush(console_t *console);
+
+#endif // __CONSOLE_H__
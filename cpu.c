@@ -1,33 +1,191 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
+#include <limits.h>
 
 #include "cpu.h"
 #include "memory.h"
 #include "io.h"
 #include "debug.h"
+#include "aot.h"
+#include "loop_idiom.h"
+#include "idle_loop.h"
 
 // TODO: Implement CPU "pins", like processor state
 
-#define regBC _regBC.single
-#define regB  _regBC.pair.higher
-#define regC  _regBC.pair.lower
-#define regDE _regDE.single
-#define regD  _regDE.pair.higher
-#define regE  _regDE.pair.lower
-#define regHL _regHL.single
-#define regH  _regHL.pair.higher
-#define regL  _regHL.pair.lower
-#define regPC _regPC.single
-#define regPC_higher _regPC.pair.higher
-#define regPC_lower _regPC.pair.lower
-#define regSP _regSP.single
-#define regSP_higher _regSP.pair.higher
-#define regSP_lower _regSP.pair.lower
-
-uint8_t regA;
-reg_16bit_t _regBC, _regDE, _regHL, _regPC, _regSP; // Don't use directly, use defines instead
-status_reg_t status_reg;
-cpu_state_t cpu_state;
+/*
+ * Every function operating on the CPU takes a 'cpu_t *cpu' argument,
+ * the registers are accessed through these defines
+ */
+#define regA  cpu->_regA
+#define regBC cpu->_regBC.single
+#define regB  cpu->_regBC.pair.higher
+#define regC  cpu->_regBC.pair.lower
+#define regDE cpu->_regDE.single
+#define regD  cpu->_regDE.pair.higher
+#define regE  cpu->_regDE.pair.lower
+#define regHL cpu->_regHL.single
+#define regH  cpu->_regHL.pair.higher
+#define regL  cpu->_regHL.pair.lower
+#define regPC cpu->_regPC.single
+#define regPC_higher cpu->_regPC.pair.higher
+#define regPC_lower cpu->_regPC.pair.lower
+#define regSP cpu->_regSP.single
+#define regSP_higher cpu->_regSP.pair.higher
+#define regSP_lower cpu->_regSP.pair.lower
+
+/*
+ * Source of the operations used by 'cpu_exec_ops'.
+ * By default every operation is fetched from the memory byte by byte.
+ * With CPU_BLOCK_CACHE the operations come from blocks decoded once
+ * and cached together with their operands.
+ * Every FETCH advances PC the same way in both cases.
+ */
+#ifdef CPU_BLOCK_CACHE
+#define FETCH_FIRST_OPCODE() (block = block_cache_get(cache, regPC), block_op = block->ops, regPC++, COUNT_OP(block_op->opcode), block_op->handler)
+#define FETCH_NEXT_OPCODE() (block_op = block_cache_next_op(cache, &block, block_op, regPC), regPC++, COUNT_OP(block_op->opcode), block_op->handler)
+#define FETCH_BYTE() (regPC += 1, (uint8_t)block_op->operand)
+#define FETCH_WORD() (regPC += 2, block_op->operand)
+// Used by the fused operations to move on to the second operation of their pair
+#define FETCH_SECOND_OPCODE() (block_op++, regPC++, (void)COUNT_OP(block_op->opcode))
+#else
+#define FETCH_FIRST_OPCODE() COUNT_OP(get_next_prog_byte(cpu))
+#define FETCH_NEXT_OPCODE() COUNT_OP(get_next_prog_byte(cpu))
+#define FETCH_BYTE() get_next_prog_byte(cpu)
+#define FETCH_WORD() get_next_2_prog_bytes(cpu)
+#endif
+
+#if defined(CPU_FUSED_OPS) && !defined(CPU_BLOCK_CACHE)
+#error "CPU_FUSED_OPS needs CPU_BLOCK_CACHE, the pairs are fused when the blocks get decoded"
+#endif
+
+/*
+ * With CPU_PAIR_STATS every fetched opcode is counted together with the one executed before it
+ */
+#ifdef CPU_PAIR_STATS
+#define COUNT_OP(opcode) count_op_pair(pair_stats, opcode)
+#else
+#define COUNT_OP(opcode) (opcode)
+#endif
+
+/*
+ * With CPU_FUSED_OPS the block cache dispatches fused operations (block_fused_op_t)
+ * next to the opcodes
+ */
+#ifdef CPU_FUSED_OPS
+typedef uint16_t dispatch_index_t;
+#else
+typedef uint8_t dispatch_index_t;
+#endif
+
+/*
+ * Opcode dispatch used by 'cpu_exec_ops'.
+ * The default core is a plain switch inside a loop. With CPU_THREADED_DISPATCH
+ * every opcode handler is a label and each handler jumps directly
+ * to the handler of the next opcode through a table of label addresses.
+ * GCC already compiles the switch into a jump table and in Release builds
+ * the threaded core measures as fast at best (and slower on some hosts), so it isn't the default
+ */
+#ifdef CPU_THREADED_DISPATCH
+#pragma GCC diagnostic ignored "-Wpedantic" // Labels as values are a GCC extension
+#define CPU_CORE_NAME "threaded"
+#define DISPATCH_BEGIN goto *dispatch_table[FETCH_FIRST_OPCODE()];
+#define DISPATCH_END exec_done:
+#define OP(opcode) op_##opcode:
+#define NEXT_OP \
+    do { \
+        cycles += operation_cycles; \
+        if (cycles >= cycle_budget) \
+            goto exec_done; \
+        goto *dispatch_table[FETCH_NEXT_OPCODE()]; \
+    } while (0)
+#else
+#define CPU_CORE_NAME "switch"
+#define DISPATCH_BEGIN for (dispatch_index_t opcode = FETCH_FIRST_OPCODE(); ; opcode = FETCH_NEXT_OPCODE()) { switch (opcode) {
+#define DISPATCH_END } cycles += operation_cycles; if (cycles >= cycle_budget) break; }
+#define OP(opcode) case opcode:
+#define NEXT_OP break
+#endif
+
+/*
+ * Traps are checked only after operations that transfer control (jumps, calls, returns, RST, PCHL)
+ * so straight-line code doesn't pay anything for them.
+ * The execution stops before the operation at the trap address.
+ * An interrupt request posted during the batch (e.g. by an OUT or from another thread) stops it there too,
+ * so cpu_run accepts it within a block instead of at the end of the budget
+ */
+#define INTERRUPT_ACCEPTABLE (cpu->state.interrupts_enabled && atomic_load_explicit(&cpu_instance->interrupt_pending, memory_order_relaxed))
+#if defined(CPU_JIT)
+// Hot jump targets also stop the batch, so cpu_run can continue in the translated code
+#define CHECK_TRAP if (is_trap_address(cpu, regPC) || jit_should_enter(jit, regPC) || INTERRUPT_ACCEPTABLE) cycle_budget = 0
+#elif defined(CPU_AOT)
+// So do the blocks of the recompiled program
+#define CHECK_TRAP if (is_trap_address(cpu, regPC) || (cpu->aot != NULL && aot_is_entry(cpu->aot, regPC)) || INTERRUPT_ACCEPTABLE) cycle_budget = 0
+#else
+#define CHECK_TRAP if (is_trap_address(cpu, regPC) || INTERRUPT_ACCEPTABLE) cycle_budget = 0
+#endif
+
+/*
+ * With CPU_LOOP_IDIOMS a taken JNZ going back to the start of a copy, fill or compare loop
+ * executes all but the last of the remaining iterations in bulk before it jumps.
+ * 'jump_address' is the target of the JNZ, PC points right after it
+ */
+#ifdef CPU_LOOP_IDIOMS
+#define CHECK_LOOP_IDIOM(jump_address) \
+    if ((jump_address) < (uint16_t)(regPC - 3) && !get_Z_flag(cpu)) \
+        operation_cycles += run_loop_idiom(cpu, loop_idioms, jump_address, regPC - 3, cycle_budget - cycles - operation_cycles)
+#else
+#define CHECK_LOOP_IDIOM(jump_address)
+#endif
+
+/*
+ * With CPU_IDLE_LOOPS a taken conditional jump going back to an IN which only polls the port
+ * skips the iterations left in the cycle budget, as long as the port gives the same value.
+ * 'jump_address' is the target of the jump, PC points right after it
+ */
+#ifdef CPU_IDLE_LOOPS
+#define CHECK_IDLE_LOOP(jump_address, taken) \
+    if ((taken) && (jump_address) < (uint16_t)(regPC - 3) && memory_get(cpu->memory, jump_address) == 0xDB) \
+        operation_cycles += run_idle_loop(cpu, idle_loops, jump_address, regPC - 3, cycle_budget - cycles - operation_cycles)
+#else
+#define CHECK_IDLE_LOOP(jump_address, taken)
+#endif
+
+/**
+ * Trap map used by CPUs without any traps
+ */
+static const cpu_traps_t no_traps;
+
+/**
+ * Checks if the execution should stop before running the operation at a given address
+ */
+inline static bool is_trap_address(cpu_t *cpu, uint16_t address) {
+    return cpu->traps->map[address >> 3] & (1 << (address & 0x07));
+}
+
+/**
+ * Counts a fetched opcode as the second operation of a pair
+ * whose first operation is the one fetched before it
+ * Returns the opcode
+ */
+inline static uint8_t count_op_pair(cpu_pair_stats_t *stats, uint8_t opcode) {
+    stats->counts[stats->previous_opcode][opcode]++;
+    stats->previous_opcode = opcode;
+    return opcode;
+}
+
+/**
+ * Returns the handler of the trap at a given address or NULL if it has none
+ */
+static const cpu_trap_handler_t *find_trap_handler(const cpu_traps_t *traps, uint16_t address) {
+    for (int i = 0; i < traps->handlers_count; i++) {
+        if (traps->handlers[i].address == address) {
+            return &traps->handlers[i];
+        }
+    }
+    return NULL;
+}
 
 /**
  * Converts two 8bit numbers to one 16bit number
@@ -39,46 +197,148 @@ inline static uint16_t join_bytes(uint8_t higher, uint8_t lower) {
 }
 
 /**
- * Calculates the new value of the Z (zero) flag
- * Affected flags: Z
- * Affected registers: None
+ * Z, S and P flags (and the always set bit 1) of every 8bit result
+ */
+static uint8_t zsp_flags[0x100];
+
+/**
+ * Z, S, P and C flags (and the always set bit 1) of every 9bit add/substract result,
+ * the 9th bit of the result is the carry (or borrow)
  */
-inline static void calc_set_Z_flag(uint8_t val) {
-    status_reg.flags.Z = (val == 0);
+static uint8_t zspc_flags[0x200];
+
+/**
+ * Fills the flag lookup tables, runs once before main
+ */
+__attribute__((constructor)) static void init_flag_tables() {
+    for (int result = 0; result < 0x200; result++) {
+        uint8_t result8bit = result & 0xFF;
+        uint8_t flags = STATUS_REG_FIXED_BITS;
+        if (result8bit == 0)
+            flags |= FLAG_Z;
+        if (result8bit & 0x80)
+            flags |= FLAG_S;
+        if (__builtin_popcount(result8bit) % 2 == 0)
+            flags |= FLAG_P;
+        if (result < 0x100) {
+            zsp_flags[result] = flags;
+        } else {
+            flags |= FLAG_C;
+        }
+        zspc_flags[result] = flags;
+    }
 }
 
+#ifdef CPU_LAZY_FLAGS
+/*
+ * With lazy flags the flag-setting operations only record their result in cpu->lazy_flags,
+ * status_reg is brought up to date only when the flags are actually read
+ */
+
 /**
- * Calculates the new value of the S (sign) flag
- * Affected flags: S
+ * Records the result of a flag-setting operation
+ * Affected flags: Z, S, P, C, AC
  * Affected registers: None
  */
-inline static void calc_set_S_flag(uint8_t val) {
-    status_reg.flags.S = ((val & (1 << 7)) == 0x80);
+inline static void set_flags(cpu_t *cpu, uint16_t result, uint8_t aux) {
+    cpu->lazy_flags.result = result;
+    cpu->lazy_flags.aux = aux;
+    cpu->lazy_flags.pending = true;
+}
+
+/**
+ * Returns the status register, calculating the pending flags first
+ */
+inline static uint8_t get_status_reg(cpu_t *cpu) {
+    if (cpu->lazy_flags.pending) {
+        cpu->status_reg.single = zspc_flags[cpu->lazy_flags.result] | ((cpu->lazy_flags.aux ^ cpu->lazy_flags.result) & FLAG_AC);
+        cpu->lazy_flags.pending = false;
+    }
+    return cpu->status_reg.single;
+}
+
+/**
+ * Overwrites the whole status register
+ */
+inline static void set_status_reg(cpu_t *cpu, uint8_t val) {
+    cpu->status_reg.single = val;
+    cpu->lazy_flags.pending = false;
+}
+
+inline static uint8_t get_C_flag(cpu_t *cpu) {
+    return cpu->lazy_flags.pending ? (cpu->lazy_flags.result >> 8) : cpu->status_reg.flags.C;
+}
+
+inline static void set_C_flag(cpu_t *cpu, uint8_t val) {
+    if (cpu->lazy_flags.pending) {
+        cpu->lazy_flags.result = (cpu->lazy_flags.result & 0xFF) | (val << 8);
+    } else {
+        cpu->status_reg.flags.C = val;
+    }
+}
+
+inline static uint8_t get_Z_flag(cpu_t *cpu) {
+    return cpu->lazy_flags.pending ? ((cpu->lazy_flags.result & 0xFF) == 0) : cpu->status_reg.flags.Z;
 }
 
+inline static uint8_t get_S_flag(cpu_t *cpu) {
+    return cpu->lazy_flags.pending ? ((cpu->lazy_flags.result >> 7) & 1) : cpu->status_reg.flags.S;
+}
+
+inline static uint8_t get_P_flag(cpu_t *cpu) {
+    return cpu->lazy_flags.pending ? ((zsp_flags[cpu->lazy_flags.result & 0xFF] & FLAG_P) != 0) : cpu->status_reg.flags.P;
+}
+#else
 /**
- * Calculates the new value of the P (parity) flag
- * Affected flags: Z
+ * Sets the flags from the result of a flag-setting operation,
+ * 'result' has the same meaning as the index of 'zspc_flags'
+ * and bit 4 of (aux ^ result) is the AC flag
+ * Affected flags: Z, S, P, C, AC
  * Affected registers: None
  */
-inline static void calc_set_P_flag(uint8_t val) {
-    status_reg.flags.P = (__builtin_popcount(val) % 2 == 0);
+inline static void set_flags(cpu_t *cpu, uint16_t result, uint8_t aux) {
+    cpu->status_reg.single = zspc_flags[result] | ((aux ^ result) & FLAG_AC);
 }
 
+inline static uint8_t get_status_reg(cpu_t *cpu) {
+    return cpu->status_reg.single;
+}
+
+inline static void set_status_reg(cpu_t *cpu, uint8_t val) {
+    cpu->status_reg.single = val;
+}
+
+inline static uint8_t get_C_flag(cpu_t *cpu) {
+    return cpu->status_reg.flags.C;
+}
+
+inline static void set_C_flag(cpu_t *cpu, uint8_t val) {
+    cpu->status_reg.flags.C = val;
+}
+
+inline static uint8_t get_Z_flag(cpu_t *cpu) {
+    return cpu->status_reg.flags.Z;
+}
+
+inline static uint8_t get_S_flag(cpu_t *cpu) {
+    return cpu->status_reg.flags.S;
+}
+
+inline static uint8_t get_P_flag(cpu_t *cpu) {
+    return cpu->status_reg.flags.P;
+}
+#endif
+
 /**
  * Adds two 8bit values with carry and sets the flags accordingly
  * Affected flags: Z, S, P, C, AC
  * Affected registers: None
  */
-static uint8_t add8bit_with_flags(uint8_t val1, uint8_t val2, uint8_t carry) {
+static uint8_t add8bit_with_flags(cpu_t *cpu, uint8_t val1, uint8_t val2, uint8_t carry) {
     int result = val1 + val2 + carry;
-    uint8_t result8bit = result & 0xFF;
-    status_reg.flags.C = (result >= 0x100);
-    status_reg.flags.AC = (((val1 & 0x0F) + (val2 & 0x0F) + carry) > 0x0F);
-    calc_set_Z_flag(result8bit);
-    calc_set_S_flag(result8bit);
-    calc_set_P_flag(result8bit);
-    return result8bit;
+    // Bit 4 of (val1 ^ val2 ^ result) is the carry from the lower nibble
+    set_flags(cpu, result, val1 ^ val2);
+    return result & 0xFF;
 }
 
 /**
@@ -86,9 +346,9 @@ static uint8_t add8bit_with_flags(uint8_t val1, uint8_t val2, uint8_t carry) {
  * Affected flags: C
  * Affected registers: None
  */
-static uint16_t add16bit_with_flag(uint16_t val1, uint16_t val2) {
+static uint16_t add16bit_with_flag(cpu_t *cpu, uint16_t val1, uint16_t val2) {
     int result = val1 + val2;
-    status_reg.flags.C = (result >= 0x10000);
+    set_C_flag(cpu, result >= 0x10000);
     return result & 0xFFFF;
 }
 
@@ -97,15 +357,13 @@ static uint16_t add16bit_with_flag(uint16_t val1, uint16_t val2) {
  * Affected flags: Z, S, P, C, AC
  * Affected registers: None
  */
-static uint8_t sub8bit_with_flags(uint8_t val1, uint8_t val2, uint8_t borrow) {
-    int result = val1 - val2 - borrow;
-    uint8_t result8bit = result & 0xFF;
-    status_reg.flags.C = ((val2+borrow) > val1);
-    status_reg.flags.AC = (((val1 & 0x0F) + (~val2 & 0x0F) + (borrow^1)) > 0x0F);
-    calc_set_Z_flag(result8bit);
-    calc_set_S_flag(result8bit);
-    calc_set_P_flag(result8bit);
-    return result8bit;
+static uint8_t sub8bit_with_flags(cpu_t *cpu, uint8_t val1, uint8_t val2, uint8_t borrow) {
+    int result = (val1 - val2 - borrow) & 0x1FF; // Negative result sets the 9th bit (borrow)
+    /* The 8080 substracts by adding the complement of val2 (and of the borrow),
+     * so AC is set when there is NO borrow from the lower nibble
+     */
+    set_flags(cpu, result, ~(val1 ^ val2));
+    return result & 0xFF;
 }
 
 /**
@@ -113,12 +371,9 @@ static uint8_t sub8bit_with_flags(uint8_t val1, uint8_t val2, uint8_t borrow) {
  * Affected flags: Z, S, P, AC
  * Affected registers: None
  */
-static uint8_t inc8bit_with_flags(uint8_t val) {
+static uint8_t inc8bit_with_flags(cpu_t *cpu, uint8_t val) {
     uint8_t result = (val + 1) & 0xFF;
-    status_reg.flags.AC = (((val & 0x0F) + 1) > 0x0F);
-    calc_set_Z_flag(result);
-    calc_set_S_flag(result);
-    calc_set_P_flag(result);
+    set_flags(cpu, (get_C_flag(cpu) << 8) | result, val); // AC is set if the lower nibble overflows
     return result;
 }
 
@@ -127,18 +382,16 @@ static uint8_t inc8bit_with_flags(uint8_t val) {
  * Affected flags: Z, S, P, AC
  * Affected registers: None
  */
-static uint8_t dec8bit_with_flags(uint8_t val) {
+static uint8_t dec8bit_with_flags(cpu_t *cpu, uint8_t val) {
     uint8_t result = (val - 1) & 0xFF;
     /* The whole calculation here should look like the one in 'sub8bit_with_flags'
      * but because 'val2' is always equal 1 and 'borrow' is always equal 0
      * we can write ((val1 & 0x0F) + (~1 & 0x0F) + (0^1)) > 0x0F
      * and the two latter values are equal: 0x0E + 1 = 0x0F.
-     * So in the end it can be simplified to (val & 0x0F) + 0x0F > 0x0F
+     * So in the end it can be simplified to (val & 0x0F) + 0x0F > 0x0F,
+     * which is the same as no borrow from the lower nibble
     */ 
-    status_reg.flags.AC = ((val & 0x0F) > 0);
-    calc_set_Z_flag(result);
-    calc_set_S_flag(result);
-    calc_set_P_flag(result);
+    set_flags(cpu, (get_C_flag(cpu) << 8) | result, ~val);
     return result;
 }
 
@@ -147,13 +400,9 @@ static uint8_t dec8bit_with_flags(uint8_t val) {
  * Affected flags: Z, S, P, C, AC
  * Affected registers: None
  */
-static uint8_t and8bit_with_flags(uint8_t val1, uint8_t val2) {
+static uint8_t and8bit_with_flags(cpu_t *cpu, uint8_t val1, uint8_t val2) {
     uint8_t result = val1 & val2;
-    calc_set_Z_flag(result);
-    calc_set_S_flag(result);
-    calc_set_P_flag(result);
-    status_reg.flags.C = 0;
-    status_reg.flags.AC = (((val1 | val2) & 0x08) != 0);
+    set_flags(cpu, result, result ^ (((val1 | val2) & 0x08) << 1));
     return result;
 }
 
@@ -162,13 +411,9 @@ static uint8_t and8bit_with_flags(uint8_t val1, uint8_t val2) {
  * Affected flags: Z, S, P, C, AC
  * Affected registers: None
  */
-static uint8_t or8bit_with_flags(uint8_t val1, uint8_t val2) {
+static uint8_t or8bit_with_flags(cpu_t *cpu, uint8_t val1, uint8_t val2) {
     uint8_t result = val1 | val2;
-    calc_set_Z_flag(result);
-    calc_set_S_flag(result);
-    calc_set_P_flag(result);
-    status_reg.flags.C = 0;
-    status_reg.flags.AC = 0;
+    set_flags(cpu, result, result);
     return result;
 }
 
@@ -177,13 +422,9 @@ static uint8_t or8bit_with_flags(uint8_t val1, uint8_t val2) {
  * Affected flags: Z, S, P, C, AC
  * Affected registers: None
  */
-static uint8_t xor8bit_with_flags(uint8_t val1, uint8_t val2) {
+static uint8_t xor8bit_with_flags(cpu_t *cpu, uint8_t val1, uint8_t val2) {
     uint8_t result = val1 ^ val2;
-    calc_set_Z_flag(result);
-    calc_set_S_flag(result);
-    calc_set_P_flag(result);
-    status_reg.flags.C = 0;
-    status_reg.flags.AC = 0;
+    set_flags(cpu, result, result);
     return result;
 }
 
@@ -192,8 +433,8 @@ static uint8_t xor8bit_with_flags(uint8_t val1, uint8_t val2) {
  * Affected flags: None
  * Affected registers: SP
  */
-inline static void stack_push(uint8_t value) {
-    memory_store(--regSP, value);
+inline static void stack_push(cpu_t *cpu, uint8_t value) {
+    memory_store(cpu->memory, --regSP, value);
 }
 
 /**
@@ -201,8 +442,8 @@ inline static void stack_push(uint8_t value) {
  * Affected flags: None
  * Affected registers: SP
  */
-inline static uint8_t stack_pop() {
-    return memory_get(regSP++);
+inline static uint8_t stack_pop(cpu_t *cpu) {
+    return memory_get(cpu->memory, regSP++);
 }
 
 /**
@@ -210,8 +451,8 @@ inline static uint8_t stack_pop() {
  * Affected flags: None
  * Affected registers: PC
  */
-inline static uint8_t get_next_prog_byte() {
-    return memory_get(regPC++);
+inline static uint8_t get_next_prog_byte(cpu_t *cpu) {
+    return memory_get(cpu->memory, regPC++);
 }
 
 /**
@@ -219,9 +460,9 @@ inline static uint8_t get_next_prog_byte() {
  * Affected flags: None
  * Affected registers: PC
  */
-static uint16_t get_next_2_prog_bytes() {
-    uint8_t lower = memory_get(regPC++);
-    uint8_t higher = memory_get(regPC++);
+inline static uint16_t get_next_2_prog_bytes(cpu_t *cpu) {
+    uint8_t lower = memory_get(cpu->memory, regPC++);
+    uint8_t higher = memory_get(cpu->memory, regPC++);
     return join_bytes(higher, lower);
 }
 
@@ -231,10 +472,10 @@ static uint16_t get_next_2_prog_bytes() {
  * Affected flags: None
  * Affected registers: PC, SP
  */
-inline static int cond_return(bool condition) {
+inline static int cond_return(cpu_t *cpu, bool condition) {
     if (condition) {
-        regPC_lower = stack_pop();
-        regPC_higher = stack_pop();
+        regPC_lower = stack_pop(cpu);
+        regPC_higher = stack_pop(cpu);
         return 11;
     } else {
         return 5;
@@ -247,11 +488,9 @@ inline static int cond_return(bool condition) {
  * Affected flags: None
  * Affected registers: PC
  */
-inline static void cond_jump(bool condition) {
+inline static void cond_jump(cpu_t *cpu, bool condition, uint16_t addr) {
     if (condition) {
-        regPC = get_next_2_prog_bytes();
-    } else {
-        regPC += 2;
+        regPC = addr;
     }
 }
 
@@ -261,15 +500,13 @@ inline static void cond_jump(bool condition) {
  * Affected flags: None
  * Affected registers: PC, SP
  */
-static int cond_call(bool condition) {
+static int cond_call(cpu_t *cpu, bool condition, uint16_t addr) {
     if (condition) {
-        uint16_t newPC = get_next_2_prog_bytes();
-        stack_push(regPC_higher);
-        stack_push(regPC_lower);
-        regPC = newPC;
+        stack_push(cpu, regPC_higher);
+        stack_push(cpu, regPC_lower);
+        regPC = addr;
         return 17;
     } else {
-        regPC += 2;
         return 11;
     }
 }
@@ -279,1170 +516,2337 @@ static int cond_call(bool condition) {
  * Affected flags: None
  * Affected registers: PC, SP
  */
-inline static void call_addr(uint16_t addr) {
-    stack_push(regPC_higher);
-    stack_push(regPC_lower);
+inline static void call_addr(cpu_t *cpu, uint16_t addr) {
+    stack_push(cpu, regPC_higher);
+    stack_push(cpu, regPC_lower);
     regPC = addr;
 }
 
 /**
- * Executes an operation specified by a given opcode on the CPU
- * Returns the number of clock cycles this operation takes
+ * Checks the condition of a conditional jump, call or return operation
+ * (bits 3-5 of its opcode: NZ, Z, NC, C, PO, PE, P, M)
+ * Affected flags: None
+ * Affected registers: None
  */
-static int cpu_exec_op(uint8_t opcode) {
-    int operation_cycles = -1;
+inline static bool condition_met(cpu_t *cpu, uint8_t opcode) {
+    switch ((opcode >> 3) & 0x07) {
+        case 0: return !get_Z_flag(cpu);
+        case 1: return get_Z_flag(cpu);
+        case 2: return !get_C_flag(cpu);
+        case 3: return get_C_flag(cpu);
+        case 4: return !get_P_flag(cpu);
+        case 5: return get_P_flag(cpu);
+        case 6: return !get_S_flag(cpu); // If the number is positive
+        default: return get_S_flag(cpu); // If the number is negative
+    }
+}
+
+/**
+ * Executes the PUSH operation with a given opcode
+ * Affected flags: None
+ * Affected registers: SP
+ */
+inline static void push_op(cpu_t *cpu, uint8_t opcode) {
     switch (opcode) {
-        case 0x00: // NOP; 1 byte; 4 cycles
-            operation_cycles = 4;
+        case 0xC5:
+            stack_push(cpu, regB);
+            stack_push(cpu, regC);
             break;
-        case 0x01: // LXI B,D16; 3 bytes; 10 cycles
-            regC = get_next_prog_byte();
-            regB = get_next_prog_byte();
-            operation_cycles = 10;
+        case 0xD5:
+            stack_push(cpu, regD);
+            stack_push(cpu, regE);
             break;
-        case 0x02: // STAX B; 1 byte; 7 cycles
-            memory_store(regBC, regA);
-            operation_cycles = 7;
+        case 0xE5:
+            stack_push(cpu, regH);
+            stack_push(cpu, regL);
+            break;
+        default:
+            stack_push(cpu, regA);
+            stack_push(cpu, get_status_reg(cpu));
+            break;
+    }
+}
+
+/**
+ * Executes the POP operation with a given opcode
+ * Affected flags: All for POP PSW, None otherwise
+ * Affected registers: SP and the popped pair
+ */
+inline static void pop_op(cpu_t *cpu, uint8_t opcode) {
+    switch (opcode) {
+        case 0xC1:
+            regC = stack_pop(cpu);
+            regB = stack_pop(cpu);
+            break;
+        case 0xD1:
+            regE = stack_pop(cpu);
+            regD = stack_pop(cpu);
+            break;
+        case 0xE1:
+            regL = stack_pop(cpu);
+            regH = stack_pop(cpu);
+            break;
+        default:
+            set_status_reg(cpu, (stack_pop(cpu) & (FLAG_C | FLAG_P | FLAG_AC | FLAG_Z | FLAG_S)) | STATUS_REG_FIXED_BITS);
+            regA = stack_pop(cpu);
+            break;
+    }
+}
+
+/**
+ * Returns the value of a register pair as encoded in the opcodes (BC, DE, HL)
+ */
+inline static uint16_t get_pair(cpu_t *cpu, int pair) {
+    switch (pair) {
+        case 0: return regBC;
+        case 1: return regDE;
+        default: return regHL;
+    }
+}
+
+inline static void set_pair(cpu_t *cpu, int pair, uint16_t val) {
+    switch (pair) {
+        case 0: regBC = val; break;
+        case 1: regDE = val; break;
+        default: regHL = val; break;
+    }
+}
+
+/**
+ * Returns the value of a register as encoded in the opcodes (B, C, D, E, H, L, -, A)
+ */
+inline static uint8_t get_reg(cpu_t *cpu, int reg) {
+    switch (reg) {
+        case 0: return regB;
+        case 1: return regC;
+        case 2: return regD;
+        case 3: return regE;
+        case 4: return regH;
+        case 5: return regL;
+        default: return regA;
+    }
+}
+
+inline static void set_reg(cpu_t *cpu, int reg, uint8_t val) {
+    switch (reg) {
+        case 0: regB = val; break;
+        case 1: regC = val; break;
+        case 2: regD = val; break;
+        case 3: regE = val; break;
+        case 4: regH = val; break;
+        case 5: regL = val; break;
+        default: regA = val; break;
+    }
+}
+
+/**
+ * Returns the lowest address accessed through a pointer of a loop in 'iterations' iterations
+ * or -1 if the accessed bytes wrap around the end of the memory
+ */
+static long find_loop_range(uint16_t pointer, int offset, int step, long long iterations) {
+    long first = pointer + offset;
+    long last = first + (iterations - 1) * step;
+    if (first < 0 || first >= MEMORY_SIZE || last < 0 || last >= MEMORY_SIZE) {
+        return -1;
+    }
+    return (step > 0) ? first : last;
+}
+
+/**
+ * Executes all but the last of the remaining iterations of a copy, fill, compare or input loop at once,
+ * a compare loop stops before the iteration which finds a difference and an input loop after
+ * the bytes its device gives in one block (it reads the status of a polling loop once more beforehand).
+ * Called by the JNZ at 'jump' before it goes back to 'head', every register and flag
+ * ends up the same as if the iterations were executed one by one.
+ * Nothing is done if the loop head is a trap address, the written bytes are code,
+ * the accessed bytes aren't plain RAM or the iterations wouldn't fit in the cycle budget
+ * Returns the number of clock cycles the executed iterations took
+ */
+inline static long long run_loop_idiom(cpu_t *cpu, loop_idioms_t *idioms, uint16_t head, uint16_t jump, long long cycle_budget) {
+    const loop_idiom_t *idiom = loop_idioms_find(idioms, head, jump);
+    if (idiom == NULL || is_trap_address(cpu, head)) {
+        return 0;
+    }
+    uint8_t *data = cpu->memory->data;
+    long long iterations = (idiom->counter_16bit ? get_pair(cpu, idiom->counter) : get_reg(cpu, idiom->counter)) - 1;
+    if (iterations > cycle_budget / idiom->iteration_cycles) {
+        iterations = cycle_budget / idiom->iteration_cycles;
+    }
+    if (iterations < LOOP_IDIOM_MIN_ITERATIONS) {
+        return 0;
+    }
+    uint16_t source = get_pair(cpu, idiom->source_pair);
+    uint16_t target = get_pair(cpu, idiom->target_pair);
+    long target_start = find_loop_range(target, idiom->target_offset, idiom->target_step, iterations);
+    bool has_source = idiom->kind == LOOP_IDIOM_COPY || idiom->kind == LOOP_IDIOM_COMPARE;
+    long source_start = has_source ? find_loop_range(source, idiom->source_offset, idiom->source_step, iterations) : 0;
+    if (target_start < 0 || source_start < 0 || !memory_is_ram(cpu->memory, target_start, iterations)
+        || (has_source && !memory_is_ram(cpu->memory, source_start, iterations))) {
+        return 0;
+    }
+    uint8_t poll_carry = get_C_flag(cpu);
+    switch (idiom->kind) {
+        case LOOP_IDIOM_COPY:
+            if (memory_has_code(cpu->memory, target_start, iterations)) {
+                return 0;
+            }
+            if (idiom->source_step == idiom->target_step
+                && (source_start + iterations <= target_start || target_start + iterations <= source_start)) {
+                memcpy(&data[target_start], &data[source_start], iterations);
+            } else {
+                // Overlapping bytes are copied one by one, the same way the loop would do it
+                for (long long i = 0; i < iterations; i++) {
+                    data[target + idiom->target_offset + i * idiom->target_step] = data[source + idiom->source_offset + i * idiom->source_step];
+                }
+            }
+            memory_mark_dirty(cpu->memory, target_start, iterations);
+            break;
+        case LOOP_IDIOM_FILL:
+            if (memory_has_code(cpu->memory, target_start, iterations)) {
+                return 0;
+            }
+            memset(&data[target_start], (idiom->fill_register == LOOP_IDIOM_IMMEDIATE) ? idiom->fill_immediate : get_reg(cpu, idiom->fill_register), iterations);
+            memory_mark_dirty(cpu->memory, target_start, iterations);
+            break;
+        case LOOP_IDIOM_INPUT:
+            // Only the devices on the I/O bus can give whole blocks of bytes
+            if (idiom->target_step != 1 || memory_has_code(cpu->memory, target_start, iterations) || cpu->io_read != io_read
+                || (idiom->has_poll && loop_idiom_poll_waits(idiom, cpu->io_read(cpu->io_context, idiom->poll_port), &poll_carry))) {
+                return 0;
+            }
+            iterations = io_read_block(cpu->io_context, idiom->port, &data[target_start], iterations);
+            if (iterations == 0) {
+                return 0; // Once the device gave some bytes they can't be left to the interpreter
+            }
+            memory_mark_dirty(cpu->memory, target_start, iterations);
+            break;
+        default: // LOOP_IDIOM_COMPARE
+            for (long long i = 0; i < iterations; i++) {
+                if (data[source + idiom->source_offset + i * idiom->source_step] != data[target + idiom->target_offset + i * idiom->target_step]) {
+                    iterations = i; // The iteration finding the difference is left to the interpreter
+                    break;
+                }
+            }
+            if (iterations < LOOP_IDIOM_MIN_ITERATIONS) {
+                return 0;
+            }
             break;
-        case 0x03: // INX B; 1 byte; 5 cycles
+    }
+    // The registers after the last executed iteration
+    set_pair(cpu, idiom->target_pair, target + iterations * idiom->target_step);
+    if (has_source) {
+        set_pair(cpu, idiom->source_pair, source + iterations * idiom->source_step);
+        regA = data[(uint16_t)(source + idiom->source_offset + (iterations - 1) * idiom->source_step)];
+    }
+    if (idiom->kind == LOOP_IDIOM_INPUT) {
+        regA = data[target_start + iterations - 1];
+        set_C_flag(cpu, poll_carry);
+    }
+    if (idiom->kind == LOOP_IDIOM_COMPARE) {
+        sub8bit_with_flags(cpu, regA, data[(uint16_t)(target + idiom->target_offset + (iterations - 1) * idiom->target_step)], 0);
+    }
+    if (idiom->counter_16bit) {
+        uint16_t counter = get_pair(cpu, idiom->counter) - iterations;
+        set_pair(cpu, idiom->counter, counter);
+        regA = or8bit_with_flags(cpu, counter >> 8, counter & 0xFF); // MOV A,r and ORA r
+    } else {
+        uint8_t counter = get_reg(cpu, idiom->counter) - iterations;
+        set_reg(cpu, idiom->counter, dec8bit_with_flags(cpu, counter + 1));
+    }
+    idioms->stats.bulk_runs++;
+    idioms->stats.skipped_iterations += iterations;
+    return iterations * idiom->iteration_cycles;
+}
+
+/**
+ * The iterations are skipped only if the previous one ended in the same state (so the port gave the same value
+ * or at least one the loop can't tell apart) and the loop head isn't a trap address.
+ * The port is assumed to keep its value until the end of the budget, so the caller
+ * shouldn't run the CPU past the next device event
+ * Returns the number of clock cycles the skipped iterations would take
+ */
+inline static long long run_idle_loop(cpu_t *cpu, idle_loops_t *loops, uint16_t head, uint16_t jump, long long cycle_budget) {
+    idle_loop_t *loop = idle_loops_find(loops, head, jump);
+    if (loop == NULL || is_trap_address(cpu, head)) {
+        return 0;
+    }
+    uint8_t flags = get_status_reg(cpu);
+    if (!loop->observed || loop->last_a != regA || loop->last_flags != flags) {
+        loop->observed = true;
+        loop->last_a = regA;
+        loop->last_flags = flags;
+        return 0;
+    }
+    long long iterations = cycle_budget / loop->iteration_cycles;
+    if (iterations <= 0) {
+        return 0;
+    }
+    loops->stats.skips++;
+    loops->stats.skipped_iterations += iterations;
+    return iterations * loop->iteration_cycles;
+}
+
+/**
+ * Copies the state of a running batch ('cpu' is its local copy) to the CPU the IO hooks get,
+ * so they see the registers and the exact cycle through the cpu_ functions
+ */
+static void enter_io_hook(cpu_t *cpu_instance, const cpu_t *cpu, long long batch_cycles) {
+    memcpy(cpu_instance, cpu, offsetof(cpu_t, interrupt_pending));
+    cpu_instance->batch_cycles = batch_cycles;
+}
+
+/**
+ * Takes back into the local copy of a running batch whatever an IO hook changed in the CPU
+ * Returns true if the hook moved the PC, the batch has to end then as its decoded operations no longer follow it
+ */
+static bool leave_io_hook(cpu_t *cpu_instance, cpu_t *cpu) {
+    uint16_t pc = regPC;
+    cpu_instance->batch_cycles = 0;
+    memcpy(cpu, cpu_instance, offsetof(cpu_t, interrupt_pending));
+    return regPC != pc;
+}
+
+/**
+ * Executes operations on the CPU until at least cycle_budget clock cycles have elapsed,
+ * the CPU gets halted or control is transferred to a trap address.
+ * At least one operation is always executed, even if it starts at a trap address
+ * Returns the number of clock cycles the executed operations took
+ */
+static long long cpu_exec_ops(cpu_t *cpu_instance, long long cycle_budget) {
+#ifdef CPU_BLOCK_CACHE
+    if (cpu_instance->block_cache == NULL) {
+        cpu_instance->block_cache = block_cache_create(cpu_instance->memory);
+        if (cpu_instance->block_cache == NULL) {
+            perror("Block cache allocation error");
+            exit(-1);
+        }
+    }
+    block_cache_t *cache = cpu_instance->block_cache;
+    const block_t *block;
+    const block_op_t *block_op;
+#endif
+#ifdef CPU_JIT
+    if (cpu_instance->jit == NULL) {
+        cpu_instance->jit = jit_create(cpu_instance->memory);
+        if (cpu_instance->jit == NULL) {
+            perror("JIT allocation error");
+            exit(-1);
+        }
+    }
+    jit_t *jit = cpu_instance->jit;
+#endif
+#ifdef CPU_LOOP_IDIOMS
+    if (cpu_instance->loop_idioms == NULL) {
+        cpu_instance->loop_idioms = loop_idioms_create(cpu_instance->memory);
+        if (cpu_instance->loop_idioms == NULL) {
+            perror("Loop idioms allocation error");
+            exit(-1);
+        }
+    }
+    loop_idioms_t *loop_idioms = cpu_instance->loop_idioms;
+#endif
+#ifdef CPU_IDLE_LOOPS
+    if (cpu_instance->idle_loops == NULL) {
+        cpu_instance->idle_loops = idle_loops_create(cpu_instance->memory);
+        if (cpu_instance->idle_loops == NULL) {
+            perror("Idle loops allocation error");
+            exit(-1);
+        }
+    }
+    idle_loops_t *idle_loops = cpu_instance->idle_loops;
+#endif
+#ifdef CPU_PAIR_STATS
+    if (cpu_instance->pair_stats == NULL) {
+        cpu_instance->pair_stats = calloc(1, sizeof(cpu_pair_stats_t));
+        if (cpu_instance->pair_stats == NULL) {
+            perror("Pair statistics allocation error");
+            exit(-1);
+        }
+    }
+    cpu_pair_stats_t *pair_stats = cpu_instance->pair_stats;
+#endif
+    /* The registers are copied into a local variable whose address never escapes
+     * so the compiler can keep them in host registers for the whole batch
+     */
+    cpu_t local_cpu;
+    memcpy(&local_cpu, cpu_instance, offsetof(cpu_t, interrupt_pending));
+    cpu_t *cpu = &local_cpu;
+    long long cycles = 0;
+    int operation_cycles = -1;
+#ifdef CPU_THREADED_DISPATCH
+    static void *const dispatch_table[] = {
+        &&op_0x00, &&op_0x01, &&op_0x02, &&op_0x03, &&op_0x04, &&op_0x05, &&op_0x06, &&op_0x07, &&op_0x08, &&op_0x09, &&op_0x0A, &&op_0x0B, &&op_0x0C, &&op_0x0D, &&op_0x0E, &&op_0x0F,
+        &&op_0x10, &&op_0x11, &&op_0x12, &&op_0x13, &&op_0x14, &&op_0x15, &&op_0x16, &&op_0x17, &&op_0x18, &&op_0x19, &&op_0x1A, &&op_0x1B, &&op_0x1C, &&op_0x1D, &&op_0x1E, &&op_0x1F,
+        &&op_0x20, &&op_0x21, &&op_0x22, &&op_0x23, &&op_0x24, &&op_0x25, &&op_0x26, &&op_0x27, &&op_0x28, &&op_0x29, &&op_0x2A, &&op_0x2B, &&op_0x2C, &&op_0x2D, &&op_0x2E, &&op_0x2F,
+        &&op_0x30, &&op_0x31, &&op_0x32, &&op_0x33, &&op_0x34, &&op_0x35, &&op_0x36, &&op_0x37, &&op_0x38, &&op_0x39, &&op_0x3A, &&op_0x3B, &&op_0x3C, &&op_0x3D, &&op_0x3E, &&op_0x3F,
+        &&op_0x40, &&op_0x41, &&op_0x42, &&op_0x43, &&op_0x44, &&op_0x45, &&op_0x46, &&op_0x47, &&op_0x48, &&op_0x49, &&op_0x4A, &&op_0x4B, &&op_0x4C, &&op_0x4D, &&op_0x4E, &&op_0x4F,
+        &&op_0x50, &&op_0x51, &&op_0x52, &&op_0x53, &&op_0x54, &&op_0x55, &&op_0x56, &&op_0x57, &&op_0x58, &&op_0x59, &&op_0x5A, &&op_0x5B, &&op_0x5C, &&op_0x5D, &&op_0x5E, &&op_0x5F,
+        &&op_0x60, &&op_0x61, &&op_0x62, &&op_0x63, &&op_0x64, &&op_0x65, &&op_0x66, &&op_0x67, &&op_0x68, &&op_0x69, &&op_0x6A, &&op_0x6B, &&op_0x6C, &&op_0x6D, &&op_0x6E, &&op_0x6F,
+        &&op_0x70, &&op_0x71, &&op_0x72, &&op_0x73, &&op_0x74, &&op_0x75, &&op_0x76, &&op_0x77, &&op_0x78, &&op_0x79, &&op_0x7A, &&op_0x7B, &&op_0x7C, &&op_0x7D, &&op_0x7E, &&op_0x7F,
+        &&op_0x80, &&op_0x81, &&op_0x82, &&op_0x83, &&op_0x84, &&op_0x85, &&op_0x86, &&op_0x87, &&op_0x88, &&op_0x89, &&op_0x8A, &&op_0x8B, &&op_0x8C, &&op_0x8D, &&op_0x8E, &&op_0x8F,
+        &&op_0x90, &&op_0x91, &&op_0x92, &&op_0x93, &&op_0x94, &&op_0x95, &&op_0x96, &&op_0x97, &&op_0x98, &&op_0x99, &&op_0x9A, &&op_0x9B, &&op_0x9C, &&op_0x9D, &&op_0x9E, &&op_0x9F,
+        &&op_0xA0, &&op_0xA1, &&op_0xA2, &&op_0xA3, &&op_0xA4, &&op_0xA5, &&op_0xA6, &&op_0xA7, &&op_0xA8, &&op_0xA9, &&op_0xAA, &&op_0xAB, &&op_0xAC, &&op_0xAD, &&op_0xAE, &&op_0xAF,
+        &&op_0xB0, &&op_0xB1, &&op_0xB2, &&op_0xB3, &&op_0xB4, &&op_0xB5, &&op_0xB6, &&op_0xB7, &&op_0xB8, &&op_0xB9, &&op_0xBA, &&op_0xBB, &&op_0xBC, &&op_0xBD, &&op_0xBE, &&op_0xBF,
+        &&op_0xC0, &&op_0xC1, &&op_0xC2, &&op_0xC3, &&op_0xC4, &&op_0xC5, &&op_0xC6, &&op_0xC7, &&op_0xC8, &&op_0xC9, &&op_0xCA, &&op_0xCB, &&op_0xCC, &&op_0xCD, &&op_0xCE, &&op_0xCF,
+        &&op_0xD0, &&op_0xD1, &&op_0xD2, &&op_0xD3, &&op_0xD4, &&op_0xD5, &&op_0xD6, &&op_0xD7, &&op_0xD8, &&op_0xD9, &&op_0xDA, &&op_0xDB, &&op_0xDC, &&op_0xDD, &&op_0xDE, &&op_0xDF,
+        &&op_0xE0, &&op_0xE1, &&op_0xE2, &&op_0xE3, &&op_0xE4, &&op_0xE5, &&op_0xE6, &&op_0xE7, &&op_0xE8, &&op_0xE9, &&op_0xEA, &&op_0xEB, &&op_0xEC, &&op_0xED, &&op_0xEE, &&op_0xEF,
+        &&op_0xF0, &&op_0xF1, &&op_0xF2, &&op_0xF3, &&op_0xF4, &&op_0xF5, &&op_0xF6, &&op_0xF7, &&op_0xF8, &&op_0xF9, &&op_0xFA, &&op_0xFB, &&op_0xFC, &&op_0xFD, &&op_0xFE, &&op_0xFF,
+#ifdef CPU_FUSED_OPS
+        &&op_BLOCK_FUSED_DCR_B_JNZ, &&op_BLOCK_FUSED_DCR_C_JNZ, &&op_BLOCK_FUSED_DCR_D_JNZ, &&op_BLOCK_FUSED_DCR_E_JNZ,
+        &&op_BLOCK_FUSED_DCR_H_JNZ, &&op_BLOCK_FUSED_DCR_L_JNZ, &&op_BLOCK_FUSED_DCR_A_JNZ, &&op_BLOCK_FUSED_INX_H_MOV_A_M,
+        &&op_BLOCK_FUSED_CMP_B_JCC, &&op_BLOCK_FUSED_CMP_C_JCC, &&op_BLOCK_FUSED_CMP_D_JCC, &&op_BLOCK_FUSED_CMP_E_JCC,
+        &&op_BLOCK_FUSED_CMP_H_JCC, &&op_BLOCK_FUSED_CMP_L_JCC, &&op_BLOCK_FUSED_CMP_M_JCC, &&op_BLOCK_FUSED_CPI_JCC,
+        &&op_BLOCK_FUSED_LXI_B_CALL, &&op_BLOCK_FUSED_LXI_D_CALL, &&op_BLOCK_FUSED_LXI_H_CALL,
+        &&op_BLOCK_FUSED_PUSH_PUSH, &&op_BLOCK_FUSED_POP_POP,
+#endif
+    };
+#endif
+    DISPATCH_BEGIN
+        OP(0x00) // NOP; 1 byte; 4 cycles
+            operation_cycles = 4;
+            NEXT_OP;
+        OP(0x01) // LXI B,D16; 3 bytes; 10 cycles
+            regBC = FETCH_WORD();
+            operation_cycles = 10;
+            NEXT_OP;
+        OP(0x02) // STAX B; 1 byte; 7 cycles
+            memory_store(cpu->memory, regBC, regA);
+            operation_cycles = 7;
+            NEXT_OP;
+        OP(0x03) // INX B; 1 byte; 5 cycles
             regBC = (regBC + 1) & 0xFFFF;
             operation_cycles = 5;
-            break;
-        case 0x04: // INR B; 1 byte; 5 cycles; Z,S,P,AC flags
-            regB = inc8bit_with_flags(regB);
+            NEXT_OP;
+        OP(0x04) // INR B; 1 byte; 5 cycles; Z,S,P,AC flags
+            regB = inc8bit_with_flags(cpu, regB);
             operation_cycles = 5;
-            break;
-        case 0x05: // DCR B; 1 byte; 5 cycles; Z,S,P,AC flags
-            regB = dec8bit_with_flags(regB);
+            NEXT_OP;
+        OP(0x05) // DCR B; 1 byte; 5 cycles; Z,S,P,AC flags
+            regB = dec8bit_with_flags(cpu, regB);
             operation_cycles = 5;
-            break;
-        case 0x06: // MVI B,D8; 2 bytes; 7 cycles
-            regB = get_next_prog_byte();
+            NEXT_OP;
+        OP(0x06) // MVI B,D8; 2 bytes; 7 cycles
+            regB = FETCH_BYTE();
             operation_cycles = 7;
-            break;
-        case 0x07: // RLC; 1 byte; 4 cycles; C flag
-            status_reg.flags.C = ((regA & 0x80) != 0);
-            regA = (regA << 1) | status_reg.flags.C;
+            NEXT_OP;
+        OP(0x07) // RLC; 1 byte; 4 cycles; C flag
+            set_C_flag(cpu, (regA & 0x80) != 0);
+            regA = (regA << 1) | (regA >> 7);
             operation_cycles = 4;
-            break;
-        case 0x08: // -; 1 byte; 4 cycles
+            NEXT_OP;
+        OP(0x08) // -; 1 byte; 4 cycles
             operation_cycles = 4;
-            break;
-        case 0x09: // DAD B; 1 byte; 10 cycles; C flag
-            regHL = add16bit_with_flag(regHL, regBC);
+            NEXT_OP;
+        OP(0x09) // DAD B; 1 byte; 10 cycles; C flag
+            regHL = add16bit_with_flag(cpu, regHL, regBC);
             operation_cycles = 10;
-            break;
-        case 0x0A: // LDAX B; 1 byte; 7 cycles
-            regA = memory_get(regBC);
+            NEXT_OP;
+        OP(0x0A) // LDAX B; 1 byte; 7 cycles
+            regA = memory_get(cpu->memory, regBC);
             operation_cycles = 7;
-            break;
-        case 0x0B: // DCX B; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x0B) // DCX B; 1 byte; 5 cycles
             regBC = (regBC - 1) & 0xFFFF;
             operation_cycles = 5;
-            break;
-        case 0x0C: // INR C; 1 byte; 5 cycles; Z,S,P,AC flags
-            regC = inc8bit_with_flags(regC);
+            NEXT_OP;
+        OP(0x0C) // INR C; 1 byte; 5 cycles; Z,S,P,AC flags
+            regC = inc8bit_with_flags(cpu, regC);
             operation_cycles = 5;
-            break;
-        case 0x0D: // DCR C; 1 byte; 5 cycles; Z,S,P,AC flags
-            regC = dec8bit_with_flags(regC);
+            NEXT_OP;
+        OP(0x0D) // DCR C; 1 byte; 5 cycles; Z,S,P,AC flags
+            regC = dec8bit_with_flags(cpu, regC);
             operation_cycles = 5;
-            break;
-        case 0x0E: // MVI C,D8; 2 bytes; 7 cycles
-            regC = get_next_prog_byte();
+            NEXT_OP;
+        OP(0x0E) // MVI C,D8; 2 bytes; 7 cycles
+            regC = FETCH_BYTE();
             operation_cycles = 7;
-            break;
-        case 0x0F: // RRC; 1 byte; 4 cycles; C flag
-            status_reg.flags.C = (regA & 0x01);
-            regA = (regA >> 1) | (status_reg.flags.C << 7);
+            NEXT_OP;
+        OP(0x0F) // RRC; 1 byte; 4 cycles; C flag
+            set_C_flag(cpu, regA & 0x01);
+            regA = (regA >> 1) | (regA << 7);
             operation_cycles = 4;
-            break;
-        case 0x10: // -; 1 byte; 4 cycles
+            NEXT_OP;
+        OP(0x10) // -; 1 byte; 4 cycles
             operation_cycles = 4;
-            break;
-        case 0x11: // LXI D,D16; 3 bytes; 10 cycles
-            regE = get_next_prog_byte();
-            regD = get_next_prog_byte();
+            NEXT_OP;
+        OP(0x11) // LXI D,D16; 3 bytes; 10 cycles
+            regDE = FETCH_WORD();
             operation_cycles = 10;
-            break;
-        case 0x12: // STAX D; 1 byte; 7 cycles
-            memory_store(regDE, regA);
+            NEXT_OP;
+        OP(0x12) // STAX D; 1 byte; 7 cycles
+            memory_store(cpu->memory, regDE, regA);
             operation_cycles = 7;
-            break;
-        case 0x13: // INX D; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x13) // INX D; 1 byte; 5 cycles
             regDE = (regDE + 1) & 0xFFFF;
             operation_cycles = 5;
-            break;
-        case 0x14: // INR D; 1 byte; 5 cycles; Z,S,P,AC flags
-            regD = inc8bit_with_flags(regD);
+            NEXT_OP;
+        OP(0x14) // INR D; 1 byte; 5 cycles; Z,S,P,AC flags
+            regD = inc8bit_with_flags(cpu, regD);
             operation_cycles = 5;
-            break;
-        case 0x15: // DCR D; 1 byte; 5 cycles; Z,S,P,AC flags
-            regD = dec8bit_with_flags(regD);
+            NEXT_OP;
+        OP(0x15) // DCR D; 1 byte; 5 cycles; Z,S,P,AC flags
+            regD = dec8bit_with_flags(cpu, regD);
             operation_cycles = 5;
-            break;
-        case 0x16: // MVI D,D8; 2 bytes; 7 cycles
-            regD = get_next_prog_byte();
+            NEXT_OP;
+        OP(0x16) // MVI D,D8; 2 bytes; 7 cycles
+            regD = FETCH_BYTE();
             operation_cycles = 7;
-            break;
-        case 0x17: // RAL; 1 byte; 4 cycles; C flag
+            NEXT_OP;
+        OP(0x17) // RAL; 1 byte; 4 cycles; C flag
             {
-                uint8_t old_C_flag = status_reg.flags.C;
-                status_reg.flags.C = ((regA & 0x80) != 0);
+                uint8_t old_C_flag = get_C_flag(cpu);
+                set_C_flag(cpu, (regA & 0x80) != 0);
                 regA = (regA << 1) | old_C_flag;
             }
             operation_cycles = 4;
-            break;
-        case 0x18: // -; 1 byte; 4 cycles
+            NEXT_OP;
+        OP(0x18) // -; 1 byte; 4 cycles
             operation_cycles = 4;
-            break;
-        case 0x19: // DAD D; 1 byte; 10 cycles; C flag
-            regHL = add16bit_with_flag(regHL, regDE);
+            NEXT_OP;
+        OP(0x19) // DAD D; 1 byte; 10 cycles; C flag
+            regHL = add16bit_with_flag(cpu, regHL, regDE);
             operation_cycles = 10;
-            break;
-        case 0x1A: // LDAX D; 1 byte; 7 cycles
-            regA = memory_get(regDE);
+            NEXT_OP;
+        OP(0x1A) // LDAX D; 1 byte; 7 cycles
+            regA = memory_get(cpu->memory, regDE);
             operation_cycles = 7;
-            break;
-        case 0x1B: // DCX D; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x1B) // DCX D; 1 byte; 5 cycles
             regDE = (regDE - 1) & 0xFFFF;
             operation_cycles = 5;
-            break;
-        case 0x1C: // INR E; 1 byte; 5 cycles; Z,S,P,AC flags
-            regE = inc8bit_with_flags(regE);
+            NEXT_OP;
+        OP(0x1C) // INR E; 1 byte; 5 cycles; Z,S,P,AC flags
+            regE = inc8bit_with_flags(cpu, regE);
             operation_cycles = 5;
-            break;
-        case 0x1D: // DCR E; 1 byte; 5 cycles; Z,S,P,AC flags
-            regE = dec8bit_with_flags(regE);
+            NEXT_OP;
+        OP(0x1D) // DCR E; 1 byte; 5 cycles; Z,S,P,AC flags
+            regE = dec8bit_with_flags(cpu, regE);
             operation_cycles = 5;
-            break;
-        case 0x1E: // MVI E,D8; 2 bytes; 7 cycles
-            regE = get_next_prog_byte();
+            NEXT_OP;
+        OP(0x1E) // MVI E,D8; 2 bytes; 7 cycles
+            regE = FETCH_BYTE();
             operation_cycles = 7;
-            break;
-        case 0x1F: // RAR; 1 byte; 4 cycles; C flag
+            NEXT_OP;
+        OP(0x1F) // RAR; 1 byte; 4 cycles; C flag
             {
-                uint8_t old_C_flag = status_reg.flags.C;
-                status_reg.flags.C = (regA & 0x01);
+                uint8_t old_C_flag = get_C_flag(cpu);
+                set_C_flag(cpu, regA & 0x01);
                 regA = (regA >> 1) | (old_C_flag << 7);
             }
             operation_cycles = 4;
-            break;
-        case 0x20: // -; 1 byte; 4 cycles
+            NEXT_OP;
+        OP(0x20) // -; 1 byte; 4 cycles
             operation_cycles = 4;
-            break;
-        case 0x21: // LXI H,D16; 3 bytes; 10 cycles
-            regL = get_next_prog_byte();
-            regH = get_next_prog_byte();
+            NEXT_OP;
+        OP(0x21) // LXI H,D16; 3 bytes; 10 cycles
+            regHL = FETCH_WORD();
             operation_cycles = 10;
-            break;
-        case 0x22: // SHLD adr; 3 bytes; 16 cycles
+            NEXT_OP;
+        OP(0x22) // SHLD adr; 3 bytes; 16 cycles
             {
-                uint16_t addr = get_next_2_prog_bytes();
-                memory_store(addr, regL);
-                memory_store(addr+1, regH);
+                uint16_t addr = FETCH_WORD();
+                memory_store(cpu->memory, addr, regL);
+                memory_store(cpu->memory, addr+1, regH);
             }
             operation_cycles = 16;
-            break;
-        case 0x23: // INX H; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x23) // INX H; 1 byte; 5 cycles
             regHL = (regHL + 1) & 0xFFFF;
             operation_cycles = 5;
-            break;
-        case 0x24: // INR H; 1 byte; 5 cycles; Z,S,P,AC flags
-            regH = inc8bit_with_flags(regH);
+            NEXT_OP;
+        OP(0x24) // INR H; 1 byte; 5 cycles; Z,S,P,AC flags
+            regH = inc8bit_with_flags(cpu, regH);
             operation_cycles = 5;
-            break;
-        case 0x25: // DCR H; 1 byte; 5 cycles; Z,S,P,AC flags
-            regH = dec8bit_with_flags(regH);
+            NEXT_OP;
+        OP(0x25) // DCR H; 1 byte; 5 cycles; Z,S,P,AC flags
+            regH = dec8bit_with_flags(cpu, regH);
             operation_cycles = 5;
-            break;
-        case 0x26: // MVI H,D8; 2 bytes; 7 cycles
-            regH = get_next_prog_byte();
+            NEXT_OP;
+        OP(0x26) // MVI H,D8; 2 bytes; 7 cycles
+            regH = FETCH_BYTE();
             operation_cycles = 7;
-            break;
-        case 0x27: // DAA; 1 byte; 4 cycles
+            NEXT_OP;
+        OP(0x27) // DAA; 1 byte; 4 cycles
             /*
             * The behaviour of flags was developed to pass all the tests I had
             * since all the documentation I could find was a bit lacking on this topic
             */
-            if ((regA & 0x0F) > 9 || status_reg.flags.AC) {
+            get_status_reg(cpu); // DAA reads AC so the pending flags have to be up to date
+            if ((regA & 0x0F) > 9 || cpu->status_reg.flags.AC) {
                 // The C flag should be set to (regA + 0x06) > 0x100, so (regA > 0xA0)
-                status_reg.flags.C |= (regA > 0xA0);
+                cpu->status_reg.flags.C |= (regA > 0xA0);
                 // The AC flag would be set to 1 if (regA & 0x0F) + 6 > 15, so (regA & 0x0F) > 9
-                status_reg.flags.AC = ((regA & 0x0F) > 0x09);
+                cpu->status_reg.flags.AC = ((regA & 0x0F) > 0x09);
                 regA = (regA + 0x06) & 0xFF;
             } else {
-                status_reg.flags.AC = 0;
+                cpu->status_reg.flags.AC = 0;
             }
-            if ((regA >> 4) > 9 || status_reg.flags.C) {
-                status_reg.flags.C  = 1;
+            if ((regA >> 4) > 9 || cpu->status_reg.flags.C) {
+                cpu->status_reg.flags.C  = 1;
                 regA = (regA + 0x60) & 0xFF;
             }
-            calc_set_P_flag(regA);
-            calc_set_S_flag(regA);
-            calc_set_Z_flag(regA);
+            set_status_reg(cpu, (cpu->status_reg.single & (FLAG_C | FLAG_AC)) | zsp_flags[regA]);
             operation_cycles = 4;
-            break;
-        case 0x28: // -; 1 byte; 4 cycles
+            NEXT_OP;
+        OP(0x28) // -; 1 byte; 4 cycles
             operation_cycles = 4;
-            break;
-        case 0x29: // DAD H; 1 byte; 10 cycles; C flag
-            regHL = add16bit_with_flag(regHL, regHL);
+            NEXT_OP;
+        OP(0x29) // DAD H; 1 byte; 10 cycles; C flag
+            regHL = add16bit_with_flag(cpu, regHL, regHL);
             operation_cycles = 10;
-            break;
-        case 0x2A: // LHLD adr; 3 bytes; 16 cycles
+            NEXT_OP;
+        OP(0x2A) // LHLD adr; 3 bytes; 16 cycles
             {
-                uint16_t addr = get_next_2_prog_bytes();
-                regL = memory_get(addr);
-                regH = memory_get(addr+1);
+                uint16_t addr = FETCH_WORD();
+                regL = memory_get(cpu->memory, addr);
+                regH = memory_get(cpu->memory, addr+1);
             }
             operation_cycles = 16;
-            break;
-        case 0x2B: // DCX H; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x2B) // DCX H; 1 byte; 5 cycles
             regHL = (regHL - 1) & 0xFFFF;
             operation_cycles = 5;
-            break;
-        case 0x2C: // INR L; 1 byte; 5 cycles; Z,S,P,AC flags
-            regL = inc8bit_with_flags(regL);
+            NEXT_OP;
+        OP(0x2C) // INR L; 1 byte; 5 cycles; Z,S,P,AC flags
+            regL = inc8bit_with_flags(cpu, regL);
             operation_cycles = 5;
-            break;
-        case 0x2D: // DCR L; 1 byte; 5 cycles; Z,S,P,AC flags
-            regL = dec8bit_with_flags(regL);
+            NEXT_OP;
+        OP(0x2D) // DCR L; 1 byte; 5 cycles; Z,S,P,AC flags
+            regL = dec8bit_with_flags(cpu, regL);
             operation_cycles = 5;
-            break;
-        case 0x2E: // MVI L,D8; 2 bytes; 7 cycles
-            regL = get_next_prog_byte();
+            NEXT_OP;
+        OP(0x2E) // MVI L,D8; 2 bytes; 7 cycles
+            regL = FETCH_BYTE();
             operation_cycles = 7;
-            break;
-        case 0x2F: // CMA; 1 byte; 4 cycles
+            NEXT_OP;
+        OP(0x2F) // CMA; 1 byte; 4 cycles
             regA = ~regA;
             operation_cycles = 4;
-            break;
-        case 0x30: // -; 1 byte; 4 cycles
+            NEXT_OP;
+        OP(0x30) // -; 1 byte; 4 cycles
             operation_cycles = 4;
-            break;
-        case 0x31: // LXI SP,D16; 3 bytes; 10 cycles
-            regSP_lower = get_next_prog_byte();
-            regSP_higher = get_next_prog_byte();
+            NEXT_OP;
+        OP(0x31) // LXI SP,D16; 3 bytes; 10 cycles
+            regSP = FETCH_WORD();
             operation_cycles = 10;
-            break;
-        case 0x32: // STA adr; 3 bytes; 13 cycles
-            memory_store(get_next_2_prog_bytes(), regA);
+            NEXT_OP;
+        OP(0x32) // STA adr; 3 bytes; 13 cycles
+            memory_store(cpu->memory, FETCH_WORD(), regA);
             operation_cycles = 13;
-            break;
-        case 0x33: // INX SP; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x33) // INX SP; 1 byte; 5 cycles
             regSP = (regSP + 1) & 0xFFFF;
             operation_cycles = 5;
-            break;
-        case 0x34: // INR M; 1 byte; 10 cycles; Z,S,P,AC flags
-            memory_store(regHL, inc8bit_with_flags(memory_get(regHL)));
+            NEXT_OP;
+        OP(0x34) // INR M; 1 byte; 10 cycles; Z,S,P,AC flags
+            memory_store(cpu->memory, regHL, inc8bit_with_flags(cpu, memory_get(cpu->memory, regHL)));
             operation_cycles = 10;
-            break;
-        case 0x35: // DCR M; 1 byte; 10 cycles; Z,S,P,AC flags
-            memory_store(regHL, dec8bit_with_flags(memory_get(regHL)));
+            NEXT_OP;
+        OP(0x35) // DCR M; 1 byte; 10 cycles; Z,S,P,AC flags
+            memory_store(cpu->memory, regHL, dec8bit_with_flags(cpu, memory_get(cpu->memory, regHL)));
             operation_cycles = 10;
-            break;
-        case 0x36: // MVI M,D8; 2 bytes; 10 cycles
-            memory_store(regHL, get_next_prog_byte());
+            NEXT_OP;
+        OP(0x36) // MVI M,D8; 2 bytes; 10 cycles
+            memory_store(cpu->memory, regHL, FETCH_BYTE());
             operation_cycles = 10;
-            break;
-        case 0x37: // STC; 1 byte; 4 cycles; C flag
-            status_reg.flags.C = 1;
+            NEXT_OP;
+        OP(0x37) // STC; 1 byte; 4 cycles; C flag
+            set_C_flag(cpu, 1);
             operation_cycles = 4;
-            break;
-        case 0x38: // -; 1 byte; 4 cycles
+            NEXT_OP;
+        OP(0x38) // -; 1 byte; 4 cycles
             operation_cycles = 4;
-            break;
-        case 0x39: // DAD SP; 1 byte; 10 cycles; C flag
-            regHL = add16bit_with_flag(regHL, regSP);
+            NEXT_OP;
+        OP(0x39) // DAD SP; 1 byte; 10 cycles; C flag
+            regHL = add16bit_with_flag(cpu, regHL, regSP);
             operation_cycles = 10;
-            break;
-        case 0x3A: // LDA adr; 3 bytes; 13 cycles
-            {
-                uint8_t lower = get_next_prog_byte();
-                uint8_t higher = get_next_prog_byte();
-                regA = memory_get(join_bytes(higher, lower));
-            }
+            NEXT_OP;
+        OP(0x3A) // LDA adr; 3 bytes; 13 cycles
+            regA = memory_get(cpu->memory, FETCH_WORD());
             operation_cycles = 13;
-            break;
-        case 0x3B: // DCX SP; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x3B) // DCX SP; 1 byte; 5 cycles
             regSP = (regSP - 1) & 0xFFFF;
             operation_cycles = 5;
-            break;
-        case 0x3C: // INR A; 1 byte; 5 cycles; Z,S,P,AC flags
-            regA = inc8bit_with_flags(regA);
+            NEXT_OP;
+        OP(0x3C) // INR A; 1 byte; 5 cycles; Z,S,P,AC flags
+            regA = inc8bit_with_flags(cpu, regA);
             operation_cycles = 5;
-            break;
-        case 0x3D: // DCR A; 1 byte; 5 cycles; Z,S,P,AC flags
-            regA = dec8bit_with_flags(regA);
+            NEXT_OP;
+        OP(0x3D) // DCR A; 1 byte; 5 cycles; Z,S,P,AC flags
+            regA = dec8bit_with_flags(cpu, regA);
             operation_cycles = 5;
-            break;
-        case 0x3E: // MVI A,D8; 2 bytes; 7 cycles
-            regA = get_next_prog_byte();
+            NEXT_OP;
+        OP(0x3E) // MVI A,D8; 2 bytes; 7 cycles
+            regA = FETCH_BYTE();
             operation_cycles = 7;
-            break;
-        case 0x3F: // CMC; 1 byte; 4 cycles
-            status_reg.flags.C = ~status_reg.flags.C;
+            NEXT_OP;
+        OP(0x3F) // CMC; 1 byte; 4 cycles
+            set_C_flag(cpu, !get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x40: // MOV B,B; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x40) // MOV B,B; 1 byte; 5 cycles
             operation_cycles = 5;
-            break;
-        case 0x41: // MOV B,C; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x41) // MOV B,C; 1 byte; 5 cycles
             regB = regC;
             operation_cycles = 5;
-            break;
-        case 0x42: // MOV B,D; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x42) // MOV B,D; 1 byte; 5 cycles
             regB = regD;
             operation_cycles = 5;
-            break;
-        case 0x43: // MOV B,E; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x43) // MOV B,E; 1 byte; 5 cycles
             regB = regE;
             operation_cycles = 5;
-            break;
-        case 0x44: // MOV B,H; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x44) // MOV B,H; 1 byte; 5 cycles
             regB = regH;
             operation_cycles = 5;
-            break;
-        case 0x45: // MOV B,L; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x45) // MOV B,L; 1 byte; 5 cycles
             regB = regL;
             operation_cycles = 5;
-            break;
-        case 0x46: // MOV B,M; 1 byte; 7 cycles
-            regB = memory_get(regHL);
+            NEXT_OP;
+        OP(0x46) // MOV B,M; 1 byte; 7 cycles
+            regB = memory_get(cpu->memory, regHL);
             operation_cycles = 7;
-            break;
-        case 0x47: // MOV B,A; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x47) // MOV B,A; 1 byte; 5 cycles
             regB = regA;
             operation_cycles = 5;
-            break;
-        case 0x48: // MOV C,B; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x48) // MOV C,B; 1 byte; 5 cycles
             regC = regB;
             operation_cycles = 5;
-            break;
-        case 0x49: // MOV C,C; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x49) // MOV C,C; 1 byte; 5 cycles
             operation_cycles = 5;
-            break;
-        case 0x4A: // MOV C,D; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x4A) // MOV C,D; 1 byte; 5 cycles
             regC = regD;
             operation_cycles = 5;
-            break;
-        case 0x4B: // MOV C,E; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x4B) // MOV C,E; 1 byte; 5 cycles
             regC = regE;
             operation_cycles = 5;
-            break;
-        case 0x4C: // MOV C,H; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x4C) // MOV C,H; 1 byte; 5 cycles
             regC = regH;
             operation_cycles = 5;
-            break;
-        case 0x4D: // MOV C,L; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x4D) // MOV C,L; 1 byte; 5 cycles
             regC = regL;
             operation_cycles = 5;
-            break;
-        case 0x4E: // MOV C,M; 1 byte; 7 cycles
-            regC = memory_get(regHL);
+            NEXT_OP;
+        OP(0x4E) // MOV C,M; 1 byte; 7 cycles
+            regC = memory_get(cpu->memory, regHL);
             operation_cycles = 7;
-            break;
-        case 0x4F: // MOV C,A; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x4F) // MOV C,A; 1 byte; 5 cycles
             regC = regA;
             operation_cycles = 5;
-            break;
-        case 0x50: // MOV D,B; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x50) // MOV D,B; 1 byte; 5 cycles
             regD = regB;
             operation_cycles = 5;
-            break;
-        case 0x51: // MOV D,C; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x51) // MOV D,C; 1 byte; 5 cycles
             regD = regC;
             operation_cycles = 5;
-            break;
-        case 0x52: // MOV D,D; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x52) // MOV D,D; 1 byte; 5 cycles
             operation_cycles = 5;
-            break;
-        case 0x53: // MOV D,E; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x53) // MOV D,E; 1 byte; 5 cycles
             regD = regE;
             operation_cycles = 5;
-            break;
-        case 0x54: // MOV D,H; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x54) // MOV D,H; 1 byte; 5 cycles
             regD = regH;
             operation_cycles = 5;
-            break;
-        case 0x55: // MOV D,L; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x55) // MOV D,L; 1 byte; 5 cycles
             regD = regL;
             operation_cycles = 5;
-            break;
-        case 0x56: // MOV D,M; 1 byte; 7 cycles
-            regD = memory_get(regHL);
+            NEXT_OP;
+        OP(0x56) // MOV D,M; 1 byte; 7 cycles
+            regD = memory_get(cpu->memory, regHL);
             operation_cycles = 7;
-            break;
-        case 0x57: // MOV D,A; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x57) // MOV D,A; 1 byte; 5 cycles
             regD = regA;
             operation_cycles = 5;
-            break;
-        case 0x58: // MOV E,B; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x58) // MOV E,B; 1 byte; 5 cycles
             regE = regB;
             operation_cycles = 5;
-            break;
-        case 0x59: // MOV E,C; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x59) // MOV E,C; 1 byte; 5 cycles
             regE = regC;
             operation_cycles = 5;
-            break;
-        case 0x5A: // MOV E,D; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x5A) // MOV E,D; 1 byte; 5 cycles
             regE = regD;
             operation_cycles = 5;
-            break;
-        case 0x5B: // MOV E,E; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x5B) // MOV E,E; 1 byte; 5 cycles
             operation_cycles = 5;
-            break;
-        case 0x5C: // MOV E,H; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x5C) // MOV E,H; 1 byte; 5 cycles
             regE = regH;
             operation_cycles = 5;
-            break;
-        case 0x5D: // MOV E,L; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x5D) // MOV E,L; 1 byte; 5 cycles
             regE = regL;
             operation_cycles = 5;
-            break;
-        case 0x5E: // MOV E,M; 1 byte; 7 cycles
-            regE = memory_get(regHL);
+            NEXT_OP;
+        OP(0x5E) // MOV E,M; 1 byte; 7 cycles
+            regE = memory_get(cpu->memory, regHL);
             operation_cycles = 7;
-            break;
-        case 0x5F: // MOV E,A; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x5F) // MOV E,A; 1 byte; 5 cycles
             regE = regA;
             operation_cycles = 5;
-            break;
-        case 0x60: // MOV H,B; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x60) // MOV H,B; 1 byte; 5 cycles
             regH = regB;
             operation_cycles = 5;
-            break;
-        case 0x61: // MOV H,C; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x61) // MOV H,C; 1 byte; 5 cycles
             regH = regC;
             operation_cycles = 5;
-            break;
-        case 0x62: // MOV H,D; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x62) // MOV H,D; 1 byte; 5 cycles
             regH = regD;
             operation_cycles = 5;
-            break;
-        case 0x63: // MOV H,E; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x63) // MOV H,E; 1 byte; 5 cycles
             regH = regE;
             operation_cycles = 5;
-            break;
-        case 0x64: // MOV H,H; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x64) // MOV H,H; 1 byte; 5 cycles
             operation_cycles = 5;
-            break;
-        case 0x65: // MOV H,L; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x65) // MOV H,L; 1 byte; 5 cycles
             regH = regL;
             operation_cycles = 5;
-            break;
-        case 0x66: // MOV H,M; 1 byte; 7 cycles
-            regH = memory_get(regHL);
+            NEXT_OP;
+        OP(0x66) // MOV H,M; 1 byte; 7 cycles
+            regH = memory_get(cpu->memory, regHL);
             operation_cycles = 7;
-            break;
-        case 0x67: // MOV H,A; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x67) // MOV H,A; 1 byte; 5 cycles
             regH = regA;
             operation_cycles = 5;
-            break;
-        case 0x68: // MOV L,B; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x68) // MOV L,B; 1 byte; 5 cycles
             regL = regB;
             operation_cycles = 5;
-            break;
-        case 0x69: // MOV L,C; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x69) // MOV L,C; 1 byte; 5 cycles
             regL = regC;
             operation_cycles = 5;
-            break;
-        case 0x6A: // MOV L,D; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x6A) // MOV L,D; 1 byte; 5 cycles
             regL = regD;
             operation_cycles = 5;
-            break;
-        case 0x6B: // MOV L,E; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x6B) // MOV L,E; 1 byte; 5 cycles
             regL = regE;
             operation_cycles = 5;
-            break;
-        case 0x6C: // MOV L,H; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x6C) // MOV L,H; 1 byte; 5 cycles
             regL = regH;
             operation_cycles = 5;
-            break;
-        case 0x6D: // MOV L,L; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x6D) // MOV L,L; 1 byte; 5 cycles
             operation_cycles = 5;
-            break;
-        case 0x6E: // MOV L,M; 1 byte; 7 cycles
-            regL = memory_get(regHL);
+            NEXT_OP;
+        OP(0x6E) // MOV L,M; 1 byte; 7 cycles
+            regL = memory_get(cpu->memory, regHL);
             operation_cycles = 7;
-            break;
-        case 0x6F: // MOV L,A; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x6F) // MOV L,A; 1 byte; 5 cycles
             regL = regA;
             operation_cycles = 5;
-            break;
-        case 0x70: // MOV M,B; 1 byte; 7 cycles
-            memory_store(regHL, regB);
+            NEXT_OP;
+        OP(0x70) // MOV M,B; 1 byte; 7 cycles
+            memory_store(cpu->memory, regHL, regB);
             operation_cycles = 7;
-            break;
-        case 0x71: // MOV M,C; 1 byte; 7 cycles
-            memory_store(regHL, regC);
+            NEXT_OP;
+        OP(0x71) // MOV M,C; 1 byte; 7 cycles
+            memory_store(cpu->memory, regHL, regC);
             operation_cycles = 7;
-            break;
-        case 0x72: // MOV M,D; 1 byte; 7 cycles
-            memory_store(regHL, regD);
+            NEXT_OP;
+        OP(0x72) // MOV M,D; 1 byte; 7 cycles
+            memory_store(cpu->memory, regHL, regD);
             operation_cycles = 7;
-            break;
-        case 0x73: // MOV M,E; 1 byte; 7 cycles
-            memory_store(regHL, regE);
+            NEXT_OP;
+        OP(0x73) // MOV M,E; 1 byte; 7 cycles
+            memory_store(cpu->memory, regHL, regE);
             operation_cycles = 7;
-            break;
-        case 0x74: // MOV M,H; 1 byte; 7 cycles
-            memory_store(regHL, regH);
+            NEXT_OP;
+        OP(0x74) // MOV M,H; 1 byte; 7 cycles
+            memory_store(cpu->memory, regHL, regH);
             operation_cycles = 7;
-            break;
-        case 0x75: // MOV M,L; 1 byte; 7 cycles
-            memory_store(regHL, regL);
+            NEXT_OP;
+        OP(0x75) // MOV M,L; 1 byte; 7 cycles
+            memory_store(cpu->memory, regHL, regL);
             operation_cycles = 7;
-            break;
-        case 0x76: // HLT; 1 byte; 7 cycles
-            cpu_state.halted = true;
+            NEXT_OP;
+        OP(0x76) // HLT; 1 byte; 7 cycles
+            cpu->state.halted = true;
             operation_cycles = 7;
-            break;
-        case 0x77: // MOV M,A; 1 byte; 7 cycles
-            memory_store(regHL, regA);
+            cycle_budget = 0; // Halted CPU doesn't fetch any more operations
+            NEXT_OP;
+        OP(0x77) // MOV M,A; 1 byte; 7 cycles
+            memory_store(cpu->memory, regHL, regA);
             operation_cycles = 7;
-            break;
-        case 0x78: // MOV A,B; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x78) // MOV A,B; 1 byte; 5 cycles
             regA = regB;
             operation_cycles = 5;
-            break;
-        case 0x79: // MOV A,C; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x79) // MOV A,C; 1 byte; 5 cycles
             regA = regC;
             operation_cycles = 5;
-            break;
-        case 0x7A: // MOV A,D; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x7A) // MOV A,D; 1 byte; 5 cycles
             regA = regD;
             operation_cycles = 5;
-            break;
-        case 0x7B: // MOV A,E; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x7B) // MOV A,E; 1 byte; 5 cycles
             regA = regE;
             operation_cycles = 5;
-            break;
-        case 0x7C: // MOV A,H; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x7C) // MOV A,H; 1 byte; 5 cycles
             regA = regH;
             operation_cycles = 5;
-            break;
-        case 0x7D: // MOV A,L; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x7D) // MOV A,L; 1 byte; 5 cycles
             regA = regL;
             operation_cycles = 5;
-            break;
-        case 0x7E: // MOV A,M; 1 byte; 7 cycles
-            regA = memory_get(regHL);
+            NEXT_OP;
+        OP(0x7E) // MOV A,M; 1 byte; 7 cycles
+            regA = memory_get(cpu->memory, regHL);
             operation_cycles = 7;
-            break;
-        case 0x7F: // MOV A,A; 1 byte; 5 cycles
+            NEXT_OP;
+        OP(0x7F) // MOV A,A; 1 byte; 5 cycles
             operation_cycles = 5;
-            break;
-        case 0x80: // ADD B; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regB, 0);
+            NEXT_OP;
+        OP(0x80) // ADD B; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regB, 0);
             operation_cycles = 4;
-            break;
-        case 0x81: // ADD C; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regC, 0);
+            NEXT_OP;
+        OP(0x81) // ADD C; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regC, 0);
             operation_cycles = 4;
-            break;
-        case 0x82: // ADD D; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regD, 0);
+            NEXT_OP;
+        OP(0x82) // ADD D; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regD, 0);
             operation_cycles = 4;
-            break;
-        case 0x83: // ADD E; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regE, 0);
+            NEXT_OP;
+        OP(0x83) // ADD E; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regE, 0);
             operation_cycles = 4;
-            break;
-        case 0x84: // ADD H; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regH, 0);
+            NEXT_OP;
+        OP(0x84) // ADD H; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regH, 0);
             operation_cycles = 4;
-            break;
-        case 0x85: // ADD L; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regL, 0);
+            NEXT_OP;
+        OP(0x85) // ADD L; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regL, 0);
             operation_cycles = 4;
-            break;
-        case 0x86: // ADD M; 1 byte; 7 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, memory_get(regHL), 0);
+            NEXT_OP;
+        OP(0x86) // ADD M; 1 byte; 7 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, memory_get(cpu->memory, regHL), 0);
             operation_cycles = 7;
-            break;
-        case 0x87: // ADD A; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regA, 0);
+            NEXT_OP;
+        OP(0x87) // ADD A; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regA, 0);
             operation_cycles = 4;
-            break;
-        case 0x88: // ADC B; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regB, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x88) // ADC B; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regB, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x89: // ADC C; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regC, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x89) // ADC C; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regC, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x8A: // ADC D; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regD, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x8A) // ADC D; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regD, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x8B: // ADC E; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regE, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x8B) // ADC E; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regE, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x8C: // ADC H; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regH, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x8C) // ADC H; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regH, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x8D: // ADC L; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regL, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x8D) // ADC L; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regL, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x8E: // ADC M; 1 byte; 7 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, memory_get(regHL), status_reg.flags.C);
+            NEXT_OP;
+        OP(0x8E) // ADC M; 1 byte; 7 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, memory_get(cpu->memory, regHL), get_C_flag(cpu));
             operation_cycles = 7;
-            break;
-        case 0x8F: // ADC A; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, regA, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x8F) // ADC A; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, regA, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x90: // SUB B; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regB, 0);
+            NEXT_OP;
+        OP(0x90) // SUB B; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regB, 0);
             operation_cycles = 4;
-            break;
-        case 0x91: // SUB C; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regC, 0);
+            NEXT_OP;
+        OP(0x91) // SUB C; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regC, 0);
             operation_cycles = 4;
-            break;
-        case 0x92: // SUB D; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regD, 0);
+            NEXT_OP;
+        OP(0x92) // SUB D; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regD, 0);
             operation_cycles = 4;
-            break;
-        case 0x93: // SUB E; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regE, 0);
+            NEXT_OP;
+        OP(0x93) // SUB E; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regE, 0);
             operation_cycles = 4;
-            break;
-        case 0x94: // SUB H; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regH, 0);
+            NEXT_OP;
+        OP(0x94) // SUB H; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regH, 0);
             operation_cycles = 4;
-            break;
-        case 0x95: // SUB L; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regL, 0);
+            NEXT_OP;
+        OP(0x95) // SUB L; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regL, 0);
             operation_cycles = 4;
-            break;
-        case 0x96: // SUB M; 1 byte; 7 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, memory_get(regHL), 0);
+            NEXT_OP;
+        OP(0x96) // SUB M; 1 byte; 7 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, memory_get(cpu->memory, regHL), 0);
             operation_cycles = 7;
-            break;
-        case 0x97: // SUB A; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regA, 0);
+            NEXT_OP;
+        OP(0x97) // SUB A; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regA, 0);
             operation_cycles = 4;
-            break;
-        case 0x98: // SBB B; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regB, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x98) // SBB B; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regB, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x99: // SBB C; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regC, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x99) // SBB C; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regC, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x9A: // SBB D; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regD, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x9A) // SBB D; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regD, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x9B: // SBB E; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regE, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x9B) // SBB E; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regE, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x9C: // DBB H; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regH, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x9C) // DBB H; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regH, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x9D: // SBB L; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regL, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x9D) // SBB L; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regL, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0x9E: // SBB M; 1 byte; 7 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, memory_get(regHL), status_reg.flags.C);
+            NEXT_OP;
+        OP(0x9E) // SBB M; 1 byte; 7 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, memory_get(cpu->memory, regHL), get_C_flag(cpu));
             operation_cycles = 7;
-            break;
-        case 0x9F: // SBB A; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, regA, status_reg.flags.C);
+            NEXT_OP;
+        OP(0x9F) // SBB A; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, regA, get_C_flag(cpu));
             operation_cycles = 4;
-            break;
-        case 0xA0: // ANA B; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = and8bit_with_flags(regA, regB);
+            NEXT_OP;
+        OP(0xA0) // ANA B; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = and8bit_with_flags(cpu, regA, regB);
             operation_cycles = 4;
-            break;
-        case 0xA1: // ANA C; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = and8bit_with_flags(regA, regC);
+            NEXT_OP;
+        OP(0xA1) // ANA C; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = and8bit_with_flags(cpu, regA, regC);
             operation_cycles = 4;
-            break;
-        case 0xA2: // ANA D; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = and8bit_with_flags(regA, regD);
+            NEXT_OP;
+        OP(0xA2) // ANA D; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = and8bit_with_flags(cpu, regA, regD);
             operation_cycles = 4;
-            break;
-        case 0xA3: // ANA E; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = and8bit_with_flags(regA, regE);
+            NEXT_OP;
+        OP(0xA3) // ANA E; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = and8bit_with_flags(cpu, regA, regE);
             operation_cycles = 4;
-            break;
-        case 0xA4: // ANA H; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = and8bit_with_flags(regA, regH);
+            NEXT_OP;
+        OP(0xA4) // ANA H; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = and8bit_with_flags(cpu, regA, regH);
             operation_cycles = 4;
-            break;
-        case 0xA5: // ANA L; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = and8bit_with_flags(regA, regL);
+            NEXT_OP;
+        OP(0xA5) // ANA L; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = and8bit_with_flags(cpu, regA, regL);
             operation_cycles = 4;
-            break;
-        case 0xA6: // ANA M; 1 byte; 7 cycles; Z,S,P,C,AC flags
-            regA = and8bit_with_flags(regA, memory_get(regHL));
+            NEXT_OP;
+        OP(0xA6) // ANA M; 1 byte; 7 cycles; Z,S,P,C,AC flags
+            regA = and8bit_with_flags(cpu, regA, memory_get(cpu->memory, regHL));
             operation_cycles = 7;
-            break;
-        case 0xA7: // ANA A; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = and8bit_with_flags(regA, regA);
+            NEXT_OP;
+        OP(0xA7) // ANA A; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = and8bit_with_flags(cpu, regA, regA);
             operation_cycles = 4;
-            break;
-        case 0xA8: // XRA B; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = xor8bit_with_flags(regA, regB);
+            NEXT_OP;
+        OP(0xA8) // XRA B; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = xor8bit_with_flags(cpu, regA, regB);
             operation_cycles = 4;
-            break;
-        case 0xA9: // XRA C; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = xor8bit_with_flags(regA, regC);
+            NEXT_OP;
+        OP(0xA9) // XRA C; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = xor8bit_with_flags(cpu, regA, regC);
             operation_cycles = 4;
-            break;
-        case 0xAA: // XRA D; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = xor8bit_with_flags(regA, regD);
+            NEXT_OP;
+        OP(0xAA) // XRA D; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = xor8bit_with_flags(cpu, regA, regD);
             operation_cycles = 4;
-            break;
-        case 0xAB: // XRA E; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = xor8bit_with_flags(regA, regE);
+            NEXT_OP;
+        OP(0xAB) // XRA E; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = xor8bit_with_flags(cpu, regA, regE);
             operation_cycles = 4;
-            break;
-        case 0xAC: // XRA H; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = xor8bit_with_flags(regA, regH);
+            NEXT_OP;
+        OP(0xAC) // XRA H; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = xor8bit_with_flags(cpu, regA, regH);
             operation_cycles = 4;
-            break;
-        case 0xAD: // XRA L; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = xor8bit_with_flags(regA, regL);
+            NEXT_OP;
+        OP(0xAD) // XRA L; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = xor8bit_with_flags(cpu, regA, regL);
             operation_cycles = 4;
-            break;
-        case 0xAE: // XRA M; 1 byte; 7 cycles; Z,S,P,C,AC flags
-            regA = xor8bit_with_flags(regA, memory_get(regHL));
+            NEXT_OP;
+        OP(0xAE) // XRA M; 1 byte; 7 cycles; Z,S,P,C,AC flags
+            regA = xor8bit_with_flags(cpu, regA, memory_get(cpu->memory, regHL));
             operation_cycles = 7;
-            break;
-        case 0xAF: // XRA A; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = xor8bit_with_flags(regA, regA);
+            NEXT_OP;
+        OP(0xAF) // XRA A; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = xor8bit_with_flags(cpu, regA, regA);
             operation_cycles = 4;
-            break;
-        case 0xB0: // ORA B; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = or8bit_with_flags(regA, regB);
+            NEXT_OP;
+        OP(0xB0) // ORA B; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = or8bit_with_flags(cpu, regA, regB);
             operation_cycles = 4;
-            break;
-        case 0xB1: // ORA C; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = or8bit_with_flags(regA, regC);
+            NEXT_OP;
+        OP(0xB1) // ORA C; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = or8bit_with_flags(cpu, regA, regC);
             operation_cycles = 4;
-            break;
-        case 0xB2: // ORA D; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = or8bit_with_flags(regA, regD);
+            NEXT_OP;
+        OP(0xB2) // ORA D; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = or8bit_with_flags(cpu, regA, regD);
             operation_cycles = 4;
-            break;
-        case 0xB3: // ORA E; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = or8bit_with_flags(regA, regE);
+            NEXT_OP;
+        OP(0xB3) // ORA E; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = or8bit_with_flags(cpu, regA, regE);
             operation_cycles = 4;
-            break;
-        case 0xB4: // ORA H; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = or8bit_with_flags(regA, regH);
+            NEXT_OP;
+        OP(0xB4) // ORA H; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = or8bit_with_flags(cpu, regA, regH);
             operation_cycles = 4;
-            break;
-        case 0xB5: // ORA L; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = or8bit_with_flags(regA, regL);
+            NEXT_OP;
+        OP(0xB5) // ORA L; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = or8bit_with_flags(cpu, regA, regL);
             operation_cycles = 4;
-            break;
-        case 0xB6: // ORA M; 1 byte; 7 cycles; Z,S,P,C,AC flags
-            regA = or8bit_with_flags(regA, memory_get(regHL));
+            NEXT_OP;
+        OP(0xB6) // ORA M; 1 byte; 7 cycles; Z,S,P,C,AC flags
+            regA = or8bit_with_flags(cpu, regA, memory_get(cpu->memory, regHL));
             operation_cycles = 7;
-            break;
-        case 0xB7: // ORA A; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            regA = or8bit_with_flags(regA, regA);
-            operation_cycles = 4;
-            break;
-        case 0xB8: // CMP B; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            sub8bit_with_flags(regA, regB, 0);
-            operation_cycles = 4;
-            break;
-        case 0xB9: // CMP C; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            sub8bit_with_flags(regA, regC, 0);
-            operation_cycles = 4;
-            break;
-        case 0xBA: // CMP D; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            sub8bit_with_flags(regA, regD, 0);
-            operation_cycles = 4;
-            break;
-        case 0xBB: // CMP E; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            sub8bit_with_flags(regA, regE, 0);
-            operation_cycles = 4;
-            break;
-        case 0xBC: // CMP H; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            sub8bit_with_flags(regA, regH, 0);
-            operation_cycles = 4;
-            break;
-        case 0xBD: // CMP L; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            sub8bit_with_flags(regA, regL, 0);
-            operation_cycles = 4;
-            break;
-        case 0xBE: // CMP M; 1 byte; 7 cycles; Z,S,P,C,AC flags
-            sub8bit_with_flags(regA, memory_get(regHL), 0);
-            operation_cycles = 4;
-            break;
-        case 0xBF: // CMP A; 1 byte; 4 cycles; Z,S,P,C,AC flags
-            sub8bit_with_flags(regA, regA, 0);
-            operation_cycles = 4;
-            break;
-        case 0xC0: // RNZ; 1 byte; 11/5 cycles
-            operation_cycles = cond_return(!status_reg.flags.Z);
-            break;
-        case 0xC1: // POP B; 1 byte; 10 cycles
-            regC = stack_pop();
-            regB = stack_pop();
+            NEXT_OP;
+        OP(0xB7) // ORA A; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            regA = or8bit_with_flags(cpu, regA, regA);
+            operation_cycles = 4;
+            NEXT_OP;
+        OP(0xB8) // CMP B; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            sub8bit_with_flags(cpu, regA, regB, 0);
+            operation_cycles = 4;
+            NEXT_OP;
+        OP(0xB9) // CMP C; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            sub8bit_with_flags(cpu, regA, regC, 0);
+            operation_cycles = 4;
+            NEXT_OP;
+        OP(0xBA) // CMP D; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            sub8bit_with_flags(cpu, regA, regD, 0);
+            operation_cycles = 4;
+            NEXT_OP;
+        OP(0xBB) // CMP E; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            sub8bit_with_flags(cpu, regA, regE, 0);
+            operation_cycles = 4;
+            NEXT_OP;
+        OP(0xBC) // CMP H; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            sub8bit_with_flags(cpu, regA, regH, 0);
+            operation_cycles = 4;
+            NEXT_OP;
+        OP(0xBD) // CMP L; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            sub8bit_with_flags(cpu, regA, regL, 0);
+            operation_cycles = 4;
+            NEXT_OP;
+        OP(0xBE) // CMP M; 1 byte; 7 cycles; Z,S,P,C,AC flags
+            sub8bit_with_flags(cpu, regA, memory_get(cpu->memory, regHL), 0);
+            operation_cycles = 4;
+            NEXT_OP;
+        OP(0xBF) // CMP A; 1 byte; 4 cycles; Z,S,P,C,AC flags
+            sub8bit_with_flags(cpu, regA, regA, 0);
+            operation_cycles = 4;
+            NEXT_OP;
+        OP(0xC0) // RNZ; 1 byte; 11/5 cycles
+            operation_cycles = cond_return(cpu, !get_Z_flag(cpu));
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xC1) // POP B; 1 byte; 10 cycles
+            regC = stack_pop(cpu);
+            regB = stack_pop(cpu);
             operation_cycles = 10;
-            break;
-        case 0xC2: // JNZ adr; 3 bytes; 10 cycles
-            cond_jump(!status_reg.flags.Z);
-            operation_cycles = 10;
-            break;
-        case 0xC3: // JMP adr; 3 bytes; 10 cycles
-            regPC = get_next_2_prog_bytes();
+            NEXT_OP;
+        OP(0xC2) // JNZ adr; 3 bytes; 10 cycles
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 10;
+                CHECK_LOOP_IDIOM(addr);
+                CHECK_IDLE_LOOP(addr, !get_Z_flag(cpu));
+                cond_jump(cpu, !get_Z_flag(cpu), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xC3) // JMP adr; 3 bytes; 10 cycles
+            regPC = FETCH_WORD();
             operation_cycles = 10;
-            break;
-        case 0xC4: // CNZ adr; 3 bytes; 17/11 cycles
-            operation_cycles = cond_call(!status_reg.flags.Z);
-            break;
-        case 0xC5: // PUSH B; 1 byte; 11 cycles
-            stack_push(regB);
-            stack_push(regC);
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xC4) // CNZ adr; 3 bytes; 17/11 cycles
+            operation_cycles = cond_call(cpu, !get_Z_flag(cpu), FETCH_WORD());
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xC5) // PUSH B; 1 byte; 11 cycles
+            stack_push(cpu, regB);
+            stack_push(cpu, regC);
             operation_cycles = 11;
-            break;
-        case 0xC6: // ADI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, get_next_prog_byte(), 0);
+            NEXT_OP;
+        OP(0xC6) // ADI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, FETCH_BYTE(), 0);
             operation_cycles = 7;
-            break;
-        case 0xC7: // RST 0; 1 byte; 11 cycles
-            call_addr(0x0000);
+            NEXT_OP;
+        OP(0xC7) // RST 0; 1 byte; 11 cycles
+            call_addr(cpu, 0x0000);
             operation_cycles = 11;
-            break;
-        case 0xC8: // RZ; 1 byte; 11/5 cycles
-            operation_cycles = cond_return(status_reg.flags.Z);
-            break;
-        case 0xC9: // RET; 1 byte; 10 cycles
-            regPC_lower = stack_pop();
-            regPC_higher = stack_pop();
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xC8) // RZ; 1 byte; 11/5 cycles
+            operation_cycles = cond_return(cpu, get_Z_flag(cpu));
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xC9) // RET; 1 byte; 10 cycles
+            regPC_lower = stack_pop(cpu);
+            regPC_higher = stack_pop(cpu);
             operation_cycles = 10;
-            break;
-        case 0xCA: // JZ adr; 3 bytes; 10 cycles
-            cond_jump(status_reg.flags.Z);
-            operation_cycles = 10;
-            break;
-        case 0xCB: // - (works as JMP addr); 3 bytes; 10 cycles
-            regPC = get_next_2_prog_bytes();
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xCA) // JZ adr; 3 bytes; 10 cycles
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 10;
+                CHECK_IDLE_LOOP(addr, get_Z_flag(cpu));
+                cond_jump(cpu, get_Z_flag(cpu), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xCB) // - (works as JMP addr); 3 bytes; 10 cycles
+            regPC = FETCH_WORD();
             operation_cycles = 10;
-            break;
-        case 0xCC: // CZ adr; 3 bytes; 17/11 cycles
-            operation_cycles = cond_call(status_reg.flags.Z);
-            break;
-        case 0xCD: // CALL adr; 3 bytes; 17 cycles
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xCC) // CZ adr; 3 bytes; 17/11 cycles
+            operation_cycles = cond_call(cpu, get_Z_flag(cpu), FETCH_WORD());
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xCD) // CALL adr; 3 bytes; 17 cycles
             {
-                uint16_t newPC = get_next_2_prog_bytes();
-                stack_push(regPC_higher);
-                stack_push(regPC_lower);
+                uint16_t newPC = FETCH_WORD();
+                stack_push(cpu, regPC_higher);
+                stack_push(cpu, regPC_lower);
                 regPC = newPC;
             }
             operation_cycles = 17;
-            break;
-        case 0xCE: // ACI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
-            regA = add8bit_with_flags(regA, get_next_prog_byte(), status_reg.flags.C);
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xCE) // ACI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
+            regA = add8bit_with_flags(cpu, regA, FETCH_BYTE(), get_C_flag(cpu));
             operation_cycles = 7;
-            break;
-        case 0xCF: // RST 1; 1 byte; 11 cycles
-            call_addr(0x0008);
+            NEXT_OP;
+        OP(0xCF) // RST 1; 1 byte; 11 cycles
+            call_addr(cpu, 0x0008);
             operation_cycles = 11;
-            break;
-        case 0xD0: // RNC; 1 byte; 11/5 cycles
-            operation_cycles = cond_return(!status_reg.flags.C);
-            break;
-        case 0xD1: // POP D; 1 byte; 10 cycles
-            regE = stack_pop();
-            regD = stack_pop();
-            operation_cycles = 10;
-            break;
-        case 0xD2: // JNC adr; 3 bytes; 10 cycles
-            cond_jump(!status_reg.flags.C);
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xD0) // RNC; 1 byte; 11/5 cycles
+            operation_cycles = cond_return(cpu, !get_C_flag(cpu));
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xD1) // POP D; 1 byte; 10 cycles
+            regE = stack_pop(cpu);
+            regD = stack_pop(cpu);
             operation_cycles = 10;
-            break;
-        case 0xD3: // OUT D8; 2 bytes; 10 cycles
-            io_write(get_next_prog_byte(), regA);
+            NEXT_OP;
+        OP(0xD2) // JNC adr; 3 bytes; 10 cycles
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 10;
+                CHECK_IDLE_LOOP(addr, !get_C_flag(cpu));
+                cond_jump(cpu, !get_C_flag(cpu), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xD3) // OUT D8; 2 bytes; 10 cycles
+            {
+                uint8_t port = FETCH_BYTE();
+                enter_io_hook(cpu_instance, cpu, cycles);
+                cpu->io_write(cpu->io_context, port, regA);
+                if (leave_io_hook(cpu_instance, cpu)) {
+                    cycle_budget = 0;
+                }
+            }
             operation_cycles = 10;
-            break;
-        case 0xD4: // CNC adr; 3 bytes; 17/11 cycles
-            operation_cycles = cond_call(!status_reg.flags.C);
-            break;
-        case 0xD5: // PUSH D; 1 byte; 11 cycles
-            stack_push(regD);
-            stack_push(regE);
+            NEXT_OP;
+        OP(0xD4) // CNC adr; 3 bytes; 17/11 cycles
+            operation_cycles = cond_call(cpu, !get_C_flag(cpu), FETCH_WORD());
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xD5) // PUSH D; 1 byte; 11 cycles
+            stack_push(cpu, regD);
+            stack_push(cpu, regE);
             operation_cycles = 11;
-            break;
-        case 0xD6: // SUI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, get_next_prog_byte(), 0);
+            NEXT_OP;
+        OP(0xD6) // SUI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, FETCH_BYTE(), 0);
             operation_cycles = 7;
-            break;
-        case 0xD7: // RST 2; 1 byte; 11 cycles
-            call_addr(0x0010);
+            NEXT_OP;
+        OP(0xD7) // RST 2; 1 byte; 11 cycles
+            call_addr(cpu, 0x0010);
             operation_cycles = 11;
-            break;
-        case 0xD8: // RC; 1 byte; 11/5 cycles
-            operation_cycles = cond_return(status_reg.flags.C);
-            break;
-        case 0xD9: // - (works as RET); 1 byte; 10 cycles
-            regPC_lower = stack_pop();
-            regPC_higher = stack_pop();
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xD8) // RC; 1 byte; 11/5 cycles
+            operation_cycles = cond_return(cpu, get_C_flag(cpu));
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xD9) // - (works as RET); 1 byte; 10 cycles
+            regPC_lower = stack_pop(cpu);
+            regPC_higher = stack_pop(cpu);
             operation_cycles = 10;
-            break;
-        case 0xDA: // JC adr; 3 bytes; 10 cycles
-            cond_jump(status_reg.flags.C);
-            operation_cycles = 10;
-            break;
-        case 0xDB: // IN D8; 2 bytes; 10 cycles
-            regA = io_read(get_next_prog_byte());
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xDA) // JC adr; 3 bytes; 10 cycles
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 10;
+                CHECK_IDLE_LOOP(addr, get_C_flag(cpu));
+                cond_jump(cpu, get_C_flag(cpu), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xDB) // IN D8; 2 bytes; 10 cycles
+            {
+                uint8_t port = FETCH_BYTE();
+                enter_io_hook(cpu_instance, cpu, cycles);
+                uint8_t value = cpu->io_read(cpu->io_context, port);
+                if (leave_io_hook(cpu_instance, cpu)) {
+                    cycle_budget = 0;
+                }
+                regA = value;
+            }
             operation_cycles = 10;
-            break;
-        case 0xDC: // CC adr; 3 bytes; 17/11 cycles
-            operation_cycles = cond_call(status_reg.flags.C);
-            break;
-        case 0xDD: // - (works as CALL addr); 3 bytes; 17 cycles
+            NEXT_OP;
+        OP(0xDC) // CC adr; 3 bytes; 17/11 cycles
+            operation_cycles = cond_call(cpu, get_C_flag(cpu), FETCH_WORD());
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xDD) // - (works as CALL addr); 3 bytes; 17 cycles
             {
-                uint16_t newPC = get_next_2_prog_bytes();
-                stack_push(regPC_higher);
-                stack_push(regPC_lower);
+                uint16_t newPC = FETCH_WORD();
+                stack_push(cpu, regPC_higher);
+                stack_push(cpu, regPC_lower);
                 regPC = newPC;
             }
             operation_cycles = 17;
-            break;
-        case 0xDE: // SBI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
-            regA = sub8bit_with_flags(regA, get_next_prog_byte(), status_reg.flags.C);
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xDE) // SBI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
+            regA = sub8bit_with_flags(cpu, regA, FETCH_BYTE(), get_C_flag(cpu));
             operation_cycles = 7;
-            break;
-        case 0xDF: // RST 3; 1 byte; 11 cycles
-            call_addr(0x0018);
+            NEXT_OP;
+        OP(0xDF) // RST 3; 1 byte; 11 cycles
+            call_addr(cpu, 0x0018);
             operation_cycles = 11;
-            break;
-        case 0xE0: // RPO; 1 byte; 11/5 cycles
-            operation_cycles = cond_return(!status_reg.flags.P);
-            break;
-        case 0xE1: // POP H; 1 byte; 10 cycles
-            regL = stack_pop();
-            regH = stack_pop();
-            operation_cycles = 10;
-            break;
-        case 0xE2: // JPO adr; 3 bytes; 10 cycles
-            cond_jump(!status_reg.flags.P);
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xE0) // RPO; 1 byte; 11/5 cycles
+            operation_cycles = cond_return(cpu, !get_P_flag(cpu));
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xE1) // POP H; 1 byte; 10 cycles
+            regL = stack_pop(cpu);
+            regH = stack_pop(cpu);
             operation_cycles = 10;
-            break;
-        case 0xE3: // XTHL; 1 byte; 18 cycles
+            NEXT_OP;
+        OP(0xE2) // JPO adr; 3 bytes; 10 cycles
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 10;
+                CHECK_IDLE_LOOP(addr, !get_P_flag(cpu));
+                cond_jump(cpu, !get_P_flag(cpu), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xE3) // XTHL; 1 byte; 18 cycles
             {
                 uint8_t tmp = regL;
-                regL = memory_get(regSP);
-                memory_store(regSP, tmp);
+                regL = memory_get(cpu->memory, regSP);
+                memory_store(cpu->memory, regSP, tmp);
                 tmp = regH;
-                regH = memory_get(regSP+1);
-                memory_store(regSP+1, tmp);
+                regH = memory_get(cpu->memory, regSP+1);
+                memory_store(cpu->memory, regSP+1, tmp);
             }
             operation_cycles = 18;
-            break;
-        case 0xE4: // CPO adr; 3 bytes; 17/11 cycles
-            operation_cycles = cond_call(!status_reg.flags.P);
-            break;
-        case 0xE5: // PUSH H; 1 byte; 11 cycles
-            stack_push(regH);
-            stack_push(regL);
+            NEXT_OP;
+        OP(0xE4) // CPO adr; 3 bytes; 17/11 cycles
+            operation_cycles = cond_call(cpu, !get_P_flag(cpu), FETCH_WORD());
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xE5) // PUSH H; 1 byte; 11 cycles
+            stack_push(cpu, regH);
+            stack_push(cpu, regL);
             operation_cycles = 11;
-            break;
-        case 0xE6: // ANI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
-            regA = and8bit_with_flags(regA, get_next_prog_byte());
+            NEXT_OP;
+        OP(0xE6) // ANI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
+            regA = and8bit_with_flags(cpu, regA, FETCH_BYTE());
             operation_cycles = 7;
-            break;
-        case 0xE7: // RST 4; 1 byte; 11 cycles
-            call_addr(0x0020);
+            NEXT_OP;
+        OP(0xE7) // RST 4; 1 byte; 11 cycles
+            call_addr(cpu, 0x0020);
             operation_cycles = 11;
-            break;
-        case 0xE8: // RPE; 1 byte; 11/5 cycles
-            operation_cycles = cond_return(status_reg.flags.P);
-            break;
-        case 0xE9: // PCHL; 1 byte; 5 cycles
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xE8) // RPE; 1 byte; 11/5 cycles
+            operation_cycles = cond_return(cpu, get_P_flag(cpu));
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xE9) // PCHL; 1 byte; 5 cycles
             regPC = regHL;
             operation_cycles = 5;
-            break;
-        case 0xEA: // JPE adr; 3 bytes; 10 cycles
-            cond_jump(status_reg.flags.P);
-            operation_cycles = 10;
-            break;
-        case 0xEB: // XCHG; 1 byte; 5 cycles
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xEA) // JPE adr; 3 bytes; 10 cycles
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 10;
+                CHECK_IDLE_LOOP(addr, get_P_flag(cpu));
+                cond_jump(cpu, get_P_flag(cpu), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xEB) // XCHG; 1 byte; 5 cycles
             {
                 uint16_t tmp = regHL;
                 regHL = regDE;
                 regDE = tmp;
             }
             operation_cycles = 5;
-            break;
-        case 0xEC: // CPE adr; 3 bytes; 17/11 cycles
-            operation_cycles = cond_call(status_reg.flags.P);
-            break;
-        case 0xED: // - (works as CALL addr); 3 bytes; 17 cycles
+            NEXT_OP;
+        OP(0xEC) // CPE adr; 3 bytes; 17/11 cycles
+            operation_cycles = cond_call(cpu, get_P_flag(cpu), FETCH_WORD());
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xED) // - (works as CALL addr); 3 bytes; 17 cycles
             {
-                uint16_t newPC = get_next_2_prog_bytes();
-                stack_push(regPC_higher);
-                stack_push(regPC_lower);
+                uint16_t newPC = FETCH_WORD();
+                stack_push(cpu, regPC_higher);
+                stack_push(cpu, regPC_lower);
                 regPC = newPC;
             }
             operation_cycles = 17;
-            break;
-        case 0xEE: // XRI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
-            regA = xor8bit_with_flags(regA, get_next_prog_byte());
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xEE) // XRI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
+            regA = xor8bit_with_flags(cpu, regA, FETCH_BYTE());
             operation_cycles = 7;
-            break;
-        case 0xEF: // RST 5; 1 byte; 11 cycles
-            call_addr(0x0028);
+            NEXT_OP;
+        OP(0xEF) // RST 5; 1 byte; 11 cycles
+            call_addr(cpu, 0x0028);
             operation_cycles = 11;
-            break;
-        case 0xF0: // RP; 1 byte; 11/5 cycles
-            operation_cycles = cond_return(!status_reg.flags.S); // If the number is positive
-            break;
-        case 0xF1: // POP PSW; 1 byte; 10 cycles
-            status_reg.single = stack_pop();
-            regA = stack_pop();
-            status_reg.flags._unused1 = 1;
-            status_reg.flags._unused2 = 0;
-            status_reg.flags._unused3 = 0;
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xF0) // RP; 1 byte; 11/5 cycles
+            operation_cycles = cond_return(cpu, !get_S_flag(cpu)); // If the number is positive
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xF1) // POP PSW; 1 byte; 10 cycles
+            set_status_reg(cpu, (stack_pop(cpu) & (FLAG_C | FLAG_P | FLAG_AC | FLAG_Z | FLAG_S)) | STATUS_REG_FIXED_BITS);
+            regA = stack_pop(cpu);
             operation_cycles = 10;
-            break;
-        case 0xF2: // JP adr; 3 bytes; 10 cycles
-            cond_jump(!status_reg.flags.S); // If the number is positive
-            operation_cycles = 10;
-            break;
-        case 0xF3: // DI; 1 byte; 4 cycles
-            cpu_state.interrupts_enabled = false;
-            operation_cycles = 4;
-            break;
-        case 0xF4: // CP adr; 3 bytes; 17/11 cycles
-            operation_cycles = cond_call(!status_reg.flags.S); // If the number is positive
-            break;
-        case 0xF5: // PUSH PSW; 1 byte; 11 cycles
-            stack_push(regA);
-            stack_push(status_reg.single);
+            NEXT_OP;
+        OP(0xF2) // JP adr; 3 bytes; 10 cycles
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 10;
+                CHECK_IDLE_LOOP(addr, !get_S_flag(cpu));
+                cond_jump(cpu, !get_S_flag(cpu), addr); // If the number is positive
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xF3) // DI; 1 byte; 4 cycles
+            cpu->state.interrupts_enabled = false;
+            operation_cycles = 4;
+            NEXT_OP;
+        OP(0xF4) // CP adr; 3 bytes; 17/11 cycles
+            operation_cycles = cond_call(cpu, !get_S_flag(cpu), FETCH_WORD()); // If the number is positive
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xF5) // PUSH PSW; 1 byte; 11 cycles
+            stack_push(cpu, regA);
+            stack_push(cpu, get_status_reg(cpu));
             operation_cycles = 11;
-            break;
-        case 0xF6: // ORI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
-            regA = or8bit_with_flags(regA, get_next_prog_byte());
+            NEXT_OP;
+        OP(0xF6) // ORI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
+            regA = or8bit_with_flags(cpu, regA, FETCH_BYTE());
             operation_cycles = 7;
-            break;
-        case 0xF7: // RST 6; 1 byte; 11 cycles
-            call_addr(0x0030);
+            NEXT_OP;
+        OP(0xF7) // RST 6; 1 byte; 11 cycles
+            call_addr(cpu, 0x0030);
             operation_cycles = 11;
-            break;
-        case 0xF8: // RM; 1 byte; 11/5 cycles
-            operation_cycles = cond_return(status_reg.flags.S); // If the number is negative
-            break;
-        case 0xF9: // SPHL; 1 byte; 5 cycles
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xF8) // RM; 1 byte; 11/5 cycles
+            operation_cycles = cond_return(cpu, get_S_flag(cpu)); // If the number is negative
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xF9) // SPHL; 1 byte; 5 cycles
             regSP = regHL;
             operation_cycles = 5;
-            break;
-        case 0xFA: // JM adr; 3 bytes; 10 cycles
-            cond_jump(status_reg.flags.S); // If the number is negative
-            operation_cycles = 10;
-            break;
-        case 0xFB: // EI; 1 byte; 4 cycles
-            cpu_state.interrupts_enabled = true;
-            operation_cycles = 4;
-            break;
-        case 0xFC: // CM adr; 3 bytes; 17/11 cycles
-            operation_cycles = cond_call(status_reg.flags.S); // If the number is negative
-            break;
-        case 0xFD: // - (works as CALL addr); 3 bytes; 17 cycles
+            NEXT_OP;
+        OP(0xFA) // JM adr; 3 bytes; 10 cycles
             {
-                uint16_t newPC = get_next_2_prog_bytes();
-                stack_push(regPC_higher);
-                stack_push(regPC_lower);
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 10;
+                CHECK_IDLE_LOOP(addr, get_S_flag(cpu));
+                cond_jump(cpu, get_S_flag(cpu), addr); // If the number is negative
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xFB) // EI; 1 byte; 4 cycles
+            cpu->state.interrupts_enabled = true;
+            operation_cycles = 4;
+            if (cycle_budget <= cycles + operation_cycles || atomic_load_explicit(&cpu_instance->interrupt_pending, memory_order_relaxed)) {
+                // Interrupts are accepted only after the next operation, so the batch ends right after it
+                cycle_budget = cycles + operation_cycles + 1;
+            }
+            NEXT_OP;
+        OP(0xFC) // CM adr; 3 bytes; 17/11 cycles
+            operation_cycles = cond_call(cpu, get_S_flag(cpu), FETCH_WORD()); // If the number is negative
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xFD) // - (works as CALL addr); 3 bytes; 17 cycles
+            {
+                uint16_t newPC = FETCH_WORD();
+                stack_push(cpu, regPC_higher);
+                stack_push(cpu, regPC_lower);
                 regPC = newPC;
             }
             operation_cycles = 17;
-            break;
-        case 0xFE: // CPI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
-            sub8bit_with_flags(regA, get_next_prog_byte(), 0);
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(0xFE) // CPI D8; 2 bytes; 7 cycles; Z,S,P,C,AC flags
+            sub8bit_with_flags(cpu, regA, FETCH_BYTE(), 0);
             operation_cycles = 7;
-            break;
-        case 0xFF: // RST 7; 1 byte; 11 cycles
-            call_addr(0x0038);
+            NEXT_OP;
+        OP(0xFF) // RST 7; 1 byte; 11 cycles
+            call_addr(cpu, 0x0038);
             operation_cycles = 11;
-            break;
-        default:
-            break;
+            CHECK_TRAP;
+            NEXT_OP;
+#ifdef CPU_FUSED_OPS
+        /*
+         * Fused operations, see block_fused_op_t. Each one takes as many cycles as its pair
+         * and stops at the same places (the traps are checked after the second operation)
+         */
+        OP(BLOCK_FUSED_DCR_B_JNZ) // DCR B + JNZ adr; 4 bytes; 15 cycles
+            regB = dec8bit_with_flags(cpu, regB);
+            FETCH_SECOND_OPCODE();
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 15;
+                CHECK_LOOP_IDIOM(addr);
+                cond_jump(cpu, !get_Z_flag(cpu), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_DCR_C_JNZ) // DCR C + JNZ adr; 4 bytes; 15 cycles
+            regC = dec8bit_with_flags(cpu, regC);
+            FETCH_SECOND_OPCODE();
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 15;
+                CHECK_LOOP_IDIOM(addr);
+                cond_jump(cpu, !get_Z_flag(cpu), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_DCR_D_JNZ) // DCR D + JNZ adr; 4 bytes; 15 cycles
+            regD = dec8bit_with_flags(cpu, regD);
+            FETCH_SECOND_OPCODE();
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 15;
+                CHECK_LOOP_IDIOM(addr);
+                cond_jump(cpu, !get_Z_flag(cpu), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_DCR_E_JNZ) // DCR E + JNZ adr; 4 bytes; 15 cycles
+            regE = dec8bit_with_flags(cpu, regE);
+            FETCH_SECOND_OPCODE();
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 15;
+                CHECK_LOOP_IDIOM(addr);
+                cond_jump(cpu, !get_Z_flag(cpu), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_DCR_H_JNZ) // DCR H + JNZ adr; 4 bytes; 15 cycles
+            regH = dec8bit_with_flags(cpu, regH);
+            FETCH_SECOND_OPCODE();
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 15;
+                CHECK_LOOP_IDIOM(addr);
+                cond_jump(cpu, !get_Z_flag(cpu), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_DCR_L_JNZ) // DCR L + JNZ adr; 4 bytes; 15 cycles
+            regL = dec8bit_with_flags(cpu, regL);
+            FETCH_SECOND_OPCODE();
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 15;
+                CHECK_LOOP_IDIOM(addr);
+                cond_jump(cpu, !get_Z_flag(cpu), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_DCR_A_JNZ) // DCR A + JNZ adr; 4 bytes; 15 cycles
+            regA = dec8bit_with_flags(cpu, regA);
+            FETCH_SECOND_OPCODE();
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 15;
+                CHECK_LOOP_IDIOM(addr);
+                cond_jump(cpu, !get_Z_flag(cpu), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_INX_H_MOV_A_M) // INX H + MOV A,M; 2 bytes; 12 cycles
+            regHL = (regHL + 1) & 0xFFFF;
+            FETCH_SECOND_OPCODE();
+            regA = memory_get(cpu->memory, regHL);
+            operation_cycles = 12;
+            NEXT_OP;
+        OP(BLOCK_FUSED_CMP_B_JCC) // CMP B + Jcc adr; 4 bytes; 14 cycles
+            sub8bit_with_flags(cpu, regA, regB, 0);
+            FETCH_SECOND_OPCODE();
+            cond_jump(cpu, condition_met(cpu, block_op->opcode), FETCH_WORD());
+            operation_cycles = 14;
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_CMP_C_JCC) // CMP C + Jcc adr; 4 bytes; 14 cycles
+            sub8bit_with_flags(cpu, regA, regC, 0);
+            FETCH_SECOND_OPCODE();
+            cond_jump(cpu, condition_met(cpu, block_op->opcode), FETCH_WORD());
+            operation_cycles = 14;
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_CMP_D_JCC) // CMP D + Jcc adr; 4 bytes; 14 cycles
+            sub8bit_with_flags(cpu, regA, regD, 0);
+            FETCH_SECOND_OPCODE();
+            cond_jump(cpu, condition_met(cpu, block_op->opcode), FETCH_WORD());
+            operation_cycles = 14;
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_CMP_E_JCC) // CMP E + Jcc adr; 4 bytes; 14 cycles
+            sub8bit_with_flags(cpu, regA, regE, 0);
+            FETCH_SECOND_OPCODE();
+            cond_jump(cpu, condition_met(cpu, block_op->opcode), FETCH_WORD());
+            operation_cycles = 14;
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_CMP_H_JCC) // CMP H + Jcc adr; 4 bytes; 14 cycles
+            sub8bit_with_flags(cpu, regA, regH, 0);
+            FETCH_SECOND_OPCODE();
+            cond_jump(cpu, condition_met(cpu, block_op->opcode), FETCH_WORD());
+            operation_cycles = 14;
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_CMP_L_JCC) // CMP L + Jcc adr; 4 bytes; 14 cycles
+            sub8bit_with_flags(cpu, regA, regL, 0);
+            FETCH_SECOND_OPCODE();
+            cond_jump(cpu, condition_met(cpu, block_op->opcode), FETCH_WORD());
+            operation_cycles = 14;
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_CMP_M_JCC) // CMP M + Jcc adr; 4 bytes; 14 cycles (CMP M is counted as 4 cycles)
+            sub8bit_with_flags(cpu, regA, memory_get(cpu->memory, regHL), 0);
+            FETCH_SECOND_OPCODE();
+            cond_jump(cpu, condition_met(cpu, block_op->opcode), FETCH_WORD());
+            operation_cycles = 14;
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_CPI_JCC) // CPI D8 + Jcc adr; 5 bytes; 17 cycles
+            sub8bit_with_flags(cpu, regA, FETCH_BYTE(), 0);
+            FETCH_SECOND_OPCODE();
+            {
+                uint16_t addr = FETCH_WORD();
+                operation_cycles = 17;
+                CHECK_IDLE_LOOP(addr, condition_met(cpu, block_op->opcode));
+                cond_jump(cpu, condition_met(cpu, block_op->opcode), addr);
+            }
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_LXI_B_CALL) // LXI B,D16 + CALL adr; 6 bytes; 27 cycles
+            regBC = FETCH_WORD();
+            FETCH_SECOND_OPCODE();
+            call_addr(cpu, FETCH_WORD());
+            operation_cycles = 27;
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_LXI_D_CALL) // LXI D,D16 + CALL adr; 6 bytes; 27 cycles
+            regDE = FETCH_WORD();
+            FETCH_SECOND_OPCODE();
+            call_addr(cpu, FETCH_WORD());
+            operation_cycles = 27;
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_LXI_H_CALL) // LXI H,D16 + CALL adr; 6 bytes; 27 cycles
+            regHL = FETCH_WORD();
+            FETCH_SECOND_OPCODE();
+            call_addr(cpu, FETCH_WORD());
+            operation_cycles = 27;
+            CHECK_TRAP;
+            NEXT_OP;
+        OP(BLOCK_FUSED_PUSH_PUSH) // PUSH rp + PUSH rp; 2 bytes; 22 cycles
+            push_op(cpu, block_op->opcode);
+            if (block_cache_is_stale(cache, block)) {
+                // The first PUSH has overwritten the code of the block, the second one has to be decoded again
+                operation_cycles = 11;
+                NEXT_OP;
+            }
+            FETCH_SECOND_OPCODE();
+            push_op(cpu, block_op->opcode);
+            operation_cycles = 22;
+            NEXT_OP;
+        OP(BLOCK_FUSED_POP_POP) // POP rp + POP rp; 2 bytes; 20 cycles
+            pop_op(cpu, block_op->opcode);
+            FETCH_SECOND_OPCODE();
+            pop_op(cpu, block_op->opcode);
+            operation_cycles = 20;
+            NEXT_OP;
+#endif
+    DISPATCH_END
+    memcpy(cpu_instance, cpu, offsetof(cpu_t, interrupt_pending));
+    return cycles;
+}
+
+/**
+ * Executes the recompiled program starting at the current PC until the cycle budget is used up
+ * or it reaches code it doesn't have (or whose code was overwritten), a trap address or the HLT operation.
+ * Nothing is executed while an interrupt request is waiting
+ * Returns the number of clock cycles the executed operations took, 0 if the program has no block at the PC
+ */
+static long long cpu_exec_aot(cpu_t *cpu, long long cycle_budget) {
+    if (cpu->aot == NULL || atomic_load_explicit(&cpu->interrupt_pending, memory_order_relaxed) || !aot_is_entry(cpu->aot, regPC)) {
+        return 0;
+    }
+    aot_regs_t regs = {
+        .a = regA,
+        .f = get_status_reg(cpu),
+        .sp = regSP,
+        .pc = regPC,
+        .interrupts_enabled = cpu->state.interrupts_enabled,
+        .remaining_cycles = cycle_budget,
+        .memory = cpu->memory,
+        .page_generation = cpu->aot->page_generation,
+        .trap_map = cpu->traps->map,
+        .interrupt_pending = &cpu->interrupt_pending,
+        .io_read = cpu->io_read,
+        .io_write = cpu->io_write,
+        .io_context = cpu->io_context
+    };
+    regs.bc.single = regBC;
+    regs.de.single = regDE;
+    regs.hl.single = regHL;
+    cpu->aot->program->run(&regs);
+    regA = regs.a;
+    set_status_reg(cpu, regs.f);
+    regBC = regs.bc.single;
+    regDE = regs.de.single;
+    regHL = regs.hl.single;
+    regSP = regs.sp;
+    regPC = regs.pc;
+    cpu->state.interrupts_enabled = regs.interrupts_enabled;
+    cpu->state.halted = regs.halted;
+    cpu->aot->stats.entries++;
+    cpu->aot->stats.blocks_executed += regs.blocks_executed;
+    cpu->aot->stats.stale_exits += regs.stale;
+    return cycle_budget - regs.remaining_cycles;
+}
+
+/**
+ * Executes translated code starting at the current PC until the cycle budget is used up
+ * or an operation left to the interpreter (or a trap address) is reached.
+ * Nothing is executed while an interrupt request is waiting. While any page isn't mapped to the RAM in 'data'
+ * the translated code leaves every operation accessing such a page to the interpreter
+ * Returns the number of clock cycles the executed operations took, 0 if there is no translated code at the PC
+ */
+static long long cpu_exec_jit(cpu_t *cpu, long long cycle_budget) {
+    if (cpu->jit == NULL || atomic_load_explicit(&cpu->interrupt_pending, memory_order_relaxed)) {
+        return 0;
     }
-    return operation_cycles;
+    jit_regs_t regs = {
+        .a = regA,
+        .f = get_status_reg(cpu),
+        .bc = regBC,
+        .de = regDE,
+        .hl = regHL,
+        .sp = regSP,
+        .pc = regPC,
+        .remaining_cycles = cycle_budget,
+        .interrupt_pending = &cpu->interrupt_pending,
+        .interrupts_enabled = &cpu->state.interrupts_enabled
+    };
+    long long cycles = jit_run(cpu->jit, &regs, cpu->traps->map, cpu->traps->generation);
+    regA = regs.a;
+    set_status_reg(cpu, regs.f);
+    regBC = regs.bc;
+    regDE = regs.de;
+    regHL = regs.hl;
+    regSP = regs.sp;
+    regPC = regs.pc;
+    return cycles;
 }
 
 
 /**
- * Sets CPU registers and helper variables to their initial values
+ * Sets CPU registers and helper variables to their initial values,
+ * connects the CPU to its memory and to the default IO devices
  */
-void cpu_init() {
+void cpu_init(cpu_t *cpu, memory_t *memory) {
+    cpu->memory = memory;
+    cpu->traps = &no_traps;
+    cpu->block_cache = NULL;
+    cpu->jit = NULL;
+    cpu->aot = NULL;
+    cpu->pair_stats = NULL;
+    cpu->loop_idioms = NULL;
+    cpu->idle_loops = NULL;
+    cpu_set_io_hooks(cpu, io_read, io_write, NULL);
+    cpu_set_next_event_hook(cpu, NULL, NULL);
+    cpu->cycles = 0;
+    cpu->batch_cycles = 0;
     regPC = 0;
     regSP = 0;
     regA = 0;
     regBC = 0;
     regDE = 0;
     regHL = 0;
-    status_reg.single = 0x02;
-    cpu_state.halted = false;
-    cpu_state.interrupts_enabled = false;
+    set_status_reg(cpu, STATUS_REG_FIXED_BITS);
+    cpu->state.halted = false;
+    cpu->state.interrupts_enabled = false;
+    atomic_init(&cpu->interrupt_pending, false);
+    atomic_init(&cpu->interrupt_queue.tail, 0);
+    cpu->interrupt_queue.head = 0;
+    for (unsigned i = 0; i < CPU_INTERRUPT_QUEUE_SIZE; i++) {
+        atomic_init(&cpu->interrupt_queue.slots[i].sequence, i);
+    }
+}
+
+/**
+ * Frees everything the CPU allocated for itself,
+ * has to be called before the CPU gets initialized again or goes out of scope and before its memory is destroyed,
+ * as the JIT removes its code write hook from the memory. The code marks are left to whoever shares the memory,
+ * loading a new image over them clears them
+ */
+void cpu_destroy(cpu_t *cpu) {
+    block_cache_destroy(cpu->block_cache);
+    cpu->block_cache = NULL;
+    jit_destroy(cpu->jit);
+    cpu->jit = NULL;
+    aot_detach(cpu->aot);
+    cpu->aot = NULL;
+    free(cpu->pair_stats);
+    cpu->pair_stats = NULL;
+    loop_idioms_destroy(cpu->loop_idioms);
+    cpu->loop_idioms = NULL;
+    idle_loops_destroy(cpu->idle_loops);
+    cpu->idle_loops = NULL;
+}
+
+/**
+ * Returns the cycle of a batch (which has 'elapsed_cycles' executed so far) at which the next device event happens
+ * or 'budget_cycles' if nothing is scheduled before the end of the budget
+ */
+static long long next_event_within(cpu_t *cpu, long long elapsed_cycles, long long budget_cycles) {
+    if (cpu->next_event != NULL) {
+        long long next_event = cpu->next_event(cpu->next_event_context);
+        if (next_event >= 0 && next_event < budget_cycles - elapsed_cycles) {
+            return elapsed_cycles + next_event;
+        }
+    }
+    return budget_cycles;
 }
 
 /**
- * Executes a signle machine cylce on the CPU
+ * The processor is usually emulated in batches so to avoid being stuck in an infinite loop
+ * I've assumed that halted processor executes NOPs.
+ * Returns the number of clock cycles elapsed in a batch after the halted CPU waits from 'elapsed_cycles'
+ * until 'wake_up_cycle', rounded up to whole NOPs
+ */
+static long long halted_cycles(long long elapsed_cycles, long long wake_up_cycle) {
+    if (wake_up_cycle <= elapsed_cycles) {
+        return elapsed_cycles;
+    }
+    return elapsed_cycles + (wake_up_cycle - elapsed_cycles + 3) / 4 * 4;
+}
+
+inline static bool has_interrupt_request(cpu_interrupt_queue_t *queue) {
+    const cpu_interrupt_slot_t *slot = &queue->slots[queue->head & (CPU_INTERRUPT_QUEUE_SIZE - 1)];
+    return atomic_load_explicit(&slot->sequence, memory_order_acquire) == queue->head + 1;
+}
+
+/**
+ * Takes the oldest interrupt request out of the queue, called only from the thread running the CPU.
+ * The pending flag is cleared when the last request is taken
+ * Returns false if the queue is empty
+ */
+static bool take_interrupt_request(cpu_t *cpu, uint8_t *opcode) {
+    cpu_interrupt_queue_t *queue = &cpu->interrupt_queue;
+    if (!has_interrupt_request(queue)) {
+        return false; // A request is still being posted, the flag stays set until it's taken
+    }
+    cpu_interrupt_slot_t *slot = &queue->slots[queue->head & (CPU_INTERRUPT_QUEUE_SIZE - 1)];
+    *opcode = slot->opcode;
+    atomic_store_explicit(&slot->sequence, queue->head + CPU_INTERRUPT_QUEUE_SIZE, memory_order_release);
+    queue->head++;
+    if (!has_interrupt_request(queue)) {
+        // The flag is cleared before looking again, so a request posted in the meantime sets it back
+        atomic_store_explicit(&cpu->interrupt_pending, false, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (has_interrupt_request(queue)) {
+            atomic_store_explicit(&cpu->interrupt_pending, true, memory_order_relaxed);
+        }
+    }
+    return true;
+}
+
+/**
+ * Executes the RST operation of the oldest interrupt request if the interrupts are enabled,
+ * which disables them and wakes up a halted CPU.
+ * Called only at batch boundaries, which never fall right after EI
+ * Returns the number of clock cycles it took, 0 if no request was accepted
+ */
+static int accept_interrupt(cpu_t *cpu) {
+    uint8_t opcode;
+    if (!cpu->state.interrupts_enabled || !take_interrupt_request(cpu, &opcode)) {
+        return 0;
+    }
+    cpu->state.interrupts_enabled = false;
+    cpu->state.halted = false;
+    call_addr(cpu, opcode & 0x38);
+    return 11;
+}
+
+/**
+ * Executes a signle machine cylce on the CPU, an operation right after EI is executed together with it.
+ * A waiting interrupt request is accepted instead if the interrupts are enabled.
+ * A halted CPU skips straight to the next device event (or executes a single NOP if nothing is scheduled)
  * Returns the number of clock cycles this step took
  */
-int cpu_step() {
-    if (!cpu_state.halted) {
-        return cpu_exec_op(get_next_prog_byte());
-    } else {
-        /* The processor is usually emulated in batches
-        * so to avoid being stuck in an infinite loop
-        * I've assumed that halted processor executes NOPs 
-        */
-        return 4;
+int cpu_step(cpu_t *cpu) {
+    int cycles = atomic_load_explicit(&cpu->interrupt_pending, memory_order_relaxed) ? accept_interrupt(cpu) : 0;
+    if (cycles == 0 && !cpu->state.halted) {
+        cycles = (int)cpu_exec_ops(cpu, 1); // Every operation takes at least 4 cycles so exactly one gets executed
+    } else if (cycles == 0) {
+        long long wake_up_cycle = next_event_within(cpu, 0, INT_MAX - 3);
+        if (wake_up_cycle == INT_MAX - 3 || wake_up_cycle < 4) {
+            wake_up_cycle = 4;
+        }
+        cycles = (int)halted_cycles(0, wake_up_cycle);
+    }
+    cpu->cycles += cycles;
+    return cycles;
+}
+
+/**
+ * Executes operations until the cycle budget is used up, the CPU gets halted (and no interrupt wakes it up)
+ * or control is transferred to a trap address without a handler (or with a handler that asks to stop).
+ * Waiting interrupt requests are accepted between the batches of operations,
+ * a batch ends at the first control transfer after a request is posted (or right after the operation following EI).
+ * The operation at the current PC is always executed, so after handling a trap
+ * the caller can just call this function again
+ * Returns why the execution stopped and the number of clock cycles it took
+ */
+cpu_run_result_t cpu_run(cpu_t *cpu, long long budget_cycles) {
+    cpu_run_result_t result = {CPU_EXIT_BUDGET, 0};
+    while (result.cycles < budget_cycles) {
+        // The only check made for every batch while there are no interrupt requests
+        long long cycles = atomic_load_explicit(&cpu->interrupt_pending, memory_order_relaxed) ? accept_interrupt(cpu) : 0;
+        if (cycles == 0) {
+            if (cpu->state.halted) {
+                // The rest of the budget is spent waiting, the same way as if the CPU was halted from the start
+                long long wake_up_cycle = halted_cycles(result.cycles, next_event_within(cpu, result.cycles, budget_cycles));
+                cpu->cycles += wake_up_cycle - result.cycles;
+                result.cycles = wake_up_cycle;
+                break;
+            }
+            cycles = cpu_exec_aot(cpu, budget_cycles - result.cycles);
+            if (cycles == 0) {
+                cycles = cpu_exec_jit(cpu, budget_cycles - result.cycles);
+            }
+            if (cycles == 0) {
+                cycles = cpu_exec_ops(cpu, budget_cycles - result.cycles);
+            }
+        }
+        result.cycles += cycles;
+        cpu->cycles += cycles;
+        if (cpu->state.halted) {
+            continue; // An interrupt may wake it up right away
+        }
+        if (is_trap_address(cpu, regPC)) {
+            // Handlers are called outside of 'cpu_exec_ops' so they see the up to date registers
+            const cpu_trap_handler_t *handler = find_trap_handler(cpu->traps, regPC);
+            if (handler == NULL || !handler->callback(cpu, handler->context)) {
+                result.reason = CPU_EXIT_TRAP;
+                break;
+            }
+        }
+    }
+    if (cpu->state.halted) {
+        result.reason = CPU_EXIT_HALT;
+    }
+    return result;
+}
+
+/**
+ * Clears the trap map and the handlers table
+ */
+void cpu_traps_init(cpu_traps_t *traps) {
+    memset(traps, 0, sizeof(*traps));
+}
+
+/**
+ * Adds a trap at a given address.
+ * The callback (if not NULL) is called when control is transferred to the address,
+ * before the operation there is executed. It returns true if the execution should continue,
+ * otherwise cpu_run stops with CPU_EXIT_TRAP. A trap can be added while CPUs use the traps,
+ * their JIT throws away the translated blocks (which could run through the address) before it runs again
+ * Returns false if there is no more space in the handlers table
+ */
+bool cpu_traps_add(cpu_traps_t *traps, uint16_t address, cpu_trap_callback_t callback, void *context) {
+    if (callback != NULL) {
+        if (traps->handlers_count >= CPU_MAX_TRAP_HANDLERS) {
+            return false;
+        }
+        cpu_trap_handler_t *handler = &traps->handlers[traps->handlers_count++];
+        handler->address = address;
+        handler->callback = callback;
+        handler->context = context;
+    }
+    traps->map[address >> 3] |= (1 << (address & 0x07));
+    traps->generation++;
+    return true;
+}
+
+/**
+ * Removes the trap (and its handler) at a given address
+ */
+void cpu_traps_remove(cpu_traps_t *traps, uint16_t address) {
+    traps->map[address >> 3] &= ~(1 << (address & 0x07));
+    traps->generation++;
+    for (int i = 0; i < traps->handlers_count; i++) {
+        if (traps->handlers[i].address == address) {
+            traps->handlers[i] = traps->handlers[--traps->handlers_count];
+            break;
+        }
+    }
+}
+
+/**
+ * Sets the trap map used by the CPU, the same map can be shared by many CPUs.
+ * Passing NULL removes all traps
+ */
+void cpu_set_traps(cpu_t *cpu, const cpu_traps_t *traps) {
+    cpu->traps = (traps != NULL) ? traps : &no_traps;
+    if (cpu->jit != NULL) {
+        jit_flush(cpu->jit); // Translated blocks may run through the new trap addresses
     }
 }
 
+/**
+ * Posts an interrupt request with a given RST operation, can be called from any thread.
+ * Requests are accepted in the order they were posted, one at every batch boundary
+ * at which the interrupts are enabled. A running batch ends at its next control transfer
+ * Returns false if the operation isn't RST or the queue is full
+ */
+bool cpu_request_interrupt(cpu_t *cpu, uint8_t opcode) {
+    if ((opcode & 0xC7) != 0xC7) {
+        return false;
+    }
+    cpu_interrupt_queue_t *queue = &cpu->interrupt_queue;
+    unsigned position = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+    cpu_interrupt_slot_t *slot;
+    while (true) {
+        slot = &queue->slots[position & (CPU_INTERRUPT_QUEUE_SIZE - 1)];
+        int difference = (int)(atomic_load_explicit(&slot->sequence, memory_order_acquire) - position);
+        if (difference == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->tail, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (difference < 0) {
+            return false; // The slot still holds a request from the previous round
+        } else {
+            position = atomic_load_explicit(&queue->tail, memory_order_relaxed); // Another thread took the slot
+        }
+    }
+    slot->opcode = opcode;
+    atomic_store_explicit(&slot->sequence, position + 1, memory_order_release);
+    // Pairs with the fence in take_interrupt_request, so the flag can't be left cleared with the request in the queue
+    atomic_thread_fence(memory_order_seq_cst);
+    atomic_store_explicit(&cpu->interrupt_pending, true, memory_order_relaxed);
+    return true;
+}
+
+/**
+ * Connects the CPU to the IO devices, the context is passed to every hook call.
+ * The interpreter hands the hooks its current state, so they may read and change the CPU through
+ * the other cpu_ functions (a changed PC is followed after the IN or OUT). The hooks called by the AOT program
+ * and by the input loops executed in bulk (CPU_LOOP_IDIOMS) see the registers from the start of the batch
+ * and anything they change in the CPU is overwritten at its end
+ */
+void cpu_set_io_hooks(cpu_t *cpu, cpu_io_read_hook_t io_read_hook, cpu_io_write_hook_t io_write_hook, void *io_context) {
+    cpu->io_read = io_read_hook;
+    cpu->io_write = io_write_hook;
+    cpu->io_context = io_context;
+}
+
+/**
+ * Sets the hook telling the CPU how many clock cycles are left until the next device event,
+ * a halted CPU skips straight to it. NULL means that nothing is ever scheduled
+ */
+void cpu_set_next_event_hook(cpu_t *cpu, cpu_next_event_hook_t next_event_hook, void *next_event_context) {
+    cpu->next_event = next_event_hook;
+    cpu->next_event_context = next_event_context;
+}
+
 /**
  * Sets the PC register to specified value
  */
-void cpu_set_PC_reg(uint16_t val) {
+void cpu_set_PC_reg(cpu_t *cpu, uint16_t val) {
     regPC = val;
 }
 
 /**
  * Returns the current value of register PC
  */
-uint16_t cpu_get_PC_reg() {
+uint16_t cpu_get_PC_reg(cpu_t *cpu) {
     return regPC;
 }
 
+/**
+ * Copies all registers and the interrupt and halt state
+ */
+void cpu_get_registers(cpu_t *cpu, cpu_registers_t *registers) {
+    registers->pc = regPC;
+    registers->sp = regSP;
+    registers->bc = regBC;
+    registers->de = regDE;
+    registers->hl = regHL;
+    registers->a = regA;
+    registers->f = get_status_reg(cpu);
+    registers->interrupts_enabled = cpu->state.interrupts_enabled;
+    registers->halted = cpu->state.halted;
+}
+
+/**
+ * Overwrites all registers and the interrupt and halt state, the fixed bits of F are corrected
+ */
+void cpu_set_registers(cpu_t *cpu, const cpu_registers_t *registers) {
+    regPC = registers->pc;
+    regSP = registers->sp;
+    regBC = registers->bc;
+    regDE = registers->de;
+    regHL = registers->hl;
+    regA = registers->a;
+    set_status_reg(cpu, (registers->f & (FLAG_C | FLAG_P | FLAG_AC | FLAG_Z | FLAG_S)) | STATUS_REG_FIXED_BITS);
+    cpu->state.interrupts_enabled = registers->interrupts_enabled;
+    cpu->state.halted = registers->halted;
+}
+
+/**
+ * Returns the number of clock cycles executed since cpu_init.
+ * Called from an I/O hook it gives the cycle of the IN or OUT operation
+ * (recompiled code only updates the counter when it returns, so devices see the cycle it was entered at)
+ */
+uint64_t cpu_get_cycles(cpu_t *cpu) {
+    return cpu->cycles + cpu->batch_cycles;
+}
+
 /**
  * Returns the current value of register C
  */
-uint8_t cpu_get_C_reg() {
+uint8_t cpu_get_C_reg(cpu_t *cpu) {
     return regC;
 }
 
 /**
  * Returns the current value of register E
  */
-uint8_t cpu_get_E_reg() {
+uint8_t cpu_get_E_reg(cpu_t *cpu) {
     return regE;
 }
 
 /**
  * Returns the current value of register DE
  */
-uint16_t cpu_get_DE_reg() {
+uint16_t cpu_get_DE_reg(cpu_t *cpu) {
     return regDE;
 }
+
+/**
+ * Returns the name of the opcode dispatch core (and flags mode) the emulator was built with
+ */
+const char *cpu_get_core_name() {
+#ifdef CPU_LAZY_FLAGS
+#define CPU_FLAGS_NAME ", lazy flags"
+#else
+#define CPU_FLAGS_NAME ""
+#endif
+#ifdef CPU_FUSED_OPS
+#define CPU_FETCH_NAME ", block cache, fused operations"
+#elif defined(CPU_BLOCK_CACHE)
+#define CPU_FETCH_NAME ", block cache"
+#elif defined(CPU_JIT)
+#define CPU_FETCH_NAME ", JIT"
+#else
+#define CPU_FETCH_NAME ""
+#endif
+    return CPU_CORE_NAME CPU_FLAGS_NAME CPU_FETCH_NAME;
+}
+
+/**
+ * Copies the statistics of the block cache
+ * Returns false if the CPU doesn't use the block cache
+ */
+bool cpu_get_block_cache_stats(cpu_t *cpu, block_cache_stats_t *stats) {
+    if (cpu->block_cache == NULL) {
+        return false;
+    }
+    *stats = cpu->block_cache->stats;
+    return true;
+}
+
+/**
+ * Copies the statistics of the JIT
+ * Returns false if the CPU doesn't use the JIT
+ */
+bool cpu_get_jit_stats(cpu_t *cpu, jit_stats_t *stats) {
+    if (cpu->jit == NULL) {
+        return false;
+    }
+    *stats = cpu->jit->stats;
+    return true;
+}
+
+/**
+ * Copies the statistics of the loops executed in bulk
+ * Returns false if the CPU doesn't look for such loops
+ */
+bool cpu_get_loop_idiom_stats(cpu_t *cpu, loop_idiom_stats_t *stats) {
+    if (cpu->loop_idioms == NULL) {
+        return false;
+    }
+    *stats = cpu->loop_idioms->stats;
+    return true;
+}
+
+/**
+ * Copies the statistics of the skipped port polling loops
+ * Returns false if the CPU doesn't look for such loops
+ */
+bool cpu_get_idle_loop_stats(cpu_t *cpu, idle_loop_stats_t *stats) {
+    if (cpu->idle_loops == NULL) {
+        return false;
+    }
+    *stats = cpu->idle_loops->stats;
+    return true;
+}
+
+/**
+ * Finds the most often executed pairs of operations, sorted from the most frequent one
+ * Returns the number of pairs written to 'pairs', 0 if the CPU doesn't collect pair statistics
+ */
+int cpu_get_top_pairs(cpu_t *cpu, cpu_op_pair_t *pairs, int max_pairs) {
+    if (cpu->pair_stats == NULL) {
+        return 0;
+    }
+    int pairs_count = 0;
+    for (int first = 0; first < 256; first++) {
+        for (int second = 0; second < 256; second++) {
+            unsigned long long count = cpu->pair_stats->counts[first][second];
+            if (count == 0 || (pairs_count == max_pairs && count <= pairs[max_pairs - 1].count)) {
+                continue;
+            }
+            // Insertion into the sorted list, dropping the last pair if it's full
+            int i = (pairs_count < max_pairs) ? pairs_count++ : max_pairs - 1;
+            while (i > 0 && pairs[i - 1].count < count) {
+                pairs[i] = pairs[i - 1];
+                i--;
+            }
+            pairs[i] = (cpu_op_pair_t){ .first_opcode = first, .second_opcode = second, .count = count };
+        }
+    }
+    return pairs_count;
+}
+
+/**
+ * Looks for a recompiled program (linked in with CPU_AOT_PROGRAMS) whose image is loaded in the CPU's memory,
+ * cpu_run executes its blocks natively from then on. Has to be called after the program is loaded
+ * Returns false if there is no such program
+ */
+bool cpu_use_aot(cpu_t *cpu) {
+    aot_detach(cpu->aot);
+    cpu->aot = NULL;
+    const aot_program_t *program = aot_find(cpu->memory);
+    if (program == NULL) {
+        return false;
+    }
+    cpu->aot = aot_attach(program, cpu->memory);
+    if (cpu->aot == NULL) {
+        perror("AOT allocation error");
+        exit(-1);
+    }
+    return true;
+}
+
+/**
+ * Copies the statistics of the recompiled program
+ * Returns the name of the program or NULL if the CPU doesn't use one
+ */
+const char *cpu_get_aot_stats(cpu_t *cpu, unsigned long long *blocks_executed, unsigned long long *stale_exits) {
+    if (cpu->aot == NULL) {
+        return NULL;
+    }
+    *blocks_executed = cpu->aot->stats.blocks_executed;
+    *stale_exits = cpu->aot->stats.stale_exits;
+    return cpu->aot->program->name;
+}
@@ -3,6 +3,12 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include "memory.h"
+#include "block_cache.h"
+#include "jit.h"
+#include "loop_idiom.h"
+#include "idle_loop.h"
 
 #define CPU_FREQ 2000000
 
@@ -28,25 +34,188 @@ typedef union STATUS_REG {
     } flags;
 } status_reg_t;
 
+// Masks of the flags inside status_reg_t.single
+#define FLAG_C  0x01
+#define FLAG_P  0x04
+#define FLAG_AC 0x10
+#define FLAG_Z  0x40
+#define FLAG_S  0x80
+#define STATUS_REG_FIXED_BITS 0x02 // Bit 1 is always set, bits 3 and 5 are always reset
+
 typedef struct CPU_STATE {
     bool interrupts_enabled;
     bool halted;
 } cpu_state_t;
 
-void cpu_init();
+// Registers and state of the CPU visible to programs, e.g. to save and restore them
+typedef struct CPU_REGISTERS {
+    uint16_t pc, sp, bc, de, hl;
+    uint8_t a;
+    uint8_t f; // Status register, bits 1, 3 and 5 are fixed
+    bool interrupts_enabled;
+    bool halted;
+} cpu_registers_t;
+
+// Result of the last flag-setting operation, used only when built with CPU_LAZY_FLAGS
+typedef struct LAZY_FLAGS {
+    uint16_t result; // 9bit result, the 9th bit is the carry
+    uint8_t aux; // Bit 4 of (aux ^ result) is the AC flag
+    bool pending; // True if status_reg is out of date
+} lazy_flags_t;
+
+// Numbers of executed pairs of operations, collected only when built with CPU_PAIR_STATS
+typedef struct CPU_OP_PAIR_STATS {
+    unsigned long long counts[256][256]; // Indexed by the opcode of the first and of the second operation
+    uint8_t previous_opcode;
+} cpu_pair_stats_t;
+
+typedef struct CPU_OP_PAIR {
+    uint8_t first_opcode;
+    uint8_t second_opcode;
+    unsigned long long count;
+} cpu_op_pair_t;
+
+#define CPU_MAX_TRAP_HANDLERS 16
+#define CPU_INTERRUPT_QUEUE_SIZE 16 // Number of waiting interrupt requests, must be a power of 2
+
+typedef struct CPU cpu_t;
+
+typedef struct AOT aot_t;
+
+typedef bool (*cpu_trap_callback_t)(cpu_t *cpu, void *context);
+
+typedef struct CPU_TRAP_HANDLER {
+    uint16_t address;
+    cpu_trap_callback_t callback;
+    void *context;
+} cpu_trap_handler_t;
+
+/*
+ * Addresses at which cpu_run stops (or calls a handler) when control is transferred to them,
+ * before the operation at the address is executed
+ */
+typedef struct CPU_TRAPS {
+    uint8_t map[MEMORY_SIZE / 8]; // One bit per address
+    cpu_trap_handler_t handlers[CPU_MAX_TRAP_HANDLERS];
+    int handlers_count;
+    uint32_t generation; // Incremented on every added or removed trap, the JIT flushes its blocks when it changes
+} cpu_traps_t;
+
+typedef struct CPU_INTERRUPT_SLOT {
+    atomic_uint sequence; // Position in the queue the slot can be written at, or one more once it holds a request
+    uint8_t opcode;
+} cpu_interrupt_slot_t;
+
+/*
+ * Bounded lock-free queue of interrupt requests. Any number of threads can post them,
+ * only the thread running the CPU takes them out
+ */
+typedef struct CPU_INTERRUPT_QUEUE {
+    atomic_uint tail; // Position of the next posted request
+    unsigned head; // Position of the next request taken by the CPU
+    cpu_interrupt_slot_t slots[CPU_INTERRUPT_QUEUE_SIZE];
+} cpu_interrupt_queue_t;
+
+typedef enum CPU_EXIT_REASON {
+    CPU_EXIT_BUDGET, // The cycle budget was used up
+    CPU_EXIT_HALT, // The CPU is halted
+    CPU_EXIT_TRAP // Control was transferred to a trap address
+} cpu_exit_reason_t;
+
+typedef struct CPU_RUN_RESULT {
+    cpu_exit_reason_t reason;
+    long long cycles;
+} cpu_run_result_t;
+
+typedef uint8_t (*cpu_io_read_hook_t)(void *context, uint8_t dev_id);
+typedef void (*cpu_io_write_hook_t)(void *context, uint8_t dev_id, uint8_t data);
+// Returns the number of clock cycles from cpu_get_cycles until the next device event or a negative value if nothing is scheduled
+typedef long long (*cpu_next_event_hook_t)(void *context);
+
+/*
+ * The whole state of a single emulated CPU, so any number of them can run
+ * in one process (each one from a single thread at a time).
+ * The registers come first and the structure is aligned to a cache line
+ * so the state used by every operation fits in the first line.
+ */
+struct CPU {
+    reg_16bit_t _regPC, _regSP, _regBC, _regDE, _regHL; // Don't use directly, use defines from cpu.c instead
+    uint8_t _regA;
+    status_reg_t status_reg;
+    lazy_flags_t lazy_flags;
+    cpu_state_t state;
+    memory_t *memory;
+    const cpu_traps_t *traps;
+    block_cache_t *block_cache; // Used only with CPU_BLOCK_CACHE, allocated on first use
+    jit_t *jit; // Used only with CPU_JIT, allocated on first use
+    aot_t *aot; // Recompiled program found by cpu_use_aot
+    cpu_pair_stats_t *pair_stats; // Used only with CPU_PAIR_STATS, allocated on first use
+    loop_idioms_t *loop_idioms; // Used only with CPU_LOOP_IDIOMS, allocated on first use
+    idle_loops_t *idle_loops; // Used only with CPU_IDLE_LOOPS, allocated on first use
+    cpu_io_read_hook_t io_read;
+    cpu_io_write_hook_t io_write;
+    void *io_context;
+    cpu_next_event_hook_t next_event;
+    void *next_event_context;
+    uint64_t cycles; // Clock cycles executed since cpu_init, updated after every batch
+    long long batch_cycles; // Cycles of the current batch executed before the running IN or OUT, 0 outside of them
+    // Fields below can be changed from outside of the CPU thread, cpu_run doesn't copy them back
+    atomic_bool interrupt_pending; // Set when an interrupt request may be waiting in the queue
+    cpu_interrupt_queue_t interrupt_queue;
+} __attribute__((aligned(64)));
+
+void cpu_init(cpu_t *cpu, memory_t *memory);
+
+void cpu_destroy(cpu_t *cpu);
+
+int cpu_step(cpu_t *cpu);
+
+cpu_run_result_t cpu_run(cpu_t *cpu, long long budget_cycles);
+
+void cpu_traps_init(cpu_traps_t *traps);
+
+bool cpu_traps_add(cpu_traps_t *traps, uint16_t address, cpu_trap_callback_t callback, void *context);
+
+void cpu_traps_remove(cpu_traps_t *traps, uint16_t address);
+
+void cpu_set_traps(cpu_t *cpu, const cpu_traps_t *traps);
+
+bool cpu_request_interrupt(cpu_t *cpu, uint8_t opcode);
+
+void cpu_set_io_hooks(cpu_t *cpu, cpu_io_read_hook_t io_read_hook, cpu_io_write_hook_t io_write_hook, void *io_context);
+
+void cpu_set_next_event_hook(cpu_t *cpu, cpu_next_event_hook_t next_event_hook, void *next_event_context);
+
+void cpu_set_PC_reg(cpu_t *cpu, uint16_t val);
+
+uint16_t cpu_get_PC_reg(cpu_t *cpu);
+
+uint64_t cpu_get_cycles(cpu_t *cpu);
+
+void cpu_get_registers(cpu_t *cpu, cpu_registers_t *registers);
+
+void cpu_set_registers(cpu_t *cpu, const cpu_registers_t *registers);
+
+uint8_t cpu_get_C_reg(cpu_t *cpu);
+
+uint8_t cpu_get_E_reg(cpu_t *cpu);
+
+uint16_t cpu_get_DE_reg(cpu_t *cpu);
+
+const char *cpu_get_core_name();
 
-int cpu_step();
+bool cpu_get_block_cache_stats(cpu_t *cpu, block_cache_stats_t *stats);
 
-void cpu_request_interrupt(uint8_t opcode);
+bool cpu_get_jit_stats(cpu_t *cpu, jit_stats_t *stats);
 
-void cpu_set_PC_reg(uint16_t val);
+bool cpu_get_loop_idiom_stats(cpu_t *cpu, loop_idiom_stats_t *stats);
 
-uint16_t cpu_get_PC_reg();
+bool cpu_get_idle_loop_stats(cpu_t *cpu, idle_loop_stats_t *stats);
 
-uint8_t cpu_get_C_reg();
+int cpu_get_top_pairs(cpu_t *cpu, cpu_op_pair_t *pairs, int max_pairs);
 
-uint8_t cpu_get_E_reg();
+bool cpu_use_aot(cpu_t *cpu);
 
-uint16_t cpu_get_DE_reg();
+const char *cpu_get_aot_stats(cpu_t *cpu, unsigned long long *blocks_executed, unsigned long long *stale_exits);
 
 #endif // __CPU_H__
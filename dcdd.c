@@ -0,0 +1,362 @@
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "dcdd.h"
+
+/**
+ * Returns the selected drive with a disk or NULL if there is none
+ */
+static dcdd_drive_t *selected_drive(dcdd_t *dcdd) {
+    if (dcdd->selected < 0 || dcdd->drives[dcdd->selected].fd < 0) {
+        return NULL;
+    }
+    return &dcdd->drives[dcdd->selected];
+}
+
+/**
+ * Returns the offset of a sector of the current track in the image
+ */
+inline static size_t sector_offset(const dcdd_drive_t *drive, uint8_t sector) {
+    return (size_t)drive->track * DCDD_TRACK_SIZE + (size_t)sector * DCDD_SECTOR_SIZE;
+}
+
+/**
+ * Moves the accurate mode to the sector under the head at the current cycle,
+ * a new sector is read again from its first byte
+ */
+static void sync_sector(dcdd_t *dcdd, uint64_t now) {
+    uint64_t number = now / DCDD_SECTOR_CYCLES;
+    if (number != dcdd->sector_number) {
+        dcdd->sector_number = number;
+        dcdd->sector = number % DCDD_SECTORS;
+        dcdd->read_index = 0;
+    }
+}
+
+/**
+ * Writes back the pages of the dirty sectors of a drive, runs of adjacent sectors with one msync
+ */
+static void flush_drive(dcdd_t *dcdd, dcdd_drive_t *drive, int flags) {
+    if (!drive->has_dirty) {
+        return;
+    }
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    int sectors = drive->tracks * DCDD_SECTORS;
+    for (int first = 0; first < sectors; first++) {
+        if (!(drive->dirty[first / 64] & (1ULL << (first % 64)))) {
+            continue;
+        }
+        int last = first;
+        while (last + 1 < sectors && (drive->dirty[(last + 1) / 64] & (1ULL << ((last + 1) % 64)))) {
+            last++;
+        }
+        size_t start = (size_t)first * DCDD_SECTOR_SIZE & ~(page_size - 1);
+        size_t end = (size_t)(last + 1) * DCDD_SECTOR_SIZE;
+        msync(drive->image + start, end - start, flags);
+        dcdd->stats.flushes++;
+        first = last;
+    }
+    memset(drive->dirty, 0, sizeof(drive->dirty));
+    drive->has_dirty = false;
+}
+
+/**
+ * Drive status, 0xFF if no drive is selected
+ */
+static uint8_t status_read(void *context, uint8_t port) {
+    (void)port;
+    dcdd_t *dcdd = context;
+    dcdd_drive_t *drive = selected_drive(dcdd);
+    if (drive == NULL) {
+        return 0xFF;
+    }
+    uint64_t now = cpu_get_cycles(dcdd->cpu);
+    uint8_t status = 0xFF & ~0x18; // Bits 3 and 4 are always 0
+    if (dcdd->writing && dcdd->write_index < DCDD_SECTOR_SIZE
+        && (dcdd->fast || now >= dcdd->write_start_cycle + (uint64_t)dcdd->write_index * DCDD_BYTE_CYCLES)) {
+        status &= ~DCDD_STATUS_ENWD;
+    }
+    if (dcdd->fast || now >= drive->move_ready_cycle) {
+        status &= ~DCDD_STATUS_MOVE_HEAD;
+    }
+    if (drive->head_loaded && (dcdd->fast || now >= drive->head_ready_cycle)) {
+        status &= ~DCDD_STATUS_HEAD;
+        if (!dcdd->fast) {
+            sync_sector(dcdd, now);
+        }
+        // Byte k of the sector passes the head k + 1 byte times after the sector pulse
+        if (dcdd->read_index < DCDD_SECTOR_SIZE
+            && (dcdd->fast || now >= dcdd->sector_number * DCDD_SECTOR_CYCLES + (uint64_t)(dcdd->read_index + 1) * DCDD_BYTE_CYCLES)) {
+            status &= ~DCDD_STATUS_NRDA;
+        }
+    }
+    if (dcdd->interrupts_enabled) {
+        status &= ~DCDD_STATUS_INTE;
+    }
+    if (drive->track == 0) {
+        status &= ~DCDD_STATUS_TRACK_0;
+    }
+    return status;
+}
+
+/**
+ * Selects a drive (bits 0-3) or deselects all of them, the drive which isn't selected anymore
+ * starts writing back its dirty sectors
+ */
+static void select_write(void *context, uint8_t port, uint8_t data) {
+    (void)port;
+    dcdd_t *dcdd = context;
+    dcdd_drive_t *previous = selected_drive(dcdd);
+    int selected = (data & DCDD_SELECT_DISABLE) ? -1 : (data & 0x0F);
+    if (previous != NULL && selected != dcdd->selected) {
+        flush_drive(dcdd, previous, MS_ASYNC);
+    }
+    dcdd->selected = selected;
+    dcdd->read_index = 0;
+    dcdd->writing = false;
+}
+
+/**
+ * Sector position (bits 1-5) with the sector true bit, 0xFF if the head isn't loaded.
+ * In the fast mode the next sector comes under the head at every read
+ */
+static uint8_t sector_read(void *context, uint8_t port) {
+    (void)port;
+    dcdd_t *dcdd = context;
+    dcdd_drive_t *drive = selected_drive(dcdd);
+    if (drive == NULL || !drive->head_loaded) {
+        return 0xFF;
+    }
+    uint8_t sector_true = 1;
+    if (dcdd->fast) {
+        dcdd->sector = (dcdd->sector + 1) % DCDD_SECTORS;
+        dcdd->read_index = 0;
+        sector_true = 0;
+    } else {
+        uint64_t now = cpu_get_cycles(dcdd->cpu);
+        sync_sector(dcdd, now);
+        // The sector is true until its first byte passes the head
+        if (now < dcdd->sector_number * DCDD_SECTOR_CYCLES + DCDD_BYTE_CYCLES) {
+            sector_true = 0;
+        }
+    }
+    return 0xC0 | (dcdd->sector << 1) | sector_true;
+}
+
+/**
+ * Steps and loads the head, enables interrupts and starts writing the sector under the head
+ */
+static void control_write(void *context, uint8_t port, uint8_t data) {
+    (void)port;
+    dcdd_t *dcdd = context;
+    dcdd_drive_t *drive = selected_drive(dcdd);
+    if (drive == NULL) {
+        return;
+    }
+    uint64_t now = cpu_get_cycles(dcdd->cpu);
+    if ((data & DCDD_CONTROL_STEP_IN) && drive->track + 1 < drive->tracks) {
+        drive->track++;
+        drive->move_ready_cycle = now + DCDD_STEP_CYCLES;
+        dcdd->read_index = 0;
+    }
+    if ((data & DCDD_CONTROL_STEP_OUT) && drive->track > 0) {
+        drive->track--;
+        drive->move_ready_cycle = now + DCDD_STEP_CYCLES;
+        dcdd->read_index = 0;
+    }
+    if ((data & DCDD_CONTROL_HEAD_LOAD) && !drive->head_loaded) {
+        drive->head_loaded = true;
+        drive->head_ready_cycle = now + DCDD_HEAD_LOAD_CYCLES;
+    }
+    if (data & DCDD_CONTROL_HEAD_UNLOAD) {
+        drive->head_loaded = false;
+        dcdd->writing = false;
+        flush_drive(dcdd, drive, MS_ASYNC);
+    }
+    if (data & DCDD_CONTROL_INTERRUPT_ENABLE) {
+        dcdd->interrupts_enabled = true;
+    }
+    if (data & DCDD_CONTROL_INTERRUPT_DISABLE) {
+        dcdd->interrupts_enabled = false;
+    }
+    if ((data & DCDD_CONTROL_WRITE_ENABLE) && drive->head_loaded) {
+        if (!dcdd->fast) {
+            sync_sector(dcdd, now);
+        }
+        dcdd->writing = true;
+        dcdd->write_sector = dcdd->sector;
+        dcdd->write_index = 0;
+        dcdd->write_start_cycle = now;
+    }
+}
+
+/**
+ * Next byte of the sector under the head, 0 past its end
+ */
+static uint8_t data_read(void *context, uint8_t port) {
+    (void)port;
+    dcdd_t *dcdd = context;
+    dcdd_drive_t *drive = selected_drive(dcdd);
+    if (drive == NULL || !drive->head_loaded) {
+        return 0;
+    }
+    if (!dcdd->fast) {
+        sync_sector(dcdd, cpu_get_cycles(dcdd->cpu));
+    }
+    if (dcdd->read_index >= DCDD_SECTOR_SIZE) {
+        return 0;
+    }
+    if (dcdd->read_index == 0) {
+        dcdd->stats.sectors_read++;
+    }
+    return drive->image[sector_offset(drive, dcdd->sector) + dcdd->read_index++];
+}
+
+/**
+ * Rest of the sector under the head at once, used only in the fast mode
+ * where the data is always ready
+ */
+static size_t data_read_block(void *context, uint8_t port, uint8_t *bytes, size_t count) {
+    (void)port;
+    dcdd_t *dcdd = context;
+    dcdd_drive_t *drive = selected_drive(dcdd);
+    if (!dcdd->fast || drive == NULL || !drive->head_loaded || dcdd->read_index >= DCDD_SECTOR_SIZE) {
+        return 0;
+    }
+    size_t left = DCDD_SECTOR_SIZE - dcdd->read_index;
+    if (count > left) {
+        count = left;
+    }
+    if (dcdd->read_index == 0) {
+        dcdd->stats.sectors_read++;
+    }
+    memcpy(bytes, &drive->image[sector_offset(drive, dcdd->sector) + dcdd->read_index], count);
+    dcdd->read_index += count;
+    dcdd->stats.block_reads++;
+    return count;
+}
+
+/**
+ * Next byte of the sector being written, marks the sector dirty
+ */
+static void data_write(void *context, uint8_t port, uint8_t data) {
+    (void)port;
+    dcdd_t *dcdd = context;
+    dcdd_drive_t *drive = selected_drive(dcdd);
+    if (drive == NULL || !dcdd->writing || dcdd->write_index >= DCDD_SECTOR_SIZE) {
+        return;
+    }
+    if (!drive->read_only) {
+        drive->image[sector_offset(drive, dcdd->write_sector) + dcdd->write_index] = data;
+        int sector = drive->track * DCDD_SECTORS + dcdd->write_sector;
+        drive->dirty[sector / 64] |= 1ULL << (sector % 64);
+        drive->has_dirty = true;
+    }
+    if (++dcdd->write_index == DCDD_SECTOR_SIZE) {
+        dcdd->writing = false;
+        dcdd->stats.sectors_written++;
+    }
+}
+
+/**
+ * Prepares a controller with empty drives, 'fast' selects the fast mode
+ */
+void dcdd_init(dcdd_t *dcdd, cpu_t *cpu, bool fast) {
+    memset(dcdd, 0, sizeof(dcdd_t));
+    dcdd->cpu = cpu;
+    dcdd->fast = fast;
+    dcdd->selected = -1;
+    dcdd->sector_number = UINT64_MAX;
+    for (int i = 0; i < DCDD_DRIVES; i++) {
+        dcdd->drives[i].fd = -1;
+    }
+}
+
+/**
+ * Puts a disk image into a drive, the image is opened read-only if it can't be written.
+ * Images shorter than 77 tracks (but with whole tracks) are allowed
+ * Returns false if the file can't be opened or mapped or it has a wrong size
+ */
+bool dcdd_mount(dcdd_t *dcdd, int drive_number, const char *path) {
+    if (drive_number < 0 || drive_number >= DCDD_DRIVES) {
+        return false;
+    }
+    dcdd_unmount(dcdd, drive_number);
+    dcdd_drive_t *drive = &dcdd->drives[drive_number];
+    bool read_only = false;
+    int fd = open(path, O_RDWR);
+    if (fd < 0 && (errno == EACCES || errno == EROFS)) {
+        fd = open(path, O_RDONLY);
+        read_only = true;
+    }
+    if (fd < 0) {
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0 || file_stat.st_size > DCDD_IMAGE_SIZE
+        || file_stat.st_size % DCDD_TRACK_SIZE != 0) {
+        close(fd);
+        return false;
+    }
+    void *image = mmap(NULL, file_stat.st_size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    memset(drive, 0, sizeof(dcdd_drive_t));
+    drive->fd = fd;
+    drive->image = image;
+    drive->image_size = file_stat.st_size;
+    drive->tracks = file_stat.st_size / DCDD_TRACK_SIZE;
+    drive->read_only = read_only;
+    return true;
+}
+
+/**
+ * Writes back the dirty sectors of a drive and takes its disk out, does nothing if the drive is empty
+ */
+void dcdd_unmount(dcdd_t *dcdd, int drive_number) {
+    dcdd_drive_t *drive = &dcdd->drives[drive_number];
+    if (drive->fd < 0) {
+        return;
+    }
+    flush_drive(dcdd, drive, MS_SYNC);
+    munmap(drive->image, drive->image_size);
+    close(drive->fd);
+    drive->fd = -1;
+    drive->image = NULL;
+    if (dcdd->selected == drive_number) {
+        dcdd->writing = false;
+    }
+}
+
+/**
+ * Writes back the dirty sectors of every drive and waits until they are written
+ */
+void dcdd_flush(dcdd_t *dcdd) {
+    for (int i = 0; i < DCDD_DRIVES; i++) {
+        if (dcdd->drives[i].fd >= 0) {
+            flush_drive(dcdd, &dcdd->drives[i], MS_SYNC);
+        }
+    }
+}
+
+void dcdd_close(dcdd_t *dcdd) {
+    for (int i = 0; i < DCDD_DRIVES; i++) {
+        dcdd_unmount(dcdd, i);
+    }
+}
+
+/**
+ * Connects the controller to its three ports starting at DCDD_PORT_SELECT
+ */
+void dcdd_attach(dcdd_t *dcdd, io_bus_t *bus) {
+    io_bus_register(bus, DCDD_PORT_SELECT, status_read, select_write, dcdd);
+    io_bus_register(bus, DCDD_PORT_CONTROL, sector_read, control_write, dcdd);
+    io_bus_register(bus, DCDD_PORT_DATA, data_read, data_write, dcdd);
+    io_bus_register_block(bus, DCDD_PORT_DATA, data_read_block);
+}
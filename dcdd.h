@@ -0,0 +1,106 @@
+#ifndef __DCDD_H__
+#define __DCDD_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "cpu.h"
+#include "io.h"
+
+#define DCDD_PORT_SELECT 0x08 // Drive select (written) and drive status (read)
+#define DCDD_PORT_CONTROL 0x09 // Drive control (written) and sector position (read)
+#define DCDD_PORT_DATA 0x0A
+#define DCDD_DRIVES 16
+#define DCDD_TRACKS 77
+#define DCDD_SECTORS 32
+#define DCDD_SECTOR_SIZE 137
+#define DCDD_TRACK_SIZE (DCDD_SECTORS * DCDD_SECTOR_SIZE)
+#define DCDD_IMAGE_SIZE (DCDD_TRACKS * DCDD_TRACK_SIZE)
+
+// Timing of an 8" drive spinning at 360 rpm with 250 kbit/s, in clock cycles of the CPU
+#define DCDD_SECTOR_CYCLES (CPU_FREQ / 6 / DCDD_SECTORS)
+#define DCDD_BYTE_CYCLES (CPU_FREQ / 31250) // 32 us
+#define DCDD_STEP_CYCLES (CPU_FREQ / 100) // 10 ms
+#define DCDD_HEAD_LOAD_CYCLES (CPU_FREQ / 25) // 40 ms
+
+// Drive status, every bit is active low
+#define DCDD_STATUS_ENWD 0x01 // Enter new write data
+#define DCDD_STATUS_MOVE_HEAD 0x02 // The head may be stepped
+#define DCDD_STATUS_HEAD 0x04 // The head is loaded and settled
+#define DCDD_STATUS_INTE 0x20 // Interrupts are enabled
+#define DCDD_STATUS_TRACK_0 0x40
+#define DCDD_STATUS_NRDA 0x80 // New read data available
+// Drive control
+#define DCDD_CONTROL_STEP_IN 0x01
+#define DCDD_CONTROL_STEP_OUT 0x02
+#define DCDD_CONTROL_HEAD_LOAD 0x04
+#define DCDD_CONTROL_HEAD_UNLOAD 0x08
+#define DCDD_CONTROL_INTERRUPT_ENABLE 0x10
+#define DCDD_CONTROL_INTERRUPT_DISABLE 0x20
+#define DCDD_CONTROL_WRITE_ENABLE 0x80
+// Drive select
+#define DCDD_SELECT_DISABLE 0x80
+// Sector position
+#define DCDD_SECTOR_NOT_TRUE 0x01 // Cleared at the start of a sector
+
+/*
+ * Drive with a disk image mapped from a host file, the sectors are written straight to the mapping
+ * and marked in a bitmap, so msync only has to write back the pages of the written sectors
+ */
+typedef struct DCDD_DRIVE {
+    int fd; // -1 if there is no disk in the drive
+    uint8_t *image;
+    size_t image_size;
+    int tracks;
+    bool read_only;
+    uint8_t track;
+    bool head_loaded;
+    uint64_t head_ready_cycle; // Cycle the head settles at after it is loaded
+    uint64_t move_ready_cycle; // Cycle the last step ends at
+    bool has_dirty;
+    uint64_t dirty[(DCDD_TRACKS * DCDD_SECTORS + 63) / 64]; // Sectors written since the last flush
+} dcdd_drive_t;
+
+typedef struct DCDD_STATS {
+    unsigned long long sectors_read; // Sectors whose first byte was read
+    unsigned long long sectors_written;
+    unsigned long long block_reads; // Parts of sectors read at once by input loops executed in bulk
+    unsigned long long flushes; // Ranges of dirty sectors written back with msync
+} dcdd_stats_t;
+
+/*
+ * Altair 88-DCDD floppy disk controller. In the accurate mode the sector under the head and the bytes
+ * passing it follow the cycle counter of the CPU, stepping and loading the head take their time.
+ * In the fast mode every read of the sector position gives the next sector and the data is always ready,
+ * the data port also gives the rest of a sector at once to input loops executed in bulk (CPU_LOOP_IDIOMS),
+ * so a BIOS reading a sector in a polling loop gets it with a single memcpy from the mapped image
+ */
+typedef struct DCDD {
+    cpu_t *cpu;
+    bool fast;
+    dcdd_drive_t drives[DCDD_DRIVES];
+    int selected; // -1 if no drive is selected
+    uint8_t sector; // Sector under the head
+    uint64_t sector_number; // Sectors passed since the start of the CPU (accurate mode)
+    int read_index; // Next byte of the sector read from the data port
+    bool writing;
+    uint8_t write_sector;
+    int write_index;
+    uint64_t write_start_cycle;
+    bool interrupts_enabled;
+    dcdd_stats_t stats;
+} dcdd_t;
+
+void dcdd_init(dcdd_t *dcdd, cpu_t *cpu, bool fast);
+
+bool dcdd_mount(dcdd_t *dcdd, int drive, const char *path);
+
+void dcdd_unmount(dcdd_t *dcdd, int drive);
+
+void dcdd_flush(dcdd_t *dcdd);
+
+void dcdd_close(dcdd_t *dcdd);
+
+void dcdd_attach(dcdd_t *dcdd, io_bus_t *bus);
+
+#endif // __DCDD_H__
@@ -7,4 +7,8 @@ char *opnames[256] = {
 
 void print_op(uint16_t pc, uint8_t opcode) {
     printf("%04X -> %s\n", pc-1, opnames[opcode]);
-}
\ No newline at end of file
+}
+
+const char *get_op_name(uint8_t opcode) {
+    return opnames[opcode];
+}
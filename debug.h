@@ -5,4 +5,6 @@
 
 void print_op(uint16_t pc, uint8_t opcode);
 
+const char *get_op_name(uint8_t opcode);
+
 #endif // __DEBUG_H__
@@ -0,0 +1,75 @@
+#include <stdlib.h>
+#include <string.h>
+#include "fork.h"
+
+/**
+ * Captures the state of a CPU and of its memory (the bytes of every page mapped to RAM are copied),
+ * the CPU can keep running afterwards. The template has to outlive all forks created from it
+ * Returns NULL if there is not enough memory
+ */
+fork_template_t *fork_template_create(cpu_t *cpu) {
+    fork_template_t *template = malloc(sizeof(fork_template_t));
+    if (template == NULL) {
+        return NULL;
+    }
+    const memory_t *memory = cpu->memory;
+    cpu_get_registers(cpu, &template->registers);
+    template->traps = cpu->traps;
+    template->io_read = cpu->io_read;
+    template->io_write = cpu->io_write;
+    template->io_context = cpu->io_context;
+    template->next_event = cpu->next_event;
+    template->next_event_context = cpu->next_event_context;
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        template->ram_pages[page] = memory->write_map[page] != NULL || memory_is_shared(memory, page);
+        if (template->ram_pages[page]) {
+            memcpy(&template->ram[page * MEMORY_PAGE_SIZE], memory->read_map[page], MEMORY_PAGE_SIZE);
+        }
+        template->rom_map[page] = memory->read_map[page];
+        template->handlers[page] = memory->handlers[page];
+    }
+    return template;
+}
+
+void fork_template_destroy(fork_template_t *template) {
+    free(template);
+}
+
+/**
+ * Initializes a CPU with the state in a template and gives it a new memory sharing the RAM of the template.
+ * Only the page tables are prepared, so a fork takes little more than them and the pages it writes.
+ * Until a fork writes a page, its translated code leaves the accesses to the page to the interpreter
+ * and loops aren't executed in bulk on it
+ * Returns false if there is not enough memory
+ */
+bool fork_create(const fork_template_t *template, cpu_t *cpu) {
+    memory_t *memory = memory_create();
+    if (memory == NULL) {
+        return false;
+    }
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if (template->ram_pages[page]) {
+            memory_map_shared(memory, page, 1, &template->ram[page * MEMORY_PAGE_SIZE]);
+        } else if (template->rom_map[page] != NULL) {
+            memory_map_rom(memory, page, 1, template->rom_map[page]);
+        } else {
+            const memory_page_handlers_t *handlers = &template->handlers[page];
+            memory_map_handlers(memory, page, 1, handlers->read, handlers->write, handlers->context);
+        }
+    }
+    cpu_init(cpu, memory);
+    cpu_set_registers(cpu, &template->registers);
+    cpu_set_traps(cpu, template->traps);
+    cpu_set_io_hooks(cpu, template->io_read, template->io_write, template->io_context);
+    cpu_set_next_event_hook(cpu, template->next_event, template->next_event_context);
+    return true;
+}
+
+/**
+ * Frees a fork created by fork_create together with its memory
+ */
+void fork_destroy(cpu_t *cpu) {
+    memory_t *memory = cpu->memory;
+    cpu_destroy(cpu);
+    memory_destroy(memory);
+}
@@ -0,0 +1,35 @@
+#ifndef __FORK_H__
+#define __FORK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+
+/*
+ * Frozen state of a machine (a CPU and its memory) which any number of forks start from.
+ * Forks share its RAM pages until they write them, ROM pages and device pages are mapped
+ * in every fork the same way as in the original machine (so the devices are shared too)
+ */
+typedef struct FORK_TEMPLATE {
+    cpu_registers_t registers;
+    const cpu_traps_t *traps;
+    cpu_io_read_hook_t io_read;
+    cpu_io_write_hook_t io_write;
+    void *io_context;
+    cpu_next_event_hook_t next_event;
+    void *next_event_context;
+    bool ram_pages[MEMORY_PAGES]; // True for pages forks share from 'ram'
+    const uint8_t *rom_map[MEMORY_PAGES]; // Host memory of ROM pages, NULL for device pages
+    memory_page_handlers_t handlers[MEMORY_PAGES]; // Handlers of device pages
+    uint8_t ram[MEMORY_SIZE];
+} fork_template_t;
+
+fork_template_t *fork_template_create(cpu_t *cpu);
+
+void fork_template_destroy(fork_template_t *template);
+
+bool fork_create(const fork_template_t *template, cpu_t *cpu);
+
+void fork_destroy(cpu_t *cpu);
+
+#endif // __FORK_H__
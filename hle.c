@@ -0,0 +1,323 @@
+#include <stddef.h>
+#include <string.h>
+#include "hle.h"
+
+/**
+ * Reads a port for a native routine, the value is recorded while the call is verified
+ */
+static uint8_t hle_in(hle_t *hle, cpu_t *cpu, uint8_t port) {
+    uint8_t data = cpu->io_read(cpu->io_context, port);
+    if (hle->recording) {
+        if (hle->io_count < HLE_MAX_IO) {
+            hle->io_log[hle->io_count++] = (hle_io_t){false, port, data};
+        } else {
+            hle->io_mismatch = true;
+        }
+    }
+    return data;
+}
+
+static void hle_out(hle_t *hle, cpu_t *cpu, uint8_t port, uint8_t data) {
+    cpu->io_write(cpu->io_context, port, data);
+    if (hle->recording) {
+        if (hle->io_count < HLE_MAX_IO) {
+            hle->io_log[hle->io_count++] = (hle_io_t){true, port, data};
+        } else {
+            hle->io_mismatch = true;
+        }
+    }
+}
+
+/**
+ * Pops the return address the same way as RET
+ */
+static void hle_return(cpu_t *cpu, cpu_registers_t *registers) {
+    registers->pc = memory_get(cpu->memory, registers->sp) | (memory_get(cpu->memory, registers->sp + 1) << 8);
+    registers->sp += 2;
+}
+
+/**
+ * Flags set by CMP and CPI, calculated the same way as by the CPU
+ */
+static uint8_t compare_flags(uint8_t a, uint8_t value) {
+    unsigned result = (a - value) & 0x1FF;
+    uint8_t flags = STATUS_REG_FIXED_BITS | ((~(a ^ value) ^ result) & FLAG_AC);
+    flags |= (result & 0x100) ? FLAG_C : 0;
+    flags |= (result & 0xFF) == 0 ? FLAG_Z : 0;
+    flags |= result & FLAG_S;
+    flags |= __builtin_parity(result & 0xFF) ? 0 : FLAG_P;
+    return flags;
+}
+
+/*
+ * Altair 8K BASIC 4.0 (programs/8kBas_e0.bin), copied from 0xE000 to 0x0000 by its loader.
+ * The console is an 88-SIO board on ports 0 and 1 with an active low status
+ */
+#define BASIC_OUTPUT_SUPPRESSED 0x01D1 // Toggled by ^O
+#define BASIC_COLUMN 0x0027 // Terminal column of the next character
+#define BASIC_LINE_WIDTH 0x48 // A new line is started (by code outside of the image) when the column reaches it
+
+/**
+ * Character input (0x0556): waits for a character, returns it in A without the parity bit.
+ * ^O toggles the output suppression and gives 0
+ */
+static bool basic_character_input(hle_t *hle, cpu_t *cpu) {
+    if (hle_in(hle, cpu, 0x00) & 0x01) {
+        return false; // Nothing received yet, the emulated routine waits
+    }
+    cpu_registers_t registers;
+    cpu_get_registers(cpu, &registers);
+    uint8_t character = hle_in(hle, cpu, 0x01) & 0x7F;
+    registers.a = character;
+    registers.f = compare_flags(character, 0x0F);
+    if (character == 0x0F) {
+        memory_store(cpu->memory, BASIC_OUTPUT_SUPPRESSED, ~memory_get(cpu->memory, BASIC_OUTPUT_SUPPRESSED));
+        registers.a = 0;
+        registers.f = STATUS_REG_FIXED_BITS | FLAG_Z | FLAG_P; // XRA A
+    }
+    hle_return(cpu, &registers);
+    cpu_set_registers(cpu, &registers);
+    return true;
+}
+
+/**
+ * Character output (RST 3 at 0x0018, continued at 0x052D): sends A counting the printable characters
+ * in the column, A and the flags are kept. Suppressed output and the end of a line are left
+ * to the emulated routine, they go to code outside of the image
+ */
+static bool basic_character_output(hle_t *hle, cpu_t *cpu) {
+    cpu_registers_t registers;
+    cpu_get_registers(cpu, &registers);
+    uint8_t column = memory_get(cpu->memory, BASIC_COLUMN);
+    bool printable = registers.a >= 0x20;
+    if (memory_get(cpu->memory, BASIC_OUTPUT_SUPPRESSED) != 0 || (printable && column == BASIC_LINE_WIDTH)) {
+        return false;
+    }
+    if (hle_in(hle, cpu, 0x00) & 0xC8) {
+        return false; // The transmitter is busy, the emulated routine waits
+    }
+    if (printable) {
+        memory_store(cpu->memory, BASIC_COLUMN, column + 1);
+    }
+    hle_out(hle, cpu, 0x01, registers.a);
+    hle_in(hle, cpu, 0x13);
+    // PUSH PSW leaves A and the flags below the return address
+    memory_store(cpu->memory, registers.sp - 1, registers.a);
+    memory_store(cpu->memory, registers.sp - 2, registers.f);
+    hle_return(cpu, &registers);
+    cpu_set_registers(cpu, &registers);
+    return true;
+}
+
+static const hle_routine_t basic_routines[] = {
+    {"BASIC character input", 0x0556, {{0x0556, 0x0017}}, basic_character_input},
+    {"BASIC character output", 0x0018, {{0x0018, 0x0008}, {0x052D, 0x0029}}, basic_character_output}
+};
+
+static const hle_rom_t known_roms[] = {
+    {"Altair 8K BASIC 4.0", 0x7144367109E427CFULL, 0x18, basic_routines, sizeof(basic_routines) / sizeof(basic_routines[0])}
+};
+
+/**
+ * 64bit FNV-1a hash of an image, the key of the known ROMs
+ */
+uint64_t hle_hash(const uint8_t *bytes, size_t size) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+void hle_init(hle_t *hle, cpu_t *cpu) {
+    hle->cpu = cpu;
+    hle->rom = NULL;
+    hle->hooks_count = 0;
+    hle->verify = false;
+    hle->recording = false;
+    hle->mismatch = NULL;
+    hle->stats = (hle_stats_t){0};
+}
+
+/**
+ * Turns the verification of every native call on or off
+ */
+void hle_set_verify(hle_t *hle, bool verify) {
+    hle->verify = verify;
+}
+
+static bool is_plain_page(cpu_t *cpu, int page) {
+    return cpu->memory->read_map[page] != NULL;
+}
+
+/**
+ * Copies the memory (without the pages of memory-mapped devices, which can't be read without side effects)
+ */
+static void save_memory(cpu_t *cpu, uint8_t *bytes) {
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if (is_plain_page(cpu, page)) {
+            memcpy(&bytes[page * MEMORY_PAGE_SIZE], cpu->memory->read_map[page], MEMORY_PAGE_SIZE);
+        }
+    }
+}
+
+/**
+ * Writes back the bytes which differ from a saved copy of the memory
+ */
+static void restore_memory(cpu_t *cpu, const uint8_t *bytes) {
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if (is_plain_page(cpu, page) && memcmp(&bytes[page * MEMORY_PAGE_SIZE], cpu->memory->read_map[page], MEMORY_PAGE_SIZE) != 0) {
+            for (int address = page * MEMORY_PAGE_SIZE; address < (page + 1) * MEMORY_PAGE_SIZE; address++) {
+                if (memory_get(cpu->memory, address) != bytes[address]) {
+                    memory_store(cpu->memory, address, bytes[address]);
+                }
+            }
+        }
+    }
+}
+
+static bool memory_matches(cpu_t *cpu, const uint8_t *bytes) {
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if (is_plain_page(cpu, page) && memcmp(&bytes[page * MEMORY_PAGE_SIZE], cpu->memory->read_map[page], MEMORY_PAGE_SIZE) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * I/O hooks of the emulated routine, they give it the values the native call read
+ * and check that it makes the same operations in the same order
+ */
+static uint8_t replay_read(void *context, uint8_t port) {
+    hle_t *hle = context;
+    if (hle->io_replayed >= hle->io_count || hle->io_log[hle->io_replayed].write || hle->io_log[hle->io_replayed].port != port) {
+        hle->io_mismatch = true;
+        return 0xFF;
+    }
+    return hle->io_log[hle->io_replayed++].data;
+}
+
+static void replay_write(void *context, uint8_t port, uint8_t data) {
+    hle_t *hle = context;
+    if (hle->io_replayed >= hle->io_count || !hle->io_log[hle->io_replayed].write
+        || hle->io_log[hle->io_replayed].port != port || hle->io_log[hle->io_replayed].data != data) {
+        hle->io_mismatch = true;
+        return;
+    }
+    hle->io_replayed++;
+}
+
+/**
+ * Runs the native routine and then the emulated one from the same state and compares them.
+ * The CPU ends up after the emulated routine
+ */
+static void verify_call(hle_t *hle, hle_hook_t *hook) {
+    cpu_t *cpu = hle->cpu;
+    cpu_registers_t before, native, emulated;
+    cpu_get_registers(cpu, &before);
+    save_memory(cpu, hle->memory_before);
+    hle->recording = true;
+    hle->io_count = 0;
+    hle->io_mismatch = false;
+    bool performed = hook->routine->callback(hle, cpu);
+    hle->recording = false;
+    if (!performed) {
+        hle->stats.emulated_calls++;
+        return;
+    }
+    cpu_get_registers(cpu, &native);
+    save_memory(cpu, hle->memory_native);
+
+    cpu_set_registers(cpu, &before);
+    restore_memory(cpu, hle->memory_before);
+    cpu_io_read_hook_t io_read = cpu->io_read;
+    cpu_io_write_hook_t io_write = cpu->io_write;
+    void *io_context = cpu->io_context;
+    cpu_set_io_hooks(cpu, replay_read, replay_write, hle);
+    hle->io_replayed = 0;
+    uint16_t return_address = memory_get(cpu->memory, before.sp) | (memory_get(cpu->memory, before.sp + 1) << 8);
+    long long cycles = 0;
+    do {
+        cycles += cpu_step(cpu);
+        cpu_get_registers(cpu, &emulated);
+    } while ((emulated.pc != return_address || emulated.sp != (uint16_t)(before.sp + 2)) && cycles < HLE_VERIFY_MAX_CYCLES);
+    cpu_set_io_hooks(cpu, io_read, io_write, io_context);
+
+    if (emulated.pc == native.pc && emulated.sp == native.sp && emulated.bc == native.bc && emulated.de == native.de
+        && emulated.hl == native.hl && emulated.a == native.a && emulated.f == native.f
+        && !hle->io_mismatch && hle->io_replayed == hle->io_count && memory_matches(cpu, hle->memory_native)) {
+        hook->verified_calls++;
+        hle->stats.verified_calls++;
+    } else {
+        hook->disabled = true;
+        hle->stats.mismatches++;
+        hle->mismatch = hook->routine->name;
+    }
+}
+
+/**
+ * Trap handler at the entry point of a routine, the routine is run natively only if its code
+ * is still the code from the image (programs may overwrite it or the image may not be copied yet)
+ */
+static bool run_hook(cpu_t *cpu, void *context) {
+    hle_hook_t *hook = context;
+    hle_t *hle = hook->hle;
+    int offset = 0;
+    bool same_code = !hook->disabled;
+    for (int i = 0; same_code && i < HLE_MAX_CODE_RANGES && hook->routine->code[i].length > 0; i++) {
+        same_code = memory_equals(cpu->memory, hook->routine->code[i].address, &hook->signature[offset], hook->routine->code[i].length);
+        offset += hook->routine->code[i].length;
+    }
+    if (!same_code) {
+        hle->stats.emulated_calls++;
+    } else if (hle->verify) {
+        verify_call(hle, hook);
+    } else if (hook->routine->callback(hle, cpu)) {
+        hook->native_calls++;
+        hle->stats.native_calls++;
+    } else {
+        hle->stats.emulated_calls++;
+    }
+    return true;
+}
+
+/**
+ * Adds traps at the routines of an image if it's one of the known ROMs,
+ * it should be done before the CPU runs (the JIT doesn't see traps added to translated code).
+ * Native calls don't take any clock cycles
+ * Returns the number of hooks installed
+ */
+int hle_install(hle_t *hle, cpu_traps_t *traps, const uint8_t *image, size_t size) {
+    uint64_t hash = hle_hash(image, size);
+    for (size_t i = 0; i < sizeof(known_roms) / sizeof(known_roms[0]); i++) {
+        if (known_roms[i].hash == hash) {
+            hle->rom = &known_roms[i];
+        }
+    }
+    if (hle->rom == NULL) {
+        return 0;
+    }
+    int installed = 0;
+    for (int i = 0; i < hle->rom->routines_count && hle->hooks_count < HLE_MAX_HOOKS; i++) {
+        const hle_routine_t *routine = &hle->rom->routines[i];
+        hle_hook_t *hook = &hle->hooks[hle->hooks_count];
+        *hook = (hle_hook_t){.hle = hle, .routine = routine};
+        bool in_image = true;
+        for (int j = 0; j < HLE_MAX_CODE_RANGES && routine->code[j].length > 0; j++) {
+            long offset = routine->code[j].address + hle->rom->image_offset;
+            if (offset < 0 || offset + routine->code[j].length > (long)size
+                || hook->signature_length + routine->code[j].length > HLE_MAX_SIGNATURE) {
+                in_image = false;
+                break;
+            }
+            memcpy(&hook->signature[hook->signature_length], &image[offset], routine->code[j].length);
+            hook->signature_length += routine->code[j].length;
+        }
+        if (in_image && cpu_traps_add(traps, routine->address, run_hook, hook)) {
+            hle->hooks_count++;
+            installed++;
+        }
+    }
+    return installed;
+}
@@ -0,0 +1,101 @@
+#ifndef __HLE_H__
+#define __HLE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "cpu.h"
+
+#define HLE_MAX_HOOKS 16
+#define HLE_MAX_CODE_RANGES 2
+#define HLE_MAX_SIGNATURE 128 // Bytes of code of a routine compared with the memory before it's run natively
+#define HLE_MAX_IO 64 // I/O operations of a native call recorded to verify it
+#define HLE_VERIFY_MAX_CYCLES 1000000 // An emulated routine which doesn't return within these doesn't match
+
+typedef struct HLE hle_t;
+
+/*
+ * Performs a routine natively, including its return to the caller.
+ * Returns false if the routine has to be emulated instead (e.g. no input is ready yet),
+ * in which case it mustn't have any side effects other than reading status ports
+ */
+typedef bool (*hle_callback_t)(hle_t *hle, cpu_t *cpu);
+
+typedef struct HLE_CODE {
+    uint16_t address;
+    uint16_t length; // 0 if the range isn't used
+} hle_code_t;
+
+typedef struct HLE_ROUTINE {
+    const char *name;
+    uint16_t address; // Entry point, the hook is a trap there
+    hle_code_t code[HLE_MAX_CODE_RANGES]; // Code the callback stands for, checked before every native call
+    hle_callback_t callback;
+} hle_routine_t;
+
+// Known ROM image, identified by the hash of all of its bytes
+typedef struct HLE_ROM {
+    const char *name;
+    uint64_t hash;
+    long image_offset; // Offset in the image of the byte which runs at address 0 (the image may be copied there)
+    const hle_routine_t *routines;
+    int routines_count;
+} hle_rom_t;
+
+typedef struct HLE_HOOK {
+    hle_t *hle;
+    const hle_routine_t *routine;
+    uint8_t signature[HLE_MAX_SIGNATURE]; // Code ranges of the routine, one after another, as they are in the image
+    int signature_length;
+    bool disabled; // Set when the verification finds a mismatch
+    unsigned long long native_calls;
+    unsigned long long verified_calls;
+} hle_hook_t;
+
+typedef struct HLE_IO {
+    bool write;
+    uint8_t port;
+    uint8_t data;
+} hle_io_t;
+
+typedef struct HLE_STATS {
+    unsigned long long native_calls;
+    unsigned long long emulated_calls; // Calls left to the emulated routine by the callback, a disabled hook or changed code
+    unsigned long long verified_calls;
+    unsigned long long mismatches;
+} hle_stats_t;
+
+/*
+ * High-level emulation of routines of known ROM images. The hooks are traps at the entry points
+ * of the routines, so they are called when control is transferred there, the same way as the BDOS.
+ * With verification every native call is compared with the emulated routine: the native result
+ * is taken, the CPU and memory are put back and the routine is emulated with the recorded I/O replayed,
+ * then the registers, the memory and the I/O have to be the same. The emulated result is kept
+ * and a hook which doesn't match is disabled
+ */
+struct HLE {
+    cpu_t *cpu;
+    const hle_rom_t *rom; // NULL if the image isn't known
+    hle_hook_t hooks[HLE_MAX_HOOKS];
+    int hooks_count;
+    bool verify;
+    bool recording; // True while a native call is verified
+    hle_io_t io_log[HLE_MAX_IO];
+    int io_count;
+    int io_replayed;
+    bool io_mismatch; // The emulated routine didn't make the recorded I/O (or there was too much of it)
+    const char *mismatch; // Name of the routine of the last mismatch, NULL if there was none
+    uint8_t memory_before[MEMORY_SIZE];
+    uint8_t memory_native[MEMORY_SIZE];
+    hle_stats_t stats;
+};
+
+uint64_t hle_hash(const uint8_t *bytes, size_t size);
+
+void hle_init(hle_t *hle, cpu_t *cpu);
+
+int hle_install(hle_t *hle, cpu_traps_t *traps, const uint8_t *image, size_t size);
+
+void hle_set_verify(hle_t *hle, bool verify);
+
+#endif // __HLE_H__
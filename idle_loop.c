@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include "idle_loop.h"
+
+/**
+ * Returns the clock cycles of an operation allowed between the IN and the closing jump
+ * or 0 if a polling loop can't contain it. Only operations whose result depends
+ * on nothing but A are allowed (so no RAL, RAR or operations with other registers)
+ */
+static int test_op_cycles(uint8_t opcode) {
+    switch (opcode) {
+        case 0xE6: // ANI D8
+        case 0xEE: // XRI D8
+        case 0xF6: // ORI D8
+        case 0xFE: // CPI D8
+            return 7;
+        case 0x07: // RLC
+        case 0x0F: // RRC
+        case 0x2F: // CMA
+        case 0xA7: // ANA A
+        case 0xB7: // ORA A
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+/**
+ * Checks if the loop from the IN at 'head' to the conditional jump at 'jump' only polls the port
+ * and describes it in 'loop'
+ * Returns false if it doesn't
+ */
+static bool recognize(memory_t *memory, uint16_t head, uint16_t jump, idle_loop_t *loop) {
+    if (memory_get(memory, head) != 0xDB || (memory_get(memory, jump) & 0xC7) != 0xC2) {
+        return false;
+    }
+    int cycles = 10 + 10; // IN and the closing jump
+    for (uint16_t address = head + 2; address < jump; ) {
+        uint8_t opcode = memory_get(memory, address);
+        int length = (opcode & 0xC7) == 0xC6 ? 2 : 1;
+        if (test_op_cycles(opcode) == 0 || address + length > jump) {
+            return false;
+        }
+        cycles += test_op_cycles(opcode);
+        address += length;
+    }
+    loop->port = memory_get(memory, head + 1);
+    loop->iteration_cycles = cycles;
+    return true;
+}
+
+/**
+ * Allocates an empty cache of recognized loops for a given memory
+ * Returns NULL if there is not enough memory
+ */
+idle_loops_t *idle_loops_create(memory_t *memory) {
+    idle_loops_t *loops = calloc(1, sizeof(idle_loops_t));
+    if (loops != NULL) {
+        loops->memory = memory;
+    }
+    return loops;
+}
+
+void idle_loops_destroy(idle_loops_t *loops) {
+    free(loops);
+}
+
+/**
+ * Decodes the loop from 'head' to the conditional jump at 'jump' into a given cache entry
+ * Returns the description of the loop (idle set to false if it does anything else than polling a port)
+ */
+idle_loop_t *idle_loops_recognize(idle_loops_t *loops, idle_loop_entry_t *entry, uint16_t head, uint16_t jump) {
+    memory_t *memory = loops->memory;
+    uint16_t last_address = jump + 2;
+    memory_mark_code(memory, head, last_address);
+    entry->valid = true;
+    entry->head = head;
+    entry->jump = jump;
+    entry->first_page = head / MEMORY_PAGE_SIZE;
+    entry->last_page = last_address / MEMORY_PAGE_SIZE;
+    entry->first_page_generation = memory->page_generation[entry->first_page];
+    entry->last_page_generation = memory->page_generation[entry->last_page];
+    entry->loop.observed = false;
+    entry->loop.idle = recognize(memory, head, jump, &entry->loop);
+    if (entry->loop.idle) {
+        loops->stats.recognized_loops++;
+    }
+    return &entry->loop;
+}
@@ -0,0 +1,71 @@
+#ifndef __IDLE_LOOP_H__
+#define __IDLE_LOOP_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory.h"
+
+#define IDLE_LOOP_CACHE_SIZE 64 // Number of cached loops, must be a power of 2
+#define IDLE_LOOP_MAX_LENGTH 8 // Longest loop body (IN and the operations testing its result) in bytes
+
+/*
+ * A loop which reads an input port, tests the value with operations changing only A and the flags
+ * and jumps back to the IN with a conditional jump, e.g. IN 10h / ANI 01h / JZ loop.
+ * While the port keeps the same value every iteration ends in the same state
+ */
+typedef struct IDLE_LOOP {
+    bool idle; // False if the loop does anything else than polling a port
+    uint8_t port;
+    int iteration_cycles;
+    bool observed; // True if the state below was seen at the end of an iteration
+    uint8_t last_a;
+    uint8_t last_flags;
+} idle_loop_t;
+
+typedef struct IDLE_LOOP_ENTRY {
+    bool valid;
+    uint16_t head; // Address of the IN
+    uint16_t jump; // Address of the closing conditional jump
+    uint8_t first_page;
+    uint8_t last_page;
+    uint32_t first_page_generation;
+    uint32_t last_page_generation;
+    idle_loop_t loop;
+} idle_loop_entry_t;
+
+typedef struct IDLE_LOOP_STATS {
+    unsigned long long recognized_loops; // Loops found to only poll a port
+    unsigned long long skips;
+    unsigned long long skipped_iterations; // Iterations which weren't executed at all
+} idle_loop_stats_t;
+
+typedef struct IDLE_LOOPS {
+    memory_t *memory;
+    idle_loop_stats_t stats;
+    idle_loop_entry_t entries[IDLE_LOOP_CACHE_SIZE]; // Direct-mapped, indexed by the lower bits of the loop head
+} idle_loops_t;
+
+idle_loops_t *idle_loops_create(memory_t *memory);
+
+void idle_loops_destroy(idle_loops_t *loops);
+
+idle_loop_t *idle_loops_recognize(idle_loops_t *loops, idle_loop_entry_t *entry, uint16_t head, uint16_t jump);
+
+/**
+ * Returns the description of the polling loop from the IN at 'head' to the conditional jump at 'jump'
+ * or NULL if the loop does anything else. The result is cached until the code of the loop is written
+ */
+inline static idle_loop_t *idle_loops_find(idle_loops_t *loops, uint16_t head, uint16_t jump) {
+    if (jump - head > IDLE_LOOP_MAX_LENGTH) {
+        return NULL;
+    }
+    idle_loop_entry_t *entry = &loops->entries[head & (IDLE_LOOP_CACHE_SIZE - 1)];
+    if (!entry->valid || entry->head != head || entry->jump != jump
+        || loops->memory->page_generation[entry->first_page] != entry->first_page_generation
+        || loops->memory->page_generation[entry->last_page] != entry->last_page_generation) {
+        idle_loops_recognize(loops, entry, head, jump);
+    }
+    return entry->loop.idle ? &entry->loop : NULL;
+}
+
+#endif // __IDLE_LOOP_H__
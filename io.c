@@ -1,11 +1,75 @@
-#include <stdio.h>
+#include <stddef.h>
 #include "io.h"
 
-void io_write(uint8_t dev_id, uint8_t data) {
-    printf("Device 0x%02X write: 0x%02X\n", dev_id, data);
+static uint8_t unmapped_read(void *context, uint8_t port) {
+    (void)context;
+    (void)port;
+    return IO_UNMAPPED_VALUE;
 }
 
-uint8_t io_read(uint8_t dev_id) {
-    printf("Device 0x%02X read\n", dev_id);
-    return 0;
+static void unmapped_write(void *context, uint8_t port, uint8_t data) {
+    (void)context;
+    (void)port;
+    (void)data;
+}
+
+/**
+ * Removes the devices from every port
+ */
+void io_bus_init(io_bus_t *bus) {
+    for (int port = 0; port < IO_PORTS; port++) {
+        io_bus_register(bus, port, NULL, NULL, NULL);
+    }
+}
+
+/**
+ * Connects a device to a port, a NULL read handler makes the port read as IO_UNMAPPED_VALUE,
+ * a NULL write handler makes it ignore writes
+ */
+void io_bus_register(io_bus_t *bus, uint8_t port, io_read_handler_t read_handler, io_write_handler_t write_handler, void *context) {
+    bus->ports[port].read = (read_handler != NULL) ? read_handler : unmapped_read;
+    bus->ports[port].write = (write_handler != NULL) ? write_handler : unmapped_write;
+    bus->ports[port].read_block = NULL;
+    bus->ports[port].context = context;
+}
+
+/**
+ * Lets the device of a port read many bytes at once (used by input loops executed in bulk),
+ * the handler gets the context of the device already registered at the port
+ */
+void io_bus_register_block(io_bus_t *bus, uint8_t port, io_read_block_handler_t read_block_handler) {
+    bus->ports[port].read_block = read_block_handler;
+}
+
+/**
+ * Output hook of the CPU, 'context' is the io_bus_t or NULL if there are no devices
+ */
+void io_write(void *context, uint8_t dev_id, uint8_t data) {
+    if (context != NULL) {
+        io_port_t *port = &((io_bus_t *)context)->ports[dev_id];
+        port->write(port->context, dev_id, data);
+    }
+}
+
+/**
+ * Input hook of the CPU, 'context' is the io_bus_t or NULL if there are no devices
+ */
+uint8_t io_read(void *context, uint8_t dev_id) {
+    if (context == NULL) {
+        return IO_UNMAPPED_VALUE;
+    }
+    io_port_t *port = &((io_bus_t *)context)->ports[dev_id];
+    return port->read(port->context, dev_id);
+}
+
+/**
+ * Reads up to 'count' bytes from a port at once if its device allows it, 'context' is the io_bus_t or NULL
+ * Returns the number of bytes read, which is 0 if the device has to be read byte by byte
+ */
+size_t io_read_block(void *context, uint8_t dev_id, uint8_t *bytes, size_t count) {
+    if (context == NULL) {
+        return 0;
+    }
+    io_port_t *port = &((io_bus_t *)context)->ports[dev_id];
+    return (port->read_block != NULL) ? port->read_block(port->context, dev_id, bytes, count) : 0;
 }
@@ -2,9 +2,38 @@
 #define __IO_H__
 
 #include <stdint.h>
+#include <stddef.h>
 
-void io_write(uint8_t dev_id, uint8_t data);
+#define IO_PORTS 256
+#define IO_UNMAPPED_VALUE 0xFF // Read from ports without a device, like from the open Altair bus
 
-uint8_t io_read(uint8_t dev_id);
+typedef uint8_t (*io_read_handler_t)(void *context, uint8_t port);
+typedef void (*io_write_handler_t)(void *context, uint8_t port, uint8_t data);
+// Reads up to 'count' bytes the same way as that many reads of the port would, returns how many it read
+typedef size_t (*io_read_block_handler_t)(void *context, uint8_t port, uint8_t *bytes, size_t count);
+
+typedef struct IO_PORT {
+    io_read_handler_t read;
+    io_write_handler_t write;
+    io_read_block_handler_t read_block; // NULL if the device reads only byte by byte
+    void *context;
+} io_port_t;
+
+// Devices of every port, ports without a device have handlers which do nothing
+typedef struct IO_BUS {
+    io_port_t ports[IO_PORTS];
+} io_bus_t;
+
+void io_bus_init(io_bus_t *bus);
+
+void io_bus_register(io_bus_t *bus, uint8_t port, io_read_handler_t read_handler, io_write_handler_t write_handler, void *context);
+
+void io_bus_register_block(io_bus_t *bus, uint8_t port, io_read_block_handler_t read_block_handler);
+
+void io_write(void *context, uint8_t dev_id, uint8_t data);
+
+uint8_t io_read(void *context, uint8_t dev_id);
+
+size_t io_read_block(void *context, uint8_t dev_id, uint8_t *bytes, size_t count);
 
 #endif // __IO_H__
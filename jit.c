@@ -0,0 +1,1244 @@
+#define _GNU_SOURCE // memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "jit.h"
+#include "cpu.h"
+
+/*
+ * Translated code keeps the whole 8080 state in host registers:
+ * AL = A, AH = F (LAHF and SAHF use the same flag layout as the 8080),
+ * BX = BC, CX = DE, DX = HL, DI = SP (upper halves are always zero, so they can index the memory),
+ * RSI = memory, R12 = remaining cycles, R13 = entries table, R14 = interrupt_pending,
+ * R15B = non-zero after a store to translated code, RBP = jit_regs_t.
+ * R8-R11 are scratch registers, R8D holds the 8080 address of every exit.
+ * Instructions using AH, BH, CH or DH can't have a REX prefix, so they never use R8-R15.
+ * The code buffer is never writable and executable at once: the same memory is mapped twice,
+ * the code is written through 'code_buffer' and executed through 'code_exec'.
+ * Jumps within the buffer are relative, so they are the same in both mappings
+ */
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum { AL, CL, DL, BL, AH, CH, DH, BH };
+
+#define NO_INDEX -1
+#define CODE_MAP_OFFSET ((int32_t)offsetof(memory_t, code_map))
+#define DIRTY_PAGES_OFFSET ((int32_t)offsetof(memory_t, dirty_pages))
+#define DIRECT_PAGES_OFFSET ((int32_t)offsetof(memory_t, direct_pages))
+
+// x86 condition codes
+#define CC_Z 0x4
+#define CC_NZ 0x5
+#define CC_LE 0xE
+
+#define FLAGS_ALL (FLAG_S | FLAG_Z | FLAG_AC | FLAG_P | FLAG_C)
+
+// Worst case size of the code (with stubs) of a single operation
+#define MAX_OP_CODE_SIZE 256
+#define MAX_BLOCK_CODE_SIZE (JIT_MAX_BLOCK_OPS * MAX_OP_CODE_SIZE)
+#define MAX_BLOCK_STUBS (JIT_MAX_BLOCK_OPS * 4 + 4)
+
+// 8080 ALU operations in the order used by the opcodes
+enum { ALU_ADD, ALU_ADC, ALU_SUB, ALU_SBB, ALU_ANA, ALU_XRA, ALU_ORA, ALU_CMP };
+
+// x86 ALU operations (/digit of the 0x80 group) of the 8080 ALU operations
+static const int alu_ops[8] = {0, 2, 5, 3, 4, 6, 1, 7};
+
+// Host registers of the 8080 registers in the order used by the opcodes: B, C, D, E, H, L, M, A
+static const int regs8[8] = {BH, BL, CH, CL, DH, DL, -1, AL};
+
+// Host registers of the 8080 register pairs in the order used by the opcodes: BC, DE, HL, SP
+static const int regs16[4] = {RBX, RCX, RDX, RDI};
+
+/**
+ * Length in bytes of every operation
+ */
+static const uint8_t op_lengths[256] = {
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0x00
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0x10
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, // 0x20
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, // 0x30
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x40
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x50
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x60
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x70
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x80
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x90
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xA0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xB0
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1, // 0xC0
+    1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, // 0xD0
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1, // 0xE0
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1  // 0xF0
+};
+
+/**
+ * Clock cycles of every operation, the same as counted by the interpreter.
+ * Conditional calls and returns take 6 more cycles when the condition is met
+ */
+static const uint8_t op_cycles[256] = {
+     4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4, // 0x00
+     4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4, // 0x10
+     4, 10, 16,  5,  5,  5,  7,  4,  4, 10, 16,  5,  5,  5,  7,  4, // 0x20
+     4, 10, 13,  5, 10, 10, 10,  4,  4, 10, 13,  5,  5,  5,  7,  4, // 0x30
+     5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5, // 0x40
+     5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5, // 0x50
+     5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5, // 0x60
+     7,  7,  7,  7,  7,  7,  7,  7,  5,  5,  5,  5,  5,  5,  7,  5, // 0x70
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 0x80
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 0x90
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 0xA0
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  4,  4, // 0xB0
+     5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11, // 0xC0
+     5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11, // 0xD0
+     5, 10, 10, 18, 11, 11,  7, 11,  5,  5, 10,  5, 11, 17,  7, 11, // 0xE0
+     5, 10, 10,  4, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11  // 0xF0
+};
+
+typedef enum JIT_STUB_KIND {
+    STUB_STOP,
+    STUB_LINK,
+    STUB_SMC
+} jit_stub_kind_t;
+
+// Out of line exit of a block, emitted after the code of all of its operations
+typedef struct JIT_STUB {
+    jit_stub_kind_t kind;
+    uint8_t *site; // rel32 field of the jump to the stub
+    uint16_t pc;
+    uint32_t info;
+    int segment_cycles; // Cycles of the segment counted up to the stub, used to give back the rest
+} jit_stub_t;
+
+typedef struct JIT_OP {
+    uint16_t pc;
+    uint8_t opcode;
+    uint16_t operand;
+    uint8_t live_flags; // Flags read before being overwritten after the operation
+} jit_op_t;
+
+/*
+ * Cycles are subtracted from R12 once per segment, a run of operations
+ * ending with a conditional operation (or the end of the block)
+ */
+typedef struct JIT_EMITTER {
+    uint8_t *p;
+    jit_stub_t stubs[MAX_BLOCK_STUBS];
+    int stubs_count;
+    uint8_t *segment_field; // imm32 of the current segment's SUB
+    int segment_cycles;
+    int segment_first_stub;
+    bool check_pages; // Every access to the memory is checked to be to a page of the RAM in 'data'
+} jit_emitter_t;
+
+static void emit8(jit_emitter_t *e, uint8_t value) {
+    *e->p++ = value;
+}
+
+static void emit32(jit_emitter_t *e, uint32_t value) {
+    memcpy(e->p, &value, sizeof(value));
+    e->p += sizeof(value);
+}
+
+/**
+ * Emits an instruction with a ModRM byte, 'rm' is a register or the base of the memory operand [rm + index * 2^scale + disp].
+ * 'reg' is a register or the /digit of a group opcode, opcodes above 0xFF are emitted as two bytes
+ */
+static void emit_instruction(jit_emitter_t *e, int size, int opcode, int reg, bool reg_is_register, int rm, bool rm_is_register, int index, int scale, int32_t disp) {
+    uint8_t rex = 0;
+    if (size == 64)
+        rex |= 0x48;
+    if (reg_is_register && reg >= 8)
+        rex |= 0x44;
+    if (index >= 8)
+        rex |= 0x42;
+    if (rm >= 8)
+        rex |= 0x41;
+    if (size == 16)
+        emit8(e, 0x66);
+    if (rex) {
+        if (size == 8 && ((reg_is_register && reg >= AH && reg <= BH) || (rm_is_register && rm >= AH && rm <= BH))) {
+            fprintf(stderr, "JIT error: high byte register used together with a REX prefix\n");
+            abort();
+        }
+        emit8(e, rex);
+    }
+    if (opcode > 0xFF)
+        emit8(e, opcode >> 8);
+    emit8(e, opcode & 0xFF);
+    reg &= 0x07;
+    if (rm_is_register) {
+        emit8(e, 0xC0 | (reg << 3) | (rm & 0x07));
+        return;
+    }
+    int mod;
+    if (disp == 0 && (rm & 0x07) != RBP) {
+        mod = 0;
+    } else if (disp >= -128 && disp <= 127) {
+        mod = 1;
+    } else {
+        mod = 2;
+    }
+    if (index == NO_INDEX) {
+        emit8(e, (mod << 6) | (reg << 3) | (rm & 0x07));
+        if ((rm & 0x07) == RSP)
+            emit8(e, 0x24);
+    } else {
+        emit8(e, (mod << 6) | (reg << 3) | 0x04);
+        emit8(e, (scale << 6) | ((index & 0x07) << 3) | (rm & 0x07));
+    }
+    if (mod == 1) {
+        emit8(e, (uint8_t)disp);
+    } else if (mod == 2) {
+        emit32(e, (uint32_t)disp);
+    }
+}
+
+// op reg, rm (both registers)
+static void emit_rr(jit_emitter_t *e, int size, int opcode, int reg, int rm) {
+    emit_instruction(e, size, opcode, reg, true, rm, true, NO_INDEX, 0, 0);
+}
+
+// op /digit, rm (register)
+static void emit_digit_r(jit_emitter_t *e, int size, int opcode, int digit, int rm) {
+    emit_instruction(e, size, opcode, digit, false, rm, true, NO_INDEX, 0, 0);
+}
+
+// op reg, [base + index + disp]
+static void emit_rm(jit_emitter_t *e, int size, int opcode, int reg, int base, int index, int32_t disp) {
+    emit_instruction(e, size, opcode, reg, true, base, false, index, 0, disp);
+}
+
+// op /digit, [base + index + disp]
+static void emit_digit_m(jit_emitter_t *e, int size, int opcode, int digit, int base, int index, int32_t disp) {
+    emit_instruction(e, size, opcode, digit, false, base, false, index, 0, disp);
+}
+
+// mov reg32, imm32
+static void emit_mov_imm32(jit_emitter_t *e, int reg, uint32_t value) {
+    if (reg >= 8)
+        emit8(e, 0x41);
+    emit8(e, 0xB8 + (reg & 0x07));
+    emit32(e, value);
+}
+
+/**
+ * Emits a jump with a 32bit displacement to be patched later
+ * Returns the address of the displacement
+ */
+static uint8_t *emit_jmp(jit_emitter_t *e) {
+    emit8(e, 0xE9);
+    uint8_t *field = e->p;
+    emit32(e, 0);
+    return field;
+}
+
+static uint8_t *emit_jcc(jit_emitter_t *e, int condition) {
+    emit8(e, 0x0F);
+    emit8(e, 0x80 | condition);
+    uint8_t *field = e->p;
+    emit32(e, 0);
+    return field;
+}
+
+static void patch_rel32(uint8_t *field, const void *target) {
+    int32_t displacement = (int32_t)((const uint8_t *)target - (field + 4));
+    memcpy(field, &displacement, sizeof(displacement));
+}
+
+static void emit_jmp_to(jit_emitter_t *e, const void *target) {
+    patch_rel32(emit_jmp(e), target);
+}
+
+static void add_stub(jit_emitter_t *e, jit_stub_kind_t kind, uint8_t *site, uint16_t pc, uint32_t info) {
+    jit_stub_t *stub = &e->stubs[e->stubs_count++];
+    stub->kind = kind;
+    stub->site = site;
+    stub->pc = pc;
+    stub->info = info;
+    stub->segment_cycles = e->segment_cycles;
+}
+
+static void open_segment(jit_emitter_t *e) {
+    emit_digit_r(e, 64, 0x81, 5, R12); // sub r12, imm32
+    e->segment_field = e->p;
+    emit32(e, 0);
+    e->segment_cycles = 0;
+    e->segment_first_stub = e->stubs_count;
+}
+
+/**
+ * Fills in the cycles of the segment, exits to the interpreter in the middle of it
+ * give back the cycles of the operations they skip
+ */
+static void close_segment(jit_emitter_t *e) {
+    memcpy(e->segment_field, &e->segment_cycles, sizeof(e->segment_cycles));
+    for (int i = e->segment_first_stub; i < e->stubs_count; i++) {
+        e->stubs[i].segment_cycles = e->segment_cycles - e->stubs[i].segment_cycles;
+    }
+}
+
+/**
+ * Emits 'op dst8, src', the source is an 8080 register (6 means M) or an immediate if 'src' is -1
+ */
+static void emit_alu8(jit_emitter_t *e, int x86_op, int dst, int src, uint8_t imm) {
+    if (src == -1) {
+        emit_digit_r(e, 8, 0x80, x86_op, dst);
+        emit8(e, imm);
+    } else if (src == 6) {
+        emit_rm(e, 8, x86_op * 8 + 2, dst, RSI, RDX, 0);
+    } else {
+        emit_rr(e, 8, x86_op * 8, regs8[src], dst);
+    }
+}
+
+// Marks a store to [rsi + index + disp] in R15B if it hit translated code and marks its page dirty, 'disp' is 0 if there is an index
+static void emit_store_check(jit_emitter_t *e, int index, int32_t disp) {
+    emit_rm(e, 8, 0x0A, R15, RSI, index, CODE_MAP_OFFSET + disp);
+    if (index == NO_INDEX) {
+        emit_digit_m(e, 8, 0xC6, 0, RSI, NO_INDEX, DIRTY_PAGES_OFFSET + disp / MEMORY_PAGE_SIZE); // mov byte [rsi + page], 1
+    } else {
+        emit_rr(e, 32, 0x89, index, R9); // mov r9d, index
+        emit_digit_r(e, 32, 0xC1, 5, R9); // shr r9d, 8
+        emit8(e, 8);
+        emit_digit_m(e, 8, 0xC6, 0, RSI, R9, DIRTY_PAGES_OFFSET); // mov byte [rsi + r9], 1
+    }
+    emit8(e, 1);
+}
+
+/**
+ * Leaves the block before the operation if the byte at [index + disp] (at 'disp' if there is no index)
+ * isn't on a page of the RAM in 'data', the interpreter executes the operation instead
+ */
+static void emit_page_check(jit_emitter_t *e, const jit_op_t *op, int index, int32_t disp) {
+    if (index == NO_INDEX) {
+        emit_digit_m(e, 8, 0x80, 7, RSI, NO_INDEX, DIRECT_PAGES_OFFSET + disp / MEMORY_PAGE_SIZE); // cmp byte [rsi + page], 0
+    } else {
+        emit_rm(e, 32, 0x8D, R9, index, NO_INDEX, disp); // lea r9d, [index + disp]
+        emit_rr(e, 32, 0x0FB7, R9, R9); // movzx r9d, r9w
+        emit_digit_r(e, 32, 0xC1, 5, R9); // shr r9d, 8
+        emit8(e, 8);
+        emit_digit_m(e, 8, 0x80, 7, RSI, R9, DIRECT_PAGES_OFFSET); // cmp byte [rsi + r9 + pages], 0
+    }
+    emit8(e, 0);
+    add_stub(e, STUB_STOP, emit_jcc(e, CC_Z), op->pc, 0);
+}
+
+// Checks the pages of all of the bytes an operation reads or writes, before it changes anything
+static void emit_page_checks(jit_emitter_t *e, const jit_op_t *op) {
+    uint8_t opcode = op->opcode;
+    if ((opcode >= 0x40 && opcode < 0xC0 && (opcode & 0x07) == 6) || (opcode >= 0x70 && opcode < 0x78)
+        || opcode == 0x34 || opcode == 0x35 || opcode == 0x36) { // MOV, ALU, INR, DCR and MVI with M
+        emit_page_check(e, op, RDX, 0);
+    } else if (opcode == 0x02 || opcode == 0x0A) { // STAX B, LDAX B
+        emit_page_check(e, op, RBX, 0);
+    } else if (opcode == 0x12 || opcode == 0x1A) { // STAX D, LDAX D
+        emit_page_check(e, op, RCX, 0);
+    } else if (opcode == 0x32 || opcode == 0x3A) { // STA, LDA
+        emit_page_check(e, op, NO_INDEX, op->operand);
+    } else if (opcode == 0x22 || opcode == 0x2A) { // SHLD, LHLD
+        emit_page_check(e, op, NO_INDEX, op->operand);
+        emit_page_check(e, op, NO_INDEX, (uint16_t)(op->operand + 1));
+    } else if ((opcode & 0xCF) == 0xC1 || opcode == 0xC9 || opcode == 0xD9 || (opcode & 0xC7) == 0xC0 || opcode == 0xE3) { // POP, RET, XTHL
+        emit_page_check(e, op, RDI, 0);
+        emit_page_check(e, op, RDI, 1);
+    } else if ((opcode & 0xCF) == 0xC5 || (opcode & 0xCF) == 0xCD || (opcode & 0xC7) == 0xC4 || (opcode & 0xC7) == 0xC7) { // PUSH, CALL, RST
+        emit_page_check(e, op, RDI, -1);
+        emit_page_check(e, op, RDI, -2);
+    }
+}
+
+// Leaves the block after an operation that has stored to translated code
+static void emit_code_write_exit(jit_emitter_t *e, const jit_op_t *op, uint16_t pc) {
+    emit_rr(e, 8, 0x84, R15, R15);
+    add_stub(e, STUB_SMC, emit_jcc(e, CC_NZ), pc, op->opcode | (op->operand << 8));
+}
+
+static void emit_push_reg(jit_emitter_t *e, int reg) {
+    emit_digit_r(e, 16, 0xFF, 1, RDI); // dec di
+    emit_rm(e, 8, 0x88, reg, RSI, RDI, 0);
+    emit_store_check(e, RDI, 0);
+}
+
+static void emit_push_imm(jit_emitter_t *e, uint8_t value) {
+    emit_digit_r(e, 16, 0xFF, 1, RDI); // dec di
+    emit_digit_m(e, 8, 0xC6, 0, RSI, RDI, 0);
+    emit8(e, value);
+    emit_store_check(e, RDI, 0);
+}
+
+static void emit_pop_reg(jit_emitter_t *e, int reg) {
+    emit_rm(e, 8, 0x8A, reg, RSI, RDI, 0);
+    emit_digit_r(e, 16, 0xFF, 0, RDI); // inc di
+}
+
+// Pushes the return address, a call always leaves the block
+static void emit_call(jit_emitter_t *e, const jit_op_t *op, uint16_t target) {
+    uint16_t return_address = op->pc + op_lengths[op->opcode];
+    emit_push_imm(e, return_address >> 8);
+    emit_push_imm(e, return_address & 0xFF);
+    emit_code_write_exit(e, op, target);
+    add_stub(e, STUB_LINK, emit_jmp(e), target, 0);
+}
+
+// Pops the return address into R8D and jumps to its block through the entries table
+static void emit_return(jit_t *jit, jit_emitter_t *e) {
+    emit_rm(e, 32, 0x0FB6, R8, RSI, RDI, 0); // movzx r8d, byte [rsi + rdi]
+    emit_digit_r(e, 16, 0xFF, 0, RDI);
+    emit_rm(e, 32, 0x0FB6, R9, RSI, RDI, 0);
+    emit_digit_r(e, 16, 0xFF, 0, RDI);
+    emit_digit_r(e, 32, 0xC1, 4, R9); // shl r9d, 8
+    emit8(e, 8);
+    emit_rr(e, 32, 0x09, R9, R8); // or r8d, r9d
+    emit_jmp_to(e, jit->lookup_routine);
+}
+
+// Sets the host zero flag to the opposite of the condition of a conditional operation
+static int emit_condition_test(jit_emitter_t *e, uint8_t opcode) {
+    static const uint8_t masks[4] = {FLAG_Z, FLAG_C, FLAG_P, FLAG_S};
+    int condition = (opcode >> 3) & 0x07;
+    emit_digit_r(e, 8, 0xF6, 0, AH); // test ah, mask
+    emit8(e, masks[condition >> 1]);
+    return (condition & 1) ? CC_NZ : CC_Z; // Host condition code met when the 8080 condition is met
+}
+
+static void emit_alu(jit_emitter_t *e, int alu, int src, uint8_t imm, uint8_t live_flags) {
+    bool flags_live = live_flags & FLAGS_ALL;
+    bool ac_live = live_flags & FLAG_AC;
+    if (alu == ALU_CMP && !flags_live)
+        return;
+    if (alu == ALU_ADC || alu == ALU_SBB)
+        emit8(e, 0x9E); // SAHF, makes the 8080 carry the host carry
+    if (alu == ALU_ANA && ac_live) {
+        // AC of AND is bit 3 of (A | operand), it's moved to bit 12 of R8D (bit 4 of AH)
+        emit_rr(e, 8, 0x88, AL, AH); // mov ah, al
+        emit_alu8(e, 1, AH, src, imm); // or ah, operand
+        emit_rr(e, 32, 0x89, RAX, R8); // mov r8d, eax
+        emit_digit_r(e, 32, 0x81, 4, R8); // and r8d, 0x800
+        emit32(e, 0x800);
+        emit_digit_r(e, 32, 0xD1, 4, R8); // shl r8d, 1
+    }
+    emit_alu8(e, alu_ops[alu], AL, src, imm);
+    if (!flags_live)
+        return;
+    emit8(e, 0x9F); // LAHF
+    if (!ac_live)
+        return;
+    switch (alu) {
+        case ALU_SUB:
+        case ALU_SBB:
+        case ALU_CMP:
+            // The 8080 sets AC when there is NO borrow from the lower nibble
+            emit_digit_r(e, 8, 0x80, 6, AH); // xor ah, AC
+            emit8(e, FLAG_AC);
+            break;
+        case ALU_ANA:
+            emit_digit_r(e, 8, 0x80, 4, AH); // and ah, ~AC
+            emit8(e, (uint8_t)~FLAG_AC);
+            emit_rr(e, 32, 0x09, R8, RAX); // or eax, r8d
+            break;
+        case ALU_XRA:
+        case ALU_ORA:
+            emit_digit_r(e, 8, 0x80, 4, AH); // and ah, ~AC
+            emit8(e, (uint8_t)~FLAG_AC);
+            break;
+    }
+}
+
+/**
+ * Emits the code of a single operation
+ * Returns true if the operation ends a segment
+ */
+static bool emit_op(jit_t *jit, jit_emitter_t *e, const jit_op_t *op) {
+    uint8_t opcode = op->opcode;
+    uint8_t live_flags = op->live_flags;
+    uint16_t next_pc = op->pc + op_lengths[opcode];
+    if (e->check_pages) {
+        emit_page_checks(e, op);
+    }
+    e->segment_cycles += op_cycles[opcode];
+    if (opcode >= 0x40 && opcode < 0x80) { // MOV, HLT never gets here
+        int dst = (opcode >> 3) & 0x07;
+        int src = opcode & 0x07;
+        if (dst == 6) {
+            emit_rm(e, 8, 0x88, regs8[src], RSI, RDX, 0);
+            emit_store_check(e, RDX, 0);
+            emit_code_write_exit(e, op, next_pc);
+        } else if (src == 6) {
+            emit_rm(e, 8, 0x8A, regs8[dst], RSI, RDX, 0);
+        } else if (dst != src) {
+            emit_rr(e, 8, 0x88, regs8[src], regs8[dst]);
+        }
+        return false;
+    }
+    if (opcode >= 0x80 && opcode < 0xC0) {
+        emit_alu(e, (opcode >> 3) & 0x07, opcode & 0x07, 0, live_flags);
+        return false;
+    }
+    if ((opcode & 0xC7) == 0xC6) {
+        emit_alu(e, (opcode >> 3) & 0x07, -1, op->operand, live_flags);
+        return false;
+    }
+    if (opcode < 0x40) {
+        int reg = (opcode >> 3) & 0x07;
+        int pair = (opcode >> 4) & 0x03;
+        switch (opcode & 0x0F) {
+            case 0x01: // LXI
+                emit_mov_imm32(e, regs16[pair], op->operand);
+                return false;
+            case 0x03: // INX
+            case 0x0B: // DCX
+                emit_digit_r(e, 16, 0xFF, (opcode >> 3) & 1, regs16[pair]);
+                return false;
+            case 0x09: // DAD
+                if (live_flags & FLAG_C)
+                    emit_digit_r(e, 8, 0xD0, 5, AH); // shr ah, 1
+                emit_rr(e, 16, 0x01, regs16[pair], RDX);
+                if (live_flags & FLAG_C)
+                    emit_digit_r(e, 8, 0xD0, 2, AH); // rcl ah, 1, the carry of the addition becomes the 8080 carry
+                return false;
+        }
+        switch (opcode & 0x07) {
+            case 0x04: // INR
+            case 0x05: // DCR
+                {
+                    int digit = opcode & 1;
+                    bool flags_live = live_flags & (FLAGS_ALL & ~FLAG_C);
+                    if (flags_live && (live_flags & FLAG_C))
+                        emit8(e, 0x9E); // SAHF, INC and DEC keep the carry
+                    if (reg == 6) {
+                        emit_digit_m(e, 8, 0xFE, digit, RSI, RDX, 0);
+                    } else {
+                        emit_digit_r(e, 8, 0xFE, digit, regs8[reg]);
+                    }
+                    if (flags_live) {
+                        emit8(e, 0x9F); // LAHF
+                        if (digit == 1 && (live_flags & FLAG_AC)) {
+                            emit_digit_r(e, 8, 0x80, 6, AH); // xor ah, AC
+                            emit8(e, FLAG_AC);
+                        }
+                    }
+                    if (reg == 6) {
+                        emit_store_check(e, RDX, 0);
+                        emit_code_write_exit(e, op, next_pc);
+                    }
+                }
+                return false;
+            case 0x06: // MVI
+                if (reg == 6) {
+                    emit_digit_m(e, 8, 0xC6, 0, RSI, RDX, 0);
+                    emit8(e, op->operand);
+                    emit_store_check(e, RDX, 0);
+                    emit_code_write_exit(e, op, next_pc);
+                } else {
+                    emit8(e, 0xB0 + regs8[reg]);
+                    emit8(e, op->operand);
+                }
+                return false;
+        }
+    }
+    switch (opcode) {
+        case 0x00: case 0x08: case 0x10: case 0x18: // NOP
+        case 0x20: case 0x28: case 0x30: case 0x38:
+            break;
+        case 0x02: // STAX B
+        case 0x12: // STAX D
+            emit_rm(e, 8, 0x88, AL, RSI, regs16[opcode >> 4], 0);
+            emit_store_check(e, regs16[opcode >> 4], 0);
+            emit_code_write_exit(e, op, next_pc);
+            break;
+        case 0x0A: // LDAX B
+        case 0x1A: // LDAX D
+            emit_rm(e, 8, 0x8A, AL, RSI, regs16[opcode >> 4], 0);
+            break;
+        case 0x22: // SHLD
+            emit_rm(e, 8, 0x88, DL, RSI, NO_INDEX, op->operand);
+            emit_rm(e, 8, 0x88, DH, RSI, NO_INDEX, (uint16_t)(op->operand + 1));
+            emit_store_check(e, NO_INDEX, op->operand);
+            emit_store_check(e, NO_INDEX, (uint16_t)(op->operand + 1));
+            emit_code_write_exit(e, op, next_pc);
+            break;
+        case 0x2A: // LHLD
+            emit_rm(e, 8, 0x8A, DL, RSI, NO_INDEX, op->operand);
+            emit_rm(e, 8, 0x8A, DH, RSI, NO_INDEX, (uint16_t)(op->operand + 1));
+            break;
+        case 0x32: // STA
+            emit_rm(e, 8, 0x88, AL, RSI, NO_INDEX, op->operand);
+            emit_store_check(e, NO_INDEX, op->operand);
+            emit_code_write_exit(e, op, next_pc);
+            break;
+        case 0x3A: // LDA
+            emit_rm(e, 8, 0x8A, AL, RSI, NO_INDEX, op->operand);
+            break;
+        case 0x07: // RLC
+        case 0x0F: // RRC
+        case 0x17: // RAL
+        case 0x1F: // RAR
+            {
+                // SHR puts the 8080 carry into the host carry, RCL brings back AH with the new carry
+                bool carry_used = (opcode == 0x17 || opcode == 0x1F);
+                if (carry_used || (live_flags & FLAG_C))
+                    emit_digit_r(e, 8, 0xD0, 5, AH);
+                emit_digit_r(e, 8, 0xD0, opcode >> 3, AL); // rol, ror, rcl or rcr al, 1
+                if (carry_used || (live_flags & FLAG_C))
+                    emit_digit_r(e, 8, 0xD0, 2, AH);
+            }
+            break;
+        case 0x2F: // CMA
+            emit_digit_r(e, 8, 0xF6, 2, AL);
+            break;
+        case 0x37: // STC
+            if (live_flags & FLAG_C) {
+                emit_digit_r(e, 8, 0x80, 1, AH);
+                emit8(e, FLAG_C);
+            }
+            break;
+        case 0x3F: // CMC
+            if (live_flags & FLAG_C) {
+                emit_digit_r(e, 8, 0x80, 6, AH);
+                emit8(e, FLAG_C);
+            }
+            break;
+        case 0xC1: // POP B
+        case 0xD1: // POP D
+        case 0xE1: // POP H
+            emit_pop_reg(e, regs8[((opcode >> 4) & 0x03) * 2 + 1]);
+            emit_pop_reg(e, regs8[((opcode >> 4) & 0x03) * 2]);
+            break;
+        case 0xF1: // POP PSW
+            emit_pop_reg(e, AH);
+            emit_digit_r(e, 8, 0x80, 4, AH);
+            emit8(e, FLAGS_ALL);
+            emit_digit_r(e, 8, 0x80, 1, AH);
+            emit8(e, STATUS_REG_FIXED_BITS);
+            emit_pop_reg(e, AL);
+            break;
+        case 0xC5: // PUSH B
+        case 0xD5: // PUSH D
+        case 0xE5: // PUSH H
+            emit_push_reg(e, regs8[((opcode >> 4) & 0x03) * 2]);
+            emit_push_reg(e, regs8[((opcode >> 4) & 0x03) * 2 + 1]);
+            emit_code_write_exit(e, op, next_pc);
+            break;
+        case 0xF5: // PUSH PSW
+            emit_push_reg(e, AL);
+            emit_push_reg(e, AH);
+            emit_code_write_exit(e, op, next_pc);
+            break;
+        case 0xC3: // JMP
+        case 0xCB:
+            add_stub(e, STUB_LINK, emit_jmp(e), op->operand, 0);
+            break;
+        case 0xCD: // CALL
+        case 0xDD:
+        case 0xED:
+        case 0xFD:
+            emit_call(e, op, op->operand);
+            break;
+        case 0xC9: // RET
+        case 0xD9:
+            emit_return(jit, e);
+            break;
+        case 0xE9: // PCHL
+            emit_rr(e, 32, 0x89, RDX, R8);
+            emit_jmp_to(e, jit->lookup_routine);
+            break;
+        case 0xF9: // SPHL
+            emit_rr(e, 32, 0x89, RDX, RDI);
+            break;
+        case 0xF3: // DI
+            emit_rm(e, 64, 0x8B, R11, RBP, NO_INDEX, offsetof(jit_regs_t, interrupts_enabled));
+            emit_digit_m(e, 8, 0xC6, 0, R11, NO_INDEX, 0);
+            emit8(e, 0);
+            break;
+        case 0xEB: // XCHG
+            emit_rr(e, 32, 0x87, RCX, RDX);
+            break;
+        case 0xE3: // XTHL
+            emit_rm(e, 32, 0x0FB6, R9, RSI, RDI, 0); // movzx r9d, byte [rsi + rdi]
+            emit_rm(e, 32, 0x8D, R10, RDI, NO_INDEX, 1); // lea r10d, [rdi + 1]
+            emit_rr(e, 32, 0x0FB7, R10, R10); // movzx r10d, r10w
+            emit_rm(e, 32, 0x0FB6, R11, RSI, R10, 0); // movzx r11d, byte [rsi + r10]
+            emit_rm(e, 8, 0x88, DL, RSI, RDI, 0);
+            emit_rr(e, 32, 0x89, RDX, R8); // mov r8d, edx
+            emit_digit_r(e, 32, 0xC1, 5, R8); // shr r8d, 8
+            emit8(e, 8);
+            emit_rm(e, 8, 0x88, R8, RSI, R10, 0);
+            emit_digit_r(e, 32, 0xC1, 4, R11); // shl r11d, 8
+            emit8(e, 8);
+            emit_rr(e, 32, 0x09, R9, R11); // or r11d, r9d
+            emit_rr(e, 32, 0x89, R11, RDX); // mov edx, r11d
+            emit_store_check(e, RDI, 0);
+            emit_store_check(e, R10, 0);
+            emit_code_write_exit(e, op, next_pc);
+            break;
+        default:
+            if ((opcode & 0xC7) == 0xC2) { // Jcc
+                add_stub(e, STUB_LINK, emit_jcc(e, emit_condition_test(e, opcode)), op->operand, 0);
+                return true;
+            }
+            if ((opcode & 0xC7) == 0xC4) { // Ccc
+                uint8_t *skip = emit_jcc(e, emit_condition_test(e, opcode) ^ 1);
+                emit_digit_r(e, 64, 0x81, 5, R12); // sub r12, 6
+                emit32(e, 6);
+                emit_call(e, op, op->operand);
+                patch_rel32(skip, e->p);
+                return true;
+            }
+            if ((opcode & 0xC7) == 0xC0) { // Rcc
+                uint8_t *skip = emit_jcc(e, emit_condition_test(e, opcode) ^ 1);
+                emit_digit_r(e, 64, 0x81, 5, R12);
+                emit32(e, 6);
+                emit_return(jit, e);
+                patch_rel32(skip, e->p);
+                return true;
+            }
+            if ((opcode & 0xC7) == 0xC7) { // RST
+                emit_call(e, op, opcode & 0x38);
+                break;
+            }
+            fprintf(stderr, "JIT error: operation %02X can't be translated\n", opcode);
+            abort();
+    }
+    return false;
+}
+
+/**
+ * Checks if the operation can be translated, the rest is left to the interpreter:
+ * DAA, HLT, IN, OUT and EI (which delays the interrupts by one operation)
+ */
+static bool is_translatable(uint8_t opcode) {
+    return opcode != 0x27 && opcode != 0x76 && opcode != 0xD3 && opcode != 0xDB && opcode != 0xFB;
+}
+
+/**
+ * Checks if the operation always transfers control (JMP, CALL, RET, RST, PCHL)
+ */
+static bool ends_block(uint8_t opcode) {
+    switch (opcode) {
+        case 0xC3: case 0xCB:
+        case 0xCD: case 0xDD: case 0xED: case 0xFD:
+        case 0xC9: case 0xD9:
+        case 0xE9:
+            return true;
+    }
+    return (opcode & 0xC7) == 0xC7;
+}
+
+/**
+ * Finds the flags read ('uses') and overwritten ('defs') by an operation.
+ * Every exit from a block (also a conditional one) counts as reading all of the flags
+ */
+static void get_flag_effects(uint8_t opcode, uint8_t *uses, uint8_t *defs) {
+    *uses = 0;
+    *defs = 0;
+    if ((opcode >= 0x80 && opcode < 0xC0) || (opcode & 0xC7) == 0xC6) {
+        int alu = (opcode >> 3) & 0x07;
+        *defs = FLAGS_ALL;
+        if (alu == ALU_ADC || alu == ALU_SBB)
+            *uses = FLAG_C;
+    } else if (opcode < 0x40 && ((opcode & 0x07) == 0x04 || (opcode & 0x07) == 0x05)) {
+        *defs = FLAGS_ALL & ~FLAG_C;
+    } else if ((opcode < 0x40 && (opcode & 0x0F) == 0x09) || opcode == 0x07 || opcode == 0x0F || opcode == 0x37) {
+        *defs = FLAG_C;
+    } else if (opcode == 0x17 || opcode == 0x1F || opcode == 0x3F) {
+        *uses = FLAG_C;
+        *defs = FLAG_C;
+    } else if (opcode == 0xF1) {
+        *defs = FLAGS_ALL;
+    } else if (opcode == 0xF5 || opcode >= 0xC0) {
+        *uses = FLAGS_ALL;
+    }
+}
+
+inline static bool is_trap_address(const uint8_t *trap_map, uint16_t address) {
+    return trap_map[address >> 3] & (1 << (address & 0x07));
+}
+
+/**
+ * Reads a byte of code the way the CPU fetches it
+ * Returns false if its page has no host memory to read (a memory-mapped device)
+ */
+static bool read_code(const memory_t *memory, uint16_t address, uint8_t *byte) {
+    const uint8_t *page = memory->read_map[address / MEMORY_PAGE_SIZE];
+    if (page == NULL) {
+        return false;
+    }
+    *byte = page[address % MEMORY_PAGE_SIZE];
+    return true;
+}
+
+/**
+ * Returns the address in the executable mapping of the code buffer of the code at 'p' in the writable one
+ */
+static void *executable(const jit_t *jit, const uint8_t *p) {
+    return jit->code_exec + (p - jit->code_buffer);
+}
+
+inline static bool block_contains(const jit_block_t *block, uint16_t address) {
+    return (uint16_t)(address - block->start_pc) <= (uint16_t)(block->last_address - block->start_pc);
+}
+
+static bool page_blocks_add(jit_page_blocks_t *page, int index) {
+    if (page->count == page->capacity) {
+        int capacity = page->capacity ? page->capacity * 2 : 16;
+        int *indices = realloc(page->indices, capacity * sizeof(int));
+        if (indices == NULL)
+            return false;
+        page->indices = indices;
+        page->capacity = capacity;
+    }
+    page->indices[page->count++] = index;
+    return true;
+}
+
+static void page_blocks_remove(jit_page_blocks_t *page, int index) {
+    for (int i = 0; i < page->count; i++) {
+        if (page->indices[i] == index) {
+            page->indices[i] = page->indices[--page->count];
+            return;
+        }
+    }
+}
+
+/**
+ * Makes room for one more block in the blocks table and in the page lists it will be added to
+ * Returns false if there is not enough memory
+ */
+static bool reserve_block(jit_t *jit, uint16_t start_pc, uint16_t last_address) {
+    if (jit->blocks_count == jit->blocks_capacity) {
+        int capacity = jit->blocks_capacity ? jit->blocks_capacity * 2 : 1024;
+        jit_block_t *blocks = realloc(jit->blocks, capacity * sizeof(jit_block_t));
+        if (blocks == NULL)
+            return false;
+        jit->blocks = blocks;
+        jit->blocks_capacity = capacity;
+    }
+    // Adding and removing a dummy entry leaves the page lists with enough capacity
+    jit_page_blocks_t *first_page = &jit->page_blocks[start_pc / MEMORY_PAGE_SIZE];
+    jit_page_blocks_t *last_page = &jit->page_blocks[last_address / MEMORY_PAGE_SIZE];
+    if (!page_blocks_add(first_page, -1))
+        return false;
+    first_page->count--;
+    if (!page_blocks_add(last_page, -1))
+        return false;
+    last_page->count--;
+    return true;
+}
+
+static void mark_page_code(jit_t *jit, int page) {
+    jit_page_blocks_t *page_blocks = &jit->page_blocks[page];
+    for (int i = 0; i < page_blocks->count; i++) {
+        const jit_block_t *block = &jit->blocks[page_blocks->indices[i]];
+        memory_mark_code(jit->memory, block->start_pc, block->last_address);
+    }
+}
+
+/**
+ * Makes the block unreachable, jumps already linked to it end up in its stale stub
+ */
+static void invalidate_block(jit_t *jit, int index) {
+    jit_block_t *block = &jit->blocks[index];
+    int first_page = block->start_pc / MEMORY_PAGE_SIZE;
+    int last_page = block->last_address / MEMORY_PAGE_SIZE;
+    block->valid = false;
+    block->code[0] = 0xE9;
+    patch_rel32(block->code + 1, block->stale_stub);
+    if (jit->entries[block->start_pc] == executable(jit, block->code)) {
+        jit->entries[block->start_pc] = NULL;
+    }
+    page_blocks_remove(&jit->page_blocks[first_page], index);
+    page_blocks_remove(&jit->page_blocks[last_page], index);
+    // Bytes shared with other blocks on the same pages are marked again
+    memory_unmark_code(jit->memory, block->start_pc, block->last_address);
+    mark_page_code(jit, first_page);
+    if (last_page != first_page) {
+        mark_page_code(jit, last_page);
+    }
+    if (jit->invalidations[block->start_pc] < JIT_MAX_INVALIDATIONS) {
+        jit->invalidations[block->start_pc]++;
+    }
+    jit->stats.invalidated_blocks++;
+}
+
+/**
+ * Invalidates every block containing a written byte, called through the memory code write hook
+ */
+static void jit_code_written(void *context, uint16_t address) {
+    jit_t *jit = context;
+    jit_page_blocks_t *page = &jit->page_blocks[address / MEMORY_PAGE_SIZE];
+    int i = 0;
+    while (i < page->count) {
+        if (block_contains(&jit->blocks[page->indices[i]], address)) {
+            invalidate_block(jit, page->indices[i]); // The last block of the list takes its place
+        } else {
+            i++;
+        }
+    }
+}
+
+/**
+ * Translates the block starting at a given address
+ * Returns its code or NULL if it can't be translated
+ */
+static void *translate_block(jit_t *jit, uint16_t start_pc, const uint8_t *trap_map) {
+    if (jit->invalidations[start_pc] >= JIT_MAX_INVALIDATIONS || is_trap_address(trap_map, start_pc)) {
+        return NULL;
+    }
+    jit_op_t ops[JIT_MAX_BLOCK_OPS];
+    int ops_count = 0;
+    uint16_t pc = start_pc;
+    bool falls_through = true;
+    bool stops_at_interpreted = false;
+    while (ops_count < JIT_MAX_BLOCK_OPS) {
+        uint8_t opcode, low = 0, high = 0;
+        // Code read from memory-mapped devices is left to the interpreter
+        if (!read_code(jit->memory, pc, &opcode) || !is_translatable(opcode)
+            || (op_lengths[opcode] > 1 && !read_code(jit->memory, pc + 1, &low))
+            || (op_lengths[opcode] > 2 && !read_code(jit->memory, pc + 2, &high))) {
+            stops_at_interpreted = true;
+            break;
+        }
+        jit_op_t *op = &ops[ops_count++];
+        op->pc = pc;
+        op->opcode = opcode;
+        op->operand = (high << 8) | low;
+        pc += op_lengths[opcode];
+        if (ends_block(opcode)) {
+            falls_through = false;
+            break;
+        }
+    }
+    if (ops_count == 0) {
+        return NULL;
+    }
+    uint16_t last_address = pc - 1;
+    // Flags overwritten later in the block don't have to be calculated
+    uint8_t live_flags = FLAGS_ALL;
+    for (int i = ops_count - 1; i >= 0; i--) {
+        uint8_t uses, defs;
+        get_flag_effects(ops[i].opcode, &uses, &defs);
+        ops[i].live_flags = live_flags;
+        live_flags = (live_flags & ~defs) | uses;
+    }
+    if (JIT_CODE_BUFFER_SIZE - jit->code_used < MAX_BLOCK_CODE_SIZE) {
+        jit_flush(jit);
+    }
+    if (!reserve_block(jit, start_pc, last_address)) {
+        return NULL;
+    }
+
+    jit_emitter_t emitter;
+    jit_emitter_t *e = &emitter;
+    e->p = jit->code_buffer + jit->code_used;
+    e->stubs_count = 0;
+    e->segment_cycles = 0;
+    e->check_pages = jit->memory->remapped_pages != 0;
+    uint8_t *code = e->p;
+    // Stop before the block if the budget is used up or an interrupt is waiting
+    emit_rr(e, 64, 0x85, R12, R12); // test r12, r12
+    add_stub(e, STUB_STOP, emit_jcc(e, CC_LE), start_pc, 0);
+    emit_digit_m(e, 8, 0x80, 7, R14, NO_INDEX, 0); // cmp byte [r14], 0
+    emit8(e, 0);
+    add_stub(e, STUB_STOP, emit_jcc(e, CC_NZ), start_pc, 0);
+    open_segment(e);
+    for (int i = 0; i < ops_count; i++) {
+        if (emit_op(jit, e, &ops[i]) && i < ops_count - 1) {
+            close_segment(e);
+            open_segment(e);
+        }
+    }
+    close_segment(e);
+    if (falls_through) {
+        if (stops_at_interpreted) {
+            emit_mov_imm32(e, R8, pc);
+            emit_mov_imm32(e, R9, JIT_EXIT_STOP);
+            emit_jmp_to(e, jit->exit_routine);
+        } else {
+            add_stub(e, STUB_LINK, emit_jmp(e), pc, 0);
+        }
+    }
+    for (int i = 0; i < e->stubs_count; i++) {
+        jit_stub_t *stub = &e->stubs[i];
+        patch_rel32(stub->site, e->p);
+        emit_mov_imm32(e, R8, stub->pc);
+        if (stub->kind != STUB_LINK && stub->segment_cycles > 0) {
+            emit_digit_r(e, 64, 0x81, 0, R12); // add r12, cycles of the skipped operations
+            emit32(e, stub->segment_cycles);
+        }
+        switch (stub->kind) {
+            case STUB_STOP:
+                emit_mov_imm32(e, R9, JIT_EXIT_STOP);
+                break;
+            case STUB_LINK:
+                emit_mov_imm32(e, R10, stub->site - jit->code_buffer);
+                emit_mov_imm32(e, R9, JIT_EXIT_LINK);
+                break;
+            case STUB_SMC:
+                emit_mov_imm32(e, R10, stub->info);
+                emit_mov_imm32(e, R9, JIT_EXIT_SMC);
+                break;
+        }
+        emit_jmp_to(e, jit->exit_routine);
+    }
+    uint8_t *stale_stub = e->p;
+    emit_mov_imm32(e, R8, start_pc);
+    emit_jmp_to(e, jit->lookup_routine);
+    if (e->p - code > MAX_BLOCK_CODE_SIZE) {
+        fprintf(stderr, "JIT error: block code overflow\n");
+        abort();
+    }
+    jit->code_used = e->p - jit->code_buffer;
+
+    int index = jit->blocks_count++;
+    jit_block_t *block = &jit->blocks[index];
+    block->start_pc = start_pc;
+    block->last_address = last_address;
+    block->valid = true;
+    block->code = code;
+    block->stale_stub = stale_stub;
+    page_blocks_add(&jit->page_blocks[start_pc / MEMORY_PAGE_SIZE], index);
+    if (last_address / MEMORY_PAGE_SIZE != start_pc / MEMORY_PAGE_SIZE) {
+        page_blocks_add(&jit->page_blocks[last_address / MEMORY_PAGE_SIZE], index);
+    }
+    memory_mark_code(jit->memory, start_pc, last_address);
+    jit->entries[start_pc] = executable(jit, code);
+    jit->unchecked_blocks |= !e->check_pages;
+    jit->stats.translated_blocks++;
+    return jit->entries[start_pc];
+}
+
+/**
+ * Emits the routines shared by all blocks at the start of the code buffer:
+ * enter (called from C), exit (returns to C) and lookup (jumps to the block at R8D)
+ */
+static void emit_routines(jit_t *jit) {
+    jit_emitter_t e = {.p = jit->code_buffer};
+
+    void *enter = executable(jit, e.p);
+    memcpy(&jit->enter, &enter, sizeof(jit->enter)); // ISO C doesn't allow casting data pointers to function pointers
+    emit8(&e, 0x53); // push rbx
+    emit8(&e, 0x55); // push rbp
+    for (int reg = R12; reg <= R15; reg++) {
+        emit8(&e, 0x41);
+        emit8(&e, 0x50 + (reg & 0x07));
+    }
+    emit_rr(&e, 64, 0x89, RDI, RBP);
+    emit_rr(&e, 64, 0x89, RSI, R9);
+    emit_rm(&e, 32, 0x0FB7, RAX, RBP, NO_INDEX, offsetof(jit_regs_t, a));
+    emit_rm(&e, 32, 0x0FB7, RBX, RBP, NO_INDEX, offsetof(jit_regs_t, bc));
+    emit_rm(&e, 32, 0x0FB7, RCX, RBP, NO_INDEX, offsetof(jit_regs_t, de));
+    emit_rm(&e, 32, 0x0FB7, RDX, RBP, NO_INDEX, offsetof(jit_regs_t, hl));
+    emit_rm(&e, 32, 0x0FB7, RDI, RBP, NO_INDEX, offsetof(jit_regs_t, sp));
+    emit_rm(&e, 64, 0x8B, RSI, RBP, NO_INDEX, offsetof(jit_regs_t, memory));
+    emit_rm(&e, 64, 0x8B, R12, RBP, NO_INDEX, offsetof(jit_regs_t, remaining_cycles));
+    emit_rm(&e, 64, 0x8B, R13, RBP, NO_INDEX, offsetof(jit_regs_t, entries));
+    emit_rm(&e, 64, 0x8B, R14, RBP, NO_INDEX, offsetof(jit_regs_t, interrupt_pending));
+    emit_rr(&e, 32, 0x31, R15, R15);
+    emit_digit_r(&e, 32, 0xFF, 4, R9); // jmp r9
+
+    jit->exit_routine = e.p;
+    emit_rm(&e, 16, 0x89, RAX, RBP, NO_INDEX, offsetof(jit_regs_t, a));
+    emit_rm(&e, 16, 0x89, RBX, RBP, NO_INDEX, offsetof(jit_regs_t, bc));
+    emit_rm(&e, 16, 0x89, RCX, RBP, NO_INDEX, offsetof(jit_regs_t, de));
+    emit_rm(&e, 16, 0x89, RDX, RBP, NO_INDEX, offsetof(jit_regs_t, hl));
+    emit_rm(&e, 16, 0x89, RDI, RBP, NO_INDEX, offsetof(jit_regs_t, sp));
+    emit_rm(&e, 16, 0x89, R8, RBP, NO_INDEX, offsetof(jit_regs_t, pc));
+    emit_rm(&e, 32, 0x89, R10, RBP, NO_INDEX, offsetof(jit_regs_t, exit_info));
+    emit_rm(&e, 64, 0x89, R12, RBP, NO_INDEX, offsetof(jit_regs_t, remaining_cycles));
+    emit_rr(&e, 32, 0x89, R9, RAX);
+    for (int reg = R15; reg >= R12; reg--) {
+        emit8(&e, 0x41);
+        emit8(&e, 0x58 + (reg & 0x07));
+    }
+    emit8(&e, 0x5D); // pop rbp
+    emit8(&e, 0x5B); // pop rbx
+    emit8(&e, 0xC3); // ret
+
+    jit->lookup_routine = e.p;
+    emit_instruction(&e, 64, 0x8B, R9, true, R13, false, R8, 3, 0); // mov r9, [r13 + r8 * 8]
+    emit_rr(&e, 64, 0x85, R9, R9);
+    uint8_t *miss = emit_jcc(&e, CC_Z);
+    emit_digit_r(&e, 32, 0xFF, 4, R9); // jmp r9
+    patch_rel32(miss, e.p);
+    emit_mov_imm32(&e, R9, JIT_EXIT_LOOKUP);
+    emit_jmp_to(&e, jit->exit_routine);
+
+    jit->routines_size = e.p - jit->code_buffer;
+    jit->code_used = jit->routines_size;
+}
+
+/**
+ * Allocates the JIT for a given memory and connects it to the memory code write hook
+ * Returns NULL if there is not enough memory or executable memory can't be mapped
+ */
+jit_t *jit_create(memory_t *memory) {
+    jit_t *jit = calloc(1, sizeof(jit_t));
+    if (jit == NULL) {
+        return NULL;
+    }
+    int fd = memfd_create("jit", MFD_CLOEXEC);
+    if (fd == -1) {
+        free(jit);
+        return NULL;
+    }
+    if (ftruncate(fd, JIT_CODE_BUFFER_SIZE) == 0) {
+        jit->code_buffer = mmap(NULL, JIT_CODE_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        jit->code_exec = mmap(NULL, JIT_CODE_BUFFER_SIZE, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+    } else {
+        jit->code_buffer = MAP_FAILED;
+        jit->code_exec = MAP_FAILED;
+    }
+    close(fd); // The mappings keep the memory
+    if (jit->code_buffer == MAP_FAILED || jit->code_exec == MAP_FAILED) {
+        if (jit->code_buffer != MAP_FAILED) {
+            munmap(jit->code_buffer, JIT_CODE_BUFFER_SIZE);
+        }
+        if (jit->code_exec != MAP_FAILED) {
+            munmap(jit->code_exec, JIT_CODE_BUFFER_SIZE);
+        }
+        free(jit);
+        return NULL;
+    }
+    jit->memory = memory;
+    emit_routines(jit);
+    memory_set_code_write_hook(memory, jit_code_written, jit);
+    return jit;
+}
+
+void jit_destroy(jit_t *jit) {
+    if (jit == NULL) {
+        return;
+    }
+    jit_flush(jit);
+    memory_set_code_write_hook(jit->memory, NULL, NULL);
+    munmap(jit->code_buffer, JIT_CODE_BUFFER_SIZE);
+    munmap(jit->code_exec, JIT_CODE_BUFFER_SIZE);
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        free(jit->page_blocks[page].indices);
+    }
+    free(jit->blocks);
+    free(jit);
+}
+
+/**
+ * Throws away all translated code
+ */
+void jit_flush(jit_t *jit) {
+    for (int i = 0; i < jit->blocks_count; i++) {
+        if (jit->blocks[i].valid) {
+            memory_unmark_code(jit->memory, jit->blocks[i].start_pc, jit->blocks[i].last_address);
+        }
+    }
+    memset(jit->entries, 0, sizeof(jit->entries));
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        jit->page_blocks[page].count = 0;
+    }
+    jit->blocks_count = 0;
+    jit->unchecked_blocks = false;
+    jit->code_used = jit->routines_size;
+    jit->stats.flushes++;
+}
+
+/**
+ * Returns the translated code of the block at a given address, translating it if the address is hot
+ * Returns NULL if it isn't translated
+ */
+void *jit_get_code(jit_t *jit, uint16_t pc, const uint8_t *trap_map) {
+    if (jit->entries[pc] != NULL) {
+        return jit->entries[pc];
+    }
+    if (jit->heat[pc] < JIT_HOT_THRESHOLD) {
+        jit->heat[pc]++;
+        return NULL;
+    }
+    void *code = translate_block(jit, pc, trap_map);
+    if (code == NULL) {
+        jit->heat[pc] = 0; // Try again later
+    }
+    return code;
+}
+
+/**
+ * Invalidates translated code overwritten by the operation the translated code has just left
+ */
+static void handle_code_write(jit_t *jit, const jit_regs_t *regs) {
+    uint8_t opcode = regs->exit_info & 0xFF;
+    uint16_t operand = regs->exit_info >> 8;
+    uint16_t address;
+    int length = 1;
+    if ((opcode & 0xC0) == 0xC0) { // PUSH, CALL, RST, XTHL
+        address = regs->sp;
+        length = 2;
+    } else if (opcode == 0x02) {
+        address = regs->bc;
+    } else if (opcode == 0x12) {
+        address = regs->de;
+    } else if (opcode == 0x22) {
+        address = operand;
+        length = 2;
+    } else if (opcode == 0x32) {
+        address = operand;
+    } else { // MOV M,r, MVI M, INR M, DCR M
+        address = regs->hl;
+    }
+    for (int i = 0; i < length; i++) {
+        uint16_t written = address + i;
+        if (jit->memory->code_map[written]) {
+            memory_code_written(jit->memory, written);
+        }
+    }
+}
+
+/**
+ * Executes translated code starting at regs->pc until regs->remaining_cycles are used up
+ * or the execution has to continue in the interpreter.
+ * Jumps to blocks that aren't translated yet are linked on the way. The blocks are thrown away first
+ * if the traps changed ('traps_generation' differs) since they were translated
+ * Returns the number of clock cycles the executed operations took, 0 if there is no translated code at regs->pc
+ */
+long long jit_run(jit_t *jit, jit_regs_t *regs, const uint8_t *trap_map, uint32_t traps_generation) {
+    long long budget_cycles = regs->remaining_cycles;
+    if (jit->traps_generation != traps_generation) {
+        if (jit->blocks_count > 0) {
+            jit_flush(jit); // Blocks may run through addresses trapped since they were translated
+        }
+        jit->traps_generation = traps_generation;
+    }
+    if (jit->unchecked_blocks && jit->memory->remapped_pages != 0) {
+        jit_flush(jit); // Pages have been remapped since the blocks were translated without checking them
+    }
+    regs->memory = jit->memory;
+    regs->entries = jit->entries;
+    void *code = jit_get_code(jit, regs->pc, trap_map);
+    while (code != NULL && regs->remaining_cycles > 0) {
+        jit_exit_reason_t reason = jit->enter(regs, code);
+        jit->stats.exits++;
+        code = NULL;
+        switch (reason) {
+            case JIT_EXIT_LINK:
+                {
+                    unsigned long long flushes = jit->stats.flushes;
+                    code = jit->entries[regs->pc];
+                    if (code == NULL) {
+                        code = translate_block(jit, regs->pc, trap_map);
+                    }
+                    if (code != NULL && jit->stats.flushes == flushes) {
+                        patch_rel32(jit->code_buffer + regs->exit_info, jit->code_buffer + ((uint8_t *)code - jit->code_exec));
+                    }
+                }
+                break;
+            case JIT_EXIT_LOOKUP:
+                code = jit_get_code(jit, regs->pc, trap_map);
+                break;
+            case JIT_EXIT_SMC:
+                handle_code_write(jit, regs);
+                code = jit->entries[regs->pc];
+                break;
+            case JIT_EXIT_STOP:
+                break;
+        }
+    }
+    return budget_cycles - regs->remaining_cycles;
+}
@@ -0,0 +1,100 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include "memory.h"
+
+#define JIT_HOT_THRESHOLD 32 // Number of control transfers to an address before its block gets translated
+#define JIT_MAX_INVALIDATIONS 4 // Blocks invalidated this many times are left to the interpreter
+#define JIT_MAX_BLOCK_OPS 64
+#define JIT_CODE_BUFFER_SIZE (16 * 1024 * 1024)
+
+// Why the translated code returned to jit_run
+typedef enum JIT_EXIT_REASON {
+    JIT_EXIT_STOP, // Budget used up, interrupt pending or an operation only the interpreter executes
+    JIT_EXIT_LOOKUP, // Indirect jump to an address without translated code
+    JIT_EXIT_LINK, // Direct jump whose target isn't linked yet
+    JIT_EXIT_SMC // The last operation has written to translated code
+} jit_exit_reason_t;
+
+/*
+ * The 8080 registers as the translated code loads them into host registers and stores them back.
+ * A and F come first and next to each other, so they form AX
+ */
+typedef struct JIT_REGS {
+    uint8_t a;
+    uint8_t f;
+    uint16_t bc, de, hl, sp, pc;
+    uint32_t exit_info; // JIT_EXIT_LINK: offset of the jump to patch, JIT_EXIT_SMC: opcode and operand of the operation
+    long long remaining_cycles;
+    memory_t *memory;
+    void *const *entries;
+    const atomic_bool *interrupt_pending;
+    bool *interrupts_enabled; // Written by the translated DI
+} jit_regs_t;
+
+typedef struct JIT_STATS {
+    unsigned long long translated_blocks;
+    unsigned long long invalidated_blocks;
+    unsigned long long flushes; // The code buffer was full and everything was thrown away
+    unsigned long long exits; // Returns from the translated code to jit_run
+} jit_stats_t;
+
+typedef struct JIT_BLOCK {
+    uint16_t start_pc;
+    uint16_t last_address; // Last byte of the last translated operation
+    bool valid;
+    uint8_t *code;
+    uint8_t *stale_stub; // Jumped to from the start of the code once the block is invalidated
+} jit_block_t;
+
+// Indices of the valid blocks having at least one byte on a page
+typedef struct JIT_PAGE_BLOCKS {
+    int *indices;
+    int count;
+    int capacity;
+} jit_page_blocks_t;
+
+typedef struct JIT {
+    memory_t *memory;
+    uint8_t *code_buffer; // Writable mapping of the code
+    uint8_t *code_exec; // Executable mapping of the same memory
+    size_t code_used;
+    size_t routines_size; // The shared routines at the start of the buffer are kept when it gets flushed
+    jit_exit_reason_t (*enter)(jit_regs_t *regs, void *code);
+    uint8_t *lookup_routine;
+    uint8_t *exit_routine;
+    void *entries[MEMORY_SIZE]; // Translated code of the blocks by their start address
+    uint8_t heat[MEMORY_SIZE];
+    uint8_t invalidations[MEMORY_SIZE];
+    jit_block_t *blocks;
+    int blocks_count;
+    int blocks_capacity;
+    jit_page_blocks_t page_blocks[MEMORY_PAGES];
+    bool unchecked_blocks; // Some blocks were translated while all pages were the RAM in 'data', so they access it without checks
+    uint32_t traps_generation; // Generation of the traps the blocks were translated with
+    jit_stats_t stats;
+} jit_t;
+
+jit_t *jit_create(memory_t *memory);
+
+void jit_destroy(jit_t *jit);
+
+void jit_flush(jit_t *jit);
+
+void *jit_get_code(jit_t *jit, uint16_t pc, const uint8_t *trap_map);
+
+long long jit_run(jit_t *jit, jit_regs_t *regs, const uint8_t *trap_map, uint32_t traps_generation);
+
+/**
+ * Counts a control transfer to a given address,
+ * returns true if the interpreter should hand the execution over to the translated code
+ */
+inline static bool jit_should_enter(jit_t *jit, uint16_t pc) {
+    return jit->entries[pc] != NULL || ++jit->heat[pc] == JIT_HOT_THRESHOLD;
+}
+
+#endif // __JIT_H__
@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "loader.h"
+
+/**
+ * Describes an error of loading a file in loader->error
+ * Returns false so it can end the loading right away
+ */
+static bool fail(loader_t *loader, const char *path, const char *format, ...) {
+    int prefix = snprintf(loader->error, LOADER_ERROR_SIZE, "%s: ", path);
+    if (prefix >= 0 && prefix < LOADER_ERROR_SIZE) {
+        va_list args;
+        va_start(args, format);
+        vsnprintf(&loader->error[prefix], LOADER_ERROR_SIZE - prefix, format, args);
+        va_end(args);
+    }
+    return false;
+}
+
+/**
+ * Maps a whole file read-only, the mapping is shared with every other process mapping the file
+ * until someone writes to it
+ * Returns NULL (with the error described) if the file can't be mapped or is empty
+ */
+static const uint8_t *map_file(loader_t *loader, const char *path, size_t *length) {
+    int file = open(path, O_RDONLY);
+    if (file < 0) {
+        fail(loader, path, "%s", strerror(errno));
+        return NULL;
+    }
+    struct stat file_stat;
+    if (fstat(file, &file_stat) != 0) {
+        fail(loader, path, "%s", strerror(errno));
+        close(file);
+        return NULL;
+    }
+    if (file_stat.st_size == 0) {
+        fail(loader, path, "the file is empty");
+        close(file);
+        return NULL;
+    }
+    void *mapped = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (mapped == MAP_FAILED) {
+        fail(loader, path, "%s", strerror(errno));
+        return NULL;
+    }
+    *length = file_stat.st_size;
+    return mapped;
+}
+
+/**
+ * Records a loaded range, merging it with the previous one if it directly follows it
+ */
+static bool add_range(loader_t *loader, const char *path, uint16_t first_address, uint32_t length, bool rom) {
+    if (loader->ranges_count > 0) {
+        loader_range_t *last = &loader->ranges[loader->ranges_count - 1];
+        if (last->rom == rom && last->first_address + last->length == first_address) {
+            last->length += length;
+            return true;
+        }
+    }
+    if (loader->ranges_count == LOADER_MAX_RANGES) {
+        return fail(loader, path, "more than %d loaded ranges", LOADER_MAX_RANGES);
+    }
+    loader->ranges[loader->ranges_count++] = (loader_range_t){first_address, length, rom};
+    return true;
+}
+
+/**
+ * Writes the bytes of an image and clears the code marks of their range. The blocks decoded from
+ * the previous bytes went stale on the write, the marks left of them would only slow down the next
+ * program if it used the range for data
+ */
+static void write_image(loader_t *loader, uint16_t first_address, const uint8_t *bytes, uint32_t length) {
+    memory_write_bytes(loader->memory, first_address, bytes, length);
+    memory_unmark_code(loader->memory, first_address, first_address + length - 1);
+}
+
+static bool load_binary(loader_t *loader, const loader_segment_t *segment) {
+    size_t length;
+    const uint8_t *image = map_file(loader, segment->path, &length);
+    if (image == NULL) {
+        return false;
+    }
+    bool fits = segment->address + length <= MEMORY_SIZE;
+    if (fits) {
+        write_image(loader, segment->address, image, length);
+    }
+    munmap((void *)image, length);
+    if (!fits) {
+        return fail(loader, segment->path, "%zu bytes don't fit in the memory at %04Xh", length, segment->address);
+    }
+    return add_range(loader, segment->path, segment->address, length, false);
+}
+
+/**
+ * Maps the pages of a ROM image straight to the mapped file. The bytes between the end of the file
+ * and the end of its last page read as 0, the host pages are never smaller than the memory pages
+ */
+static bool load_rom(loader_t *loader, const loader_segment_t *segment) {
+    if (segment->address % MEMORY_PAGE_SIZE != 0) {
+        return fail(loader, segment->path, "ROM address %04Xh isn't at a page boundary", segment->address);
+    }
+    if (loader->mappings_count == LOADER_MAX_MAPPINGS) {
+        return fail(loader, segment->path, "more than %d ROM images", LOADER_MAX_MAPPINGS);
+    }
+    size_t length;
+    const uint8_t *image = map_file(loader, segment->path, &length);
+    if (image == NULL) {
+        return false;
+    }
+    if (segment->address + length > MEMORY_SIZE) {
+        munmap((void *)image, length);
+        return fail(loader, segment->path, "%zu bytes don't fit in the memory at %04Xh", length, segment->address);
+    }
+    loader_mapping_t *mapping = &loader->mappings[loader->mappings_count++];
+    mapping->address = (void *)image;
+    mapping->length = length;
+    mapping->first_page = segment->address / MEMORY_PAGE_SIZE;
+    mapping->pages_count = (length + MEMORY_PAGE_SIZE - 1) / MEMORY_PAGE_SIZE;
+    memory_map_rom(loader->memory, mapping->first_page, mapping->pages_count, image);
+    memory_unmark_code(loader->memory, segment->address, segment->address + length - 1);
+    return add_range(loader, segment->path, segment->address, length, true);
+}
+
+/**
+ * Parses 'count' pairs of hex digits
+ * Returns false if there are less of them
+ */
+static bool parse_hex_bytes(const uint8_t *text, const uint8_t *end, int count, uint8_t *bytes) {
+    for (int i = 0; i < count; i++) {
+        if (end - text < 2) {
+            return false;
+        }
+        int value = 0;
+        for (int j = 0; j < 2; j++, text++) {
+            int digit = (*text >= '0' && *text <= '9') ? *text - '0'
+                : (*text >= 'A' && *text <= 'F') ? *text - 'A' + 10
+                : (*text >= 'a' && *text <= 'f') ? *text - 'a' + 10 : -1;
+            if (digit < 0) {
+                return false;
+            }
+            value = value * 16 + digit;
+        }
+        bytes[i] = value;
+    }
+    return true;
+}
+
+/**
+ * Loads data records (00) of an Intel HEX file. Extended address records (02, 04) are accepted
+ * only with a zero base and start address records (03, 05) set the entry address
+ */
+static bool load_intel_hex(loader_t *loader, const loader_segment_t *segment) {
+    size_t length;
+    const uint8_t *text = map_file(loader, segment->path, &length);
+    if (text == NULL) {
+        return false;
+    }
+    const uint8_t *end = text + length;
+    const uint8_t *position = text;
+    bool result = true;
+    bool ended = false;
+    for (int line = 1; result && !ended && position < end; line++) {
+        const uint8_t *line_end = memchr(position, '\n', end - position);
+        if (line_end == NULL) {
+            line_end = end;
+        }
+        const uint8_t *record_end = line_end;
+        while (record_end > position && (record_end[-1] == '\r' || record_end[-1] == ' ' || record_end[-1] == '\t')) {
+            record_end--;
+        }
+        if (record_end > position) {
+            uint8_t record[5 + 255];
+            if (*position != ':' || !parse_hex_bytes(position + 1, record_end, 1, record)
+                || record_end - position != 1 + 2 * (5 + record[0])
+                || !parse_hex_bytes(position + 1, record_end, 5 + record[0], record)) {
+                result = fail(loader, segment->path, "line %d isn't an Intel HEX record", line);
+                break;
+            }
+            uint8_t checksum = 0;
+            for (int i = 0; i < 5 + record[0]; i++) {
+                checksum += record[i];
+            }
+            int data_length = record[0];
+            uint16_t address = (record[1] << 8) | record[2];
+            const uint8_t *data = &record[4];
+            if (checksum != 0) {
+                result = fail(loader, segment->path, "wrong checksum on line %d", line);
+            } else if (record[3] == 0x00) {
+                if (address + data_length > MEMORY_SIZE) {
+                    result = fail(loader, segment->path, "record on line %d doesn't fit in the memory", line);
+                } else if (data_length > 0) {
+                    write_image(loader, address, data, data_length);
+                    result = add_range(loader, segment->path, address, data_length, false);
+                }
+            } else if (record[3] == 0x01) {
+                ended = true;
+            } else if ((record[3] == 0x02 || record[3] == 0x04) && data_length == 2) {
+                if (data[0] != 0 || data[1] != 0) {
+                    result = fail(loader, segment->path, "extended address on line %d is beyond the memory", line);
+                }
+            } else if ((record[3] == 0x03 || record[3] == 0x05) && data_length == 4) {
+                uint32_t entry = (record[3] == 0x03)
+                    ? ((uint32_t)((data[0] << 8) | data[1]) << 4) + ((data[2] << 8) | data[3])
+                    : ((uint32_t)data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+                if (entry >= MEMORY_SIZE) {
+                    result = fail(loader, segment->path, "start address on line %d is beyond the memory", line);
+                } else {
+                    loader->has_entry_address = true;
+                    loader->entry_address = entry;
+                }
+            } else {
+                result = fail(loader, segment->path, "unsupported record on line %d", line);
+            }
+        }
+        position = line_end + 1;
+    }
+    munmap((void *)text, length);
+    return result;
+}
+
+/**
+ * Prepares a loader putting images into a given memory
+ */
+void loader_init(loader_t *loader, memory_t *memory) {
+    memset(loader, 0, sizeof(loader_t));
+    loader->memory = memory;
+}
+
+/**
+ * Loads segments in the given order, the later ones overwrite the earlier ones.
+ * Loading stops at the first segment which can't be loaded, everything loaded
+ * before it (listed in loader->ranges) stays in the memory
+ * Returns false (with loader->error describing the problem) if some segment can't be loaded
+ */
+bool loader_load(loader_t *loader, const loader_segment_t *segments, int segments_count) {
+    loader->error[0] = '\0';
+    for (int i = 0; i < segments_count; i++) {
+        bool loaded;
+        switch (segments[i].format) {
+            case LOADER_BINARY:
+                loaded = load_binary(loader, &segments[i]);
+                break;
+            case LOADER_INTEL_HEX:
+                loaded = load_intel_hex(loader, &segments[i]);
+                break;
+            case LOADER_ROM:
+                loaded = load_rom(loader, &segments[i]);
+                break;
+            default:
+                loaded = fail(loader, segments[i].path, "unknown format");
+                break;
+        }
+        if (!loaded) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Maps the pages of the ROM images back to the RAM and unmaps the images
+ */
+void loader_unload(loader_t *loader) {
+    for (int i = 0; i < loader->mappings_count; i++) {
+        loader_mapping_t *mapping = &loader->mappings[i];
+        memory_map_ram(loader->memory, mapping->first_page, mapping->pages_count, NULL);
+        munmap(mapping->address, mapping->length);
+    }
+    loader->mappings_count = 0;
+}
@@ -0,0 +1,55 @@
+#ifndef __LOADER_H__
+#define __LOADER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "memory.h"
+
+#define LOADER_MAX_RANGES 64 // Loaded ranges reported by a single loader
+#define LOADER_MAX_MAPPINGS 16 // ROM images mapped by a single loader
+#define LOADER_ERROR_SIZE 256
+
+typedef enum LOADER_FORMAT {
+    LOADER_BINARY, // Raw bytes copied into the memory at the segment address
+    LOADER_INTEL_HEX, // Intel HEX records copied into the memory at their own addresses
+    LOADER_ROM // Raw bytes mapped read-only at the segment address without copying, which has to be at a page boundary
+} loader_format_t;
+
+typedef struct LOADER_SEGMENT {
+    const char *path;
+    loader_format_t format;
+    uint16_t address; // Ignored for LOADER_INTEL_HEX
+} loader_segment_t;
+
+typedef struct LOADER_RANGE {
+    uint16_t first_address;
+    uint32_t length;
+    bool rom; // True if the range is mapped read-only
+} loader_range_t;
+
+typedef struct LOADER_MAPPING {
+    void *address;
+    size_t length;
+    uint8_t first_page;
+    int pages_count;
+} loader_mapping_t;
+
+typedef struct LOADER {
+    memory_t *memory;
+    loader_range_t ranges[LOADER_MAX_RANGES]; // Every range of the memory loaded so far, in the order of loading
+    int ranges_count;
+    bool has_entry_address;
+    uint16_t entry_address; // Start address from the last Intel HEX file which had one
+    loader_mapping_t mappings[LOADER_MAX_MAPPINGS]; // Mapped ROM images, unmapped by loader_unload
+    int mappings_count;
+    char error[LOADER_ERROR_SIZE]; // Description of the last error
+} loader_t;
+
+void loader_init(loader_t *loader, memory_t *memory);
+
+bool loader_load(loader_t *loader, const loader_segment_t *segments, int segments_count);
+
+void loader_unload(loader_t *loader);
+
+#endif // __LOADER_H__
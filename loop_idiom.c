@@ -0,0 +1,339 @@
+#include <stdlib.h>
+#include "loop_idiom.h"
+
+#define REG_A 7
+
+/**
+ * Returns the register pair a register belongs to (B and C to BC and so on)
+ */
+inline static int pair_of(int reg) {
+    return reg / 2;
+}
+
+/**
+ * Returns the clock cycles of an operation allowed in a loop body
+ * (counted the same way as in cpu.c) or 0 if the loop can't contain it
+ */
+static int body_op_cycles(uint8_t opcode) {
+    if (opcode == 0x7E || opcode == 0x0A || opcode == 0x1A) { // MOV A,M; LDAX B; LDAX D
+        return 7;
+    }
+    if ((opcode >= 0x70 && opcode <= 0x75) || opcode == 0x77 || opcode == 0x02 || opcode == 0x12) { // MOV M,r; STAX B; STAX D
+        return 7;
+    }
+    if (opcode == 0x36 || opcode == 0xDB) { // MVI M,D8; IN D8
+        return 10;
+    }
+    if ((opcode & 0xC7) == 0x03 && opcode != 0x33 && opcode != 0x3B) { // INX rp; DCX rp (but not SP)
+        return 5;
+    }
+    if ((opcode & 0xC7) == 0x05 && opcode != 0x35 && opcode != 0x3D) { // DCR r (but not M or A)
+        return 5;
+    }
+    if (opcode >= 0x78 && opcode <= 0x7D) { // MOV A,r
+        return 5;
+    }
+    if (opcode >= 0xB0 && opcode <= 0xB5) { // ORA r
+        return 4;
+    }
+    if (opcode == 0xBE) { // CMP M
+        return 4;
+    }
+    if (opcode == 0xC2) { // JNZ adr, leaving the loop (not taken)
+        return 10;
+    }
+    return 0;
+}
+
+/**
+ * Returns the clock cycles of an operation testing the status in the poll of an input loop
+ * or 0 if the poll can't use it
+ */
+static int poll_test_cycles(uint8_t opcode) {
+    if (opcode == 0xB7 || opcode == 0xA7) { // ORA A; ANA A
+        return 4;
+    }
+    if (opcode == 0x07 || opcode == 0x0F || opcode == 0x17 || opcode == 0x1F) { // RLC; RRC; RAL; RAR
+        return 4;
+    }
+    if (opcode == 0xE6) { // ANI D8
+        return 7;
+    }
+    return 0;
+}
+
+/**
+ * Returns true if a jump tests a flag set by a given status test,
+ * the carry for rotations (which leave the other flags alone), the zero or sign flag otherwise
+ */
+static bool is_poll_jump(uint8_t opcode, uint8_t test) {
+    int condition = (opcode >> 3) & 0x07;
+    bool rotation = test != 0xB7 && test != 0xA7 && test != 0xE6;
+    return (opcode & 0xC7) == 0xC2 && (rotation ? (condition == 2 || condition == 3) : (condition <= 1 || condition >= 6));
+}
+
+/**
+ * Recognizes a status poll at the start of a loop (IN, a test and a jump back to 'head')
+ * Returns the address of the operation after it or 'head' if there is no poll
+ */
+static uint16_t recognize_poll(memory_t *memory, uint16_t head, uint16_t jump, loop_idiom_t *idiom, int *cycles) {
+    idiom->has_poll = false;
+    uint8_t test = memory_get(memory, head + 2);
+    int test_length = (test == 0xE6) ? 2 : 1;
+    uint16_t poll_jump = head + 2 + test_length;
+    if (memory_get(memory, head) != 0xDB || poll_test_cycles(test) == 0 || poll_jump + 3 > jump
+        || !is_poll_jump(memory_get(memory, poll_jump), test)
+        || ((memory_get(memory, poll_jump + 2) << 8) | memory_get(memory, poll_jump + 1)) != head) {
+        return head;
+    }
+    idiom->has_poll = true;
+    idiom->poll_port = memory_get(memory, head + 1);
+    idiom->poll_test = test;
+    idiom->poll_mask = memory_get(memory, head + 3);
+    idiom->poll_jump = memory_get(memory, poll_jump);
+    *cycles += 10 + poll_test_cycles(test) + 10; // IN, the test and the jump which isn't taken
+    return poll_jump + 3;
+}
+
+/**
+ * Checks if the status poll of an input loop would go back to its head with a given status
+ * and gives the carry flag the test leaves
+ */
+bool loop_idiom_poll_waits(const loop_idiom_t *idiom, uint8_t status, uint8_t *carry) {
+    uint8_t value = status;
+    *carry = 0;
+    switch (idiom->poll_test) {
+        case 0x07: // RLC
+        case 0x17: // RAL
+            *carry = status >> 7;
+            break;
+        case 0x0F: // RRC
+        case 0x1F: // RAR
+            *carry = status & 0x01;
+            break;
+        case 0xE6: // ANI D8
+            value = status & idiom->poll_mask;
+            break;
+        default: // ORA A; ANA A
+            break;
+    }
+    bool condition;
+    switch ((idiom->poll_jump >> 3) & 0x07) {
+        case 0: condition = value != 0; break; // JNZ
+        case 1: condition = value == 0; break; // JZ
+        case 2: condition = !*carry; break; // JNC
+        case 3: condition = *carry; break; // JC
+        case 6: condition = !(value & 0x80); break; // JP
+        default: condition = value & 0x80; break; // JM
+    }
+    return condition;
+}
+
+/**
+ * Checks if the loop from 'head' to the JNZ at 'jump' is one of the loops executed in bulk
+ * and describes it in 'idiom'
+ * Returns false if it isn't
+ */
+static bool recognize(memory_t *memory, uint16_t head, uint16_t jump, loop_idiom_t *idiom) {
+    uint8_t opcodes[LOOP_IDIOM_MAX_LENGTH];
+    uint16_t operands[LOOP_IDIOM_MAX_LENGTH];
+    int ops_count = 0;
+    int cycles = 10; // The closing JNZ
+    for (uint16_t address = recognize_poll(memory, head, jump, idiom, &cycles); address < jump; ops_count++) {
+        uint8_t opcode = memory_get(memory, address);
+        int length = (opcode == 0x36 || opcode == 0xDB) ? 2 : (opcode == 0xC2) ? 3 : 1;
+        if (body_op_cycles(opcode) == 0 || address + length > jump) {
+            return false;
+        }
+        opcodes[ops_count] = opcode;
+        operands[ops_count] = (length == 2) ? memory_get(memory, address + 1)
+            : (length == 3) ? (memory_get(memory, address + 2) << 8) | memory_get(memory, address + 1) : 0;
+        cycles += body_op_cycles(opcode);
+        address += length;
+    }
+
+    // The counter is tested right before the closing JNZ
+    int body_end;
+    int counter_dcx_count = 0;
+    if (ops_count >= 3 && opcodes[ops_count - 2] >= 0x78 && opcodes[ops_count - 2] <= 0x7D
+        && opcodes[ops_count - 1] >= 0xB0 && opcodes[ops_count - 1] <= 0xB5) {
+        int first_reg = opcodes[ops_count - 2] & 0x07;
+        int second_reg = opcodes[ops_count - 1] & 0x07;
+        if (first_reg == second_reg || pair_of(first_reg) != pair_of(second_reg)) {
+            return false;
+        }
+        idiom->counter_16bit = true;
+        idiom->counter = pair_of(first_reg);
+        body_end = ops_count - 2;
+    } else if (ops_count >= 2 && (opcodes[ops_count - 1] & 0xC7) == 0x05) {
+        idiom->counter_16bit = false;
+        idiom->counter = (opcodes[ops_count - 1] >> 3) & 0x07;
+        body_end = ops_count - 1;
+    } else {
+        return false;
+    }
+
+    int offsets[3] = {0, 0, 0};
+    bool stepped[3] = {false, false, false};
+    int load_pair = -1, load_offset = 0, load_index = -1;
+    int store_pair = -1, store_offset = 0, store_index = -1, store_register = 0;
+    int compare_offset = 0, compare_index = -1;
+    int input_index = -1;
+    for (int i = 0; i < body_end; i++) {
+        uint8_t opcode = opcodes[i];
+        int pair = (opcode >> 4) & 0x03;
+        if ((opcode & 0xCF) == 0x03) { // INX rp
+            if (idiom->counter_16bit && pair == idiom->counter) {
+                return false;
+            }
+            offsets[pair]++;
+            stepped[pair] = true;
+        } else if ((opcode & 0xCF) == 0x0B) { // DCX rp
+            if (idiom->counter_16bit && pair == idiom->counter) {
+                counter_dcx_count++;
+            } else {
+                offsets[pair]--;
+                stepped[pair] = true;
+            }
+        } else if (opcode == 0x7E || opcode == 0x0A || opcode == 0x1A) {
+            if (load_index >= 0 || input_index >= 0) {
+                return false;
+            }
+            load_pair = (opcode == 0x7E) ? LOOP_IDIOM_PAIR_HL : pair;
+            load_offset = offsets[load_pair];
+            load_index = i;
+        } else if (opcode == 0xDB) {
+            if (load_index >= 0 || input_index >= 0) {
+                return false;
+            }
+            idiom->port = operands[i];
+            input_index = i;
+        } else if ((opcode >= 0x70 && opcode <= 0x77) || opcode == 0x36 || opcode == 0x02 || opcode == 0x12) {
+            if (store_index >= 0) {
+                return false;
+            }
+            store_pair = (opcode == 0x02 || opcode == 0x12) ? pair : LOOP_IDIOM_PAIR_HL;
+            store_offset = offsets[store_pair];
+            store_index = i;
+            store_register = (opcode == 0x36) ? LOOP_IDIOM_IMMEDIATE : (opcode == 0x02 || opcode == 0x12) ? REG_A : (opcode & 0x07);
+            idiom->fill_immediate = operands[i];
+        } else if (opcode == 0xBE) {
+            // CMP M has to be followed by the JNZ leaving the loop on the first difference
+            if (compare_index >= 0 || i + 1 >= body_end || opcodes[i + 1] != 0xC2
+                || (operands[i + 1] >= head && operands[i + 1] <= jump)) {
+                return false;
+            }
+            compare_offset = offsets[LOOP_IDIOM_PAIR_HL];
+            compare_index = i;
+            i++;
+        } else {
+            return false; // DCR, MOV A,r, ORA r or JNZ anywhere else
+        }
+    }
+    if (idiom->counter_16bit && counter_dcx_count != 1) {
+        return false;
+    }
+
+    if (input_index >= 0) {
+        if (compare_index >= 0 || store_index < input_index || store_register != REG_A) {
+            return false;
+        }
+        idiom->kind = LOOP_IDIOM_INPUT;
+        idiom->target_pair = store_pair;
+        idiom->target_offset = store_offset;
+    } else if (idiom->has_poll) {
+        return false; // Only input loops wait for the device
+    } else if (compare_index >= 0) {
+        if (load_index < 0 || load_index > compare_index || store_index >= 0 || load_pair == LOOP_IDIOM_PAIR_HL) {
+            return false;
+        }
+        idiom->kind = LOOP_IDIOM_COMPARE;
+        idiom->source_pair = load_pair;
+        idiom->source_offset = load_offset;
+        idiom->target_pair = LOOP_IDIOM_PAIR_HL;
+        idiom->target_offset = compare_offset;
+    } else if (load_index >= 0) {
+        if (store_index < load_index || store_register != REG_A || store_pair == load_pair) {
+            return false;
+        }
+        idiom->kind = LOOP_IDIOM_COPY;
+        idiom->source_pair = load_pair;
+        idiom->source_offset = load_offset;
+        idiom->target_pair = store_pair;
+        idiom->target_offset = store_offset;
+    } else if (store_index >= 0) {
+        // The stored value has to stay the same in every iteration
+        if (store_register == REG_A && idiom->counter_16bit) {
+            return false;
+        }
+        if (store_register < REG_A && store_register != LOOP_IDIOM_IMMEDIATE
+            && (stepped[pair_of(store_register)] || (idiom->counter_16bit ? pair_of(store_register) == idiom->counter : store_register == idiom->counter))) {
+            return false;
+        }
+        idiom->kind = LOOP_IDIOM_FILL;
+        idiom->target_pair = store_pair;
+        idiom->target_offset = store_offset;
+        idiom->fill_register = store_register;
+    } else {
+        return false;
+    }
+
+    // Every pointer moves by one byte per iteration, nothing else is stepped and the counter isn't a pointer
+    bool used[3] = {false, false, false};
+    bool has_source = idiom->kind == LOOP_IDIOM_COPY || idiom->kind == LOOP_IDIOM_COMPARE;
+    used[idiom->target_pair] = true;
+    if (has_source) {
+        used[idiom->source_pair] = true;
+    }
+    for (int pair = 0; pair < 3; pair++) {
+        if (used[pair] ? (offsets[pair] != 1 && offsets[pair] != -1) : stepped[pair]) {
+            return false;
+        }
+    }
+    if (used[idiom->counter_16bit ? idiom->counter : pair_of(idiom->counter)]) {
+        return false;
+    }
+    idiom->source_step = has_source ? offsets[idiom->source_pair] : 0;
+    idiom->target_step = offsets[idiom->target_pair];
+    idiom->iteration_cycles = cycles;
+    return true;
+}
+
+/**
+ * Allocates an empty cache of recognized loops for a given memory
+ * Returns NULL if there is not enough memory
+ */
+loop_idioms_t *loop_idioms_create(memory_t *memory) {
+    loop_idioms_t *idioms = calloc(1, sizeof(loop_idioms_t));
+    if (idioms != NULL) {
+        idioms->memory = memory;
+    }
+    return idioms;
+}
+
+void loop_idioms_destroy(loop_idioms_t *idioms) {
+    free(idioms);
+}
+
+/**
+ * Decodes the loop from 'head' to the JNZ at 'jump' into a given cache entry
+ * Returns the description of the loop or NULL if it can't be executed in bulk
+ */
+const loop_idiom_t *loop_idioms_recognize(loop_idioms_t *idioms, loop_idiom_entry_t *entry, uint16_t head, uint16_t jump) {
+    memory_t *memory = idioms->memory;
+    uint16_t last_address = jump + 2;
+    memory_mark_code(memory, head, last_address);
+    entry->valid = true;
+    entry->head = head;
+    entry->jump = jump;
+    entry->first_page = head / MEMORY_PAGE_SIZE;
+    entry->last_page = last_address / MEMORY_PAGE_SIZE;
+    entry->first_page_generation = memory->page_generation[entry->first_page];
+    entry->last_page_generation = memory->page_generation[entry->last_page];
+    if (!recognize(memory, head, jump, &entry->idiom)) {
+        entry->idiom.kind = LOOP_IDIOM_NONE;
+        return NULL;
+    }
+    idioms->stats.recognized_loops++;
+    return &entry->idiom;
+}
@@ -0,0 +1,105 @@
+#ifndef __LOOP_IDIOM_H__
+#define __LOOP_IDIOM_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory.h"
+
+#define LOOP_IDIOM_CACHE_SIZE 256 // Number of cached loops, must be a power of 2
+#define LOOP_IDIOM_MAX_LENGTH 24 // Longest loop body (without the closing JNZ) in bytes
+#define LOOP_IDIOM_MIN_ITERATIONS 4 // Fewer iterations are left to the interpreter
+
+// Register pairs as they are encoded in the opcodes
+#define LOOP_IDIOM_PAIR_BC 0
+#define LOOP_IDIOM_PAIR_DE 1
+#define LOOP_IDIOM_PAIR_HL 2
+
+#define LOOP_IDIOM_IMMEDIATE 6 // Register index of M, used for the value of MVI M,D8
+
+typedef enum LOOP_IDIOM_KIND {
+    LOOP_IDIOM_NONE, // The loop can't be executed in bulk
+    LOOP_IDIOM_COPY, // Loads A from the source and stores it to the target
+    LOOP_IDIOM_FILL, // Stores the same value to the target
+    LOOP_IDIOM_COMPARE, // Loads A from the source and compares it with the target (CMP M), leaves the loop on the first difference
+    LOOP_IDIOM_INPUT // Reads A from an input port (IN D8) and stores it to the target, the device may give the bytes as a block
+} loop_idiom_kind_t;
+
+/*
+ * A loop closed by a JNZ going back to its first operation.
+ * In the iteration k (counted from 0 at the loop head) the source is read from
+ * source pair + source_offset + k * source_step and the target is accessed
+ * at target pair + target_offset + k * target_step.
+ * An input loop may start with a status poll going back to the head until the device is ready,
+ * IN port; ORA A, ANA A, ANI D8 or a rotation; JZ, JNZ, JC, JNC, JP or JM
+ */
+typedef struct LOOP_IDIOM {
+    loop_idiom_kind_t kind;
+    uint8_t source_pair;
+    int8_t source_offset;
+    int8_t source_step;
+    uint8_t target_pair;
+    int8_t target_offset;
+    int8_t target_step;
+    bool counter_16bit; // DCX rp + MOV A,r + ORA r, otherwise DCR r
+    uint8_t counter; // Register pair or register (as encoded in the opcodes) counted down to 0
+    uint8_t fill_register; // Register stored by fill loops or LOOP_IDIOM_IMMEDIATE
+    uint8_t fill_immediate;
+    uint8_t port; // Data port of input loops
+    bool has_poll;
+    uint8_t poll_port;
+    uint8_t poll_test; // Opcode of the operation testing the status
+    uint8_t poll_mask; // Immediate of ANI
+    uint8_t poll_jump; // Opcode of the jump going back to the head
+    int iteration_cycles; // Clock cycles of an iteration which doesn't leave the loop (and doesn't wait in the poll)
+} loop_idiom_t;
+
+typedef struct LOOP_IDIOM_ENTRY {
+    bool valid;
+    uint16_t head; // Address of the first operation of the loop
+    uint16_t jump; // Address of the closing JNZ
+    uint8_t first_page;
+    uint8_t last_page;
+    uint32_t first_page_generation;
+    uint32_t last_page_generation;
+    loop_idiom_t idiom;
+} loop_idiom_entry_t;
+
+typedef struct LOOP_IDIOM_STATS {
+    unsigned long long recognized_loops; // Loops found to be executable in bulk
+    unsigned long long bulk_runs;
+    unsigned long long skipped_iterations; // Iterations executed in bulk instead of by the interpreter
+} loop_idiom_stats_t;
+
+typedef struct LOOP_IDIOMS {
+    memory_t *memory;
+    loop_idiom_stats_t stats;
+    loop_idiom_entry_t entries[LOOP_IDIOM_CACHE_SIZE]; // Direct-mapped, indexed by the lower bits of the loop head
+} loop_idioms_t;
+
+loop_idioms_t *loop_idioms_create(memory_t *memory);
+
+void loop_idioms_destroy(loop_idioms_t *idioms);
+
+bool loop_idiom_poll_waits(const loop_idiom_t *idiom, uint8_t status, uint8_t *carry);
+
+const loop_idiom_t *loop_idioms_recognize(loop_idioms_t *idioms, loop_idiom_entry_t *entry, uint16_t head, uint16_t jump);
+
+/**
+ * Returns the description of the loop from 'head' to the JNZ at 'jump'
+ * or NULL if it can't be executed in bulk. The result is cached
+ * until the code of the loop is written
+ */
+inline static const loop_idiom_t *loop_idioms_find(loop_idioms_t *idioms, uint16_t head, uint16_t jump) {
+    if (jump - head > LOOP_IDIOM_MAX_LENGTH) {
+        return NULL;
+    }
+    loop_idiom_entry_t *entry = &idioms->entries[head & (LOOP_IDIOM_CACHE_SIZE - 1)];
+    if (entry->valid && entry->head == head && entry->jump == jump
+        && idioms->memory->page_generation[entry->first_page] == entry->first_page_generation
+        && idioms->memory->page_generation[entry->last_page] == entry->last_page_generation) {
+        return (entry->idiom.kind != LOOP_IDIOM_NONE) ? &entry->idiom : NULL;
+    }
+    return loop_idioms_recognize(idioms, entry, head, jump);
+}
+
+#endif // __LOOP_IDIOM_H__
@@ -1,26 +1,283 @@
-#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "memory.h"
 
-static uint8_t memory_data[MEMORY_SIZE];
+/**
+ * Maps the RAM in 'data' to every page, without touching the RAM itself
+ */
+static void init_maps(memory_t *memory) {
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        memory->read_map[page] = &memory->data[page * MEMORY_PAGE_SIZE];
+        memory->write_map[page] = &memory->data[page * MEMORY_PAGE_SIZE];
+        memory->direct_pages[page] = 1;
+    }
+    memset(memory->handlers, 0, sizeof(memory->handlers));
+    memory->remapped_pages = 0;
+}
+
+/**
+ * Clears the whole memory and maps the RAM in 'data' to every page
+ */
+void memory_init(memory_t *memory) {
+    memset(memory->data, 0, MEMORY_SIZE);
+    init_maps(memory);
+    memset(memory->dirty_pages, 0, sizeof(memory->dirty_pages));
+    memset(memory->page_generation, 0, sizeof(memory->page_generation));
+    memset(memory->line_generation, 0, sizeof(memory->line_generation));
+    memset(memory->code_map, 0, sizeof(memory->code_map));
+    memory->code_write_hook = NULL;
+    memory->code_write_context = NULL;
+}
+
+/**
+ * Allocates a cleared memory the same as memory_init would prepare it. The host pages
+ * of the RAM and of the code map are left to the system to clear when they are first used,
+ * so an allocated memory takes little more than its page tables until it is written
+ * Returns NULL if there is not enough memory
+ */
+memory_t *memory_create() {
+    memory_t *memory = calloc(1, sizeof(memory_t));
+    if (memory != NULL) {
+        init_maps(memory);
+    }
+    return memory;
+}
+
+void memory_destroy(memory_t *memory) {
+    free(memory);
+}
+
+/**
+ * Write handler of shared pages, copies the page into the RAM in 'data' and maps it there
+ * before the write, 'context' is the memory
+ */
+static void copy_on_write(void *context, uint16_t address, uint8_t value) {
+    memory_t *memory = context;
+    uint8_t page = address / MEMORY_PAGE_SIZE;
+    memcpy(&memory->data[page * MEMORY_PAGE_SIZE], memory->read_map[page], MEMORY_PAGE_SIZE);
+    memory_map_ram(memory, page, 1, NULL);
+    memory_store(memory, address, value);
+}
+
+/**
+ * Writes bytes to a range of the memory (not wrapping around its end) the way the CPU would,
+ * directly to the host memory of the pages which have it and through the page handlers otherwise
+ */
+void memory_write_bytes(memory_t *memory, uint16_t first_address, const uint8_t *bytes, uint32_t length) {
+    uint32_t address = first_address;
+    while (length > 0) {
+        uint8_t *page = memory->write_map[address / MEMORY_PAGE_SIZE];
+        uint32_t offset = address % MEMORY_PAGE_SIZE;
+        uint32_t chunk = (length < MEMORY_PAGE_SIZE - offset) ? length : MEMORY_PAGE_SIZE - offset;
+        if (page == NULL) {
+            for (uint32_t i = 0; i < chunk; i++) {
+                memory_store(memory, address + i, bytes[i]); // The first write may map the page, e.g. a shared one
+            }
+        } else {
+            memcpy(&page[offset], bytes, chunk);
+            memory->dirty_pages[address / MEMORY_PAGE_SIZE] = 1;
+            for (uint32_t i = 0; i < chunk; i++) {
+                if (memory->code_map[address + i]) {
+                    memory_code_written(memory, address + i);
+                }
+            }
+        }
+        address += chunk;
+        bytes += chunk;
+        length -= chunk;
+    }
+}
+
+/**
+ * Overwrites a page with a saved copy of its bytes in the host memory it's mapped to (the RAM in 'data'
+ * for pages of devices), ROM pages are left as they are. A shared page is mapped to 'data' instead.
+ * The page stays clean as it holds the saved state
+ */
+void memory_restore_page(memory_t *memory, uint8_t page, const uint8_t *bytes) {
+    uint16_t first_address = page * MEMORY_PAGE_SIZE;
+    if (memory_is_shared(memory, page)) {
+        memory_map_ram(memory, page, 1, NULL);
+    }
+    uint8_t *host = memory->write_map[page];
+    if (host == NULL && memory->read_map[page] == NULL) {
+        host = &memory->data[first_address];
+    }
+    if (host != NULL) {
+        memcpy(host, bytes, MEMORY_PAGE_SIZE);
+        for (int i = 0; i < MEMORY_PAGE_SIZE; i++) {
+            if (memory->code_map[first_address + i]) {
+                memory_code_written(memory, first_address + i);
+            }
+        }
+    }
+    memory->dirty_pages[page] = 0;
+}
+
+/**
+ * Changes what a page is mapped to, keeping the number of remapped pages up to date.
+ * The page is dirty, its generation changes and its code counts as written, as it may no longer hold the same bytes
+ */
+static void map_page(memory_t *memory, int page, const uint8_t *read, uint8_t *write, const memory_page_handlers_t *handlers) {
+    const uint8_t *ram = &memory->data[page * MEMORY_PAGE_SIZE];
+    bool was_ram = memory->read_map[page] == ram && memory->write_map[page] == ram;
+    memory->read_map[page] = read;
+    memory->write_map[page] = write;
+    memory->handlers[page] = *handlers;
+    bool is_ram = read == ram && write == ram;
+    memory->remapped_pages += (int)was_ram - (int)is_ram;
+    memory->direct_pages[page] = is_ram;
+    memory->dirty_pages[page] = 1;
+    memory->page_generation[page]++;
+    for (int line = page * MEMORY_PAGE_SIZE / MEMORY_CODE_LINE_SIZE; line < (page + 1) * MEMORY_PAGE_SIZE / MEMORY_CODE_LINE_SIZE; line++) {
+        memory->line_generation[line]++;
+    }
+    for (int address = page * MEMORY_PAGE_SIZE; address < (page + 1) * MEMORY_PAGE_SIZE; address++) {
+        if (memory->code_map[address]) {
+            memory_code_written(memory, address);
+        }
+    }
+}
+
+/**
+ * Maps pages to host memory read and written directly, NULL maps them back to the RAM in 'data'
+ */
+void memory_map_ram(memory_t *memory, uint8_t first_page, int pages_count, uint8_t *ram) {
+    static const memory_page_handlers_t no_handlers = {NULL, NULL, NULL};
+    for (int i = 0; i < pages_count && first_page + i < MEMORY_PAGES; i++) {
+        int page = first_page + i;
+        uint8_t *page_ram = (ram != NULL) ? &ram[i * MEMORY_PAGE_SIZE] : &memory->data[page * MEMORY_PAGE_SIZE];
+        map_page(memory, page, page_ram, page_ram, &no_handlers);
+    }
+}
 
-void memory_read_file(char *path, uint16_t start_at) {
-    // TODO: Rework this, also handle file opening errors
-    FILE *file = fopen(path, "r");
-    if (file == NULL) {
-        perror("Program open error");
-        exit(-1);
+/**
+ * Maps pages to host memory which is read directly, writes to the pages are ignored
+ */
+void memory_map_rom(memory_t *memory, uint8_t first_page, int pages_count, const uint8_t *rom) {
+    static const memory_page_handlers_t no_handlers = {NULL, NULL, NULL};
+    for (int i = 0; i < pages_count && first_page + i < MEMORY_PAGES; i++) {
+        map_page(memory, first_page + i, &rom[i * MEMORY_PAGE_SIZE], NULL, &no_handlers);
     }
-    fread(memory_data+start_at, 1, (MEMORY_SIZE - start_at), file);
-    fclose(file);
 }
 
-void memory_store(uint16_t address, uint8_t value) {
-    memory_data[address] = value;
-    // printf("WRITE: %04X, VAL: %02X\n", address, memory_data[address]);
+/**
+ * Maps pages to a memory-mapped device, every access to them calls one of the handlers
+ * with the full address. A NULL read handler makes the pages read as MEMORY_UNMAPPED_VALUE,
+ * a NULL write handler makes them ignore writes
+ */
+void memory_map_handlers(memory_t *memory, uint8_t first_page, int pages_count,
+    memory_read_handler_t read_handler, memory_write_handler_t write_handler, void *context) {
+    const memory_page_handlers_t handlers = {read_handler, write_handler, context};
+    for (int i = 0; i < pages_count && first_page + i < MEMORY_PAGES; i++) {
+        map_page(memory, first_page + i, NULL, NULL, &handlers);
+    }
+}
+
+/**
+ * Maps pages to host memory shared with other memories, e.g. their common initial state.
+ * Reads go straight to the shared memory, the first write to a page copies it
+ * into the RAM in 'data' and maps it there, so the shared memory is never written
+ */
+void memory_map_shared(memory_t *memory, uint8_t first_page, int pages_count, const uint8_t *ram) {
+    const memory_page_handlers_t handlers = {NULL, copy_on_write, memory};
+    for (int i = 0; i < pages_count && first_page + i < MEMORY_PAGES; i++) {
+        map_page(memory, first_page + i, &ram[i * MEMORY_PAGE_SIZE], NULL, &handlers);
+    }
+}
+
+/**
+ * Checks if a page is mapped to shared memory it wasn't copied from yet
+ */
+bool memory_is_shared(const memory_t *memory, uint8_t page) {
+    return memory->handlers[page].write == copy_on_write;
+}
+
+/**
+ * Reads a byte from a page without host memory to read, called by memory_get
+ */
+uint8_t memory_read_handled(memory_t *memory, uint16_t address) {
+    const memory_page_handlers_t *handlers = &memory->handlers[address / MEMORY_PAGE_SIZE];
+    return (handlers->read != NULL) ? handlers->read(handlers->context, address) : MEMORY_UNMAPPED_VALUE;
+}
+
+/**
+ * Writes a byte to a page without host memory to write, called by memory_store
+ */
+void memory_write_handled(memory_t *memory, uint16_t address, uint8_t value) {
+    const memory_page_handlers_t *handlers = &memory->handlers[address / MEMORY_PAGE_SIZE];
+    if (handlers->write != NULL) {
+        handlers->write(handlers->context, address, value);
+    }
+}
+
+/**
+ * Compares a range of the memory (not wrapping around its end) with given bytes
+ * the way they are read, pages without host memory to read never match
+ */
+bool memory_equals(const memory_t *memory, uint16_t first_address, const uint8_t *bytes, uint32_t length) {
+    uint32_t address = first_address;
+    while (length > 0) {
+        const uint8_t *page = memory->read_map[address / MEMORY_PAGE_SIZE];
+        uint32_t offset = address % MEMORY_PAGE_SIZE;
+        uint32_t chunk = (length < MEMORY_PAGE_SIZE - offset) ? length : MEMORY_PAGE_SIZE - offset;
+        if (page == NULL || memcmp(&page[offset], bytes, chunk) != 0) {
+            return false;
+        }
+        address += chunk;
+        bytes += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+/**
+ * Marks a range of bytes as code, so writing to any of them
+ * changes the generation of its page and calls the code write hook.
+ * The range can wrap around the end of the memory
+ */
+void memory_mark_code(memory_t *memory, uint16_t first_address, uint16_t last_address) {
+    for (uint16_t address = first_address; ; address++) {
+        memory->code_map[address] = 1;
+        if (address == last_address)
+            break;
+    }
+}
+
+/**
+ * Marks a range of bytes as no longer used as code
+ */
+void memory_unmark_code(memory_t *memory, uint16_t first_address, uint16_t last_address) {
+    for (uint16_t address = first_address; ; address++) {
+        memory->code_map[address] = 0;
+        if (address == last_address)
+            break;
+    }
+}
+
+/**
+ * Checks if any byte of a range (not wrapping around the end of the memory) is marked as code,
+ * writes to such a range have to go through memory_store
+ */
+bool memory_has_code(const memory_t *memory, uint16_t first_address, uint32_t length) {
+    return memchr(&memory->code_map[first_address], 1, length) != NULL;
+}
+
+/**
+ * Handles a write to a byte marked as code,
+ * called by memory_store and by the JIT after its own stores
+ */
+void memory_code_written(memory_t *memory, uint16_t address) {
+    memory->page_generation[address / MEMORY_PAGE_SIZE]++;
+    memory->line_generation[address / MEMORY_CODE_LINE_SIZE]++;
+    if (memory->code_write_hook != NULL) {
+        memory->code_write_hook(memory->code_write_context, address);
+    }
 }
 
-uint8_t memory_get(uint16_t address) {
-    // printf("READ: %04X, VAL: %02X\n", address, memory_data[address]);
-    return memory_data[address];
+/**
+ * Sets the function called after every write to a byte marked as code, NULL removes it
+ */
+void memory_set_code_write_hook(memory_t *memory, memory_code_write_hook_t hook, void *context) {
+    memory->code_write_hook = hook;
+    memory->code_write_context = context;
 }
@@ -2,13 +2,130 @@
 #define __MEMORY_H__
 
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
 
 #define MEMORY_SIZE 0x10000
+#define MEMORY_PAGE_SIZE 0x100
+#define MEMORY_PAGES (MEMORY_SIZE / MEMORY_PAGE_SIZE)
+#define MEMORY_CODE_LINE_SIZE 32 // Code writes are tracked by lines this long for the block cache
+#define MEMORY_CODE_LINES (MEMORY_SIZE / MEMORY_CODE_LINE_SIZE)
+#define MEMORY_UNMAPPED_VALUE 0xFF // Read from pages without memory or a handler, like from the open Altair bus
 
-void memory_read_file(char *path, uint16_t start_at);
+typedef void (*memory_code_write_hook_t)(void *context, uint16_t address);
+typedef uint8_t (*memory_read_handler_t)(void *context, uint16_t address);
+typedef void (*memory_write_handler_t)(void *context, uint16_t address, uint8_t value);
 
-void memory_store(uint16_t address, uint8_t value);
+// Memory-mapped device handling the accesses to a page which has no host memory
+typedef struct MEMORY_PAGE_HANDLERS {
+    memory_read_handler_t read; // NULL if the page reads as MEMORY_UNMAPPED_VALUE
+    memory_write_handler_t write; // NULL if writes to the page are ignored
+    void *context;
+} memory_page_handlers_t;
 
-uint8_t memory_get(uint16_t address);
+typedef struct MEMORY {
+    uint8_t data[MEMORY_SIZE]; // RAM mapped by default, has to stay the first field, the JIT addresses it through the memory_t pointer
+    const uint8_t *read_map[MEMORY_PAGES]; // Host memory every page is read from, NULL if reads go to the page handlers
+    uint8_t *write_map[MEMORY_PAGES]; // Host memory every page is written to, NULL if writes go to the page handlers
+    memory_page_handlers_t handlers[MEMORY_PAGES];
+    int remapped_pages; // Number of pages that aren't the RAM in 'data', the bulk loops run only while it's 0
+    uint8_t direct_pages[MEMORY_PAGES]; // Non-zero for pages read and written in the RAM in 'data', the JIT checks them while any page is remapped
+    uint32_t page_generation[MEMORY_PAGES]; // Incremented on every write to code on the page and when the page is remapped
+    uint32_t line_generation[MEMORY_CODE_LINES]; // The same for every line, so a write to code goes stale only the blocks near it
+    uint8_t dirty_pages[MEMORY_PAGES]; // Non-zero for pages written or remapped since the last snapshot, cleared by the snapshots
+    uint8_t code_map[MEMORY_SIZE]; // Non-zero for bytes decoded as code by the block cache or translated by the JIT
+    memory_code_write_hook_t code_write_hook; // Called after a byte marked as code is written
+    void *code_write_context;
+} memory_t;
+
+void memory_init(memory_t *memory);
+
+memory_t *memory_create();
+
+void memory_destroy(memory_t *memory);
+
+void memory_map_ram(memory_t *memory, uint8_t first_page, int pages_count, uint8_t *ram);
+
+void memory_map_rom(memory_t *memory, uint8_t first_page, int pages_count, const uint8_t *rom);
+
+void memory_map_handlers(memory_t *memory, uint8_t first_page, int pages_count,
+    memory_read_handler_t read_handler, memory_write_handler_t write_handler, void *context);
+
+void memory_map_shared(memory_t *memory, uint8_t first_page, int pages_count, const uint8_t *ram);
+
+bool memory_is_shared(const memory_t *memory, uint8_t page);
+
+uint8_t memory_read_handled(memory_t *memory, uint16_t address);
+
+void memory_write_handled(memory_t *memory, uint16_t address, uint8_t value);
+
+void memory_write_bytes(memory_t *memory, uint16_t first_address, const uint8_t *bytes, uint32_t length);
+
+bool memory_equals(const memory_t *memory, uint16_t first_address, const uint8_t *bytes, uint32_t length);
+
+void memory_restore_page(memory_t *memory, uint8_t page, const uint8_t *bytes);
+
+void memory_mark_code(memory_t *memory, uint16_t first_address, uint16_t last_address);
+
+void memory_unmark_code(memory_t *memory, uint16_t first_address, uint16_t last_address);
+
+void memory_code_written(memory_t *memory, uint16_t address);
+
+bool memory_has_code(const memory_t *memory, uint16_t first_address, uint32_t length);
+
+void memory_set_code_write_hook(memory_t *memory, memory_code_write_hook_t hook, void *context);
+
+/**
+ * Reads a byte, RAM and ROM pages are read directly from the host memory
+ */
+inline static uint8_t memory_get(memory_t *memory, uint16_t address) {
+    const uint8_t *page = memory->read_map[address / MEMORY_PAGE_SIZE];
+    if (page == NULL) {
+        return memory_read_handled(memory, address);
+    }
+    return page[address % MEMORY_PAGE_SIZE];
+}
+
+/**
+ * Writes a byte, RAM pages are written directly to the host memory
+ */
+inline static void memory_store(memory_t *memory, uint16_t address, uint8_t value) {
+    uint8_t *page = memory->write_map[address / MEMORY_PAGE_SIZE];
+    if (page == NULL) {
+        memory_write_handled(memory, address, value);
+        return;
+    }
+    page[address % MEMORY_PAGE_SIZE] = value;
+    memory->dirty_pages[address / MEMORY_PAGE_SIZE] = 1;
+    if (memory->code_map[address]) {
+        memory_code_written(memory, address);
+    }
+}
+
+/**
+ * Marks the pages of a range of bytes (not wrapping around the end of the memory) written
+ * directly to 'data' as dirty
+ */
+inline static void memory_mark_dirty(memory_t *memory, uint16_t first_address, uint32_t length) {
+    for (uint32_t page = first_address / MEMORY_PAGE_SIZE; page <= (first_address + length - 1) / MEMORY_PAGE_SIZE; page++) {
+        memory->dirty_pages[page] = 1;
+    }
+}
+
+/**
+ * Checks if a range of bytes (not wrapping around the end of the memory) is mapped to the RAM in 'data',
+ * so it can be read and written there directly
+ */
+inline static bool memory_is_ram(const memory_t *memory, uint16_t first_address, uint32_t length) {
+    if (memory->remapped_pages == 0) {
+        return true;
+    }
+    for (uint32_t page = first_address / MEMORY_PAGE_SIZE; page <= (first_address + length - 1) / MEMORY_PAGE_SIZE; page++) {
+        if (!memory->direct_pages[page]) {
+            return false;
+        }
+    }
+    return true;
+}
 
 #endif // __MEMORY_H__
@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include "memory_bank.h"
+
+/**
+ * Allocates banks for a window of pages starting at 'first_page', bank 0 is selected.
+ * The window has to fit in the address space and there has to be at least one bank
+ * Returns NULL if there is not enough memory or the window is invalid
+ */
+memory_banks_t *memory_banks_create(memory_t *memory, uint8_t first_page, int pages_count, int banks_count) {
+    if (pages_count <= 0 || first_page + pages_count > MEMORY_PAGES || banks_count <= 0) {
+        return NULL;
+    }
+    memory_banks_t *banks = calloc(1, sizeof(memory_banks_t));
+    if (banks == NULL) {
+        return NULL;
+    }
+    if (banks_count > 1) {
+        banks->storage = calloc((size_t)(banks_count - 1) * pages_count, MEMORY_PAGE_SIZE);
+        if (banks->storage == NULL) {
+            free(banks);
+            return NULL;
+        }
+    }
+    banks->memory = memory;
+    banks->first_page = first_page;
+    banks->pages_count = pages_count;
+    banks->banks_count = banks_count;
+    return banks;
+}
+
+/**
+ * Frees the banks, the window is mapped back to bank 0 first
+ */
+void memory_banks_destroy(memory_banks_t *banks) {
+    if (banks != NULL) {
+        memory_banks_select(banks, 0);
+        free(banks->storage);
+        free(banks);
+    }
+}
+
+/**
+ * Returns the host memory holding a bank (pages_count pages), e.g. to load a program into it
+ * or NULL if there is no such bank
+ */
+uint8_t *memory_banks_get(memory_banks_t *banks, int bank) {
+    if (bank < 0 || bank >= banks->banks_count) {
+        return NULL;
+    }
+    if (bank == 0) {
+        return &banks->memory->data[banks->first_page * MEMORY_PAGE_SIZE];
+    }
+    return &banks->storage[(size_t)(bank - 1) * banks->pages_count * MEMORY_PAGE_SIZE];
+}
+
+/**
+ * Maps a bank into the window, nothing is copied and selecting the mapped bank again does nothing
+ * Returns false if there is no such bank
+ */
+bool memory_banks_select(memory_banks_t *banks, int bank) {
+    if (bank < 0 || bank >= banks->banks_count) {
+        return false;
+    }
+    if (bank != banks->selected) {
+        memory_map_ram(banks->memory, banks->first_page, banks->pages_count, (bank == 0) ? NULL : memory_banks_get(banks, bank));
+        banks->selected = bank;
+        banks->switches++;
+    }
+    return true;
+}
+
+/**
+ * Output port hook selecting the bank written to the port, 'context' is the memory_banks_t
+ * Values without a bank are ignored
+ */
+void memory_banks_io_write(void *context, uint8_t dev_id, uint8_t data) {
+    (void)dev_id;
+    memory_banks_select(context, data);
+}
+
+/**
+ * Memory-mapped register selecting the bank written to it, to be passed to memory_map_handlers
+ * with the memory_banks_t as the context. Values without a bank are ignored
+ */
+void memory_banks_mmio_write(void *context, uint16_t address, uint8_t value) {
+    (void)address;
+    memory_banks_select(context, value);
+}
@@ -0,0 +1,35 @@
+#ifndef __MEMORY_BANK_H__
+#define __MEMORY_BANK_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "memory.h"
+
+/*
+ * A window of pages in the address space switched between several banks of RAM.
+ * Bank 0 is the RAM in the memory itself, the other banks have their own host memory,
+ * so switching a bank only swaps the page pointers of the window
+ */
+typedef struct MEMORY_BANKS {
+    memory_t *memory;
+    uint8_t first_page; // First page of the window
+    int pages_count; // Pages in the window
+    int banks_count;
+    int selected;
+    uint8_t *storage; // Host memory of banks 1 to banks_count - 1, one after another
+    unsigned long long switches; // Selections which changed the mapped bank
+} memory_banks_t;
+
+memory_banks_t *memory_banks_create(memory_t *memory, uint8_t first_page, int pages_count, int banks_count);
+
+void memory_banks_destroy(memory_banks_t *banks);
+
+uint8_t *memory_banks_get(memory_banks_t *banks, int bank);
+
+bool memory_banks_select(memory_banks_t *banks, int bank);
+
+void memory_banks_io_write(void *context, uint8_t dev_id, uint8_t data);
+
+void memory_banks_mmio_write(void *context, uint16_t address, uint8_t value);
+
+#endif // __MEMORY_BANK_H__
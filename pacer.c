@@ -0,0 +1,103 @@
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include "pacer.h"
+
+static long long now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Sleeps until shortly before the deadline and spins until the deadline itself,
+ * as sleeps tend to end late by tens of microseconds
+ */
+static void wait_until(long long deadline_ns, long long spin_ns) {
+    long long wake_up_ns = deadline_ns - spin_ns;
+    if (now_ns() < wake_up_ns) {
+        struct timespec wake_up = {wake_up_ns / 1000000000LL, wake_up_ns % 1000000000LL};
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_up, NULL) == EINTR) {
+        }
+    }
+    while (now_ns() < deadline_ns) {
+    }
+}
+
+/**
+ * Prepares a pacer starting its epoch now, with the default slice size, drift cap and spin time
+ */
+void pacer_init(pacer_t *pacer, long long frequency, double speed) {
+    pacer->frequency = frequency;
+    pacer->slice_cycles = PACER_DEFAULT_SLICE_CYCLES;
+    pacer->max_lag_ns = PACER_DEFAULT_MAX_LAG_NS;
+    pacer->spin_ns = PACER_DEFAULT_SPIN_NS;
+    pacer_set_speed(pacer, speed);
+    pacer_reset_stats(pacer);
+}
+
+/**
+ * Changes the speed multiplier, the emulated time is counted at the new speed from now on
+ */
+void pacer_set_speed(pacer_t *pacer, double speed) {
+    pacer->speed = speed;
+    pacer->epoch_ns = now_ns();
+    pacer->epoch_cycles = 0;
+}
+
+/**
+ * Accounts for cycles executed by the CPU and waits until the host time catches up with them.
+ * Nothing is waited if the pacer is behind, if it's behind by more than the drift cap
+ * the lag is dropped and the following slices are timed from now
+ */
+void pacer_wait(pacer_t *pacer, long long cycles) {
+    pacer->epoch_cycles += cycles;
+    pacer->stats.slices++;
+    pacer->stats.cycles += cycles;
+    if (pacer->speed <= PACER_UNLIMITED) {
+        return;
+    }
+    long long deadline_ns = pacer->epoch_ns + (long long)(pacer->epoch_cycles * 1e9 / (pacer->frequency * pacer->speed));
+    long long now = now_ns();
+    long long slack_ns = deadline_ns - now;
+    if (slack_ns < pacer->stats.min_slack_ns) {
+        pacer->stats.min_slack_ns = slack_ns;
+    }
+    if (slack_ns < 0) {
+        pacer->stats.overruns++;
+        if (-slack_ns > pacer->stats.max_late_ns) {
+            pacer->stats.max_late_ns = -slack_ns;
+        }
+        if (-slack_ns > pacer->max_lag_ns) {
+            pacer->stats.dropped_ns += -slack_ns;
+            pacer->epoch_ns = now;
+            pacer->epoch_cycles = 0;
+        }
+        return;
+    }
+    pacer->stats.total_slack_ns += slack_ns;
+    wait_until(deadline_ns, pacer->spin_ns);
+}
+
+/**
+ * Runs the CPU for one slice and waits for its deadline
+ */
+cpu_run_result_t pacer_run_slice(pacer_t *pacer, cpu_t *cpu) {
+    cpu_run_result_t result = cpu_run(cpu, pacer->slice_cycles);
+    pacer_wait(pacer, result.cycles);
+    return result;
+}
+
+void pacer_get_stats(pacer_t *pacer, pacer_stats_t *stats) {
+    *stats = pacer->stats;
+    if (stats->min_slack_ns == LLONG_MAX) {
+        stats->min_slack_ns = 0; // No paced slice yet
+    }
+    stats->elapsed_ns = now_ns() - pacer->stats_start_ns;
+    stats->effective_mhz = (stats->elapsed_ns > 0) ? stats->cycles * 1e3 / stats->elapsed_ns : 0;
+}
+
+void pacer_reset_stats(pacer_t *pacer) {
+    pacer->stats = (pacer_stats_t){.min_slack_ns = LLONG_MAX};
+    pacer->stats_start_ns = now_ns();
+}
@@ -0,0 +1,53 @@
+#ifndef __PACER_H__
+#define __PACER_H__
+
+#include <stdbool.h>
+#include "cpu.h"
+
+#define PACER_DEFAULT_SLICE_CYCLES (CPU_FREQ / 1000) // 1 ms of emulated time
+#define PACER_DEFAULT_MAX_LAG_NS 100000000LL // Falling behind by more than 100 ms isn't caught up
+#define PACER_DEFAULT_SPIN_NS 100000LL // The end of every wait is spun instead of slept
+#define PACER_UNLIMITED 0.0 // Speed running the CPU as fast as possible
+
+typedef struct PACER_STATS {
+    unsigned long long slices;
+    unsigned long long overruns; // Slices which ended after their deadline
+    long long min_slack_ns; // Smallest time left to the deadline at the end of a slice, negative if late
+    long long max_late_ns; // Longest time a slice ended after its deadline
+    long long total_slack_ns; // Sum of the time left to the deadlines, waited in sleeps and spins
+    long long dropped_ns; // Lag given up because it was above the drift cap
+    long long cycles;
+    long long elapsed_ns; // Host time since the statistics were reset
+    double effective_mhz; // Emulated clock frequency achieved since the statistics were reset
+} pacer_stats_t;
+
+/*
+ * Keeps the emulated time in step with the host time. The CPU runs in slices and after every slice
+ * the pacer waits until the deadline of the cycles executed so far. Deadlines are counted from an epoch
+ * on CLOCK_MONOTONIC, so rounding never accumulates and slices running late are caught up later
+ */
+typedef struct PACER {
+    long long frequency; // Emulated clock frequency in Hz
+    double speed; // Multiple of the frequency to run at, PACER_UNLIMITED doesn't wait at all
+    long long slice_cycles;
+    long long max_lag_ns; // Drift cap, a bigger lag is dropped by moving the epoch
+    long long spin_ns;
+    long long epoch_ns;
+    long long epoch_cycles; // Cycles executed since the epoch
+    long long stats_start_ns;
+    pacer_stats_t stats;
+} pacer_t;
+
+void pacer_init(pacer_t *pacer, long long frequency, double speed);
+
+void pacer_set_speed(pacer_t *pacer, double speed);
+
+void pacer_wait(pacer_t *pacer, long long cycles);
+
+cpu_run_result_t pacer_run_slice(pacer_t *pacer, cpu_t *cpu);
+
+void pacer_get_stats(pacer_t *pacer, pacer_stats_t *stats);
+
+void pacer_reset_stats(pacer_t *pacer);
+
+#endif // __PACER_H__
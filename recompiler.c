@@ -0,0 +1,592 @@
+/*
+ * Ahead-of-time recompiler of 8080 programs.
+ * Finds the code reachable from the entry points by recursive descent,
+ * splits it into basic blocks and writes a C source with one function per block.
+ * The source is linked into the emulator (see CPU_AOT_PROGRAMS in CMakeLists.txt)
+ * and registers itself, so cpu_use_aot finds it once the same image is loaded in the memory.
+ *
+ * Usage: Intel8080Recompiler image output.c [load address] [entry address...]
+ * Addresses are hexadecimal, the load address defaults to 0100 (CP/M .COM files)
+ * and the entry address to the load address.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define MEMORY_SIZE 0x10000
+#define MAX_ENTRIES 64
+
+/**
+ * Length in bytes of every operation
+ */
+static const uint8_t op_lengths[256] = {
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0x00
+    1, 3, 1, 1, 1, 1, 2, 1, 1, 1, 1, 1, 1, 1, 2, 1, // 0x10
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, // 0x20
+    1, 3, 3, 1, 1, 1, 2, 1, 1, 1, 3, 1, 1, 1, 2, 1, // 0x30
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x40
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x50
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x60
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x70
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x80
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0x90
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xA0
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, // 0xB0
+    1, 1, 3, 3, 3, 1, 2, 1, 1, 1, 3, 3, 3, 3, 2, 1, // 0xC0
+    1, 1, 3, 2, 3, 1, 2, 1, 1, 1, 3, 2, 3, 3, 2, 1, // 0xD0
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1, // 0xE0
+    1, 1, 3, 1, 3, 1, 2, 1, 1, 1, 3, 1, 3, 3, 2, 1  // 0xF0
+};
+
+/**
+ * Clock cycles of every operation, the same as counted by the interpreter.
+ * Conditional calls and returns take 6 more cycles when the condition is met
+ */
+static const uint8_t op_cycles[256] = {
+     4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4, // 0x00
+     4, 10,  7,  5,  5,  5,  7,  4,  4, 10,  7,  5,  5,  5,  7,  4, // 0x10
+     4, 10, 16,  5,  5,  5,  7,  4,  4, 10, 16,  5,  5,  5,  7,  4, // 0x20
+     4, 10, 13,  5, 10, 10, 10,  4,  4, 10, 13,  5,  5,  5,  7,  4, // 0x30
+     5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5, // 0x40
+     5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5, // 0x50
+     5,  5,  5,  5,  5,  5,  7,  5,  5,  5,  5,  5,  5,  5,  7,  5, // 0x60
+     7,  7,  7,  7,  7,  7,  7,  7,  5,  5,  5,  5,  5,  5,  7,  5, // 0x70
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 0x80
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 0x90
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4, // 0xA0
+     4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  4,  4, // 0xB0
+     5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11, // 0xC0
+     5, 10, 10, 10, 11, 11,  7, 11,  5, 10, 10, 10, 11, 17,  7, 11, // 0xD0
+     5, 10, 10, 18, 11, 11,  7, 11,  5,  5, 10,  5, 11, 17,  7, 11, // 0xE0
+     5, 10, 10,  4, 11, 11,  7, 11,  5,  5, 10,  4, 11, 17,  7, 11  // 0xF0
+};
+
+// C expressions of the 8080 registers in the order used by the opcodes: B, C, D, E, H, L, M, A
+static const char *const regs8[8] = {
+    "BC.pair.higher", "BC.pair.lower", "DE.pair.higher", "DE.pair.lower",
+    "HL.pair.higher", "HL.pair.lower", "aot_read(memory, HL.single)", "A"
+};
+
+// C expressions of the 8080 register pairs in the order used by the opcodes: BC, DE, HL, SP
+static const char *const regs16[4] = {"BC.single", "DE.single", "HL.single", "SP"};
+
+// C expressions of the conditions in the order used by the opcodes: NZ, Z, NC, C, PO, PE, P, M
+static const char *const conditions[8] = {
+    "!(F & FLAG_Z)", "(F & FLAG_Z)", "!(F & FLAG_C)", "(F & FLAG_C)",
+    "!(F & FLAG_P)", "(F & FLAG_P)", "!(F & FLAG_S)", "(F & FLAG_S)"
+};
+
+static uint8_t image[MEMORY_SIZE];
+static uint32_t image_size;
+static uint16_t load_address;
+static bool is_leader[MEMORY_SIZE]; // A basic block starts at the address
+static bool is_visited[MEMORY_SIZE];
+
+typedef enum OP_KIND {
+    OP_PLAIN,
+    OP_JUMP, // Unconditional control transfer without a return (JMP, RET, PCHL)
+    OP_CALL, // CALL, RST
+    OP_CONDITIONAL, // Jcc, Ccc, Rcc
+    OP_HALT,
+    OP_INTERPRETED // EI, left to the interpreter which delays the interrupts by one operation
+} op_kind_t;
+
+static op_kind_t get_op_kind(uint8_t opcode) {
+    switch (opcode) {
+        case 0xC3: case 0xCB: // JMP
+        case 0xC9: case 0xD9: // RET
+        case 0xE9: // PCHL
+            return OP_JUMP;
+        case 0xCD: case 0xDD: case 0xED: case 0xFD: // CALL
+            return OP_CALL;
+        case 0x76:
+            return OP_HALT;
+        case 0xFB:
+            return OP_INTERPRETED;
+    }
+    if ((opcode & 0xC7) == 0xC7) // RST
+        return OP_CALL;
+    if ((opcode & 0xC7) == 0xC0 || (opcode & 0xC7) == 0xC2 || (opcode & 0xC7) == 0xC4)
+        return OP_CONDITIONAL;
+    return OP_PLAIN;
+}
+
+inline static bool in_image(uint32_t address) {
+    return address >= load_address && address < load_address + image_size;
+}
+
+inline static uint8_t image_byte(uint32_t address) {
+    return image[(address - load_address) & 0xFFFF];
+}
+
+inline static uint16_t image_word(uint32_t address) {
+    return (image_byte(address + 1) << 8) | image_byte(address);
+}
+
+/**
+ * Checks if the whole operation at a given address lies inside of the image
+ */
+static bool op_in_image(uint32_t address) {
+    return in_image(address) && in_image(address + op_lengths[image_byte(address)] - 1);
+}
+
+/**
+ * Checks if a block is generated for the address, the operations left to the interpreter can't start one
+ */
+static bool is_block_start(uint32_t address) {
+    return is_leader[address] && op_in_image(address) && get_op_kind(image_byte(address)) != OP_INTERPRETED;
+}
+
+/**
+ * Returns the static target of a control transfer or -1 if it's only known at runtime
+ */
+static int32_t get_op_target(uint32_t address) {
+    uint8_t opcode = image_byte(address);
+    if ((opcode & 0xC7) == 0xC7)
+        return opcode & 0x38;
+    if (opcode == 0xC3 || opcode == 0xCB || get_op_kind(opcode) == OP_CALL || (opcode & 0xC7) == 0xC2 || (opcode & 0xC7) == 0xC4)
+        return image_word(address + 1);
+    return -1;
+}
+
+/**
+ * Follows the control flow from the entry points, marking the start of every basic block
+ */
+static void find_blocks(const uint16_t *entries, int entries_count) {
+    static uint16_t pending[MEMORY_SIZE + MAX_ENTRIES];
+    int pending_count = 0;
+    for (int i = 0; i < entries_count; i++) {
+        is_leader[entries[i]] = true;
+        pending[pending_count++] = entries[i];
+    }
+    while (pending_count > 0) {
+        uint32_t address = pending[--pending_count];
+        while (op_in_image(address) && !is_visited[address]) {
+            is_visited[address] = true;
+            uint8_t opcode = image_byte(address);
+            op_kind_t kind = get_op_kind(opcode);
+            int32_t target = get_op_target(address);
+            address += op_lengths[opcode];
+            if (target >= 0 && in_image(target) && !is_leader[target]) {
+                is_leader[target] = true;
+                pending[pending_count++] = target;
+            }
+            if (kind == OP_JUMP)
+                break;
+            if (kind != OP_PLAIN && address < MEMORY_SIZE) {
+                is_leader[address] = true; // Return address or the not taken path
+            }
+        }
+    }
+}
+
+/**
+ * Writes the statements of a single operation that doesn't transfer control
+ */
+static void write_plain_op(FILE *out, uint32_t address) {
+    uint8_t opcode = image_byte(address);
+    uint8_t byte = image_byte(address + 1);
+    uint16_t word = image_word(address + 1);
+    int dst = (opcode >> 3) & 0x07;
+    int src = opcode & 0x07;
+    int pair = (opcode >> 4) & 0x03;
+    if (opcode >= 0x40 && opcode < 0x80) { // MOV
+        if (dst == 6) {
+            fprintf(out, "    aot_write(memory, HL.single, %s);\n", regs8[src]);
+        } else {
+            fprintf(out, "    %s = %s;\n", regs8[dst], regs8[src]);
+        }
+        return;
+    }
+    if (opcode >= 0x80 && opcode < 0xC0) {
+        static const char *const alu_formats[8] = {
+            "    A = aot_add(&F, A, %s, 0);\n", "    A = aot_add(&F, A, %s, F & FLAG_C);\n",
+            "    A = aot_sub(&F, A, %s, 0);\n", "    A = aot_sub(&F, A, %s, F & FLAG_C);\n",
+            "    A = aot_and(&F, A, %s);\n", "    A = aot_xor(&F, A, %s);\n",
+            "    A = aot_or(&F, A, %s);\n", "    aot_sub(&F, A, %s, 0);\n"
+        };
+        fprintf(out, alu_formats[dst], regs8[src]);
+        return;
+    }
+    if ((opcode & 0xC7) == 0xC6) { // ALU with immediate data
+        char immediate[8];
+        snprintf(immediate, sizeof(immediate), "0x%02X", byte);
+        static const char *const alu_formats[8] = {
+            "    A = aot_add(&F, A, %s, 0);\n", "    A = aot_add(&F, A, %s, F & FLAG_C);\n",
+            "    A = aot_sub(&F, A, %s, 0);\n", "    A = aot_sub(&F, A, %s, F & FLAG_C);\n",
+            "    A = aot_and(&F, A, %s);\n", "    A = aot_xor(&F, A, %s);\n",
+            "    A = aot_or(&F, A, %s);\n", "    aot_sub(&F, A, %s, 0);\n"
+        };
+        fprintf(out, alu_formats[dst], immediate);
+        return;
+    }
+    if (opcode < 0x40) {
+        switch (opcode & 0x0F) {
+            case 0x01: // LXI
+                fprintf(out, "    %s = 0x%04X;\n", regs16[pair], word);
+                return;
+            case 0x03: // INX
+                fprintf(out, "    %s++;\n", regs16[pair]);
+                return;
+            case 0x0B: // DCX
+                fprintf(out, "    %s--;\n", regs16[pair]);
+                return;
+            case 0x09: // DAD
+                fprintf(out, "    HL.single = aot_dad(&F, HL.single, %s);\n", regs16[pair]);
+                return;
+        }
+        switch (opcode & 0x07) {
+            case 0x04: // INR
+            case 0x05: // DCR
+                if (dst == 6) {
+                    fprintf(out, "    aot_write(memory, HL.single, aot_%s(&F, aot_read(memory, HL.single)));\n", (opcode & 1) ? "dec" : "inc");
+                } else {
+                    fprintf(out, "    %s = aot_%s(&F, %s);\n", regs8[dst], (opcode & 1) ? "dec" : "inc", regs8[dst]);
+                }
+                return;
+            case 0x06: // MVI
+                if (dst == 6) {
+                    fprintf(out, "    aot_write(memory, HL.single, 0x%02X);\n", byte);
+                } else {
+                    fprintf(out, "    %s = 0x%02X;\n", regs8[dst], byte);
+                }
+                return;
+        }
+    }
+    switch (opcode) {
+        case 0x00: case 0x08: case 0x10: case 0x18: // NOP
+        case 0x20: case 0x28: case 0x30: case 0x38:
+            break;
+        case 0x02: // STAX B
+        case 0x12: // STAX D
+            fprintf(out, "    aot_write(memory, %s, A);\n", regs16[pair]);
+            break;
+        case 0x0A: // LDAX B
+        case 0x1A: // LDAX D
+            fprintf(out, "    A = aot_read(memory, %s);\n", regs16[pair]);
+            break;
+        case 0x22: // SHLD
+            fprintf(out, "    aot_write(memory, 0x%04X, HL.pair.lower);\n", word);
+            fprintf(out, "    aot_write(memory, 0x%04X, HL.pair.higher);\n", (uint16_t)(word + 1));
+            break;
+        case 0x2A: // LHLD
+            fprintf(out, "    HL.pair.lower = aot_read(memory, 0x%04X);\n", word);
+            fprintf(out, "    HL.pair.higher = aot_read(memory, 0x%04X);\n", (uint16_t)(word + 1));
+            break;
+        case 0x32: // STA
+            fprintf(out, "    aot_write(memory, 0x%04X, A);\n", word);
+            break;
+        case 0x3A: // LDA
+            fprintf(out, "    A = aot_read(memory, 0x%04X);\n", word);
+            break;
+        case 0x07: fprintf(out, "    A = aot_rlc(&F, A);\n"); break;
+        case 0x0F: fprintf(out, "    A = aot_rrc(&F, A);\n"); break;
+        case 0x17: fprintf(out, "    A = aot_ral(&F, A);\n"); break;
+        case 0x1F: fprintf(out, "    A = aot_rar(&F, A);\n"); break;
+        case 0x27: fprintf(out, "    A = aot_daa(&F, A);\n"); break;
+        case 0x2F: fprintf(out, "    A = ~A;\n"); break;
+        case 0x37: fprintf(out, "    F |= FLAG_C;\n"); break;
+        case 0x3F: fprintf(out, "    F ^= FLAG_C;\n"); break;
+        case 0xC1: // POP B
+        case 0xD1: // POP D
+        case 0xE1: // POP H
+            fprintf(out, "    %s = aot_read(memory, SP++);\n", regs8[pair * 2 + 1]);
+            fprintf(out, "    %s = aot_read(memory, SP++);\n", regs8[pair * 2]);
+            break;
+        case 0xF1: // POP PSW
+            fprintf(out, "    F = (aot_read(memory, SP++) & AOT_FLAGS_ALL) | STATUS_REG_FIXED_BITS;\n");
+            fprintf(out, "    A = aot_read(memory, SP++);\n");
+            break;
+        case 0xC5: // PUSH B
+        case 0xD5: // PUSH D
+        case 0xE5: // PUSH H
+            fprintf(out, "    aot_write(memory, --SP, %s);\n", regs8[pair * 2]);
+            fprintf(out, "    aot_write(memory, --SP, %s);\n", regs8[pair * 2 + 1]);
+            break;
+        case 0xF5: // PUSH PSW
+            fprintf(out, "    aot_write(memory, --SP, A);\n");
+            fprintf(out, "    aot_write(memory, --SP, F);\n");
+            break;
+        case 0xD3: // OUT
+            fprintf(out, "    r->io_write(r->io_context, 0x%02X, A);\n", byte);
+            break;
+        case 0xDB: // IN
+            fprintf(out, "    A = r->io_read(r->io_context, 0x%02X);\n", byte);
+            break;
+        case 0xE3: // XTHL
+            fprintf(out, "    {\n");
+            fprintf(out, "        uint8_t lower = aot_read(memory, SP);\n");
+            fprintf(out, "        uint8_t higher = aot_read(memory, SP + 1);\n");
+            fprintf(out, "        aot_write(memory, SP, HL.pair.lower);\n");
+            fprintf(out, "        aot_write(memory, SP + 1, HL.pair.higher);\n");
+            fprintf(out, "        HL.pair.lower = lower;\n");
+            fprintf(out, "        HL.pair.higher = higher;\n");
+            fprintf(out, "    }\n");
+            break;
+        case 0xEB: // XCHG
+            fprintf(out, "    {\n");
+            fprintf(out, "        uint16_t de = DE.single;\n");
+            fprintf(out, "        DE.single = HL.single;\n");
+            fprintf(out, "        HL.single = de;\n");
+            fprintf(out, "    }\n");
+            break;
+        case 0xF3: fprintf(out, "    r->interrupts_enabled = false;\n"); break;
+        case 0xF9: fprintf(out, "    SP = HL.single;\n"); break;
+    }
+}
+
+/**
+ * Checks if an operation that doesn't transfer control may write to the memory
+ */
+static bool op_may_store(uint8_t opcode) {
+    switch (opcode) {
+        case 0x02: case 0x12: case 0x22: case 0x32: case 0x34: case 0x35: case 0x36:
+        case 0xC5: case 0xD5: case 0xE5: case 0xF5: case 0xE3:
+            return true;
+    }
+    return opcode >= 0x70 && opcode < 0x78;
+}
+
+/**
+ * Returns the address of the last byte of the basic block starting at a given address
+ */
+static uint16_t find_block_end(uint32_t start) {
+    uint32_t address = start;
+    while (true) {
+        uint8_t opcode = image_byte(address);
+        uint32_t next = address + op_lengths[opcode];
+        if (get_op_kind(opcode) == OP_INTERPRETED) {
+            return address - 1;
+        }
+        if (get_op_kind(opcode) != OP_PLAIN || next >= MEMORY_SIZE || is_leader[next] || !op_in_image(next)) {
+            return next - 1;
+        }
+        address = next;
+    }
+}
+
+/**
+ * Writes the statements leaving a block: the registers are stored and the cycles subtracted
+ */
+static void write_block_exit(FILE *out, const char *indent, int cycles) {
+    fprintf(out, "%sAOT_STORE_REGS(r);\n", indent);
+    fprintf(out, "%sr->remaining_cycles -= %d;\n", indent, cycles);
+}
+
+/**
+ * Writes the statements of a return, the popped address goes to r->pc
+ */
+static void write_return(FILE *out, const char *indent) {
+    fprintf(out, "%s{\n", indent);
+    fprintf(out, "%s    uint8_t lower = aot_read(memory, SP++);\n", indent);
+    fprintf(out, "%s    r->pc = (aot_read(memory, SP++) << 8) | lower;\n", indent);
+    fprintf(out, "%s}\n", indent);
+}
+
+static void write_call(FILE *out, const char *indent, uint16_t return_address, uint16_t target) {
+    fprintf(out, "%saot_write(memory, --SP, 0x%02X);\n", indent, return_address >> 8);
+    fprintf(out, "%saot_write(memory, --SP, 0x%02X);\n", indent, return_address & 0xFF);
+    fprintf(out, "%sr->pc = 0x%04X;\n", indent, target);
+}
+
+/**
+ * Writes the function of the basic block starting at a given address
+ */
+static void write_block(FILE *out, uint32_t start) {
+    fprintf(out, "static void block_%04X(aot_regs_t *r) {\n", start);
+    fprintf(out, "    AOT_LOAD_REGS(r);\n");
+    uint32_t address = start;
+    int cycles = 0;
+    while (true) {
+        uint8_t opcode = image_byte(address);
+        uint32_t next = address + op_lengths[opcode];
+        op_kind_t kind = get_op_kind(opcode);
+        int32_t target = get_op_target(address);
+        cycles += op_cycles[opcode];
+        switch (kind) {
+            case OP_PLAIN:
+                write_plain_op(out, address);
+                break;
+            case OP_HALT:
+                fprintf(out, "    r->halted = true;\n");
+                break;
+            case OP_INTERPRETED:
+                // The block ends right before the operation
+                fprintf(out, "    r->pc = 0x%04X;\n", address);
+                write_block_exit(out, "    ", cycles - op_cycles[opcode]);
+                fprintf(out, "}\n\n");
+                return;
+            case OP_JUMP:
+                if (opcode == 0xE9) {
+                    fprintf(out, "    r->pc = HL.single;\n");
+                } else if (target >= 0) {
+                    fprintf(out, "    r->pc = 0x%04X;\n", target);
+                } else {
+                    write_return(out, "    ");
+                }
+                write_block_exit(out, "    ", cycles);
+                fprintf(out, "}\n\n");
+                return;
+            case OP_CALL:
+                write_call(out, "    ", next, target);
+                write_block_exit(out, "    ", cycles);
+                fprintf(out, "}\n\n");
+                return;
+            case OP_CONDITIONAL:
+                fprintf(out, "    if (%s) {\n", conditions[(opcode >> 3) & 0x07]);
+                if ((opcode & 0xC7) == 0xC2) {
+                    fprintf(out, "        r->pc = 0x%04X;\n", target);
+                    fprintf(out, "    } else {\n");
+                    fprintf(out, "        r->pc = 0x%04X;\n", next & 0xFFFF);
+                    fprintf(out, "    }\n");
+                    write_block_exit(out, "    ", cycles);
+                } else {
+                    if ((opcode & 0xC7) == 0xC4) {
+                        write_call(out, "        ", next, target);
+                    } else {
+                        write_return(out, "        ");
+                    }
+                    write_block_exit(out, "        ", cycles + 6);
+                    fprintf(out, "    } else {\n");
+                    fprintf(out, "        r->pc = 0x%04X;\n", next & 0xFFFF);
+                    write_block_exit(out, "        ", cycles);
+                    fprintf(out, "    }\n");
+                }
+                fprintf(out, "}\n\n");
+                return;
+        }
+        if (kind == OP_HALT || next >= MEMORY_SIZE || is_leader[next] || !op_in_image(next)) {
+            fprintf(out, "    r->pc = 0x%04X;\n", next & 0xFFFF);
+            write_block_exit(out, "    ", cycles);
+            fprintf(out, "}\n\n");
+            return;
+        }
+        if (op_may_store(opcode)) {
+            // The block may have just overwritten its own code
+            fprintf(out, "    if (!aot_block_is_current(r, image, LOAD_ADDRESS, 0x%04X, 0x%04X)) {\n", start, find_block_end(start));
+            fprintf(out, "        r->pc = 0x%04X;\n", next);
+            write_block_exit(out, "        ", cycles);
+            fprintf(out, "        return;\n");
+            fprintf(out, "    }\n");
+        }
+        address = next;
+    }
+}
+
+/**
+ * Derives the name of the program from the image path: the file name without the extension
+ */
+static void get_program_name(const char *path, char *name, size_t size) {
+    const char *file_name = strrchr(path, '/');
+    file_name = (file_name != NULL) ? file_name + 1 : path;
+    snprintf(name, size, "%s", file_name);
+    char *extension = strrchr(name, '.');
+    if (extension != NULL && extension != name) {
+        *extension = '\0';
+    }
+}
+
+static void write_source(FILE *out, const char *image_path) {
+    char name[256];
+    get_program_name(image_path, name, sizeof(name));
+    int blocks_count = 0;
+    fprintf(out, "/*\n * Recompiled from %s by Intel8080Recompiler, don't edit\n */\n", name);
+    fprintf(out, "#include \"aot.h\"\n\n");
+    fprintf(out, "#define LOAD_ADDRESS 0x%04X\n\n", load_address);
+    fprintf(out, "static const uint8_t image[%u] = {", image_size);
+    for (uint32_t i = 0; i < image_size; i++) {
+        fprintf(out, "%s0x%02X,", (i % 16 == 0) ? "\n    " : " ", image[i]);
+    }
+    fprintf(out, "\n};\n\n");
+    for (uint32_t address = load_address; address < load_address + image_size; address++) {
+        if (is_block_start(address)) {
+            write_block(out, address);
+            blocks_count++;
+        }
+    }
+    fprintf(out, "static const aot_block_t blocks[%d] = {\n", blocks_count);
+    for (uint32_t address = load_address; address < load_address + image_size; address++) {
+        if (is_block_start(address)) {
+            fprintf(out, "    {0x%04X, 0x%04X},\n", address, find_block_end(address));
+        }
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "static void run(aot_regs_t *r) {\n");
+    fprintf(out, "    do {\n");
+    fprintf(out, "        switch (r->pc) {\n");
+    for (uint32_t address = load_address; address < load_address + image_size; address++) {
+        if (is_block_start(address)) {
+            fprintf(out, "            case 0x%04X:\n", address);
+            fprintf(out, "                if (!aot_block_is_current(r, image, LOAD_ADDRESS, 0x%04X, 0x%04X)) {\n", address, find_block_end(address));
+            fprintf(out, "                    r->stale = true;\n");
+            fprintf(out, "                    return;\n");
+            fprintf(out, "                }\n");
+            fprintf(out, "                block_%04X(r);\n", address);
+            fprintf(out, "                break;\n");
+        }
+    }
+    fprintf(out, "            default:\n");
+    fprintf(out, "                return; // Code not found by the recompiler\n");
+    fprintf(out, "        }\n");
+    fprintf(out, "        r->blocks_executed++;\n");
+    fprintf(out, "    } while (aot_can_continue(r));\n");
+    fprintf(out, "}\n\n");
+    fprintf(out, "static const aot_program_t program = {\"%s\", LOAD_ADDRESS, sizeof(image), image, blocks, %d, run};\n\n", name, blocks_count);
+    fprintf(out, "__attribute__((constructor)) static void register_program() {\n");
+    fprintf(out, "    aot_register(&program);\n");
+    fprintf(out, "}\n");
+}
+
+static bool parse_address(const char *text, uint16_t *address) {
+    char *end;
+    unsigned long value = strtoul(text, &end, 16);
+    if (*text == '\0' || *end != '\0' || value >= MEMORY_SIZE) {
+        fprintf(stderr, "Invalid address: %s\n", text);
+        return false;
+    }
+    *address = value;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argc - 4 > MAX_ENTRIES) {
+        fprintf(stderr, "Usage: %s image output.c [load address] [entry address...]\n", argv[0]);
+        return 1;
+    }
+    load_address = 0x0100;
+    if (argc > 3 && !parse_address(argv[3], &load_address)) {
+        return 1;
+    }
+    uint16_t entries[MAX_ENTRIES];
+    int entries_count = 0;
+    for (int i = 4; i < argc; i++) {
+        if (!parse_address(argv[i], &entries[entries_count++])) {
+            return 1;
+        }
+    }
+    if (entries_count == 0) {
+        entries[entries_count++] = load_address;
+    }
+    FILE *file = fopen(argv[1], "rb");
+    if (file == NULL) {
+        perror("Image open error");
+        return 1;
+    }
+    image_size = fread(image, 1, MEMORY_SIZE - load_address, file);
+    fclose(file);
+    if (image_size == 0) {
+        fprintf(stderr, "Empty image: %s\n", argv[1]);
+        return 1;
+    }
+    find_blocks(entries, entries_count);
+    FILE *out = fopen(argv[2], "w");
+    if (out == NULL) {
+        perror("Output open error");
+        return 1;
+    }
+    write_source(out, argv[1]);
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,229 @@
+#include <stddef.h>
+#include "scheduler.h"
+
+#define SLOT_INDEX(slot) ((slot) & (SCHEDULER_SLOTS - 1))
+
+static long long next_event_hook(void *context) {
+    scheduler_t *scheduler = context;
+    uint64_t deadline = scheduler_next_deadline(scheduler);
+    if (deadline == SCHEDULER_NO_EVENT) {
+        return -1;
+    }
+    uint64_t now = cpu_get_cycles(scheduler->cpu);
+    return deadline > now ? (long long)(deadline - now) : 0;
+}
+
+/**
+ * Prepares an empty wheel starting at the current cycle of the CPU and sets the next event hook of the CPU,
+ * so a halted CPU wakes up at the deadlines of the events
+ */
+void scheduler_init(scheduler_t *scheduler, cpu_t *cpu) {
+    scheduler->cpu = cpu;
+    scheduler->current_slot = cpu_get_cycles(cpu) >> SCHEDULER_SLOT_SHIFT;
+    for (int i = 0; i < SCHEDULER_SLOTS; i++) {
+        scheduler->slots[i] = NULL;
+    }
+    for (int i = 0; i < SCHEDULER_SLOTS / 64; i++) {
+        scheduler->occupied[i] = 0;
+    }
+    scheduler->overflow = NULL;
+    scheduler->overflow_deadline = SCHEDULER_NO_EVENT;
+    scheduler->stats = (scheduler_stats_t){0};
+    cpu_set_next_event_hook(cpu, next_event_hook, scheduler);
+}
+
+void scheduler_event_init(scheduler_event_t *event, scheduler_callback_t callback, void *context) {
+    event->deadline = SCHEDULER_NO_EVENT;
+    event->callback = callback;
+    event->context = context;
+    event->next = NULL;
+    event->link = NULL;
+    event->slot = -1;
+}
+
+/**
+ * Inserts an event into a list sorted by the deadlines, after the events with the same deadline
+ */
+static void insert_sorted(scheduler_event_t **list, scheduler_event_t *event) {
+    while (*list != NULL && (*list)->deadline <= event->deadline) {
+        list = &(*list)->next;
+    }
+    event->next = *list;
+    if (event->next != NULL) {
+        event->next->link = &event->next;
+    }
+    event->link = list;
+    *list = event;
+}
+
+static void unlink_event(scheduler_event_t *event) {
+    *event->link = event->next;
+    if (event->next != NULL) {
+        event->next->link = event->link;
+    }
+    event->next = NULL;
+    event->link = NULL;
+}
+
+/**
+ * Puts an event into its slot of the wheel (events already due go to the current slot)
+ * or into the overflow list if the wheel doesn't reach its deadline yet
+ */
+static void insert_event(scheduler_t *scheduler, scheduler_event_t *event) {
+    uint64_t slot = event->deadline >> SCHEDULER_SLOT_SHIFT;
+    if (slot < scheduler->current_slot) {
+        slot = scheduler->current_slot;
+    }
+    if (slot - scheduler->current_slot < SCHEDULER_SLOTS) {
+        int index = SLOT_INDEX(slot);
+        event->slot = index;
+        insert_sorted(&scheduler->slots[index], event);
+        scheduler->occupied[index / 64] |= 1ULL << (index % 64);
+    } else {
+        event->slot = -1;
+        insert_sorted(&scheduler->overflow, event);
+        scheduler->overflow_deadline = scheduler->overflow->deadline;
+    }
+}
+
+/**
+ * Schedules an event at a given cycle of the CPU, an event which is already scheduled is moved.
+ * Deadlines in the past fire at the next call to scheduler_fire
+ */
+void scheduler_schedule(scheduler_t *scheduler, scheduler_event_t *event, uint64_t deadline) {
+    if (event->link != NULL) {
+        scheduler_cancel(scheduler, event);
+    }
+    event->deadline = deadline;
+    insert_event(scheduler, event);
+    scheduler->stats.scheduled++;
+}
+
+/**
+ * Schedules an event a given number of cycles after the current cycle of the CPU
+ * (which inside of an I/O hook is the cycle of the IN or OUT operation)
+ */
+void scheduler_schedule_in(scheduler_t *scheduler, scheduler_event_t *event, uint64_t cycles) {
+    scheduler_schedule(scheduler, event, cpu_get_cycles(scheduler->cpu) + cycles);
+}
+
+/**
+ * Removes an event from the scheduler, does nothing if it isn't scheduled
+ */
+void scheduler_cancel(scheduler_t *scheduler, scheduler_event_t *event) {
+    if (event->link == NULL) {
+        return;
+    }
+    unlink_event(event);
+    if (event->slot >= 0) {
+        if (scheduler->slots[event->slot] == NULL) {
+            scheduler->occupied[event->slot / 64] &= ~(1ULL << (event->slot % 64));
+        }
+    } else {
+        scheduler->overflow_deadline = scheduler->overflow != NULL ? scheduler->overflow->deadline : SCHEDULER_NO_EVENT;
+    }
+    event->slot = -1;
+}
+
+/**
+ * Returns the index of the first slot with events starting from the current one (wrapping around the wheel)
+ * or -1 if the wheel is empty
+ */
+static int first_occupied_slot(const scheduler_t *scheduler) {
+    int start = SLOT_INDEX(scheduler->current_slot);
+    int word = start / 64;
+    uint64_t bits = scheduler->occupied[word] & (~0ULL << (start % 64));
+    for (int i = 0; i <= SCHEDULER_SLOTS / 64; i++) {
+        if (bits != 0) {
+            return word * 64 + __builtin_ctzll(bits);
+        }
+        word = (word + 1) % (SCHEDULER_SLOTS / 64);
+        bits = scheduler->occupied[word];
+    }
+    return -1;
+}
+
+/**
+ * Returns the earliest deadline of the scheduled events or SCHEDULER_NO_EVENT if there are none
+ */
+uint64_t scheduler_next_deadline(scheduler_t *scheduler) {
+    int slot = first_occupied_slot(scheduler);
+    uint64_t deadline = slot >= 0 ? scheduler->slots[slot]->deadline : SCHEDULER_NO_EVENT;
+    return scheduler->overflow_deadline < deadline ? scheduler->overflow_deadline : deadline;
+}
+
+/**
+ * Moves the wheel forward to a given slot and moves the overflow events it reaches now into it
+ */
+static void advance_wheel(scheduler_t *scheduler, uint64_t slot) {
+    if (slot <= scheduler->current_slot) {
+        return;
+    }
+    scheduler->current_slot = slot;
+    while (scheduler->overflow != NULL
+           && (scheduler->overflow->deadline >> SCHEDULER_SLOT_SHIFT) < slot + SCHEDULER_SLOTS) {
+        scheduler_event_t *event = scheduler->overflow;
+        unlink_event(event);
+        insert_event(scheduler, event);
+        scheduler->stats.cascaded++;
+    }
+    scheduler->overflow_deadline = scheduler->overflow != NULL ? scheduler->overflow->deadline : SCHEDULER_NO_EVENT;
+}
+
+/**
+ * Calls the callbacks of all events whose deadline has passed, in the order of the deadlines.
+ * Events scheduled by the callbacks which are already due are fired in the same call
+ */
+void scheduler_fire(scheduler_t *scheduler) {
+    uint64_t now = cpu_get_cycles(scheduler->cpu);
+    for (;;) {
+        int slot = first_occupied_slot(scheduler);
+        if (slot >= 0 && scheduler->slots[slot]->deadline <= now) {
+            scheduler_event_t *event = scheduler->slots[slot];
+            scheduler_cancel(scheduler, event);
+            scheduler->stats.fired++;
+            event->callback(scheduler, event->context);
+        } else if (scheduler->overflow_deadline <= now) {
+            // Events beyond the wheel are always later than the ones in it, so the wheel catches up with them
+            // only when it has nothing due (possible after a long run without firing)
+            advance_wheel(scheduler, scheduler->overflow_deadline >> SCHEDULER_SLOT_SHIFT);
+        } else {
+            break;
+        }
+    }
+    advance_wheel(scheduler, now >> SCHEDULER_SLOT_SHIFT);
+}
+
+/**
+ * Runs the CPU for a given number of cycles firing the events at their deadlines,
+ * the CPU is stopped at every deadline so the callbacks see the exact cycle.
+ * A halted CPU waits for the next event, which may wake it up with an interrupt request.
+ * Stops early only at a trap address without a handler (or with a handler that asks to stop)
+ * Returns why the execution stopped and the number of clock cycles it took
+ */
+cpu_run_result_t scheduler_run(scheduler_t *scheduler, long long budget_cycles) {
+    cpu_run_result_t result = {CPU_EXIT_BUDGET, 0};
+    scheduler_fire(scheduler);
+    while (result.cycles < budget_cycles) {
+        long long slice = budget_cycles - result.cycles;
+        uint64_t deadline = scheduler_next_deadline(scheduler);
+        uint64_t now = cpu_get_cycles(scheduler->cpu);
+        if (deadline != SCHEDULER_NO_EVENT && deadline > now && deadline - now < (uint64_t)slice) {
+            slice = deadline - now;
+        }
+        cpu_run_result_t slice_result = cpu_run(scheduler->cpu, slice);
+        result.cycles += slice_result.cycles;
+        scheduler_fire(scheduler);
+        if (slice_result.reason == CPU_EXIT_TRAP) {
+            result.reason = CPU_EXIT_TRAP;
+            return result;
+        }
+        if (slice_result.reason == CPU_EXIT_HALT && scheduler_next_deadline(scheduler) == SCHEDULER_NO_EVENT) {
+            break; // Nothing left that could wake the CPU up
+        }
+    }
+    if (scheduler->cpu->state.halted) {
+        result.reason = CPU_EXIT_HALT;
+    }
+    return result;
+}
@@ -0,0 +1,67 @@
+#ifndef __SCHEDULER_H__
+#define __SCHEDULER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+
+#define SCHEDULER_SLOT_SHIFT 10 // Every slot of the wheel covers 2^10 clock cycles
+#define SCHEDULER_SLOTS 256 // Must be a multiple of 64, the wheel covers SCHEDULER_SLOTS << SCHEDULER_SLOT_SHIFT cycles
+#define SCHEDULER_NO_EVENT UINT64_MAX
+
+struct SCHEDULER;
+
+// Called at (or right after) the deadline of an event, the event may be scheduled again from it
+typedef void (*scheduler_callback_t)(struct SCHEDULER *scheduler, void *context);
+
+/*
+ * Event owned by a device (usually a field of it), so scheduling never allocates memory
+ */
+typedef struct SCHEDULER_EVENT {
+    uint64_t deadline; // Cycle of the CPU at which the event fires
+    scheduler_callback_t callback;
+    void *context;
+    struct SCHEDULER_EVENT *next;
+    struct SCHEDULER_EVENT **link; // Pointer pointing to this event in its list, NULL if the event isn't scheduled
+    int slot; // Slot of the wheel holding the event or -1 if it's beyond the wheel
+} scheduler_event_t;
+
+typedef struct SCHEDULER_STATS {
+    unsigned long long scheduled;
+    unsigned long long fired;
+    unsigned long long cascaded; // Events moved from beyond the wheel into it
+} scheduler_stats_t;
+
+/*
+ * Timing wheel of device events driven by the cycle counter of a CPU.
+ * The wheel has a sorted list of events for every slot of cycles and a bitmap of the slots
+ * which aren't empty, so only the events of the same slot are walked when an event is scheduled.
+ * Events further than the wheel covers wait in a sorted overflow list until the wheel comes close to them
+ */
+typedef struct SCHEDULER {
+    cpu_t *cpu;
+    uint64_t current_slot; // Slot number (cycle >> SCHEDULER_SLOT_SHIFT) the wheel starts at
+    scheduler_event_t *slots[SCHEDULER_SLOTS];
+    uint64_t occupied[SCHEDULER_SLOTS / 64]; // Bit set for every slot with events
+    scheduler_event_t *overflow;
+    uint64_t overflow_deadline; // Earliest deadline in the overflow list
+    scheduler_stats_t stats;
+} scheduler_t;
+
+void scheduler_init(scheduler_t *scheduler, cpu_t *cpu);
+
+void scheduler_event_init(scheduler_event_t *event, scheduler_callback_t callback, void *context);
+
+void scheduler_schedule(scheduler_t *scheduler, scheduler_event_t *event, uint64_t deadline);
+
+void scheduler_schedule_in(scheduler_t *scheduler, scheduler_event_t *event, uint64_t cycles);
+
+void scheduler_cancel(scheduler_t *scheduler, scheduler_event_t *event);
+
+uint64_t scheduler_next_deadline(scheduler_t *scheduler);
+
+void scheduler_fire(scheduler_t *scheduler);
+
+cpu_run_result_t scheduler_run(scheduler_t *scheduler, long long budget_cycles);
+
+#endif // __SCHEDULER_H__
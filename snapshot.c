@@ -0,0 +1,163 @@
+#include <string.h>
+#include "snapshot.h"
+
+static void put16(uint8_t *p, uint16_t value) {
+    p[0] = value & 0xFF;
+    p[1] = value >> 8;
+}
+
+static uint16_t get16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static bool fail(snapshot_chain_t *chain, const char *reason) {
+    chain->error = reason;
+    return false;
+}
+
+/**
+ * Prepares a chain whose first snapshot will be a full one
+ */
+void snapshot_chain_init(snapshot_chain_t *chain, cpu_t *cpu) {
+    chain->cpu = cpu;
+    chain->banks = NULL;
+    chain->started = false;
+    chain->sequence = 0;
+    chain->error = NULL;
+}
+
+/**
+ * Saves the selection of a bank window with every snapshot of the chain, so restoring it selects the same bank
+ */
+void snapshot_chain_set_banks(snapshot_chain_t *chain, memory_banks_t *banks) {
+    chain->banks = banks;
+}
+
+/**
+ * Writes a snapshot of the registers and of the memory as the CPU reads it: pages mapped to banks, ROM
+ * or shared memory are saved with the bytes they are mapped to (pages of devices with the RAM in 'data').
+ * The first snapshot of a chain is always a full one, a delta has only the pages written or remapped
+ * since the previous snapshot. Banks other than the selected one, devices and waiting interrupt requests aren't saved
+ * Returns the size of the snapshot or -1 if it couldn't be written
+ */
+long snapshot_save(snapshot_chain_t *chain, FILE *file, snapshot_kind_t kind) {
+    memory_t *memory = chain->cpu->memory;
+    if (!chain->started) {
+        kind = SNAPSHOT_FULL;
+    }
+    uint32_t sequence = chain->started ? chain->sequence + 1 : 0;
+    cpu_registers_t registers;
+    cpu_get_registers(chain->cpu, &registers);
+
+    uint8_t *header = chain->buffer;
+    memcpy(header, SNAPSHOT_MAGIC, 8);
+    put16(&header[8], SNAPSHOT_VERSION);
+    header[10] = kind;
+    header[11] = registers.interrupts_enabled | (registers.halted << 1);
+    put16(&header[12], sequence & 0xFFFF);
+    put16(&header[14], sequence >> 16);
+    put16(&header[16], registers.pc);
+    put16(&header[18], registers.sp);
+    put16(&header[20], registers.bc);
+    put16(&header[22], registers.de);
+    put16(&header[24], registers.hl);
+    header[26] = registers.a;
+    header[27] = registers.f;
+    header[30] = (chain->banks != NULL) ? chain->banks->selected : 0;
+    header[31] = 0;
+
+    uint8_t *record = &chain->buffer[SNAPSHOT_HEADER_SIZE];
+    int pages_count = 0;
+    for (int page = 0; page < MEMORY_PAGES; page++) {
+        if (kind == SNAPSHOT_FULL || memory->dirty_pages[page]) {
+            record[0] = page;
+            const uint8_t *bytes = (memory->read_map[page] != NULL) ? memory->read_map[page] : &memory->data[page * MEMORY_PAGE_SIZE];
+            memcpy(&record[1], bytes, MEMORY_PAGE_SIZE);
+            record += SNAPSHOT_PAGE_RECORD_SIZE;
+            pages_count++;
+        }
+    }
+    put16(&header[28], pages_count);
+
+    size_t size = record - chain->buffer;
+    if (fwrite(chain->buffer, 1, size, file) != size) {
+        return -1;
+    }
+    memset(memory->dirty_pages, 0, sizeof(memory->dirty_pages));
+    chain->started = true;
+    chain->sequence = sequence;
+    return size;
+}
+
+/**
+ * Reads the next snapshot, selects the saved bank and restores the registers and the saved pages
+ * into whatever they are mapped to (ROM pages stay as they are).
+ * A delta is restored only if the previous snapshot of the chain was the last one restored
+ * and no page was written or remapped since then
+ * Returns false (with the reason in chain->error) if the snapshot can't be restored, the state is left unchanged then
+ */
+bool snapshot_restore(snapshot_chain_t *chain, FILE *file) {
+    memory_t *memory = chain->cpu->memory;
+    uint8_t *header = chain->buffer;
+    chain->error = NULL;
+    if (fread(header, 1, SNAPSHOT_HEADER_SIZE, file) != SNAPSHOT_HEADER_SIZE) {
+        return fail(chain, "truncated header");
+    }
+    if (memcmp(header, SNAPSHOT_MAGIC, 8) != 0) {
+        return fail(chain, "not a snapshot");
+    }
+    if (get16(&header[8]) != SNAPSHOT_VERSION) {
+        return fail(chain, "unsupported version");
+    }
+    snapshot_kind_t kind = header[10];
+    uint32_t sequence = get16(&header[12]) | ((uint32_t)get16(&header[14]) << 16);
+    int pages_count = get16(&header[28]);
+    if ((kind != SNAPSHOT_FULL && kind != SNAPSHOT_DELTA) || pages_count > MEMORY_PAGES
+        || (kind == SNAPSHOT_FULL && pages_count != MEMORY_PAGES)) {
+        return fail(chain, "corrupted header");
+    }
+    if (chain->banks != NULL && header[30] >= chain->banks->banks_count) {
+        return fail(chain, "no such bank");
+    }
+    if (kind == SNAPSHOT_DELTA) {
+        if (!chain->started || sequence != chain->sequence + 1) {
+            return fail(chain, "delta doesn't follow the last restored snapshot");
+        }
+        for (int page = 0; page < MEMORY_PAGES; page++) {
+            if (memory->dirty_pages[page]) {
+                return fail(chain, "memory was written since the last restored snapshot");
+            }
+        }
+    }
+    uint8_t *records = &chain->buffer[SNAPSHOT_HEADER_SIZE];
+    size_t records_size = (size_t)pages_count * SNAPSHOT_PAGE_RECORD_SIZE;
+    if (fread(records, 1, records_size, file) != records_size) {
+        return fail(chain, "truncated pages");
+    }
+
+    if (chain->banks != NULL) {
+        memory_banks_select(chain->banks, header[30]);
+    }
+    for (int i = 0; i < pages_count; i++) {
+        const uint8_t *record = &records[i * SNAPSHOT_PAGE_RECORD_SIZE];
+        memory_restore_page(memory, record[0], &record[1]);
+    }
+    if (kind == SNAPSHOT_FULL) {
+        memset(memory->dirty_pages, 0, sizeof(memory->dirty_pages));
+    }
+    cpu_registers_t registers = {
+        .pc = get16(&header[16]),
+        .sp = get16(&header[18]),
+        .bc = get16(&header[20]),
+        .de = get16(&header[22]),
+        .hl = get16(&header[24]),
+        .a = header[26],
+        .f = header[27],
+        .interrupts_enabled = header[11] & 1,
+        .halted = (header[11] >> 1) & 1
+    };
+    cpu_set_registers(chain->cpu, &registers);
+    chain->started = true;
+    chain->sequence = sequence;
+    return true;
+}
@@ -0,0 +1,51 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+#include "memory_bank.h"
+
+#define SNAPSHOT_MAGIC "I8080SS" // First 8 bytes of every snapshot, with the terminating zero
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 32
+#define SNAPSHOT_PAGE_RECORD_SIZE (1 + MEMORY_PAGE_SIZE) // Page number and its bytes
+#define SNAPSHOT_MAX_SIZE (SNAPSHOT_HEADER_SIZE + MEMORY_PAGES * SNAPSHOT_PAGE_RECORD_SIZE)
+
+/*
+ * Every snapshot is a header followed by page records, all numbers are little-endian:
+ *  0  magic (8 bytes)          16 PC, SP, BC, DE, HL (2 bytes each)
+ *  8  version (2 bytes)        26 A, F
+ * 10  kind                     28 number of page records (2 bytes)
+ * 11  bit 0: interrupts        30 selected bank of the window
+ *     enabled, bit 1: halted   31 reserved
+ * 12  sequence number (4 bytes)
+ * Pages hold their bytes as the CPU reads them, the ones of the selected bank in the bank window.
+ * A full snapshot has all pages, a delta only the pages written or remapped since the previous snapshot
+ * and it can be restored only right after the snapshot with the previous sequence number
+ */
+typedef enum SNAPSHOT_KIND {
+    SNAPSHOT_FULL,
+    SNAPSHOT_DELTA
+} snapshot_kind_t;
+
+// Snapshots of a single CPU and its memory saved to (or restored from) one sequence of files or one stream
+typedef struct SNAPSHOT_CHAIN {
+    cpu_t *cpu;
+    memory_banks_t *banks; // Window whose selected bank is saved and selected again on restore, NULL if there is none
+    bool started; // True after a full snapshot was saved or restored
+    uint32_t sequence; // Sequence number of the last snapshot saved or restored
+    const char *error; // Why the last snapshot couldn't be restored
+    uint8_t buffer[SNAPSHOT_MAX_SIZE];
+} snapshot_chain_t;
+
+void snapshot_chain_init(snapshot_chain_t *chain, cpu_t *cpu);
+
+void snapshot_chain_set_banks(snapshot_chain_t *chain, memory_banks_t *banks);
+
+long snapshot_save(snapshot_chain_t *chain, FILE *file, snapshot_kind_t kind);
+
+bool snapshot_restore(snapshot_chain_t *chain, FILE *file);
+
+#endif // __SNAPSHOT_H__
@@ -0,0 +1,215 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "memory.h"
+#include "io.h"
+#include "acia.h"
+#include "tests.h"
+
+#define TEST_BUDGET_CYCLES 100000
+#define TEST_TIMEOUT_MS 1000 // How long the host thread gets to move the bytes
+#define STATUS_PORT ACIA_2SIO_PORT_A
+#define DATA_PORT (ACIA_2SIO_PORT_A + 1)
+#define RST_7 0xFF
+#define CONTROL_8N1 0x15 // 8 data bits, no parity, 1 stop bit, clock divided by 16
+#define BAUD_RATE 9600
+#define CHARACTER_CYCLES (CPU_FREQ * ACIA_BITS_PER_CHARACTER / BAUD_RATE)
+
+static memory_t memory;
+static cpu_t cpu;
+static io_bus_t bus;
+static acia_t acia;
+static int input_pipe[2]; // Written by the test, read by the ACIA
+static int output_pipe[2]; // Written by the ACIA, read by the test
+
+/**
+ * Waits until a status port of the bus has the given bits set (or cleared when they're active low)
+ */
+static bool wait_for_status(uint8_t port, uint8_t mask, uint8_t value) {
+    for (int i = 0; i < TEST_TIMEOUT_MS; i++) {
+        if ((io_read(&bus, port) & mask) == value) {
+            return true;
+        }
+        poll(NULL, 0, 1);
+    }
+    return false;
+}
+
+static bool open_acia() {
+    TEST_CHECK(pipe(input_pipe) == 0);
+    TEST_CHECK(pipe(output_pipe) == 0);
+    TEST_CHECK(acia_open_fds(&acia, input_pipe[0], output_pipe[1]));
+    io_bus_init(&bus);
+    return true;
+}
+
+static void close_acia() {
+    acia_close(&acia);
+    close(input_pipe[0]);
+    close(input_pipe[1]);
+    close(output_pipe[0]);
+    close(output_pipe[1]);
+}
+
+/**
+ * Reads the bytes the ACIA transmitted, waiting for the host thread to write them out
+ * Returns the number of bytes read
+ */
+static ssize_t read_output(char *bytes, size_t size) {
+    struct pollfd output = {output_pipe[0], POLLIN, 0};
+    if (poll(&output, 1, TEST_TIMEOUT_MS) <= 0) {
+        return 0;
+    }
+    return read(output_pipe[0], bytes, size);
+}
+
+// Bytes go through the rings in both directions and the status register follows them
+static bool test_status_and_data() {
+    if (!open_acia()) {
+        return false;
+    }
+    acia_attach(&acia, &bus, STATUS_PORT);
+    io_write(&bus, STATUS_PORT, ACIA_CONTROL_MASTER_RESET);
+    io_write(&bus, STATUS_PORT, CONTROL_8N1);
+    uint8_t empty_status = io_read(&bus, STATUS_PORT);
+    TEST_CHECK(write(input_pipe[1], "AB", 2) == 2);
+    bool received = wait_for_status(STATUS_PORT, ACIA_STATUS_RDRF, ACIA_STATUS_RDRF);
+    uint8_t full_status = io_read(&bus, STATUS_PORT);
+    uint8_t first = io_read(&bus, DATA_PORT);
+    uint8_t second = io_read(&bus, DATA_PORT);
+    uint8_t drained_status = io_read(&bus, STATUS_PORT);
+    uint8_t repeated = io_read(&bus, DATA_PORT);
+    io_write(&bus, DATA_PORT, 'x');
+    io_write(&bus, DATA_PORT, 'y');
+    char output[8];
+    ssize_t length = read_output(output, sizeof(output));
+    if (length == 1) { // The host thread may write the bytes out one by one
+        length += read_output(&output[1], sizeof(output) - 1);
+    }
+    close(input_pipe[1]);
+    bool ended = false;
+    for (int i = 0; i < TEST_TIMEOUT_MS && !ended; i++) {
+        ended = acia_input_ended(&acia);
+        poll(NULL, 0, 1);
+    }
+    close_acia();
+    TEST_CHECK(empty_status == ACIA_STATUS_TDRE);
+    TEST_CHECK(received);
+    TEST_CHECK(full_status == (ACIA_STATUS_RDRF | ACIA_STATUS_TDRE)); // No IRQ bit with receive interrupts disabled
+    TEST_CHECK(first == 'A');
+    TEST_CHECK(second == 'B');
+    TEST_CHECK(drained_status == ACIA_STATUS_TDRE);
+    TEST_CHECK(repeated == 'B'); // The data register keeps the last byte
+    TEST_CHECK(length == 2);
+    TEST_CHECK(memcmp(output, "xy", 2) == 0);
+    TEST_CHECK(ended);
+    return true;
+}
+
+// A byte arriving with receive interrupts enabled posts the RST set for the board, the handler reads it
+static bool test_receive_interrupt() {
+    static const uint8_t program[] = {
+        0x31, 0x00, 0x02, // LXI SP,0200h
+        0x3E, CONTROL_8N1 | ACIA_CONTROL_RECEIVE_INTERRUPT, // MVI A,95h
+        0xD3, STATUS_PORT, // OUT STATUS_PORT
+        0xFB, // EI
+        0xC3, 0x08, 0x01 // 0108: JMP 0108h
+    };
+    static const uint8_t handler[] = {
+        0xDB, STATUS_PORT, // IN STATUS_PORT
+        0x47, // MOV B,A
+        0xDB, DATA_PORT, // IN DATA_PORT
+        0x76 // HLT
+    };
+    if (!open_acia()) {
+        return false;
+    }
+    memory_init(&memory);
+    memory_write_bytes(&memory, 0x0038, handler, sizeof(handler));
+    memory_write_bytes(&memory, 0x0100, program, sizeof(program));
+    cpu_init(&cpu, &memory);
+    cpu_set_PC_reg(&cpu, 0x0100);
+    cpu_set_io_hooks(&cpu, io_read, io_write, &bus);
+    acia_attach(&acia, &bus, STATUS_PORT);
+    acia_set_interrupt(&acia, &cpu, RST_7);
+    cpu_run_result_t waiting = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    uint16_t waiting_pc = cpu_get_PC_reg(&cpu);
+    TEST_CHECK(write(input_pipe[1], "Z", 1) == 1);
+    cpu_run_result_t result = {CPU_EXIT_BUDGET, 0};
+    for (int i = 0; i < TEST_TIMEOUT_MS && result.reason != CPU_EXIT_HALT; i++) {
+        result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+        poll(NULL, 0, 1);
+    }
+    cpu_registers_t registers;
+    cpu_get_registers(&cpu, &registers);
+    cpu_destroy(&cpu);
+    close_acia();
+    TEST_CHECK(waiting.reason == CPU_EXIT_BUDGET);
+    TEST_CHECK(waiting_pc >= 0x0108 && waiting_pc < 0x010B); // Nothing received, nothing posted
+    TEST_CHECK(result.reason == CPU_EXIT_HALT);
+    TEST_CHECK(registers.pc == 0x003E);
+    TEST_CHECK((registers.bc >> 8) == (ACIA_STATUS_IRQ | ACIA_STATUS_RDRF | ACIA_STATUS_TDRE));
+    TEST_CHECK(registers.a == 'Z');
+    TEST_CHECK(!registers.interrupts_enabled);
+    return true;
+}
+
+// With a baud rate set the byte after the one read is ready one character time later, until then the data
+// register keeps the byte read
+static bool test_paced_receive() {
+    if (!open_acia()) {
+        return false;
+    }
+    memory_init(&memory); // NOPs
+    cpu_init(&cpu, &memory);
+    acia_attach(&acia, &bus, STATUS_PORT);
+    acia_set_baud_rate(&acia, &cpu, BAUD_RATE);
+    TEST_CHECK(write(input_pipe[1], "AB", 2) == 2);
+    uint8_t early_status = io_read(&bus, STATUS_PORT);
+    cpu_run(&cpu, CHARACTER_CYCLES);
+    bool received = wait_for_status(STATUS_PORT, ACIA_STATUS_RDRF, ACIA_STATUS_RDRF);
+    uint8_t first = io_read(&bus, DATA_PORT);
+    uint8_t waiting_status = io_read(&bus, STATUS_PORT);
+    uint8_t repeated = io_read(&bus, DATA_PORT);
+    cpu_run(&cpu, CHARACTER_CYCLES - 8);
+    uint8_t almost_status = io_read(&bus, STATUS_PORT);
+    cpu_run(&cpu, 8);
+    uint8_t second_status = io_read(&bus, STATUS_PORT);
+    uint8_t second = io_read(&bus, DATA_PORT);
+    cpu_destroy(&cpu);
+    close_acia();
+    TEST_CHECK(early_status == ACIA_STATUS_TDRE); // Not even the first byte is in before a character time
+    TEST_CHECK(received && first == 'A');
+    TEST_CHECK(waiting_status == ACIA_STATUS_TDRE && repeated == 'A');
+    TEST_CHECK(almost_status == ACIA_STATUS_TDRE);
+    TEST_CHECK(second_status == (ACIA_STATUS_RDRF | ACIA_STATUS_TDRE) && second == 'B');
+    return true;
+}
+
+// On the ports of an 88-SIO the status bits are active low, input ready in bit 0 and output ready in bit 7
+static bool test_sio_status() {
+    if (!open_acia()) {
+        return false;
+    }
+    acia_attach_sio(&acia, &bus, ACIA_SIO_PORT);
+    uint8_t empty_status = io_read(&bus, ACIA_SIO_PORT);
+    TEST_CHECK(write(input_pipe[1], "Q", 1) == 1);
+    bool received = wait_for_status(ACIA_SIO_PORT, ACIA_SIO_STATUS_INPUT_BUSY, 0);
+    uint8_t full_status = io_read(&bus, ACIA_SIO_PORT);
+    uint8_t data = io_read(&bus, ACIA_SIO_PORT + 1);
+    uint8_t drained_status = io_read(&bus, ACIA_SIO_PORT);
+    close_acia();
+    TEST_CHECK(empty_status == ACIA_SIO_STATUS_INPUT_BUSY);
+    TEST_CHECK(received);
+    TEST_CHECK(full_status == 0);
+    TEST_CHECK(data == 'Q');
+    TEST_CHECK(drained_status == ACIA_SIO_STATUS_INPUT_BUSY);
+    return true;
+}
+
+bool test_acia() {
+    return test_status_and_data() && test_receive_interrupt() && test_paced_receive() && test_sio_status();
+}
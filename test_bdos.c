@@ -0,0 +1,436 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include "cpu.h"
+#include "memory.h"
+#include "console.h"
+#include "bdos.h"
+#include "tests.h"
+
+#define TEST_BUDGET_CYCLES 100000
+#define CALL_ADDRESS 0x0100 // CALL 0005h, followed by a trapped stop
+#define FCB_ADDRESS 0x0200
+#define SECOND_FCB_ADDRESS 0x0240
+#define DMA_ADDRESS 0x0300
+#define FCB_EX 12
+#define FCB_RC 15
+#define FCB_CR 32
+#define FCB_R0 33
+#define RESULT_END_OF_FILE 0x01
+#define RESULT_OUT_OF_RANGE 0x06
+#define RESULT_FAILED 0xFF
+#define FILE_RECORDS 300 // Three extents, the last one with 44 records
+
+static memory_t memory;
+static cpu_t cpu;
+static cpu_traps_t traps;
+static bdos_t bdos;
+static console_t console;
+static int null_fd;
+static char directory[] = "/tmp/bdos_test_XXXXXX";
+
+static bool stop(cpu_t *cpu, void *context) {
+    (void)cpu;
+    (void)context;
+    return false;
+}
+
+static uint8_t record_byte(uint32_t record, int index) {
+    return (uint8_t)(record * 3 + index);
+}
+
+/**
+ * Writes 'length' bytes of the record pattern to a host file in the drive directory,
+ * an existing file is written over from its start, so it only grows
+ */
+static bool create_file(const char *name, size_t length) {
+    char path[sizeof(directory) + 256];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    int fd = open(path, O_WRONLY | O_CREAT, 0644);
+    TEST_CHECK(fd >= 0);
+    bool written = true;
+    for (size_t offset = 0; offset < length; offset++) {
+        uint8_t byte = record_byte(offset / BDOS_RECORD_SIZE, offset % BDOS_RECORD_SIZE);
+        written &= write(fd, &byte, 1) == 1;
+    }
+    close(fd);
+    TEST_CHECK(written);
+    return true;
+}
+
+static off_t host_file_size(const char *name) {
+    char path[sizeof(directory) + 256];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    close(fd);
+    return size;
+}
+
+/**
+ * Prepares a machine with an empty temporary directory as drive A:, the console goes to /dev/null
+ */
+static bool setup() {
+    strcpy(directory, "/tmp/bdos_test_XXXXXX");
+    TEST_CHECK(mkdtemp(directory) != NULL);
+    null_fd = open("/dev/null", O_RDWR);
+    TEST_CHECK(null_fd >= 0);
+    memory_init(&memory);
+    static const uint8_t call[] = {0xCD, BDOS_CALL_ADDRESS & 0xFF, BDOS_CALL_ADDRESS >> 8}; // CALL 0005h
+    memory_write_bytes(&memory, CALL_ADDRESS, call, sizeof(call));
+    cpu_init(&cpu, &memory);
+    cpu_traps_init(&traps);
+    cpu_set_traps(&cpu, &traps);
+    console_init(&console, null_fd);
+    bdos_init(&bdos, &cpu, null_fd, &console);
+    bdos_set_drive(&bdos, 0, directory);
+    TEST_CHECK(bdos_install(&bdos, &traps));
+    TEST_CHECK(cpu_traps_add(&traps, CALL_ADDRESS + sizeof(call), stop, NULL));
+    return true;
+}
+
+static void teardown() {
+    bdos_close_files(&bdos);
+    cpu_destroy(&cpu);
+    close(null_fd);
+    DIR *listing = opendir(directory);
+    struct dirent *entry;
+    char path[sizeof(directory) + 256];
+    while (listing != NULL && (entry = readdir(listing)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            snprintf(path, sizeof(path), "%s/%s", directory, entry->d_name);
+            unlink(path);
+        }
+    }
+    if (listing != NULL) {
+        closedir(listing);
+    }
+    rmdir(directory);
+}
+
+/**
+ * Calls a BDOS function the way a program does, with the function in C and the argument in DE
+ * Returns the result in A, -1 if the call didn't come back
+ */
+static int call_bdos(uint8_t function, uint16_t de) {
+    cpu_registers_t registers;
+    cpu_get_registers(&cpu, &registers);
+    registers.pc = CALL_ADDRESS;
+    registers.sp = 0xF000;
+    registers.bc = function;
+    registers.de = de;
+    cpu_set_registers(&cpu, &registers);
+    cpu_run_result_t result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    cpu_get_registers(&cpu, &registers);
+    return (result.reason == CPU_EXIT_TRAP && registers.pc == CALL_ADDRESS + 3) ? registers.a : -1;
+}
+
+/**
+ * Writes an FCB for a name in the 11 character form (e.g. "TEST    DAT") on the current drive, at the start of the file
+ */
+static void set_fcb(uint16_t address, const char *name) {
+    uint8_t fcb[36] = {0};
+    memcpy(&fcb[1], name, 11);
+    memory_write_bytes(&memory, address, fcb, sizeof(fcb));
+}
+
+static uint32_t random_record(uint16_t fcb_address) {
+    return memory.data[fcb_address + FCB_R0] | (memory.data[fcb_address + FCB_R0 + 1] << 8)
+        | (memory.data[fcb_address + FCB_R0 + 2] << 16);
+}
+
+static void set_random_record(uint16_t fcb_address, uint32_t record) {
+    memory.data[fcb_address + FCB_R0] = record & 0xFF;
+    memory.data[fcb_address + FCB_R0 + 1] = (record >> 8) & 0xFF;
+    memory.data[fcb_address + FCB_R0 + 2] = record >> 16;
+}
+
+static bool dma_has_record(uint32_t record) {
+    for (int i = 0; i < BDOS_RECORD_SIZE; i++) {
+        if (memory.data[DMA_ADDRESS + i] != record_byte(record, i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Records written one after the other into a new file are read back in order, across the end of an extent
+static bool test_sequential() {
+    if (!setup()) {
+        return false;
+    }
+    set_fcb(FCB_ADDRESS, "SEQ     DAT");
+    TEST_CHECK(call_bdos(22, FCB_ADDRESS) == 0);
+    TEST_CHECK(call_bdos(26, DMA_ADDRESS) == 0);
+    bool written = true;
+    for (uint32_t record = 0; record < 130; record++) {
+        for (int i = 0; i < BDOS_RECORD_SIZE; i++) {
+            memory.data[DMA_ADDRESS + i] = record_byte(record, i);
+        }
+        written &= call_bdos(21, FCB_ADDRESS) == 0;
+    }
+    uint8_t written_ex = memory.data[FCB_ADDRESS + FCB_EX];
+    uint8_t written_cr = memory.data[FCB_ADDRESS + FCB_CR];
+    int closed = call_bdos(16, FCB_ADDRESS);
+    off_t size = host_file_size("SEQ.DAT");
+    set_fcb(FCB_ADDRESS, "SEQ     DAT");
+    int opened = call_bdos(15, FCB_ADDRESS);
+    uint8_t opened_rc = memory.data[FCB_ADDRESS + FCB_RC];
+    bool read = true;
+    for (uint32_t record = 0; record < 130; record++) {
+        read &= call_bdos(20, FCB_ADDRESS) == 0 && dma_has_record(record);
+    }
+    uint8_t read_ex = memory.data[FCB_ADDRESS + FCB_EX];
+    uint8_t read_rc = memory.data[FCB_ADDRESS + FCB_RC];
+    int past_end = call_bdos(20, FCB_ADDRESS);
+    bdos_stats_t stats = bdos.stats;
+    teardown();
+    TEST_CHECK(written);
+    TEST_CHECK(written_ex == 1 && written_cr == 2);
+    TEST_CHECK(closed == 0 && size == 130 * BDOS_RECORD_SIZE);
+    TEST_CHECK(opened == 0 && opened_rc == 128);
+    TEST_CHECK(read);
+    TEST_CHECK(read_ex == 1 && read_rc == 2); // The second extent has the last 2 records
+    TEST_CHECK(past_end == RESULT_END_OF_FILE);
+    TEST_CHECK(stats.records_written == 130 && stats.records_read == 130);
+    return true;
+}
+
+// A file which doesn't end at a record boundary has its last record padded with end of file characters
+static bool test_short_last_record() {
+    if (!setup() || !create_file("SHORT.TXT", BDOS_RECORD_SIZE + 72)) {
+        return false;
+    }
+    set_fcb(FCB_ADDRESS, "SHORT   TXT");
+    call_bdos(26, DMA_ADDRESS);
+    int opened = call_bdos(15, FCB_ADDRESS);
+    uint8_t rc = memory.data[FCB_ADDRESS + FCB_RC];
+    int first = call_bdos(20, FCB_ADDRESS);
+    int second = call_bdos(20, FCB_ADDRESS);
+    bool padded = true;
+    for (int i = 0; i < BDOS_RECORD_SIZE; i++) {
+        padded &= memory.data[DMA_ADDRESS + i] == ((i < 72) ? record_byte(1, i) : BDOS_EOF);
+    }
+    int third = call_bdos(20, FCB_ADDRESS);
+    teardown();
+    TEST_CHECK(opened == 0 && rc == 2);
+    TEST_CHECK(first == 0 && second == 0 && padded);
+    TEST_CHECK(third == RESULT_END_OF_FILE);
+    return true;
+}
+
+// Opening a later extent gives the number of records in it, the position in the extent is left to the program
+static bool test_extent_arithmetic() {
+    if (!setup() || !create_file("BIG.DAT", FILE_RECORDS * BDOS_RECORD_SIZE)) {
+        return false;
+    }
+    call_bdos(26, DMA_ADDRESS);
+    set_fcb(FCB_ADDRESS, "BIG     DAT");
+    memory.data[FCB_ADDRESS + FCB_EX] = 1;
+    int second_opened = call_bdos(15, FCB_ADDRESS);
+    uint8_t second_rc = memory.data[FCB_ADDRESS + FCB_RC];
+    set_fcb(FCB_ADDRESS, "BIG     DAT");
+    memory.data[FCB_ADDRESS + FCB_EX] = 2;
+    memory.data[FCB_ADDRESS + FCB_CR] = 5;
+    int third_opened = call_bdos(15, FCB_ADDRESS);
+    uint8_t third_rc = memory.data[FCB_ADDRESS + FCB_RC];
+    int read = call_bdos(20, FCB_ADDRESS);
+    bool same_record = dma_has_record(2 * 128 + 5);
+    uint8_t read_cr = memory.data[FCB_ADDRESS + FCB_CR];
+    call_bdos(36, FCB_ADDRESS);
+    uint32_t position = random_record(FCB_ADDRESS);
+    int sized = call_bdos(35, FCB_ADDRESS);
+    uint32_t records = random_record(FCB_ADDRESS);
+    set_fcb(SECOND_FCB_ADDRESS, "NONE    DAT");
+    int missing = call_bdos(35, SECOND_FCB_ADDRESS);
+    teardown();
+    TEST_CHECK(second_opened == 0 && second_rc == 128);
+    TEST_CHECK(third_opened == 0 && third_rc == FILE_RECORDS - 256);
+    TEST_CHECK(read == 0 && same_record && read_cr == 6);
+    TEST_CHECK(position == 2 * 128 + 6); // Set random record takes the sequential position
+    TEST_CHECK(sized == 0 && records == FILE_RECORDS);
+    TEST_CHECK(missing == RESULT_FAILED);
+    return true;
+}
+
+// Random records in another extent move the sequential position there, a random write past the end grows the file
+static bool test_random() {
+    if (!setup() || !create_file("RAND.DAT", FILE_RECORDS * BDOS_RECORD_SIZE)) {
+        return false;
+    }
+    call_bdos(26, DMA_ADDRESS);
+    set_fcb(FCB_ADDRESS, "RAND    DAT");
+    call_bdos(15, FCB_ADDRESS);
+    set_random_record(FCB_ADDRESS, 129);
+    int read = call_bdos(33, FCB_ADDRESS);
+    bool read_record = dma_has_record(129);
+    uint8_t ex = memory.data[FCB_ADDRESS + FCB_EX];
+    uint8_t cr = memory.data[FCB_ADDRESS + FCB_CR];
+    uint8_t rc = memory.data[FCB_ADDRESS + FCB_RC];
+    int sequential = call_bdos(20, FCB_ADDRESS); // Reads the same record again, like CP/M
+    bool sequential_record = dma_has_record(129);
+    uint32_t kept = random_record(FCB_ADDRESS);
+    for (int i = 0; i < BDOS_RECORD_SIZE; i++) {
+        memory.data[DMA_ADDRESS + i] = record_byte(400, i);
+    }
+    set_random_record(FCB_ADDRESS, 400);
+    int written = call_bdos(34, FCB_ADDRESS);
+    uint8_t written_ex = memory.data[FCB_ADDRESS + FCB_EX];
+    uint8_t written_cr = memory.data[FCB_ADDRESS + FCB_CR];
+    off_t size = host_file_size("RAND.DAT");
+    memset(&memory.data[DMA_ADDRESS], 0, BDOS_RECORD_SIZE);
+    int read_back = call_bdos(33, FCB_ADDRESS);
+    bool written_record = dma_has_record(400);
+    set_random_record(FCB_ADDRESS, 401);
+    int past_end = call_bdos(33, FCB_ADDRESS);
+    set_random_record(FCB_ADDRESS, 0x10000);
+    int out_of_range = call_bdos(33, FCB_ADDRESS);
+    teardown();
+    TEST_CHECK(read == 0 && read_record);
+    TEST_CHECK(ex == 1 && cr == 1 && rc == 128);
+    TEST_CHECK(sequential == 0 && sequential_record && kept == 129);
+    TEST_CHECK(written == 0 && written_ex == 3 && written_cr == 400 - 3 * 128);
+    TEST_CHECK(size == 401 * BDOS_RECORD_SIZE);
+    TEST_CHECK(read_back == 0 && written_record);
+    TEST_CHECK(past_end == RESULT_END_OF_FILE);
+    TEST_CHECK(out_of_range == RESULT_OUT_OF_RANGE);
+    return true;
+}
+
+// Records appended to a file by the host after it was mapped are read once the mapping is made again
+static bool test_grown_file() {
+    if (!setup() || !create_file("GROW.DAT", BDOS_RECORD_SIZE)) {
+        return false;
+    }
+    call_bdos(26, DMA_ADDRESS);
+    set_fcb(FCB_ADDRESS, "GROW    DAT");
+    call_bdos(15, FCB_ADDRESS);
+    int first = call_bdos(20, FCB_ADDRESS);
+    int end = call_bdos(20, FCB_ADDRESS);
+    unsigned long long remaps_at_end = bdos.stats.remaps;
+    bool grown = create_file("GROW.DAT", 2 * BDOS_RECORD_SIZE);
+    int second = call_bdos(20, FCB_ADDRESS);
+    bool second_record = dma_has_record(1);
+    unsigned long long remaps = bdos.stats.remaps;
+    teardown();
+    TEST_CHECK(first == 0 && end == RESULT_END_OF_FILE && remaps_at_end == 0);
+    TEST_CHECK(grown);
+    TEST_CHECK(second == 0 && second_record && remaps == 1);
+    return true;
+}
+
+// Search first and next list the matching files one directory entry at a time
+static bool test_search() {
+    if (!setup() || !create_file("ONE.TXT", 10) || !create_file("TWO.TXT", 3 * BDOS_RECORD_SIZE)
+        || !create_file("THREE.DAT", 10) || !create_file("too-long-name.txt", 10)) {
+        return false;
+    }
+    call_bdos(26, DMA_ADDRESS);
+    set_fcb(FCB_ADDRESS, "????????TXT");
+    int found = 0;
+    bool one = false;
+    bool two = false;
+    for (int result = call_bdos(17, FCB_ADDRESS); result == 0 && found < 10; result = call_bdos(18, 0)) {
+        found++;
+        one |= memcmp(&memory.data[DMA_ADDRESS + 1], "ONE     TXT", 11) == 0 && memory.data[DMA_ADDRESS + FCB_RC] == 1;
+        two |= memcmp(&memory.data[DMA_ADDRESS + 1], "TWO     TXT", 11) == 0 && memory.data[DMA_ADDRESS + FCB_RC] == 3;
+    }
+    int after_end = call_bdos(18, 0);
+    set_fcb(FCB_ADDRESS, "NONE    COM");
+    int none = call_bdos(17, FCB_ADDRESS);
+    teardown();
+    TEST_CHECK(found == 2 && one && two);
+    TEST_CHECK(after_end == RESULT_FAILED);
+    TEST_CHECK(none == RESULT_FAILED);
+    return true;
+}
+
+// A renamed file is opened by its new name only, a deleted one not at all
+static bool test_rename_and_delete() {
+    if (!setup() || !create_file("OLD.DAT", BDOS_RECORD_SIZE)) {
+        return false;
+    }
+    call_bdos(26, DMA_ADDRESS);
+    set_fcb(FCB_ADDRESS, "OLD     DAT");
+    int read = call_bdos(20, FCB_ADDRESS); // Opens the host file
+    set_fcb(FCB_ADDRESS, "OLD     DAT");
+    memcpy(&memory.data[FCB_ADDRESS + 17], "NEW     DAT", 11);
+    int renamed = call_bdos(23, FCB_ADDRESS);
+    set_fcb(FCB_ADDRESS, "OLD     DAT");
+    int old_opened = call_bdos(15, FCB_ADDRESS);
+    set_fcb(FCB_ADDRESS, "NEW     DAT");
+    int new_opened = call_bdos(15, FCB_ADDRESS);
+    int new_read = call_bdos(20, FCB_ADDRESS);
+    bool same_record = dma_has_record(0);
+    int deleted = call_bdos(19, FCB_ADDRESS);
+    off_t size = host_file_size("NEW.DAT");
+    int deleted_opened = call_bdos(15, FCB_ADDRESS);
+    int deleted_again = call_bdos(19, FCB_ADDRESS);
+    teardown();
+    TEST_CHECK(read == 0 && renamed == 0);
+    TEST_CHECK(old_opened == RESULT_FAILED);
+    TEST_CHECK(new_opened == 0 && new_read == 0 && same_record);
+    TEST_CHECK(deleted == 0 && size < 0);
+    TEST_CHECK(deleted_opened == RESULT_FAILED && deleted_again == RESULT_FAILED);
+    return true;
+}
+
+static bool is_open(const char *name) {
+    for (int i = 0; i < BDOS_MAX_FILES; i++) {
+        if (bdos.files[i].used && strcmp(bdos.files[i].name, name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Opening more files than are kept open closes the least recently used one, which is opened again when used
+static bool test_least_recently_used() {
+    if (!setup()) {
+        return false;
+    }
+    char name[16];
+    char fcb_name[12];
+    for (int i = 0; i <= BDOS_MAX_FILES; i++) {
+        snprintf(name, sizeof(name), "F%d.DAT", i);
+        if (!create_file(name, BDOS_RECORD_SIZE)) {
+            teardown();
+            return false;
+        }
+    }
+    call_bdos(26, DMA_ADDRESS);
+    bool opened = true;
+    for (int i = 0; i < BDOS_MAX_FILES; i++) {
+        snprintf(fcb_name, sizeof(fcb_name), "F%-7dDAT", i);
+        set_fcb(FCB_ADDRESS, fcb_name);
+        opened &= call_bdos(15, FCB_ADDRESS) == 0;
+    }
+    bool all_open = is_open("F0.DAT") && is_open("F15.DAT");
+    set_fcb(FCB_ADDRESS, "F0      DAT");
+    int used = call_bdos(20, FCB_ADDRESS); // F1 becomes the least recently used
+    set_fcb(FCB_ADDRESS, "F16     DAT");
+    opened &= call_bdos(15, FCB_ADDRESS) == 0;
+    bool evicted = !is_open("F1.DAT") && is_open("F0.DAT") && is_open("F16.DAT");
+    set_fcb(FCB_ADDRESS, "F1      DAT");
+    int reopened = call_bdos(20, FCB_ADDRESS);
+    bool same_record = dma_has_record(0);
+    bool second_evicted = is_open("F1.DAT") && !is_open("F2.DAT");
+    teardown();
+    TEST_CHECK(opened && all_open);
+    TEST_CHECK(used == 0);
+    TEST_CHECK(evicted);
+    TEST_CHECK(reopened == 0 && same_record && second_evicted);
+    return true;
+}
+
+bool test_bdos() {
+    return test_sequential() && test_short_last_record() && test_extent_arithmetic() && test_random()
+        && test_grown_file() && test_search() && test_rename_and_delete() && test_least_recently_used();
+}
@@ -0,0 +1,151 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "memory.h"
+#include "io.h"
+#include "console.h"
+#include "scheduler.h"
+#include "tests.h"
+
+#define TEST_BUDGET_CYCLES (4 * CONSOLE_FLUSH_CYCLES)
+#define STATUS_PORT 0x10
+#define DATA_PORT 0x11
+#define FREE_PORT 0x20
+
+static memory_t memory;
+static cpu_t cpu;
+static io_bus_t bus;
+static console_t console;
+static scheduler_t scheduler;
+static int pipe_fds[2];
+
+/**
+ * Loads a program at 0x0100 writing to a console on a pipe (so it isn't line buffered),
+ * flushed on time if it's 'scheduled'
+ */
+static bool load(const uint8_t *program, uint32_t program_length, bool scheduled) {
+    TEST_CHECK(pipe(pipe_fds) == 0);
+    TEST_CHECK(fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK) == 0);
+    memory_init(&memory);
+    memory_write_bytes(&memory, 0x0100, program, program_length);
+    cpu_init(&cpu, &memory);
+    cpu_set_PC_reg(&cpu, 0x0100);
+    io_bus_init(&bus);
+    console_init(&console, pipe_fds[1]);
+    console_attach(&console, &bus, STATUS_PORT, DATA_PORT);
+    cpu_set_io_hooks(&cpu, io_read, io_write, &bus);
+    scheduler_init(&scheduler, &cpu);
+    if (scheduled) {
+        console_set_scheduler(&console, &scheduler);
+    }
+    return true;
+}
+
+static void unload() {
+    cpu_destroy(&cpu);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+}
+
+static const uint8_t halting_program[] = {
+    0x3E, 'H', // MVI A,'H'
+    0xD3, DATA_PORT, // OUT DATA_PORT
+    0x3E, 'I', // MVI A,'I'
+    0xD3, DATA_PORT, // OUT DATA_PORT
+    0x76 // HLT
+};
+
+// Output of a program which halts without polling the console stays buffered until the batch ends and it's flushed
+static bool test_flushed_after_batch() {
+    if (!load(halting_program, sizeof(halting_program), false)) {
+        return false;
+    }
+    cpu_run_result_t result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    char output[8] = {0};
+    ssize_t early_length = read(pipe_fds[0], output, sizeof(output));
+    bool flushed = console_flush(&console);
+    ssize_t length = read(pipe_fds[0], output, sizeof(output));
+    unload();
+    TEST_CHECK(result.reason == CPU_EXIT_HALT);
+    TEST_CHECK(early_length < 0); // Nothing written out yet
+    TEST_CHECK(flushed && length == 2);
+    TEST_CHECK(memcmp(output, "HI", 2) == 0);
+    TEST_CHECK(console.flushes == 1);
+    return true;
+}
+
+// A program polling the console gets its output written out, a port without a device reads FFh
+static bool test_flushed_on_poll() {
+    static const uint8_t program[] = {
+        0x3E, '!', // MVI A,'!'
+        0xD3, DATA_PORT, // OUT DATA_PORT
+        0xDB, STATUS_PORT, // IN STATUS_PORT
+        0x47, // MOV B,A
+        0xDB, FREE_PORT, // IN FREE_PORT
+        0x76 // HLT
+    };
+    if (!load(program, sizeof(program), false)) {
+        return false;
+    }
+    cpu_run_result_t result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    char output[8] = {0};
+    ssize_t length = read(pipe_fds[0], output, sizeof(output));
+    cpu_registers_t registers;
+    cpu_get_registers(&cpu, &registers);
+    unload();
+    TEST_CHECK(result.reason == CPU_EXIT_HALT);
+    TEST_CHECK(length == 1);
+    TEST_CHECK(output[0] == '!');
+    TEST_CHECK(console.flushes == 1);
+    TEST_CHECK(registers.bc >> 8 == CONSOLE_STATUS_OUTPUT_READY);
+    TEST_CHECK(registers.a == 0xFF);
+    return true;
+}
+
+// Output of a program which halts without polling the console is written out while the CPU is halted
+static bool test_flushed_when_halted() {
+    if (!load(halting_program, sizeof(halting_program), true)) {
+        return false;
+    }
+    cpu_run_result_t result = scheduler_run(&scheduler, TEST_BUDGET_CYCLES);
+    char output[8] = {0};
+    ssize_t length = read(pipe_fds[0], output, sizeof(output));
+    unload();
+    TEST_CHECK(result.reason == CPU_EXIT_HALT);
+    TEST_CHECK(length == 2);
+    TEST_CHECK(memcmp(output, "HI", 2) == 0);
+    TEST_CHECK(console.flushes == 1);
+    TEST_CHECK(console.flush_event.link == NULL);
+    return true;
+}
+
+// Output of a program which keeps running without polling is written out CONSOLE_FLUSH_CYCLES after the first byte
+static bool test_flushed_while_running() {
+    static const uint8_t program[] = {
+        0x3E, '!', // MVI A,'!'
+        0xD3, DATA_PORT, // OUT DATA_PORT
+        0xC3, 0x04, 0x01 // 0104: JMP 0104h
+    };
+    if (!load(program, sizeof(program), true)) {
+        return false;
+    }
+    char output[8] = {0};
+    cpu_run_result_t result = scheduler_run(&scheduler, CONSOLE_FLUSH_CYCLES / 2);
+    ssize_t early_length = read(pipe_fds[0], output, sizeof(output));
+    scheduler_run(&scheduler, CONSOLE_FLUSH_CYCLES);
+    ssize_t length = read(pipe_fds[0], output, sizeof(output));
+    unload();
+    TEST_CHECK(result.reason == CPU_EXIT_BUDGET);
+    TEST_CHECK(early_length < 0); // Nothing written out yet
+    TEST_CHECK(length == 1);
+    TEST_CHECK(output[0] == '!');
+    TEST_CHECK(console.flushes == 1);
+    return true;
+}
+
+bool test_console() {
+    return test_flushed_after_batch() && test_flushed_on_poll() && test_flushed_when_halted() && test_flushed_while_running();
+}
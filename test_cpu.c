@@ -1,52 +1,109 @@
+#include <time.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include "cpu.h"
 #include "memory.h"
+#include "loader.h"
+#include "console.h"
+#include "bdos.h"
+#include "pacer.h"
+#include "debug.h"
 
+#define RUN_BUDGET_CYCLES CPU_FREQ
+#define TOP_PAIRS_COUNT 10
+
+static memory_t memory;
+static cpu_t cpu;
+static cpu_traps_t traps;
+static console_t console;
+static bdos_t bdos;
 
 /**
- * Implement some IO functions of BDOS from CP/M.
- * Tests were designed to be run inside CP/M
- * but they're using it only for printing
- * so we can emulate that function and forget about CP/M :)
+ * Runs a CP/M program until it resets, as fast as possible or paced at a multiple of CPU_FREQ
  */
-static void bdos_io() {
-    uint8_t c_reg = cpu_get_C_reg();
-    if (c_reg == 2) {
-        printf("%c", cpu_get_E_reg());
-    } else if (c_reg == 9) {
-        uint16_t addr = cpu_get_DE_reg();
-        char chr = 0;
-        while (1) {
-            chr = memory_get(addr++);
-            if (chr == '$')
-                break;
-            printf("%c", chr);
-        }
-    }
-}
-
-void run_test(char *program_path) {
+void run_test(char *program_path, double speed) {
     printf("====== Running test %s ======\n", program_path);
-    memory_read_file(program_path, 0x100);
-    cpu_init();
-    cpu_set_PC_reg(0x100);
-    memory_store(0x0005, 0xC9); // Insert return operation at address on which CP/M's print subroutine should start
+    loader_t loader;
+    loader_init(&loader, &memory);
+    loader_segment_t program = {program_path, LOADER_BINARY, 0x100};
+    if (!loader_load(&loader, &program, 1)) {
+        printf("Program load error: %s\n", loader.error);
+        return;
+    }
+    cpu_init(&cpu, &memory);
+    cpu_set_PC_reg(&cpu, 0x100);
+    // Tests were designed to be run inside CP/M, its BDOS is emulated with the files of the current directory on drive A:
+    cpu_traps_init(&traps);
+    console_init(&console, STDOUT_FILENO);
+    bdos_init(&bdos, &cpu, STDIN_FILENO, &console);
+    bdos_set_drive(&bdos, 0, ".");
+    bdos_install(&bdos, &traps);
+    cpu_traps_add(&traps, 0x0000, NULL, NULL); // CP/M resets on this address so for now we can exit
+    cpu_set_traps(&cpu, &traps);
+    cpu_use_aot(&cpu);
+    pacer_t pacer;
+    pacer_init(&pacer, CPU_FREQ, speed);
     bool should_run = true;
-    long long total_cycles_elapsed = 0;
+    fflush(stdout); // The console writes the output of the program to the descriptor, past the stream
+    struct timespec start_time, end_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
     while (should_run) {
-        total_cycles_elapsed += cpu_step();
-        if (cpu_get_PC_reg() == 0x0005) {
-            bdos_io();
-        } else if (cpu_get_PC_reg() == 0x0000) { // CP/M resets on this address so for now we can exit
-            should_run = false;
-        }
-    }
-    printf("\n====== Elapsed CPU cycles: %lld ======\n\n\n", total_cycles_elapsed);
+        cpu_run_result_t result = (speed > PACER_UNLIMITED) ? pacer_run_slice(&pacer, &cpu) : cpu_run(&cpu, RUN_BUDGET_CYCLES);
+        // Only the reset trap stops the execution and there are no interrupts in the tests to wake up a halted CPU
+        should_run = (result.reason == CPU_EXIT_BUDGET);
+        console_flush(&console);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    long long total_cycles_elapsed = cpu_get_cycles(&cpu);
+    double elapsed_seconds = (end_time.tv_sec - start_time.tv_sec) + (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+    printf("\n====== Elapsed CPU cycles: %lld ======\n", total_cycles_elapsed);
+    printf("====== Elapsed host time: %.3f s (%.1f MHz, core: %s) ======\n",
+        elapsed_seconds, total_cycles_elapsed / elapsed_seconds / 1e6, cpu_get_core_name());
+    if (speed > PACER_UNLIMITED) {
+        pacer_stats_t pacer_stats;
+        pacer_get_stats(&pacer, &pacer_stats);
+        printf("====== Pacer: %.1fx, %llu slices, %llu overruns, %.3f ms dropped, %.3f ms max late ======\n",
+            speed, pacer_stats.slices, pacer_stats.overruns, pacer_stats.dropped_ns / 1e6, pacer_stats.max_late_ns / 1e6);
+    }
+    block_cache_stats_t block_cache_stats;
+    if (cpu_get_block_cache_stats(&cpu, &block_cache_stats)) {
+        printf("====== Block cache: %llu hits, %llu misses, %llu invalidations ======\n",
+            block_cache_stats.hits, block_cache_stats.misses, block_cache_stats.invalidations);
+    }
+    jit_stats_t jit_stats;
+    if (cpu_get_jit_stats(&cpu, &jit_stats)) {
+        printf("====== JIT: %llu translated blocks, %llu invalidated, %llu flushes, %llu exits ======\n",
+            jit_stats.translated_blocks, jit_stats.invalidated_blocks, jit_stats.flushes, jit_stats.exits);
+    }
+    loop_idiom_stats_t loop_idiom_stats;
+    if (cpu_get_loop_idiom_stats(&cpu, &loop_idiom_stats)) {
+        printf("====== Loop idioms: %llu loops recognized, %llu bulk runs, %llu iterations skipped ======\n",
+            loop_idiom_stats.recognized_loops, loop_idiom_stats.bulk_runs, loop_idiom_stats.skipped_iterations);
+    }
+    idle_loop_stats_t idle_loop_stats;
+    if (cpu_get_idle_loop_stats(&cpu, &idle_loop_stats)) {
+        printf("====== Idle loops: %llu loops recognized, %llu skips, %llu iterations skipped ======\n",
+            idle_loop_stats.recognized_loops, idle_loop_stats.skips, idle_loop_stats.skipped_iterations);
+    }
+    cpu_op_pair_t top_pairs[TOP_PAIRS_COUNT];
+    int top_pairs_count = cpu_get_top_pairs(&cpu, top_pairs, TOP_PAIRS_COUNT);
+    for (int i = 0; i < top_pairs_count; i++) {
+        printf("====== Pair %d: %s + %s, %llu times ======\n", i + 1,
+            get_op_name(top_pairs[i].first_opcode), get_op_name(top_pairs[i].second_opcode), top_pairs[i].count);
+    }
+    unsigned long long aot_blocks_executed, aot_stale_exits;
+    const char *aot_program = cpu_get_aot_stats(&cpu, &aot_blocks_executed, &aot_stale_exits);
+    if (aot_program != NULL) {
+        printf("====== AOT: %s, %llu blocks executed, %llu stale exits ======\n", aot_program, aot_blocks_executed, aot_stale_exits);
+    }
+    printf("\n\n");
+    bdos_close_files(&bdos);
+    cpu_destroy(&cpu);
 }
 
-void run_all_tests() {
+void run_all_tests(double speed) {
+    memory_init(&memory);
     char *Test_Programs[] = {
         "../programs/8080PRE.COM",
         "../programs/CPUTEST.COM",
@@ -55,6 +112,6 @@ void run_all_tests() {
         "../programs/8080EXM.COM"
     };
     for (unsigned i = 0; i < (sizeof(Test_Programs) / sizeof(Test_Programs[0])); i++) {
-        run_test(Test_Programs[i]);
+        run_test(Test_Programs[i], speed);
     }
 }
@@ -1,8 +1,8 @@
 #ifndef __TEST_CPU_H__
 #define __TEST_CPU_H__
 
-void run_test();
+void run_test(char *program_path, double speed);
 
-void run_all_tests();
+void run_all_tests(double speed);
 
 #endif // __TEST_CPU_H__
\ No newline at end of file
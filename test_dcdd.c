@@ -0,0 +1,308 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cpu.h"
+#include "memory.h"
+#include "io.h"
+#include "dcdd.h"
+#include "tests.h"
+
+#define TEST_TRACKS 2
+#define TEST_BUDGET_CYCLES 1000000
+#define BUFFER_ADDRESS 0x0200
+
+static memory_t memory;
+static cpu_t cpu;
+static io_bus_t bus;
+static dcdd_t dcdd;
+static char image_path[] = "/tmp/dcdd_test_XXXXXX";
+
+// Reads a sector of track 1 into the buffer, D has the sector position it was read at
+static const uint8_t read_program[] = {
+    0xAF, // 0100: XRA A
+    0xD3, DCDD_PORT_SELECT, // OUT 08h (drive 0)
+    0x3E, DCDD_CONTROL_HEAD_LOAD | DCDD_CONTROL_STEP_IN, // MVI A,05h
+    0xD3, DCDD_PORT_CONTROL, // OUT 09h
+    0xDB, DCDD_PORT_SELECT, // 0107: IN 08h
+    0xE6, DCDD_STATUS_HEAD, // ANI 04h
+    0xC2, 0x07, 0x01, // JNZ 0107h (wait for the head to settle)
+    0xDB, DCDD_PORT_CONTROL, // 010E: IN 09h
+    0x57, // MOV D,A
+    0x1F, // RAR
+    0xDA, 0x0E, 0x01, // JC 010Eh (wait for the sector true bit)
+    0x21, BUFFER_ADDRESS & 0xFF, BUFFER_ADDRESS >> 8, // LXI H,BUFFER_ADDRESS
+    0x06, DCDD_SECTOR_SIZE, // MVI B,137
+    0xDB, DCDD_PORT_SELECT, // 011A: IN 08h
+    0xB7, // ORA A
+    0xFA, 0x1A, 0x01, // JM 011Ah (wait for new read data)
+    0xDB, DCDD_PORT_DATA, // IN 0Ah
+    0x77, // MOV M,A
+    0x23, // INX H
+    0x05, // DCR B
+    0xC2, 0x1A, 0x01, // JNZ 011Ah
+    0x76 // HLT
+};
+
+static uint8_t image_byte(int track, int sector, int index) {
+    return (uint8_t)(track * DCDD_SECTORS + sector + index * 7);
+}
+
+/**
+ * Creates a temporary image of two tracks with a different pattern in every sector
+ */
+static bool create_image() {
+    strcpy(image_path, "/tmp/dcdd_test_XXXXXX");
+    int fd = mkstemp(image_path);
+    TEST_CHECK(fd >= 0);
+    static uint8_t track[DCDD_TRACK_SIZE];
+    bool written = true;
+    for (int t = 0; t < TEST_TRACKS; t++) {
+        for (int s = 0; s < DCDD_SECTORS; s++) {
+            for (int i = 0; i < DCDD_SECTOR_SIZE; i++) {
+                track[s * DCDD_SECTOR_SIZE + i] = image_byte(t, s, i);
+            }
+        }
+        written &= (write(fd, track, sizeof(track)) == (ssize_t)sizeof(track));
+    }
+    close(fd);
+    TEST_CHECK(written);
+    return true;
+}
+
+/**
+ * Prepares a machine with the controller in a given mode and the image in drive 0, the CPU waits in a loop at 0x0000
+ */
+static bool setup(bool fast) {
+    if (!create_image()) {
+        return false;
+    }
+    memory_init(&memory);
+    static const uint8_t wait_loop[] = {0xC3, 0x00, 0x00}; // JMP 0000h
+    memory_write_bytes(&memory, 0x0000, wait_loop, sizeof(wait_loop));
+    memory_write_bytes(&memory, 0x0100, read_program, sizeof(read_program));
+    cpu_init(&cpu, &memory);
+    io_bus_init(&bus);
+    dcdd_init(&dcdd, &cpu, fast);
+    dcdd_attach(&dcdd, &bus);
+    cpu_set_io_hooks(&cpu, io_read, io_write, &bus);
+    TEST_CHECK(dcdd_mount(&dcdd, 0, image_path));
+    return true;
+}
+
+static void teardown() {
+    dcdd_close(&dcdd);
+    cpu_destroy(&cpu);
+    unlink(image_path);
+}
+
+/**
+ * Lets the emulated time pass
+ */
+static void wait_cycles(long long cycles) {
+    cpu_run(&cpu, cycles);
+}
+
+static bool same_registers(const cpu_registers_t *first, const cpu_registers_t *second) {
+    return first->pc == second->pc && first->sp == second->sp && first->bc == second->bc && first->de == second->de
+        && first->hl == second->hl && first->a == second->a && first->f == second->f
+        && first->interrupts_enabled == second->interrupts_enabled && first->halted == second->halted;
+}
+
+// In the accurate mode the head, the track and the bytes of the sector under the head follow the cycle counter
+static bool test_accurate_ports() {
+    if (!setup(false)) {
+        return false;
+    }
+    uint8_t unselected = io_read(&bus, DCDD_PORT_SELECT);
+    io_write(&bus, DCDD_PORT_SELECT, 0);
+    uint8_t unloaded = io_read(&bus, DCDD_PORT_SELECT);
+    uint8_t unloaded_sector = io_read(&bus, DCDD_PORT_CONTROL);
+    io_write(&bus, DCDD_PORT_CONTROL, DCDD_CONTROL_HEAD_LOAD | DCDD_CONTROL_STEP_IN);
+    uint8_t loading = io_read(&bus, DCDD_PORT_SELECT);
+    wait_cycles(DCDD_STEP_CYCLES);
+    uint8_t stepped = io_read(&bus, DCDD_PORT_SELECT);
+    wait_cycles(DCDD_HEAD_LOAD_CYCLES - DCDD_STEP_CYCLES);
+    uint8_t loaded = io_read(&bus, DCDD_PORT_SELECT);
+    // Wait for the start of the next sector
+    wait_cycles(DCDD_SECTOR_CYCLES - cpu_get_cycles(&cpu) % DCDD_SECTOR_CYCLES);
+    uint64_t sector_start = cpu_get_cycles(&cpu) - cpu_get_cycles(&cpu) % DCDD_SECTOR_CYCLES;
+    int sector = (sector_start / DCDD_SECTOR_CYCLES) % DCDD_SECTORS;
+    uint8_t position = io_read(&bus, DCDD_PORT_CONTROL);
+    uint8_t before_data = io_read(&bus, DCDD_PORT_SELECT);
+    wait_cycles(sector_start + DCDD_BYTE_CYCLES - cpu_get_cycles(&cpu));
+    uint8_t first_ready = io_read(&bus, DCDD_PORT_SELECT);
+    uint8_t position_after_byte = io_read(&bus, DCDD_PORT_CONTROL);
+    uint8_t first = io_read(&bus, DCDD_PORT_DATA);
+    uint8_t second_early = io_read(&bus, DCDD_PORT_SELECT);
+    wait_cycles(sector_start + 2 * DCDD_BYTE_CYCLES - cpu_get_cycles(&cpu));
+    uint8_t second_ready = io_read(&bus, DCDD_PORT_SELECT);
+    uint8_t second = io_read(&bus, DCDD_PORT_DATA);
+    wait_cycles(DCDD_SECTOR_CYCLES);
+    uint8_t next_position = io_read(&bus, DCDD_PORT_CONTROL);
+    uint8_t next_first = io_read(&bus, DCDD_PORT_DATA); // Read right away, the sector starts again
+    io_write(&bus, DCDD_PORT_CONTROL, DCDD_CONTROL_STEP_OUT);
+    io_write(&bus, DCDD_PORT_CONTROL, DCDD_CONTROL_STEP_OUT);
+    uint8_t track_0 = io_read(&bus, DCDD_PORT_SELECT);
+    uint8_t track = dcdd.drives[0].track;
+    teardown();
+    TEST_CHECK(unselected == 0xFF);
+    TEST_CHECK(unloaded_sector == 0xFF);
+    TEST_CHECK(!(unloaded & DCDD_STATUS_TRACK_0) && !(unloaded & DCDD_STATUS_MOVE_HEAD) && (unloaded & DCDD_STATUS_HEAD));
+    TEST_CHECK((loading & DCDD_STATUS_TRACK_0) && (loading & DCDD_STATUS_MOVE_HEAD) && (loading & DCDD_STATUS_HEAD));
+    TEST_CHECK(!(stepped & DCDD_STATUS_MOVE_HEAD) && (stepped & DCDD_STATUS_HEAD));
+    TEST_CHECK(!(loaded & DCDD_STATUS_HEAD));
+    TEST_CHECK(position == (0xC0 | (sector << 1))); // Sector true
+    TEST_CHECK(before_data & DCDD_STATUS_NRDA);
+    TEST_CHECK(!(first_ready & DCDD_STATUS_NRDA));
+    TEST_CHECK(position_after_byte == (0xC0 | (sector << 1) | DCDD_SECTOR_NOT_TRUE));
+    TEST_CHECK(first == image_byte(1, sector, 0));
+    TEST_CHECK(second_early & DCDD_STATUS_NRDA); // The next byte hasn't passed the head yet
+    TEST_CHECK(!(second_ready & DCDD_STATUS_NRDA));
+    TEST_CHECK(second == image_byte(1, sector, 1));
+    TEST_CHECK(next_position == (0xC0 | (((sector + 1) % DCDD_SECTORS) << 1) | DCDD_SECTOR_NOT_TRUE));
+    TEST_CHECK(next_first == image_byte(1, (sector + 1) % DCDD_SECTORS, 0));
+    TEST_CHECK(track == 0);
+    TEST_CHECK(!(track_0 & DCDD_STATUS_TRACK_0));
+    TEST_CHECK(dcdd.stats.sectors_read == 2);
+    return true;
+}
+
+// A program polling the accurate controller gets the sector a byte every 32 us after the head settles
+static bool test_accurate_program() {
+    if (!setup(false)) {
+        return false;
+    }
+    cpu_set_PC_reg(&cpu, 0x0100);
+    // Short batches, as the polling loops may be skipped to the end of a batch (CPU_IDLE_LOOPS)
+    cpu_run_result_t result = {CPU_EXIT_BUDGET, 0};
+    while (result.reason == CPU_EXIT_BUDGET && cpu_get_cycles(&cpu) < TEST_BUDGET_CYCLES) {
+        result = cpu_run(&cpu, DCDD_BYTE_CYCLES / 2);
+    }
+    cpu_registers_t registers;
+    cpu_get_registers(&cpu, &registers);
+    uint64_t cycles = cpu_get_cycles(&cpu);
+    int sector = ((registers.de >> 8) >> 1) & 0x1F;
+    bool same_data = true;
+    for (int i = 0; i < DCDD_SECTOR_SIZE; i++) {
+        same_data &= (memory.data[BUFFER_ADDRESS + i] == image_byte(1, sector, i));
+    }
+    teardown();
+    TEST_CHECK(result.reason == CPU_EXIT_HALT);
+    TEST_CHECK(same_data);
+    TEST_CHECK(registers.hl == BUFFER_ADDRESS + DCDD_SECTOR_SIZE);
+    TEST_CHECK(cycles >= DCDD_HEAD_LOAD_CYCLES + DCDD_SECTOR_SIZE * DCDD_BYTE_CYCLES);
+    // At most a sector is waited for after the head settles, then the bytes come at their own pace
+    TEST_CHECK(cycles < DCDD_HEAD_LOAD_CYCLES + DCDD_SECTOR_CYCLES + (DCDD_SECTOR_SIZE + 1) * DCDD_BYTE_CYCLES);
+    return true;
+}
+
+/**
+ * Runs the read program with the fast controller, with the data port giving whole sectors
+ * to input loops executed in bulk or only byte by byte
+ */
+static bool run_fast(bool block_reads, cpu_registers_t *registers, uint64_t *cycles, uint8_t *buffer) {
+    if (!setup(true)) {
+        return false;
+    }
+    if (!block_reads) {
+        io_bus_register_block(&bus, DCDD_PORT_DATA, NULL);
+    }
+    cpu_set_PC_reg(&cpu, 0x0100);
+    cpu_run_result_t result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    cpu_get_registers(&cpu, registers);
+    *cycles = cpu_get_cycles(&cpu);
+    memcpy(buffer, &memory.data[BUFFER_ADDRESS], DCDD_SECTOR_SIZE);
+    dcdd_stats_t stats = dcdd.stats;
+    teardown();
+    TEST_CHECK(result.reason == CPU_EXIT_HALT);
+    TEST_CHECK(stats.sectors_read == 1);
+    if (!block_reads) {
+        TEST_CHECK(stats.block_reads == 0);
+    }
+#ifdef CPU_LOOP_IDIOMS
+    if (block_reads) {
+        TEST_CHECK(stats.block_reads > 0);
+    }
+#endif
+    return true;
+}
+
+// The fast path leaves the same memory, registers and cycle count as the byte by byte path
+static bool test_fast_same_as_ports() {
+    cpu_registers_t block_registers, port_registers;
+    uint64_t block_cycles, port_cycles;
+    uint8_t block_buffer[DCDD_SECTOR_SIZE], port_buffer[DCDD_SECTOR_SIZE];
+    if (!run_fast(true, &block_registers, &block_cycles, block_buffer)
+        || !run_fast(false, &port_registers, &port_cycles, port_buffer)) {
+        return false;
+    }
+    bool expected_data = true;
+    for (int i = 0; i < DCDD_SECTOR_SIZE; i++) {
+        expected_data &= (port_buffer[i] == image_byte(1, 1, i)); // The first read of the position gives sector 1
+    }
+    TEST_CHECK(expected_data);
+    TEST_CHECK(memcmp(block_buffer, port_buffer, DCDD_SECTOR_SIZE) == 0);
+    TEST_CHECK(same_registers(&block_registers, &port_registers));
+    TEST_CHECK(block_cycles == port_cycles);
+    return true;
+}
+
+// Written sectors are marked dirty and reach the file when they are written back with msync
+static bool test_write_flushed() {
+    if (!setup(true)) {
+        return false;
+    }
+    io_write(&bus, DCDD_PORT_SELECT, 0);
+    io_write(&bus, DCDD_PORT_CONTROL, DCDD_CONTROL_HEAD_LOAD | DCDD_CONTROL_STEP_IN);
+    uint8_t position = io_read(&bus, DCDD_PORT_CONTROL);
+    io_write(&bus, DCDD_PORT_CONTROL, DCDD_CONTROL_WRITE_ENABLE);
+    uint8_t writing = io_read(&bus, DCDD_PORT_SELECT);
+    for (int i = 0; i < DCDD_SECTOR_SIZE; i++) {
+        io_write(&bus, DCDD_PORT_DATA, (uint8_t)~i);
+    }
+    uint8_t written = io_read(&bus, DCDD_PORT_SELECT);
+    int dirty_sector = 1 * DCDD_SECTORS + 1;
+    bool dirty = dcdd.drives[0].has_dirty && (dcdd.drives[0].dirty[dirty_sector / 64] & (1ULL << (dirty_sector % 64)));
+    dcdd_flush(&dcdd);
+    bool clean = !dcdd.drives[0].has_dirty;
+    dcdd_stats_t stats = dcdd.stats;
+    dcdd_close(&dcdd);
+    // Read the file back without the mapping
+    FILE *file = fopen(image_path, "rb");
+    static uint8_t image[TEST_TRACKS * DCDD_TRACK_SIZE];
+    size_t length = (file != NULL) ? fread(image, 1, sizeof(image), file) : 0;
+    if (file != NULL) {
+        fclose(file);
+    }
+    teardown();
+    bool sector_written = true;
+    bool rest_kept = true;
+    size_t sector_start = DCDD_TRACK_SIZE + DCDD_SECTOR_SIZE;
+    for (size_t offset = 0; offset < sizeof(image); offset++) {
+        int track = offset / DCDD_TRACK_SIZE;
+        int sector = offset % DCDD_TRACK_SIZE / DCDD_SECTOR_SIZE;
+        int index = offset % DCDD_SECTOR_SIZE;
+        if (offset >= sector_start && offset < sector_start + DCDD_SECTOR_SIZE) {
+            sector_written &= (image[offset] == (uint8_t)~index);
+        } else {
+            rest_kept &= (image[offset] == image_byte(track, sector, index));
+        }
+    }
+    TEST_CHECK(position == (0xC0 | (1 << 1)));
+    TEST_CHECK(!(writing & DCDD_STATUS_ENWD));
+    TEST_CHECK(written & DCDD_STATUS_ENWD); // The whole sector is written
+    TEST_CHECK(dirty);
+    TEST_CHECK(clean);
+    TEST_CHECK(stats.sectors_written == 1);
+    TEST_CHECK(stats.flushes == 1);
+    TEST_CHECK(length == sizeof(image));
+    TEST_CHECK(sector_written);
+    TEST_CHECK(rest_kept);
+    return true;
+}
+
+bool test_dcdd() {
+    return test_accurate_ports() && test_accurate_program() && test_fast_same_as_ports() && test_write_flushed();
+}
@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+#include "memory.h"
+#include "fork.h"
+#include "tests.h"
+
+#define TEST_BUDGET_CYCLES 100000
+
+static memory_t memory;
+static cpu_t cpu;
+static cpu_t first_fork;
+static cpu_t second_fork;
+
+// A write to a shared page copies it into the fork that wrote it, the other fork and the template keep the shared bytes
+static bool test_write_to_shared_page() {
+    static const uint8_t program[] = {
+        0x3E, 0x42, // MVI A,42h
+        0x32, 0x00, 0x40, // STA 4000h
+        0x76 // HLT
+    };
+    memory_init(&memory);
+    memory_write_bytes(&memory, 0x0100, program, sizeof(program));
+    memory_store(&memory, 0x4000, 0x11);
+    memory_store(&memory, 0x4001, 0x22);
+    cpu_init(&cpu, &memory);
+    cpu_set_PC_reg(&cpu, 0x0100);
+    fork_template_t *template = fork_template_create(&cpu);
+    TEST_CHECK(template != NULL);
+    TEST_CHECK(fork_create(template, &first_fork));
+    TEST_CHECK(fork_create(template, &second_fork));
+    TEST_CHECK(memory_is_shared(first_fork.memory, 0x40) && memory_is_shared(second_fork.memory, 0x40));
+
+    TEST_CHECK(cpu_run(&first_fork, TEST_BUDGET_CYCLES).reason == CPU_EXIT_HALT);
+    TEST_CHECK(memory_get(first_fork.memory, 0x4000) == 0x42);
+    TEST_CHECK(memory_get(first_fork.memory, 0x4001) == 0x22); // The rest of the page was copied
+    TEST_CHECK(!memory_is_shared(first_fork.memory, 0x40));
+    TEST_CHECK(first_fork.memory->read_map[0x40] == &first_fork.memory->data[0x4000]);
+    TEST_CHECK(memory_is_shared(first_fork.memory, 0x01)); // The code was only read
+
+    TEST_CHECK(memory_is_shared(second_fork.memory, 0x40));
+    TEST_CHECK(memory_get(second_fork.memory, 0x4000) == 0x11);
+    TEST_CHECK(cpu_get_PC_reg(&second_fork) == 0x0100);
+    TEST_CHECK(template->ram[0x4000] == 0x11);
+    TEST_CHECK(memory.data[0x4000] == 0x11);
+
+    memory_store(second_fork.memory, 0x4001, 0x99);
+    TEST_CHECK(!memory_is_shared(second_fork.memory, 0x40));
+    TEST_CHECK(memory_get(second_fork.memory, 0x4000) == 0x11 && memory_get(second_fork.memory, 0x4001) == 0x99);
+    TEST_CHECK(memory_get(first_fork.memory, 0x4001) == 0x22);
+    TEST_CHECK(template->ram[0x4001] == 0x22);
+
+    fork_destroy(&first_fork);
+    fork_destroy(&second_fork);
+    fork_template_destroy(template);
+    cpu_destroy(&cpu);
+    return true;
+}
+
+bool test_fork() {
+    return test_write_to_shared_page();
+}
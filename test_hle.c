@@ -0,0 +1,119 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu.h"
+#include "memory.h"
+#include "io.h"
+#include "loader.h"
+#include "hle.h"
+#include "tests.h"
+
+#define TEST_BUDGET_CYCLES 1000000
+#define SIO_STATUS_PORT 0x00
+#define SIO_DATA_PORT 0x01
+#define SIO_INPUT_BUSY 0x01 // Active low, set while nothing is received
+#define BASIC_OUTPUT_SUPPRESSED 0x01D1
+#define BASIC_COLUMN 0x0027
+#define DRIVER_ADDRESS 0x2000 // Past the 0x1D00 bytes the loader of the image copies to 0x0000
+#define OUTPUT_SIZE 64
+
+// 88-SIO console giving a fixed input and collecting the output
+typedef struct TEST_SIO {
+    const char *input;
+    size_t input_index;
+    char output[OUTPUT_SIZE];
+    size_t output_length;
+} test_sio_t;
+
+static memory_t memory;
+static cpu_t cpu;
+static cpu_traps_t traps;
+static io_bus_t bus;
+static hle_t hle;
+static test_sio_t sio;
+
+static uint8_t sio_status(void *context, uint8_t port) {
+    (void)port;
+    test_sio_t *sio = context;
+    return (sio->input[sio->input_index] != '\0') ? 0 : SIO_INPUT_BUSY; // Output is always ready
+}
+
+static uint8_t sio_read(void *context, uint8_t port) {
+    (void)port;
+    test_sio_t *sio = context;
+    return (sio->input[sio->input_index] != '\0') ? (uint8_t)sio->input[sio->input_index++] : 0;
+}
+
+static void sio_write(void *context, uint8_t port, uint8_t data) {
+    (void)port;
+    test_sio_t *sio = context;
+    if (sio->output_length < OUTPUT_SIZE) {
+        sio->output[sio->output_length++] = data;
+    }
+}
+
+// Every character of the input, read and echoed through the routines of BASIC, is verified against the emulated routines
+static bool test_verified_echo() {
+    static const char input[] = "10 PRINT \"Hi\"\r\xC1?"; // 0xC1 is 'A' with the parity bit
+    static const char expected[] = "10 PRINT \"Hi\"\rA?";
+    const int characters = sizeof(input) - 1;
+    const uint8_t driver[] = {
+        0x31, 0x00, 0x30, // LXI SP,3000h
+        0x0E, characters, // MVI C,characters
+        0xCD, 0x56, 0x05, // 2005: CALL 0556h (character input)
+        0xDF, // RST 3 (character output)
+        0x0D, // DCR C
+        0xC2, 0x05, 0x20, // JNZ 2005h
+        0x76 // HLT
+    };
+    memory_init(&memory);
+    loader_t loader;
+    loader_init(&loader, &memory);
+    loader_segment_t image = {TEST_PROGRAMS_DIR "/8kBas_e0.bin", LOADER_ROM, 0xE000};
+    TEST_CHECK(loader_load(&loader, &image, 1));
+    memory_write_bytes(&memory, DRIVER_ADDRESS, driver, sizeof(driver));
+    cpu_init(&cpu, &memory);
+    cpu_traps_init(&traps);
+    hle_init(&hle, &cpu);
+    hle_set_verify(&hle, true);
+    int installed = hle_install(&hle, &traps, loader.mappings[0].address, loader.ranges[0].length);
+    cpu_traps_add(&traps, 0x0000, NULL, NULL); // The loader of the image jumps there once BASIC is copied
+    cpu_set_traps(&cpu, &traps);
+    sio = (test_sio_t){.input = input};
+    io_bus_init(&bus);
+    io_bus_register(&bus, SIO_STATUS_PORT, sio_status, NULL, &sio);
+    io_bus_register(&bus, SIO_DATA_PORT, sio_read, sio_write, &sio);
+    cpu_set_io_hooks(&cpu, io_read, io_write, &bus);
+
+    cpu_set_PC_reg(&cpu, 0xE000);
+    cpu_run_result_t copied = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    uint16_t copied_pc = cpu_get_PC_reg(&cpu);
+    // The initialization of BASIC isn't in the image, its state is set up the way it would leave it
+    memory_store(&memory, BASIC_OUTPUT_SUPPRESSED, 0);
+    memory_store(&memory, BASIC_COLUMN, 0);
+    cpu_set_PC_reg(&cpu, DRIVER_ADDRESS);
+    cpu_run_result_t result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    cpu_registers_t registers;
+    cpu_get_registers(&cpu, &registers);
+    uint8_t column = memory_get(&memory, BASIC_COLUMN);
+    cpu_destroy(&cpu);
+    loader_unload(&loader);
+    TEST_CHECK(installed == 2);
+    TEST_CHECK(copied.reason == CPU_EXIT_TRAP);
+    TEST_CHECK(copied_pc == 0x0000);
+    TEST_CHECK(result.reason == CPU_EXIT_HALT);
+    TEST_CHECK(registers.pc == DRIVER_ADDRESS + sizeof(driver));
+    TEST_CHECK(registers.sp == 0x3000);
+    TEST_CHECK(sio.output_length == strlen(expected));
+    TEST_CHECK(memcmp(sio.output, expected, strlen(expected)) == 0);
+    TEST_CHECK(column == strlen(expected) - 1); // Every character but CR is counted (BASIC starts a new line elsewhere)
+    TEST_CHECK(hle.stats.mismatches == 0);
+    TEST_CHECK(hle.mismatch == NULL);
+    TEST_CHECK(hle.stats.verified_calls == 2 * (unsigned long long)characters);
+    TEST_CHECK(hle.hooks[0].verified_calls > 0 && hle.hooks[1].verified_calls > 0);
+    return true;
+}
+
+bool test_hle() {
+    return test_verified_echo();
+}
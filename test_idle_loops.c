@@ -0,0 +1,141 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+#include "memory.h"
+#include "tests.h"
+
+#define TEST_BUDGET_CYCLES 100000
+#define STATUS_PORT 0x10
+#define STATUS_VALUE 0x02 // The ready bit (bit 0) stays clear, so the poll never ends
+#define POLL_ITERATION_CYCLES 27 // IN, ANI and the taken JZ
+#define DEADLINE_CYCLES 5000 // Cycle of the next device event the halted CPU waits for
+
+static memory_t memory;
+static cpu_t cpu;
+static cpu_traps_t traps;
+static int head_traps; // Calls of the handler of the trap at the loop head
+
+// IN STATUS_PORT / ANI 01h / JZ back to the IN
+static const uint8_t poll_program[] = {
+    0xDB, STATUS_PORT, // 0100: IN STATUS_PORT
+    0xE6, 0x01, // ANI 01h
+    0xCA, 0x00, 0x01 // JZ 0100h
+};
+
+static uint8_t read_status(void *context, uint8_t port) {
+    (void)context;
+    return (port == STATUS_PORT) ? STATUS_VALUE : 0xFF;
+}
+
+static void ignore_output(void *context, uint8_t port, uint8_t data) {
+    (void)context;
+    (void)port;
+    (void)data;
+}
+
+static bool count_head_trap(cpu_t *cpu, void *context) {
+    (void)cpu;
+    (void)context;
+    head_traps++;
+    return true;
+}
+
+// Cycles left until DEADLINE_CYCLES, like a scheduler with a single event
+static long long cycles_to_deadline(void *context) {
+    long long cycles = DEADLINE_CYCLES - (long long)cpu_get_cycles(context);
+    return (cycles > 0) ? cycles : 0;
+}
+
+/**
+ * Loads a program at 0x0100 and points the CPU at it, the status port always reads STATUS_VALUE
+ */
+static void load(const uint8_t *program, uint32_t length) {
+    memory_init(&memory);
+    memory_write_bytes(&memory, 0x0100, program, length);
+    cpu_init(&cpu, &memory);
+    cpu_set_io_hooks(&cpu, read_status, ignore_output, NULL);
+    cpu_traps_init(&traps);
+    cpu_set_traps(&cpu, &traps);
+    cpu_set_PC_reg(&cpu, 0x0100);
+}
+
+/**
+ * Runs the poll loop for the test budget, then again one operation at a time for as many cycles,
+ * and checks that both end in the same state. Gives the statistics of the first run in 'stats',
+ * 'has_stats' is false if the CPU doesn't collect them
+ */
+static bool run_poll_same_as_steps(idle_loop_stats_t *stats, bool *has_stats) {
+    load(poll_program, sizeof(poll_program));
+    cpu_run_result_t result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    cpu_registers_t run_registers;
+    cpu_get_registers(&cpu, &run_registers);
+    uint64_t run_cycles = cpu_get_cycles(&cpu);
+    *has_stats = cpu_get_idle_loop_stats(&cpu, stats);
+    cpu_destroy(&cpu);
+    TEST_CHECK(result.reason == CPU_EXIT_BUDGET && run_cycles >= TEST_BUDGET_CYCLES);
+
+    load(poll_program, sizeof(poll_program));
+    while (cpu_get_cycles(&cpu) < run_cycles) {
+        cpu_step(&cpu);
+    }
+    cpu_registers_t step_registers;
+    cpu_get_registers(&cpu, &step_registers);
+    uint64_t step_cycles = cpu_get_cycles(&cpu);
+    cpu_destroy(&cpu);
+    TEST_CHECK(step_cycles == run_cycles);
+    TEST_CHECK(run_registers.pc == step_registers.pc);
+    TEST_CHECK(run_registers.a == step_registers.a && run_registers.f == step_registers.f);
+    return true;
+}
+
+// The iterations of a poll which reads the same value are skipped without changing A or the flags
+static bool test_poll_skipped() {
+    idle_loop_stats_t stats;
+    bool has_stats;
+    TEST_CHECK(run_poll_same_as_steps(&stats, &has_stats));
+    if (has_stats) {
+        TEST_CHECK(stats.recognized_loops == 1 && stats.skips == 1);
+        // Only the iterations before the state repeats and the ones after the skip are executed
+        TEST_CHECK(stats.skipped_iterations * POLL_ITERATION_CYCLES > TEST_BUDGET_CYCLES - 4 * POLL_ITERATION_CYCLES);
+    }
+    return true;
+}
+
+// A trap at the loop head sees every iteration
+static bool test_trapped_poll_executed() {
+    load(poll_program, sizeof(poll_program));
+    cpu_traps_add(&traps, 0x0100, count_head_trap, NULL);
+    head_traps = 0;
+    cpu_run_result_t result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    idle_loop_stats_t stats;
+    bool has_stats = cpu_get_idle_loop_stats(&cpu, &stats);
+    cpu_destroy(&cpu);
+    TEST_CHECK(result.reason == CPU_EXIT_BUDGET);
+    TEST_CHECK(head_traps == result.cycles / POLL_ITERATION_CYCLES);
+    TEST_CHECK(!has_stats || stats.skips == 0);
+    return true;
+}
+
+// A halted CPU skips straight to the next device event, or to the end of the budget without one
+static bool test_halt_to_deadline() {
+    static const uint8_t program[] = {0x76}; // HLT
+    load(program, sizeof(program));
+    cpu_set_next_event_hook(&cpu, cycles_to_deadline, &cpu);
+    cpu_run_result_t result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    uint64_t cycles = cpu_get_cycles(&cpu);
+    cpu_destroy(&cpu);
+    TEST_CHECK(result.reason == CPU_EXIT_HALT);
+    TEST_CHECK(cycles >= DEADLINE_CYCLES && cycles < DEADLINE_CYCLES + 4); // Waiting takes whole 4-cycle steps
+    TEST_CHECK(result.cycles == (long long)cycles);
+
+    load(program, sizeof(program));
+    result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    cycles = cpu_get_cycles(&cpu);
+    cpu_destroy(&cpu);
+    TEST_CHECK(result.reason == CPU_EXIT_HALT && cycles >= TEST_BUDGET_CYCLES && cycles < TEST_BUDGET_CYCLES + 4);
+    return true;
+}
+
+bool test_idle_loops() {
+    return test_poll_skipped() && test_trapped_poll_executed() && test_halt_to_deadline();
+}
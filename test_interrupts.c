@@ -0,0 +1,125 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu.h"
+#include "memory.h"
+#include "tests.h"
+
+#define TEST_BUDGET_CYCLES 100000
+#define POST_PORT 0x10 // Writing to it posts RST 7, like a device raising its interrupt line
+#define RST_7 0xFF
+
+static memory_t memory;
+static cpu_t cpu;
+
+static uint8_t no_input(void *context, uint8_t dev_id) {
+    (void)context;
+    (void)dev_id;
+    return 0xFF;
+}
+
+static void post_on_write(void *context, uint8_t dev_id, uint8_t data) {
+    (void)data;
+    if (dev_id == POST_PORT) {
+        cpu_request_interrupt(context, RST_7);
+    }
+}
+
+/**
+ * Loads a program at 0x0100 and an RST 7 handler at 0x0038 and points the CPU at the program
+ */
+static void load(const uint8_t *program, uint32_t program_length, const uint8_t *handler, uint32_t handler_length) {
+    memory_init(&memory);
+    memcpy(&memory.data[0x0038], handler, handler_length);
+    memcpy(&memory.data[0x0100], program, program_length);
+    cpu_init(&cpu, &memory);
+    cpu_set_io_hooks(&cpu, no_input, post_on_write, &cpu);
+    cpu_set_PC_reg(&cpu, 0x0100);
+}
+
+static uint16_t return_address(const cpu_registers_t *registers) {
+    return memory.data[registers->sp] | (memory.data[(uint16_t)(registers->sp + 1)] << 8);
+}
+
+// A request posted in the middle of a batch is accepted at the next control transfer, not at the end of the budget
+static bool test_accepted_at_control_transfer() {
+    static const uint8_t program[] = {
+        0x31, 0x00, 0x02, // LXI SP,0200h
+        0xFB, // EI
+        0xD3, POST_PORT, // OUT POST_PORT
+        0x04, // 0106: INR B
+        0xC3, 0x06, 0x01 // JMP 0106h
+    };
+    static const uint8_t handler[] = {0x76}; // HLT
+    load(program, sizeof(program), handler, sizeof(handler));
+    cpu_run_result_t result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    cpu_registers_t registers;
+    cpu_get_registers(&cpu, &registers);
+    cpu_destroy(&cpu);
+    TEST_CHECK(result.reason == CPU_EXIT_HALT);
+    TEST_CHECK(registers.bc == 0x0100); // The loop ran once
+    TEST_CHECK(registers.pc == 0x0039);
+    TEST_CHECK(registers.sp == 0x01FE);
+    TEST_CHECK(return_address(&registers) == 0x0106);
+    TEST_CHECK(!registers.interrupts_enabled);
+    return true;
+}
+
+// A request waiting while the interrupts are disabled is accepted right after the operation following EI
+static bool test_ei_delay() {
+    static const uint8_t program[] = {
+        0x31, 0x00, 0x02, // LXI SP,0200h
+        0xFB, // EI
+        0x04, // INR B
+        0x0C, // 0105: INR C
+        0x76 // HLT
+    };
+    static const uint8_t handler[] = {0x76}; // HLT
+    load(program, sizeof(program), handler, sizeof(handler));
+    TEST_CHECK(cpu_request_interrupt(&cpu, RST_7));
+    cpu_run_result_t result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    cpu_registers_t registers;
+    cpu_get_registers(&cpu, &registers);
+    cpu_destroy(&cpu);
+    TEST_CHECK(result.reason == CPU_EXIT_HALT);
+    TEST_CHECK(registers.bc == 0x0100); // INR B ran, INR C didn't
+    TEST_CHECK(registers.pc == 0x0039);
+    TEST_CHECK(return_address(&registers) == 0x0105);
+    return true;
+}
+
+// A request wakes up a halted CPU, which continues after HLT once the handler returns
+static bool test_halt_wake_up() {
+    static const uint8_t program[] = {
+        0x31, 0x00, 0x02, // LXI SP,0200h
+        0xFB, // EI
+        0x76, // 0104: HLT
+        0x04, // INR B
+        0x76 // HLT
+    };
+    static const uint8_t handler[] = {
+        0x0E, 0x55, // MVI C,55h
+        0xC9 // RET
+    };
+    load(program, sizeof(program), handler, sizeof(handler));
+    cpu_run_result_t result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    TEST_CHECK(result.reason == CPU_EXIT_HALT);
+    TEST_CHECK(result.cycles >= TEST_BUDGET_CYCLES); // The rest of the budget is spent halted
+    TEST_CHECK(cpu_get_PC_reg(&cpu) == 0x0105);
+    TEST_CHECK(cpu_request_interrupt(&cpu, RST_7));
+    result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    cpu_registers_t registers;
+    cpu_get_registers(&cpu, &registers);
+    cpu_destroy(&cpu);
+    TEST_CHECK(result.reason == CPU_EXIT_HALT);
+    TEST_CHECK(registers.bc == 0x0155);
+    TEST_CHECK(registers.pc == 0x0107);
+    TEST_CHECK(registers.sp == 0x0200);
+    TEST_CHECK(registers.halted);
+    TEST_CHECK(!registers.interrupts_enabled);
+    return true;
+}
+
+bool test_interrupts() {
+    return test_accepted_at_control_transfer() && test_ei_delay() && test_halt_wake_up();
+}
@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "memory.h"
+#include "loader.h"
+#include "tests.h"
+
+#define ROM_ADDRESS 0x3000
+#define ROM_LENGTH 0x180 // The second page of the ROM is only half filled
+
+static memory_t memory;
+static loader_t loader;
+static char path[] = "/tmp/loader_test_XXXXXX";
+static char second_path[] = "/tmp/loader_test_XXXXXX";
+
+/**
+ * Creates a temporary file with the given contents, its name is written to 'file_path'
+ * (a mkstemp template which is reset first)
+ */
+static bool create_file(char *file_path, const void *contents, size_t length) {
+    strcpy(file_path, "/tmp/loader_test_XXXXXX");
+    int fd = mkstemp(file_path);
+    TEST_CHECK(fd >= 0);
+    bool written = write(fd, contents, length) == (ssize_t)length;
+    close(fd);
+    TEST_CHECK(written);
+    return true;
+}
+
+/**
+ * Loads a single Intel HEX file with the given text into a cleared memory
+ * Returns what loader_load returned
+ */
+static bool load_hex(const char *text) {
+    if (!create_file(path, text, strlen(text))) {
+        return false;
+    }
+    memory_init(&memory);
+    loader_init(&loader, &memory);
+    loader_segment_t segment = {path, LOADER_INTEL_HEX, 0};
+    bool loaded = loader_load(&loader, &segment, 1);
+    unlink(path);
+    return loaded;
+}
+
+// Data records next to each other make one range, the extended address records with a zero base are ignored
+static bool test_hex_records() {
+    TEST_CHECK(load_hex(
+        ":0401000001020304F1\r\n"
+        ":020000020000FC\r\n"
+        ":020104000506EE\r\n"
+        ":0400000301000034C4\r\n"
+        ":00000001FF\r\n"));
+    TEST_CHECK(loader.ranges_count == 1);
+    TEST_CHECK(loader.ranges[0].first_address == 0x0100 && loader.ranges[0].length == 6 && !loader.ranges[0].rom);
+    static const uint8_t expected[] = {1, 2, 3, 4, 5, 6};
+    TEST_CHECK(memcmp(&memory.data[0x0100], expected, sizeof(expected)) == 0);
+    TEST_CHECK(loader.has_entry_address && loader.entry_address == 0x1034); // Segment 0100h, offset 0034h
+    TEST_CHECK(load_hex(":040000050000F800FF\n:00000001FF\n"));
+    TEST_CHECK(loader.has_entry_address && loader.entry_address == 0xF800);
+    return true;
+}
+
+/**
+ * Checks that an Intel HEX file with the given text fails to load with an error containing 'error'
+ */
+static bool check_hex_error(const char *text, const char *error) {
+    TEST_CHECK(!load_hex(text));
+    TEST_CHECK(strstr(loader.error, error) != NULL);
+    return true;
+}
+
+static bool test_hex_errors() {
+    TEST_CHECK(check_hex_error(":0401000001020304F1\n:0401000001020304F2\n", "wrong checksum on line 2"));
+    TEST_CHECK(check_hex_error(":0401000001020304\n", "line 1 isn't an Intel HEX record"));
+    TEST_CHECK(check_hex_error(":0401000001020304F100\n", "line 1 isn't an Intel HEX record"));
+    TEST_CHECK(check_hex_error("0401000001020304F1\n", "line 1 isn't an Intel HEX record"));
+    TEST_CHECK(check_hex_error(":020000021000EC\n", "extended address on line 1 is beyond the memory"));
+    TEST_CHECK(check_hex_error(":020000040001F9\n", "extended address on line 1 is beyond the memory"));
+    TEST_CHECK(check_hex_error(":0400000500010000F6\n", "start address on line 1 is beyond the memory"));
+    return true;
+}
+
+// Binary images next to each other make one range, a ROM after them makes another
+static bool test_merged_ranges() {
+    uint8_t bytes[0x100];
+    memset(bytes, 0xC9, sizeof(bytes));
+    TEST_CHECK(create_file(path, bytes, 0x10));
+    TEST_CHECK(create_file(second_path, bytes, sizeof(bytes)));
+    memory_init(&memory);
+    loader_init(&loader, &memory);
+    loader_segment_t segments[] = {
+        {path, LOADER_BINARY, 0x2000},
+        {path, LOADER_BINARY, 0x2010},
+        {second_path, LOADER_ROM, 0x2100}
+    };
+    bool loaded = loader_load(&loader, segments, 3);
+    loader_unload(&loader);
+    unlink(path);
+    unlink(second_path);
+    TEST_CHECK(loaded);
+    TEST_CHECK(loader.ranges_count == 2);
+    TEST_CHECK(loader.ranges[0].first_address == 0x2000 && loader.ranges[0].length == 0x20 && !loader.ranges[0].rom);
+    TEST_CHECK(loader.ranges[1].first_address == 0x2100 && loader.ranges[1].length == 0x100 && loader.ranges[1].rom);
+    return true;
+}
+
+// A ROM is mapped over the RAM, which comes back once the ROM is unloaded
+static bool test_rom() {
+    uint8_t rom[ROM_LENGTH];
+    memset(rom, 0x5A, sizeof(rom));
+    TEST_CHECK(create_file(path, rom, sizeof(rom)));
+    memory_init(&memory);
+    memory.data[ROM_ADDRESS] = 0x11;
+    memory.data[ROM_ADDRESS + ROM_LENGTH] = 0x22;
+    loader_init(&loader, &memory);
+    loader_segment_t misaligned = {path, LOADER_ROM, ROM_ADDRESS + 0x80};
+    TEST_CHECK(!loader_load(&loader, &misaligned, 1));
+    TEST_CHECK(strstr(loader.error, "isn't at a page boundary") != NULL && loader.mappings_count == 0);
+    loader_segment_t segment = {path, LOADER_ROM, ROM_ADDRESS};
+    bool loaded = loader_load(&loader, &segment, 1);
+    unlink(path);
+    TEST_CHECK(loaded && loader.mappings_count == 1);
+    TEST_CHECK(memory_get(&memory, ROM_ADDRESS) == 0x5A);
+    TEST_CHECK(memory_get(&memory, ROM_ADDRESS + ROM_LENGTH) == 0x00); // The rest of the last page
+    memory_store(&memory, ROM_ADDRESS, 0x77);
+    TEST_CHECK(memory_get(&memory, ROM_ADDRESS) == 0x5A);
+    loader_unload(&loader);
+    TEST_CHECK(loader.mappings_count == 0 && memory.remapped_pages == 0);
+    TEST_CHECK(memory_get(&memory, ROM_ADDRESS) == 0x11 && memory_get(&memory, ROM_ADDRESS + ROM_LENGTH) == 0x22);
+    return true;
+}
+
+bool test_loader() {
+    return test_hex_records() && test_hex_errors() && test_merged_ranges() && test_rom();
+}
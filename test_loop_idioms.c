@@ -0,0 +1,248 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu.h"
+#include "memory.h"
+#include "io.h"
+#include "tests.h"
+
+#define TEST_BUDGET_CYCLES 1000000
+#define EXIT_ADDRESS 0x0000 // Trapped, every program ends with a jump there
+#define PROGRAM_ADDRESS 0x0100
+#define LOOP_ADDRESS 0x0109 // Every program sets HL, DE and BC before its loop
+#define SOURCE_ADDRESS 0x3000
+#define TARGET_ADDRESS 0x4000
+#define BYTES_COUNT 0x300
+#define DIFFERENCE_INDEX 0x250 // The only byte the target differs from the source at before a program runs
+#define INPUT_PORT 0x10
+
+static memory_t memory;
+static cpu_t cpu;
+static cpu_traps_t traps;
+static io_bus_t bus;
+static uint8_t input_next; // Next byte the input device gives
+static int head_traps; // Calls of the handler of the trap at the loop head
+static cpu_registers_t registers; // Registers at the end of the last program
+static uint8_t run_data[MEMORY_SIZE];
+
+// MOV A,M / STAX D / INX H / INX D / DCX B / MOV A,B / ORA C / JNZ from SOURCE_ADDRESS to TARGET_ADDRESS
+static const uint8_t copy_program[] = {
+    0x21, SOURCE_ADDRESS & 0xFF, SOURCE_ADDRESS >> 8, // LXI H,SOURCE_ADDRESS
+    0x11, TARGET_ADDRESS & 0xFF, TARGET_ADDRESS >> 8, // LXI D,TARGET_ADDRESS
+    0x01, BYTES_COUNT & 0xFF, BYTES_COUNT >> 8, // LXI B,BYTES_COUNT
+    0x7E, 0x12, 0x23, 0x13, 0x0B, 0x78, 0xB1, // 0109: MOV A,M; STAX D; INX H; INX D; DCX B; MOV A,B; ORA C
+    0xC2, LOOP_ADDRESS & 0xFF, LOOP_ADDRESS >> 8, // JNZ 0109h
+    0xC3, EXIT_ADDRESS & 0xFF, EXIT_ADDRESS >> 8 // JMP EXIT_ADDRESS
+};
+
+// The same copy with the target a byte after the source, so every byte is copied from the one it has just written
+static const uint8_t overlapping_copy_program[] = {
+    0x21, SOURCE_ADDRESS & 0xFF, SOURCE_ADDRESS >> 8, // LXI H,SOURCE_ADDRESS
+    0x11, (SOURCE_ADDRESS + 1) & 0xFF, (SOURCE_ADDRESS + 1) >> 8, // LXI D,SOURCE_ADDRESS+1
+    0x01, BYTES_COUNT & 0xFF, BYTES_COUNT >> 8, // LXI B,BYTES_COUNT
+    0x7E, 0x12, 0x23, 0x13, 0x0B, 0x78, 0xB1, // 0109: MOV A,M; STAX D; INX H; INX D; DCX B; MOV A,B; ORA C
+    0xC2, LOOP_ADDRESS & 0xFF, LOOP_ADDRESS >> 8, // JNZ 0109h
+    0xC3, EXIT_ADDRESS & 0xFF, EXIT_ADDRESS >> 8 // JMP EXIT_ADDRESS
+};
+
+// A copy counted down by DCR B
+static const uint8_t counter_8bit_program[] = {
+    0x21, SOURCE_ADDRESS & 0xFF, SOURCE_ADDRESS >> 8, // LXI H,SOURCE_ADDRESS
+    0x11, TARGET_ADDRESS & 0xFF, TARGET_ADDRESS >> 8, // LXI D,TARGET_ADDRESS
+    0x01, 0x00, 0xC8, // LXI B,0C800h
+    0x7E, 0x12, 0x23, 0x13, 0x05, // 0109: MOV A,M; STAX D; INX H; INX D; DCR B
+    0xC2, LOOP_ADDRESS & 0xFF, LOOP_ADDRESS >> 8, // JNZ 0109h
+    0xC3, EXIT_ADDRESS & 0xFF, EXIT_ADDRESS >> 8 // JMP EXIT_ADDRESS
+};
+
+// MVI M,0E5h / INX H / DCX B / MOV A,B / ORA C / JNZ over the target
+static const uint8_t fill_program[] = {
+    0x21, TARGET_ADDRESS & 0xFF, TARGET_ADDRESS >> 8, // LXI H,TARGET_ADDRESS
+    0x11, 0x00, 0x00, // LXI D,0
+    0x01, BYTES_COUNT & 0xFF, BYTES_COUNT >> 8, // LXI B,BYTES_COUNT
+    0x36, 0xE5, 0x23, 0x0B, 0x78, 0xB1, // 0109: MVI M,0E5h; INX H; DCX B; MOV A,B; ORA C
+    0xC2, LOOP_ADDRESS & 0xFF, LOOP_ADDRESS >> 8, // JNZ 0109h
+    0xC3, EXIT_ADDRESS & 0xFF, EXIT_ADDRESS >> 8 // JMP EXIT_ADDRESS
+};
+
+// LDAX D / CMP M / JNZ out / INX D / INX H / DCX B / MOV A,B / ORA C / JNZ, stops at DIFFERENCE_INDEX
+static const uint8_t compare_program[] = {
+    0x21, TARGET_ADDRESS & 0xFF, TARGET_ADDRESS >> 8, // LXI H,TARGET_ADDRESS
+    0x11, SOURCE_ADDRESS & 0xFF, SOURCE_ADDRESS >> 8, // LXI D,SOURCE_ADDRESS
+    0x01, BYTES_COUNT & 0xFF, BYTES_COUNT >> 8, // LXI B,BYTES_COUNT
+    0x1A, 0xBE, // 0109: LDAX D; CMP M
+    0xC2, 0x16, 0x01, // JNZ 0116h
+    0x13, 0x23, 0x0B, 0x78, 0xB1, // INX D; INX H; DCX B; MOV A,B; ORA C
+    0xC2, LOOP_ADDRESS & 0xFF, LOOP_ADDRESS >> 8, // JNZ 0109h
+    0xC3, EXIT_ADDRESS & 0xFF, EXIT_ADDRESS >> 8 // 0116: JMP EXIT_ADDRESS
+};
+
+// IN INPUT_PORT / MOV M,A / INX H / DCR B / JNZ into the target
+static const uint8_t input_program[] = {
+    0x21, TARGET_ADDRESS & 0xFF, TARGET_ADDRESS >> 8, // LXI H,TARGET_ADDRESS
+    0x11, 0x00, 0x00, // LXI D,0
+    0x01, 0x00, 0xC8, // LXI B,0C800h
+    0xDB, INPUT_PORT, 0x77, 0x23, 0x05, // 0109: IN INPUT_PORT; MOV M,A; INX H; DCR B
+    0xC2, LOOP_ADDRESS & 0xFF, LOOP_ADDRESS >> 8, // JNZ 0109h
+    0xC3, EXIT_ADDRESS & 0xFF, EXIT_ADDRESS >> 8 // JMP EXIT_ADDRESS
+};
+
+static uint8_t read_input(void *context, uint8_t port) {
+    (void)context;
+    (void)port;
+    return input_next++;
+}
+
+static size_t read_input_block(void *context, uint8_t port, uint8_t *bytes, size_t count) {
+    (void)context;
+    (void)port;
+    for (size_t i = 0; i < count; i++) {
+        bytes[i] = input_next++;
+    }
+    return count;
+}
+
+// The target pages as a device keeping its bytes where the RAM would
+static uint8_t read_device(void *context, uint16_t address) {
+    (void)context;
+    return memory.data[address];
+}
+
+static void write_device(void *context, uint16_t address, uint8_t value) {
+    (void)context;
+    memory.data[address] = value;
+}
+
+static bool count_head_trap(cpu_t *cpu, void *context) {
+    (void)cpu;
+    (void)context;
+    head_traps++;
+    return true;
+}
+
+static void mark_target_code() {
+    memory_mark_code(&memory, TARGET_ADDRESS, TARGET_ADDRESS + BYTES_COUNT - 1);
+}
+
+static void trap_loop_head() {
+    cpu_traps_add(&traps, LOOP_ADDRESS, count_head_trap, NULL);
+}
+
+static void map_target_device() {
+    memory_map_handlers(&memory, TARGET_ADDRESS / MEMORY_PAGE_SIZE, BYTES_COUNT / MEMORY_PAGE_SIZE, read_device, write_device, NULL);
+}
+
+/**
+ * Loads a program with the source and the target filled with the same pattern (but for one byte)
+ * and prepares the CPU to run it, 'prepare' (if not NULL) is called last
+ */
+static void load(const uint8_t *program, size_t length, void (*prepare)()) {
+    memory_init(&memory);
+    for (int i = 0; i < BYTES_COUNT; i++) {
+        memory.data[SOURCE_ADDRESS + i] = (uint8_t)(i * 7 + 1);
+        memory.data[TARGET_ADDRESS + i] = (uint8_t)(i * 7 + 1);
+    }
+    memory.data[TARGET_ADDRESS + DIFFERENCE_INDEX] ^= 0x80;
+    memory_write_bytes(&memory, PROGRAM_ADDRESS, program, length);
+    input_next = 0;
+    cpu_init(&cpu, &memory);
+    cpu_set_io_hooks(&cpu, io_read, io_write, &bus);
+    cpu_traps_init(&traps);
+    cpu_traps_add(&traps, EXIT_ADDRESS, NULL, NULL);
+    cpu_set_traps(&cpu, &traps);
+    cpu_set_PC_reg(&cpu, PROGRAM_ADDRESS);
+    if (prepare != NULL) {
+        prepare();
+    }
+}
+
+/**
+ * Runs a program with cpu_run, then again one operation at a time with cpu_step,
+ * and checks that both end with the same registers, flags, cycles and memory.
+ * With CPU_LOOP_IDIOMS it also checks if the loop was executed in bulk as 'bulk' says
+ */
+static bool run_same_as_steps(const uint8_t *program, size_t length, void (*prepare)(), bool bulk) {
+    load(program, length, prepare);
+    head_traps = 0;
+    cpu_run_result_t result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    cpu_registers_t run_registers;
+    cpu_get_registers(&cpu, &run_registers);
+    uint64_t run_cycles = cpu_get_cycles(&cpu);
+    loop_idiom_stats_t stats;
+    bool has_stats = cpu_get_loop_idiom_stats(&cpu, &stats);
+    memcpy(run_data, memory.data, MEMORY_SIZE);
+    cpu_destroy(&cpu);
+    TEST_CHECK(result.reason == CPU_EXIT_TRAP && run_registers.pc == EXIT_ADDRESS);
+    TEST_CHECK(!has_stats || (stats.bulk_runs > 0) == bulk);
+
+    load(program, length, prepare);
+    while (cpu_get_PC_reg(&cpu) != EXIT_ADDRESS && cpu_get_cycles(&cpu) < TEST_BUDGET_CYCLES) {
+        cpu_step(&cpu);
+    }
+    cpu_get_registers(&cpu, &registers);
+    uint64_t step_cycles = cpu_get_cycles(&cpu);
+    cpu_destroy(&cpu);
+    TEST_CHECK(registers.pc == EXIT_ADDRESS);
+    TEST_CHECK(run_registers.a == registers.a && run_registers.f == registers.f);
+    TEST_CHECK(run_registers.bc == registers.bc && run_registers.de == registers.de && run_registers.hl == registers.hl);
+    TEST_CHECK(run_registers.sp == registers.sp);
+    TEST_CHECK(run_cycles == step_cycles);
+    TEST_CHECK(memcmp(run_data, memory.data, MEMORY_SIZE) == 0);
+    return true;
+}
+
+static bool test_copy() {
+    TEST_CHECK(run_same_as_steps(copy_program, sizeof(copy_program), NULL, true));
+    TEST_CHECK(memcmp(&memory.data[TARGET_ADDRESS], &memory.data[SOURCE_ADDRESS], BYTES_COUNT) == 0);
+    return true;
+}
+
+static bool test_overlapping_copy() {
+    TEST_CHECK(run_same_as_steps(overlapping_copy_program, sizeof(overlapping_copy_program), NULL, true));
+    TEST_CHECK(memory.data[SOURCE_ADDRESS + BYTES_COUNT] == memory.data[SOURCE_ADDRESS]);
+    return true;
+}
+
+static bool test_counter_8bit() {
+    TEST_CHECK(run_same_as_steps(counter_8bit_program, sizeof(counter_8bit_program), NULL, true));
+    TEST_CHECK(memcmp(&memory.data[TARGET_ADDRESS], &memory.data[SOURCE_ADDRESS], 0xC8) == 0);
+    return true;
+}
+
+static bool test_fill() {
+    TEST_CHECK(run_same_as_steps(fill_program, sizeof(fill_program), NULL, true));
+    TEST_CHECK(memory.data[TARGET_ADDRESS] == 0xE5 && memory.data[TARGET_ADDRESS + BYTES_COUNT - 1] == 0xE5);
+    return true;
+}
+
+static bool test_compare() {
+    TEST_CHECK(run_same_as_steps(compare_program, sizeof(compare_program), NULL, true));
+    TEST_CHECK(registers.hl == TARGET_ADDRESS + DIFFERENCE_INDEX && registers.bc == BYTES_COUNT - DIFFERENCE_INDEX);
+    return true;
+}
+
+static bool test_input() {
+    io_bus_init(&bus);
+    io_bus_register(&bus, INPUT_PORT, read_input, NULL, NULL);
+    io_bus_register_block(&bus, INPUT_PORT, read_input_block);
+    TEST_CHECK(run_same_as_steps(input_program, sizeof(input_program), NULL, true));
+    TEST_CHECK(memory.data[TARGET_ADDRESS] == 0 && memory.data[TARGET_ADDRESS + 0xC7] == 0xC7);
+    io_bus_init(&bus);
+    return true;
+}
+
+// Loops writing to code, starting at a trap address or accessing a device are left to the interpreter
+static bool test_refused() {
+    TEST_CHECK(run_same_as_steps(copy_program, sizeof(copy_program), mark_target_code, false));
+    TEST_CHECK(run_same_as_steps(fill_program, sizeof(fill_program), trap_loop_head, false));
+    TEST_CHECK(head_traps == BYTES_COUNT - 1); // Every jump back to the head stops at the trap
+    TEST_CHECK(run_same_as_steps(copy_program, sizeof(copy_program), map_target_device, false));
+    TEST_CHECK(memcmp(&memory.data[TARGET_ADDRESS], &memory.data[SOURCE_ADDRESS], BYTES_COUNT) == 0);
+    return true;
+}
+
+bool test_loop_idioms() {
+    io_bus_init(&bus);
+    return test_copy() && test_overlapping_copy() && test_counter_8bit() && test_fill() && test_compare()
+        && test_input() && test_refused();
+}
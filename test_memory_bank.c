@@ -0,0 +1,73 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "cpu.h"
+#include "memory.h"
+#include "memory_bank.h"
+#include "tests.h"
+
+#define TEST_BUDGET_CYCLES 100000
+#define BANK_PORT 0x40
+#define WINDOW_PAGES 0x40 // 0000h-3FFFh is switched, the rest is common
+
+static memory_t memory;
+static cpu_t cpu;
+
+static uint8_t no_input(void *context, uint8_t port) {
+    (void)context;
+    (void)port;
+    return 0xFF;
+}
+
+// Banks selected through the port are read, written and executed in the window, the common area stays the same
+static bool test_select_through_port() {
+    static const uint8_t program[] = {
+        0x31, 0x00, 0xF0, // LXI SP,F000h
+        0x3E, 0x01, 0xD3, BANK_PORT, // MVI A,1; OUT BANK_PORT
+        0x3E, 0x11, 0x32, 0x00, 0x10, // MVI A,11h; STA 1000h
+        0x3E, 0x22, 0x32, 0x00, 0x90, // MVI A,22h; STA 9000h
+        0x3E, 0x02, 0xD3, BANK_PORT, // MVI A,2; OUT BANK_PORT
+        0x3E, 0x33, 0x32, 0x00, 0x10, // MVI A,33h; STA 1000h
+        0x3A, 0x00, 0x90, 0x47, // LDA 9000h; MOV B,A
+        0x3E, 0x00, 0xD3, BANK_PORT, // MVI A,0; OUT BANK_PORT
+        0x3A, 0x00, 0x10, 0x4F, // LDA 1000h; MOV C,A
+        0x3E, 0x01, 0xD3, BANK_PORT, // MVI A,1; OUT BANK_PORT
+        0x3A, 0x00, 0x10, 0x57, // LDA 1000h; MOV D,A
+        0x3E, 0x07, 0xD3, BANK_PORT, // MVI A,7; OUT BANK_PORT (there is no such bank)
+        0x3A, 0x00, 0x10, 0x5F, // LDA 1000h; MOV E,A
+        0xCD, 0x00, 0x20, 0x65, // CALL 2000h; MOV H,L
+        0x3E, 0x02, 0xD3, BANK_PORT, // MVI A,2; OUT BANK_PORT
+        0xCD, 0x00, 0x20, // CALL 2000h
+        0x76 // HLT
+    };
+    static const uint8_t routine_1[] = {0x2E, 0x5A, 0xC9}; // MVI L,5Ah; RET
+    static const uint8_t routine_2[] = {0x2E, 0xA5, 0xC9}; // MVI L,0A5h; RET
+    memory_init(&memory);
+    memory_banks_t *banks = memory_banks_create(&memory, 0x00, WINDOW_PAGES, 3);
+    TEST_CHECK(banks != NULL);
+    memory.data[0x1000] = 0x99;
+    memcpy(&memory_banks_get(banks, 1)[0x2000], routine_1, sizeof(routine_1));
+    memcpy(&memory_banks_get(banks, 2)[0x2000], routine_2, sizeof(routine_2));
+    memcpy(&memory.data[0x8000], program, sizeof(program));
+    cpu_init(&cpu, &memory);
+    cpu_set_io_hooks(&cpu, no_input, memory_banks_io_write, banks);
+    cpu_set_PC_reg(&cpu, 0x8000);
+    cpu_run_result_t result = cpu_run(&cpu, TEST_BUDGET_CYCLES);
+    cpu_registers_t registers;
+    cpu_get_registers(&cpu, &registers);
+    cpu_destroy(&cpu);
+    TEST_CHECK(result.reason == CPU_EXIT_HALT);
+    TEST_CHECK(registers.bc == 0x2299); // B: the common area written with bank 1 read with bank 2, C: bank 0
+    TEST_CHECK(registers.de == 0x1111); // D: bank 1, E: still bank 1 after selecting a bank that doesn't exist
+    TEST_CHECK(registers.hl == 0x5AA5); // The routines of banks 1 and 2 at the same address
+    TEST_CHECK(banks->selected == 2 && banks->switches == 5);
+    TEST_CHECK(memory_banks_get(banks, 1)[0x1000] == 0x11 && memory_banks_get(banks, 2)[0x1000] == 0x33);
+    TEST_CHECK(memory.data[0x9000] == 0x22);
+    memory_banks_destroy(banks);
+    TEST_CHECK(memory.read_map[0x10] == &memory.data[0x1000] && memory.data[0x1000] == 0x99); // Bank 0 is mapped back
+    return true;
+}
+
+bool test_memory_bank() {
+    return test_select_through_port();
+}
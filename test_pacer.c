@@ -0,0 +1,91 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "cpu.h"
+#include "memory.h"
+#include "pacer.h"
+#include "tests.h"
+
+#define TEST_SLICES 100 // 100 ms of emulated time at the default slice size
+#define TEST_TOLERANCE 0.05 // Relative error of the effective clock frequency
+#define TEST_MAX_LAG_NS 1000000LL
+#define TEST_STALL_NS 5000000LL // A stall of the host much longer than the drift cap
+
+static memory_t memory;
+static cpu_t cpu;
+
+static void stall(long long duration_ns) {
+    struct timespec duration = {duration_ns / 1000000000LL, duration_ns % 1000000000LL};
+    while (nanosleep(&duration, &duration) != 0) {
+    }
+}
+
+// Paced at the real speed a busy loop runs at the emulated clock frequency, and twice as fast at speed 2
+static bool test_paced_frequency(double speed) {
+    static const uint8_t program[] = {
+        0x04, // 0100: INR B
+        0xC3, 0x00, 0x01 // JMP 0100h
+    };
+    memory_init(&memory);
+    memory_write_bytes(&memory, 0x0100, program, sizeof(program));
+    cpu_init(&cpu, &memory);
+    cpu_set_PC_reg(&cpu, 0x0100);
+    pacer_t pacer;
+    pacer_init(&pacer, CPU_FREQ, speed);
+    for (int i = 0; i < TEST_SLICES; i++) {
+        pacer_run_slice(&pacer, &cpu);
+    }
+    pacer_stats_t stats;
+    pacer_get_stats(&pacer, &stats);
+    cpu_destroy(&cpu);
+    double expected_mhz = CPU_FREQ * speed / 1e6;
+    TEST_CHECK(stats.slices == TEST_SLICES);
+    TEST_CHECK(stats.cycles >= TEST_SLICES * pacer.slice_cycles);
+    TEST_CHECK(stats.effective_mhz > expected_mhz * (1 - TEST_TOLERANCE));
+    TEST_CHECK(stats.effective_mhz < expected_mhz * (1 + TEST_TOLERANCE));
+    TEST_CHECK(stats.dropped_ns == 0);
+    return true;
+}
+
+// A stall of the host shorter than the drift cap is an overrun caught up by the following slices
+static bool test_lag_caught_up() {
+    pacer_t pacer;
+    pacer_init(&pacer, CPU_FREQ, 1);
+    pacer.max_lag_ns = 10 * TEST_STALL_NS;
+    stall(TEST_STALL_NS);
+    pacer_wait(&pacer, pacer.slice_cycles);
+    pacer_stats_t stats;
+    pacer_get_stats(&pacer, &stats);
+    TEST_CHECK(stats.overruns == 1);
+    TEST_CHECK(stats.max_late_ns >= TEST_STALL_NS - 1000000LL);
+    TEST_CHECK(stats.min_slack_ns < 0);
+    TEST_CHECK(stats.dropped_ns == 0);
+    // The epoch stays, so the following slices are late too until the emulated time catches up
+    pacer_wait(&pacer, pacer.slice_cycles);
+    pacer_get_stats(&pacer, &stats);
+    TEST_CHECK(stats.overruns == 2);
+    return true;
+}
+
+// A stall longer than the drift cap is dropped, the following slices are timed from its end
+static bool test_lag_dropped() {
+    pacer_t pacer;
+    pacer_init(&pacer, CPU_FREQ, 1);
+    pacer.max_lag_ns = TEST_MAX_LAG_NS;
+    stall(TEST_STALL_NS);
+    pacer_wait(&pacer, pacer.slice_cycles);
+    pacer_stats_t stats;
+    pacer_get_stats(&pacer, &stats);
+    TEST_CHECK(stats.overruns == 1);
+    TEST_CHECK(stats.dropped_ns >= TEST_STALL_NS - 1000000LL);
+    TEST_CHECK(pacer.epoch_cycles == 0);
+    pacer_wait(&pacer, pacer.slice_cycles);
+    pacer_get_stats(&pacer, &stats);
+    TEST_CHECK(stats.overruns == 1); // Not late, a whole slice was waited
+    TEST_CHECK(stats.total_slack_ns > 0);
+    return true;
+}
+
+bool test_pacer() {
+    return test_paced_frequency(1) && test_paced_frequency(2) && test_lag_caught_up() && test_lag_dropped();
+}
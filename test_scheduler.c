@@ -0,0 +1,118 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "cpu.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "tests.h"
+
+#define TEST_EVENTS 6
+#define NOP_CYCLES 4 // The memory is all NOPs, so the CPU stops at most one operation after a deadline
+#define WHEEL_CYCLES ((uint64_t)SCHEDULER_SLOTS << SCHEDULER_SLOT_SHIFT)
+
+typedef struct TEST_EVENT {
+    scheduler_event_t event;
+    int id;
+} test_event_t;
+
+static memory_t memory;
+static cpu_t cpu;
+static scheduler_t scheduler;
+static test_event_t events[TEST_EVENTS];
+static int fired_ids[TEST_EVENTS];
+static uint64_t fired_cycles[TEST_EVENTS];
+static int fired_count;
+
+static void record(scheduler_t *scheduler, void *context) {
+    test_event_t *event = context;
+    fired_ids[fired_count] = event->id;
+    fired_cycles[fired_count] = cpu_get_cycles(scheduler->cpu);
+    fired_count++;
+}
+
+static void setup() {
+    memory_init(&memory);
+    cpu_init(&cpu, &memory);
+    scheduler_init(&scheduler, &cpu);
+    for (int i = 0; i < TEST_EVENTS; i++) {
+        events[i].id = i;
+        scheduler_event_init(&events[i].event, record, &events[i]);
+    }
+    fired_count = 0;
+}
+
+// Events scheduled out of order in different slots fire in the order of their deadlines, each at its own cycle
+static bool test_ordering() {
+    static const uint64_t deadlines[] = {50000, 3000, 20000, 1000, 120000};
+    setup();
+    for (int i = 0; i < 5; i++) {
+        scheduler_schedule(&scheduler, &events[i].event, deadlines[i]);
+    }
+    scheduler_cancel(&scheduler, &events[2].event);
+    TEST_CHECK(scheduler_next_deadline(&scheduler) == 1000);
+    scheduler_run(&scheduler, 200000);
+    cpu_destroy(&cpu);
+    static const int expected_ids[] = {3, 1, 0, 4};
+    TEST_CHECK(fired_count == 4);
+    for (int i = 0; i < 4; i++) {
+        TEST_CHECK(fired_ids[i] == expected_ids[i]);
+        TEST_CHECK(fired_cycles[i] >= deadlines[expected_ids[i]]);
+        TEST_CHECK(fired_cycles[i] < deadlines[expected_ids[i]] + NOP_CYCLES);
+    }
+    TEST_CHECK(scheduler.stats.scheduled == 5);
+    TEST_CHECK(scheduler.stats.fired == 4);
+    TEST_CHECK(scheduler_next_deadline(&scheduler) == SCHEDULER_NO_EVENT);
+    return true;
+}
+
+// Events in the same slot fire in the order of their deadlines, events with the same deadline in the order they were scheduled
+static bool test_same_slot() {
+    static const uint64_t deadlines[] = {2100, 2060, 2100, 2048, 2100};
+    setup();
+    for (int i = 0; i < 5; i++) {
+        scheduler_schedule(&scheduler, &events[i].event, deadlines[i]);
+    }
+    TEST_CHECK(scheduler.occupied[0] == 1ULL << (2048 >> SCHEDULER_SLOT_SHIFT)); // All in one slot
+    scheduler_schedule(&scheduler, &events[0].event, 2070); // Moved in front of 1 and 2
+    scheduler_run(&scheduler, 4096);
+    cpu_destroy(&cpu);
+    static const int expected_ids[] = {3, 1, 0, 2, 4};
+    TEST_CHECK(fired_count == 5);
+    for (int i = 0; i < 5; i++) {
+        TEST_CHECK(fired_ids[i] == expected_ids[i]);
+    }
+    TEST_CHECK(fired_cycles[3] == fired_cycles[4]); // Fired together at the same stop of the CPU
+    return true;
+}
+
+// Events beyond the wheel wait in the overflow list, are moved into the wheel when it gets close and fire on time
+static bool test_overflow_cascade() {
+    const uint64_t far_deadline = 3 * WHEEL_CYCLES + 500;
+    const uint64_t farther_deadline = 5 * WHEEL_CYCLES;
+    setup();
+    scheduler_schedule(&scheduler, &events[0].event, farther_deadline);
+    scheduler_schedule(&scheduler, &events[1].event, far_deadline);
+    scheduler_schedule(&scheduler, &events[2].event, 100);
+    TEST_CHECK(events[0].event.slot == -1);
+    TEST_CHECK(events[1].event.slot == -1);
+    TEST_CHECK(scheduler.overflow_deadline == far_deadline);
+    TEST_CHECK(scheduler_next_deadline(&scheduler) == 100);
+    scheduler_run(&scheduler, 2 * WHEEL_CYCLES + WHEEL_CYCLES / 2);
+    TEST_CHECK(fired_count == 1);
+    TEST_CHECK(scheduler.stats.cascaded == 1); // The wheel reaches the first one, it's in a slot now
+    TEST_CHECK(events[1].event.slot >= 0);
+    TEST_CHECK(events[0].event.slot == -1);
+    scheduler_run(&scheduler, 4 * WHEEL_CYCLES);
+    cpu_destroy(&cpu);
+    TEST_CHECK(fired_count == 3);
+    TEST_CHECK(fired_ids[1] == 1);
+    TEST_CHECK(fired_cycles[1] >= far_deadline && fired_cycles[1] < far_deadline + NOP_CYCLES);
+    TEST_CHECK(fired_ids[2] == 0);
+    TEST_CHECK(fired_cycles[2] >= farther_deadline && fired_cycles[2] < farther_deadline + NOP_CYCLES);
+    TEST_CHECK(scheduler.stats.cascaded == 2);
+    TEST_CHECK(scheduler.overflow == NULL);
+    return true;
+}
+
+bool test_scheduler() {
+    return test_ordering() && test_same_slot() && test_overflow_cascade();
+}
@@ -0,0 +1,112 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include "cpu.h"
+#include "memory.h"
+#include "memory_bank.h"
+#include "snapshot.h"
+#include "tests.h"
+
+#define WINDOW_FIRST_PAGE 0x80
+#define WINDOW_PAGES 0x10
+
+static memory_t memory;
+static cpu_t cpu;
+static snapshot_chain_t chain;
+static uint8_t expected[MEMORY_SIZE];
+
+static bool registers_equal(const cpu_registers_t *a, const cpu_registers_t *b) {
+    return a->pc == b->pc && a->sp == b->sp && a->bc == b->bc && a->de == b->de && a->hl == b->hl
+        && a->a == b->a && a->f == b->f && a->interrupts_enabled == b->interrupts_enabled && a->halted == b->halted;
+}
+
+// A full snapshot and a delta with one written page are restored over a changed state, in order
+static bool test_full_and_delta() {
+    const cpu_registers_t first = {.pc = 0x1234, .sp = 0xFF00, .bc = 0x0102, .de = 0x0304, .hl = 0x0506, .a = 0x07, .f = 0x83, .interrupts_enabled = true};
+    const cpu_registers_t second = {.pc = 0x4321, .sp = 0xFE00, .bc = 0x1112, .de = 0x1314, .hl = 0x1516, .a = 0x17, .f = 0x02, .halted = true};
+    memory_init(&memory);
+    cpu_init(&cpu, &memory);
+    for (int address = 0; address < MEMORY_SIZE; address++) {
+        memory_store(&memory, address, address * 7);
+    }
+    cpu_set_registers(&cpu, &first);
+    FILE *file = tmpfile();
+    TEST_CHECK(file != NULL);
+    snapshot_chain_init(&chain, &cpu);
+    TEST_CHECK(snapshot_save(&chain, file, SNAPSHOT_DELTA) == SNAPSHOT_MAX_SIZE); // The first one is always full
+    memory_store(&memory, 0x1234, 0xAA);
+    memory_store(&memory, 0x12FF, 0xBB);
+    cpu_set_registers(&cpu, &second);
+    TEST_CHECK(snapshot_save(&chain, file, SNAPSHOT_DELTA) == SNAPSHOT_HEADER_SIZE + SNAPSHOT_PAGE_RECORD_SIZE);
+    memcpy(expected, memory.data, MEMORY_SIZE);
+
+    // Everything is changed and then rolled forward from the start of the chain
+    for (int address = 0; address < MEMORY_SIZE; address += 3) {
+        memory_store(&memory, address, 0);
+    }
+    cpu_set_registers(&cpu, &(cpu_registers_t){.pc = 0x0000});
+    rewind(file);
+    snapshot_chain_init(&chain, &cpu);
+    cpu_registers_t registers;
+    TEST_CHECK(snapshot_restore(&chain, file));
+    cpu_get_registers(&cpu, &registers);
+    TEST_CHECK(registers_equal(&registers, &first));
+    TEST_CHECK(memory.data[0x1234] == (uint8_t)(0x1234 * 7) && memory.data[0x3000] == (uint8_t)(0x3000 * 7));
+    TEST_CHECK(snapshot_restore(&chain, file));
+    cpu_get_registers(&cpu, &registers);
+    TEST_CHECK(registers_equal(&registers, &second));
+    TEST_CHECK(memcmp(memory.data, expected, MEMORY_SIZE) == 0);
+
+    // A delta can't be restored twice
+    rewind(file);
+    snapshot_chain_init(&chain, &cpu);
+    fseek(file, SNAPSHOT_MAX_SIZE, SEEK_SET);
+    TEST_CHECK(!snapshot_restore(&chain, file));
+    fclose(file);
+    cpu_destroy(&cpu);
+    return true;
+}
+
+// The pages of a window are saved from the selected bank and the selection is restored with them
+static bool test_bank_switched_in() {
+    memory_init(&memory);
+    cpu_init(&cpu, &memory);
+    memory_banks_t *banks = memory_banks_create(&memory, WINDOW_FIRST_PAGE, WINDOW_PAGES, 2);
+    TEST_CHECK(banks != NULL);
+    memory_store(&memory, 0x8000, 0xB0);
+    memory_banks_select(banks, 1);
+    memory_store(&memory, 0x8000, 0xB1);
+    FILE *file = tmpfile();
+    TEST_CHECK(file != NULL);
+    snapshot_chain_init(&chain, &cpu);
+    snapshot_chain_set_banks(&chain, banks);
+    TEST_CHECK(snapshot_save(&chain, file, SNAPSHOT_FULL) == SNAPSHOT_MAX_SIZE);
+    memory_banks_select(banks, 0);
+    memory_store(&memory, 0x8001, 0x77);
+    // Every page of the window was remapped, nothing else was written
+    TEST_CHECK(snapshot_save(&chain, file, SNAPSHOT_DELTA) == SNAPSHOT_HEADER_SIZE + WINDOW_PAGES * SNAPSHOT_PAGE_RECORD_SIZE);
+
+    memory_banks_select(banks, 1);
+    memory_store(&memory, 0x8000, 0xEE);
+    memory_store(&memory, 0x8001, 0xEE);
+    rewind(file);
+    snapshot_chain_init(&chain, &cpu);
+    snapshot_chain_set_banks(&chain, banks);
+    TEST_CHECK(snapshot_restore(&chain, file));
+    TEST_CHECK(banks->selected == 1);
+    TEST_CHECK(memory_get(&memory, 0x8000) == 0xB1 && memory_get(&memory, 0x8001) == 0x00);
+    TEST_CHECK(memory.data[0x8000] == 0xB0); // Bank 0 wasn't mapped, so it wasn't saved or restored
+    TEST_CHECK(snapshot_restore(&chain, file));
+    TEST_CHECK(banks->selected == 0);
+    TEST_CHECK(memory_get(&memory, 0x8000) == 0xB0 && memory_get(&memory, 0x8001) == 0x77);
+    TEST_CHECK(memory_banks_get(banks, 1)[0x0000] == 0xB1);
+    fclose(file);
+    memory_banks_destroy(banks);
+    cpu_destroy(&cpu);
+    return true;
+}
+
+bool test_snapshot() {
+    return test_full_and_delta() && test_bank_switched_in();
+}
@@ -0,0 +1,45 @@
+#include <stdio.h>
+#include <string.h>
+#include "tests.h"
+
+typedef struct TEST {
+    const char *name;
+    bool (*run)();
+} test_t;
+
+static const test_t tests[] = {
+    {"loop_idioms", test_loop_idioms},
+    {"idle_loops", test_idle_loops},
+    {"interrupts", test_interrupts},
+    {"memory_bank", test_memory_bank},
+    {"loader", test_loader},
+    {"snapshot", test_snapshot},
+    {"fork", test_fork},
+    {"console", test_console},
+    {"pacer", test_pacer},
+    {"scheduler", test_scheduler},
+    {"acia", test_acia},
+    {"bdos", test_bdos},
+    {"dcdd", test_dcdd},
+    {"hle", test_hle}
+};
+
+/**
+ * Runs the tests named on the command line, or all of them without arguments
+ * Returns 0 if every test passed
+ */
+int main(int argc, char *argv[]) {
+    int failed = 0;
+    for (unsigned i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        bool selected = (argc == 1);
+        for (int arg = 1; arg < argc; arg++) {
+            selected |= (strcmp(argv[arg], tests[i].name) == 0);
+        }
+        if (selected) {
+            bool passed = tests[i].run();
+            printf("====== Test %s: %s ======\n", tests[i].name, passed ? "passed" : "FAILED");
+            failed += !passed;
+        }
+    }
+    return failed != 0;
+}
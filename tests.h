@@ -0,0 +1,44 @@
+#ifndef __TESTS_H__
+#define __TESTS_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+// Fails the running test (a function returning bool) if the condition doesn't hold
+#define TEST_CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+            return false; \
+        } \
+    } while (0)
+
+bool test_loop_idioms();
+
+bool test_idle_loops();
+
+bool test_interrupts();
+
+bool test_memory_bank();
+
+bool test_loader();
+
+bool test_snapshot();
+
+bool test_fork();
+
+bool test_console();
+
+bool test_pacer();
+
+bool test_scheduler();
+
+bool test_acia();
+
+bool test_bdos();
+
+bool test_dcdd();
+
+bool test_hle();
+
+#endif // __TESTS_H__